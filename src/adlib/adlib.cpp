@@ -18,16 +18,26 @@
  * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstring>
+
 #include "common/util.hpp"
 #include "common/error.hpp"
+#include "common/stream.hpp"
 #include "common/file.hpp"
+#include "common/stats.hpp"
 
 #include "adlib/adlib.hpp"
+#include "adlib/opl.hpp"
+#include "adlib/keyframes.hpp"
 
 static const int kPitchTom        = 24;
 static const int kPitchTomToSnare =  7;
 static const int kPitchSnareDrum  = kPitchTom + kPitchTomToSnare;
 
+/** Start value and prime of the FNV-1a hash of the music data. */
+static const uint32 kHashBasis = 2166136261U;
+static const uint32 kHashPrime = 16777619U;
+
 namespace AdLib {
 
 // Is the operator a modulator (0) or a carrier (1)?
@@ -86,26 +96,40 @@ const uint16 AdLib::kHihatParams    [kParamCount] = {
 	  0,  1,  0, 15, 11,  0,  7,  5,  0,  0,  0,  0,  0,  0   };
 
 
-AdLib::VGMLine::VGMLine() : size(0) {
+SongInfo::SongInfo() : rate(0), samples(0), events(0), instruments(0), percussion(false) {
+	for (int i = 0; i < kVoiceCount; i++)
+		voiceNotes[i] = 0;
 }
 
-AdLib::VGMLine::VGMLine(byte cmd) : size(1) {
-	data[0] = cmd;
-}
+uint32 SongInfo::getUsedVoiceCount() const {
+	uint32 count = 0;
+	for (int i = 0; i < kVoiceCount; i++)
+		if (voiceNotes[i] > 0)
+			count++;
 
-AdLib::VGMLine::VGMLine(byte cmd, byte a1) : size(2) {
-	data[0] = cmd;
-	data[1] = a1;
+	return count;
 }
 
-AdLib::VGMLine::VGMLine(byte cmd, byte a1, byte a2) : size(3) {
-	data[0] = cmd;
-	data[1] = a1;
-	data[2] = a2;
+
+PlayLimits::PlayLimits() :
+	maxSamples(2 * 60 * 60 * 44100), maxEvents(0), maxOutputSize(256 * 1024 * 1024), maxTime(0) {
 }
 
 
-AdLib::AdLib() : _first(true), _ended(true), _vgmDataSize(0), _vgmLength(0) {
+AdLib::AdLib() : _inputSize(0), _inputHash(kHashBasis), _first(true), _ended(true), _repeat(false), _length(0), _trimSilence(false),
+	_sounded(false), _silence(0), _audibleUntil(0), _trimmedStart(0), _trimmedEnd(0), _heldNext(0),
+	_replaying(false), _keyframes(0), _startTime(0),
+	_eventCount(0), _oplWriteCount(0), _command(kCommandOther), _sink(0), _writeCount(0) {
+
+	for (int i = 0; i < kCommandMAX; i++)
+		_commandCounts[i] = 0;
+
+	_percussionUsed = false;
+	for (int i = 0; i < kMaxVoiceCount; i++)
+		_voiceNotes[i] = 0;
+
+	std::memset(_registers, 0, sizeof(_registers));
+
 	initFreqs();
 }
 
@@ -116,96 +140,638 @@ uint32 AdLib::getSamplesPerSecond() const {
 	return kRate;
 }
 
+uint32 AdLib::getVoiceOperators(uint8 voice, bool percussion) {
+	if (!percussion || (voice < kVoiceBaseDrum)) {
+		if (voice >= kMelodyVoiceCount)
+			return 0;
+
+		return (1 << kVoiceMelodyOperator[0][voice]) | (1 << kVoiceMelodyOperator[1][voice]);
+	}
+
+	if (voice >= kMaxVoiceCount)
+		return 0;
+
+	const uint8 voicePerc = voice - kVoiceBaseDrum;
+
+	// Only the base drum plays on two operators
+	uint32 operators = 1 << kVoicePercussionOperator[0][voicePerc];
+	if (voice == kVoiceBaseDrum)
+		operators |= 1 << kVoicePercussionOperator[1][voicePerc];
+
+	return operators;
+}
+
 void AdLib::convert(const std::string &outFile) {
-	createVGMData();
+	std::vector<byte> vgmData;
+
+	convert(outFile, vgmData);
+}
+
+void AdLib::convert(const std::string &outFile, std::vector<byte> &vgmData) {
+	Common::StatsTimer timer(Common::kStatsStageConvert);
 
-	if (_vgmLength < 44100)
-		throw Common::Exception("VGM shorter than one second");
+	VGMSink sink(vgmData);
+	recordVGM(sink);
+
+	Common::StatsTimer writeTimer(Common::kStatsStageWriteVGM);
 
 	Common::DumpFile vgm;
 	if (!vgm.open(outFile))
 		throw Common::Exception("Failed to open \"%s\" for writing", outFile.c_str());
 
-	writeVGMHeader(vgm);
-	writeVGMData(vgm);
+	sink.write(vgm);
 
 	vgm.flush();
 	vgm.close();
 
 	if (vgm.err())
 		throw Common::kWriteError;
+
+	writeTimer.setBytes(0, sink.getFileSize());
+
+	timer.setBytes(_inputSize, sink.getFileSize());
+	timer.setEvents(_eventCount, _oplWriteCount);
+}
+
+void AdLib::convert(Common::WriteStream &vgm, std::vector<byte> &vgmData) {
+	Common::StatsTimer timer(Common::kStatsStageConvert);
+
+	VGMSink sink(vgmData);
+	recordVGM(sink);
+
+	sink.write(vgm);
+
+	if (!vgm.flush() || vgm.err())
+		throw Common::kWriteError;
+
+	timer.setBytes(_inputSize, sink.getFileSize());
+	timer.setEvents(_eventCount, _oplWriteCount);
+}
+
+void AdLib::profile(OPLProfile &profile) {
+	CountingSink sink(profile);
+	play(sink);
+	checkLength();
+
+	profile.rate = kRate;
+	for (int i = 0; i < kCommandMAX; i++)
+		profile.commands[i] = _commandCounts[i];
+}
+
+void AdLib::probe(SongInfo &info) {
+	NullSink sink;
+	play(sink);
+	checkLength();
+
+	info = SongInfo();
+
+	info.rate    = kRate;
+	info.samples = _length;
+	info.events  = _eventCount;
+
+	info.instruments = getInstrumentCount();
+	info.percussion  = _percussionUsed;
+
+	for (int i = 0; i < kMaxVoiceCount; i++)
+		info.voiceNotes[i] = _voiceNotes[i];
+}
+
+void AdLib::play(OPLSink &sink) {
+	startPlaying(sink);
+
+	while (playStep())
+		;
+
+	stopPlaying();
+}
+
+void AdLib::setLimits(const PlayLimits &limits) {
+	_limits = limits;
+}
+
+void AdLib::setTrimSilence(bool trim) {
+	_trimSilence = trim;
+}
+
+uint32 AdLib::getTrimmedStart() const {
+	return _trimmedStart;
+}
+
+uint32 AdLib::getTrimmedEnd() const {
+	return _trimmedEnd;
+}
+
+void AdLib::recordVGM(VGMSink &sink) {
+	Common::StatsTimer timer(Common::kStatsStageCreateVGM);
+
+	play(sink);
+
+	timer.setBytes(_inputSize, sink.getSize());
+	timer.setEvents(_eventCount, _oplWriteCount);
+
+	checkLength();
+}
+
+void AdLib::checkLength() const {
+	// Most resources that aren't music at all stop right away
+	if (_length < kRate)
+		throw Common::Exception("Song shorter than one second");
+}
+
+Command AdLib::beginCommand(Command command) {
+	const Command outer = _command;
+	if (outer != kCommandOther)
+		return outer;
+
+	_command = command;
+	_commandCounts[command]++;
+
+	return outer;
 }
 
-void AdLib::createVGMData() {
-	_vgmLines.clear();
+void AdLib::endCommand(Command command) {
+	_command = command;
+}
+
+void AdLib::startPlaying(OPLSink &sink) {
+	_sink       = &sink;
+	_writeCount = 0;
+
+	_length = 0;
+
+	_sounded      = false;
+	_silence      = 0;
+	_audibleUntil = 0;
+	_trimmedStart = 0;
+	_trimmedEnd   = 0;
+
+	_heldWrites.clear();
+	_heldWaits.clear();
+
+	_heldNext  = 0;
+	_replaying = false;
+
+	_eventCount    = 0;
+	_oplWriteCount = 0;
+
+	for (int i = 0; i < kCommandMAX; i++)
+		_commandCounts[i] = 0;
 
-	_vgmDataSize = 0;
-	_vgmLength   = 0;
+	_first  = true;
+	_ended  = false;
+	_repeat = false;
 
-	_first = true;
-	_ended = false;
+	_percussionUsed = false;
+	for (int i = 0; i < kMaxVoiceCount; i++)
+		_voiceNotes[i] = 0;
 
-	initOPL();
-	rewind();
+	_command = kCommandOther;
+
+	std::memset(_registers, 0, sizeof(_registers));
+
+	if (_keyframes) {
+		_keyframes->clear();
+		_keyframes->setInput(_inputSize, _inputHash);
+	}
+
+	try {
+		_sink->begin();
+
+		const Command outer = beginCommand(kCommandSetup);
+
+		initOPL();
+		rewind();
+
+		endCommand(outer);
+
+	} catch (Common::Exception &e) {
+		_sink = 0;
+		throw;
+	}
+
+	_startTime = (_limits.maxTime > 0) ? getMicroseconds() : 0;
+}
+
+bool AdLib::playStep() {
+	if (_sink && _replaying) {
+		replayHeld();
+		return !_replaying || !_ended;
+	}
+
+	if (!_sink || _ended)
+		return false;
+
+	try {
+		if (_keyframes && _keyframes->isDue(_length))
+			_keyframes->record(*this);
 
-	while (!_ended) {
 		uint32 delay = pollMusic(_first);
 
-		_vgmLength += delay;
-		while (delay > 0) {
-			uint16 waitTime = MIN<uint32>(delay, 65535);
+		_eventCount++;
 
-			_vgmLines.push_back(VGMLine(0x61, waitTime & 0xFF, waitTime >> 8));
-			_vgmDataSize += 3;
+		flushOPL();
 
-			delay -= waitTime;
-		}
+		if (_trimSilence)
+			waitAudible(delay);
+		else
+			_sink->wait(delay);
+
+		_length += delay;
 
 		_first = false;
+
+		checkLimits(_startTime);
+
+	} catch (Common::Exception &e) {
+		_sink = 0;
+		throw;
 	}
 
-	_vgmLines.push_back(VGMLine(0x66));
-	_vgmDataSize += 1;
-}
-
-static byte kVGMHeader[256] = {
-	0x56,0x67,0x6D,0x20, 0x00,0x00,0x00,0x00, 0x70,0x01,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x00
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x10
-	0x00,0x00,0x00,0x00, 0xE8,0x03,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x20
-	0x00,0x00,0x00,0x00, 0xCC,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x30
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x40
-	0x00,0x9E,0x36,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x50
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x60
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x70
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x80
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x90
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0xA0
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0xB0
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0xC0
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0xD0
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0xE0
-	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00  // 0xF0
-};
+	return !_ended;
+}
+
+void AdLib::stopPlaying() {
+	if (!_sink)
+		return;
+
+	flushOPL();
+
+	// The silence still held back is at the end, or the song never made a sound at all
+	if (_sounded) {
+		_trimmedEnd = _silence;
+
+		releaseHeld();
+	} else
+		_trimmedStart += _silence;
+
+	_silence = 0;
+
+	_sink->end();
+	_sink = 0;
+}
+
+uint32 AdLib::getPosition() const {
+	return _length;
+}
+
+uint32 AdLib::getInputSize() const {
+	return _inputSize;
+}
+
+uint32 AdLib::getInputHash() const {
+	return _inputHash;
+}
+
+void AdLib::addInput(Common::SeekableReadStream &stream) {
+	const int32 pos = stream.pos();
+
+	if (!stream.seek(0))
+		throw Common::kSeekError;
+
+	byte buffer[4096];
+	while (!stream.eos()) {
+		const uint32 n = stream.read(buffer, sizeof(buffer));
+
+		for (uint32 i = 0; i < n; i++)
+			_inputHash = (_inputHash ^ buffer[i]) * kHashPrime;
+
+		_inputSize += n;
+
+		if (n < sizeof(buffer))
+			break;
+	}
+
+	if (stream.err() || !stream.seek(pos))
+		throw Common::kReadError;
+}
+
+void AdLib::setKeyframes(KeyframeIndex *index) {
+	_keyframes = index;
+}
+
+bool AdLib::seek(uint32 position, const KeyframeIndex *index) {
+	if (!_sink)
+		throw Common::Exception("Can't seek in a song that isn't playing");
+
+	if (index && !index->isOf(*this))
+		throw Common::Exception("The keyframe index was recorded from another song");
+
+	uint32 keyframe;
+	if (index && index->find(position, keyframe) && (index->getPosition(keyframe) > _length))
+		index->restore(keyframe, *this);
+
+	while (!_ended && (_length <= position))
+		playStep();
+
+	return !_ended;
+}
+
+void AdLib::saveState(Common::WriteStream &state) const {
+	byte flags = 0;
 
-void AdLib::writeVGMHeader(Common::WriteStream &vgm) const {
-	WRITE_LE_UINT32(kVGMHeader + 0x04, 256 + _vgmDataSize - 4); // Relative offset to end of file
-	WRITE_LE_UINT32(kVGMHeader + 0x18, _vgmLength);             // # samples (total count of wait times)
+	flags |= _first            ? 0x01 : 0;
+	flags |= _ended            ? 0x02 : 0;
+	flags |= _repeat           ? 0x04 : 0;
+	flags |= _tremoloDepth     ? 0x08 : 0;
+	flags |= _vibratoDepth     ? 0x10 : 0;
+	flags |= _keySplit         ? 0x20 : 0;
+	flags |= _enableWaveSelect ? 0x40 : 0;
+	flags |= _percussionMode   ? 0x80 : 0;
 
-	vgm.write(kVGMHeader, sizeof(kVGMHeader));
+	state.writeByte(flags);
+	state.writeByte(_percussionBits);
+	state.writeByte(_pitchRange);
+
+	state.write(_voiceNote, kMaxVoiceCount);
+	state.write(_voiceOn  , kMaxVoiceCount);
+
+	// The pitch bend of each voice: which frequency table, and how many half tones off
+	for (int i = 0; i < kMaxVoiceCount; i++) {
+		state.writeByte((_freqPtr[i] - _freqs[0]) / kHalfToneCount);
+		state.writeByte((byte) ((int8) _halfToneOffset[i]));
+	}
+
+	state.write(_operatorVolume, kOperatorCount);
+	state.write(_operatorParams, kOperatorCount * kParamCount);
+
+	state.writeUint32LE(_length);
+	state.writeUint32LE(_eventCount);
+
+	state.write(_registers, sizeof(_registers));
+
+	savePlayerState(state);
+}
+
+void AdLib::loadState(Common::ReadStream &state) {
+	if (!_sink)
+		throw Common::Exception("Can't restore the state of a song that isn't playing");
+
+	const byte flags = state.readByte();
+
+	_first            = (flags & 0x01) != 0;
+	_ended            = (flags & 0x02) != 0;
+	_repeat           = (flags & 0x04) != 0;
+	_tremoloDepth     = (flags & 0x08) != 0;
+	_vibratoDepth     = (flags & 0x10) != 0;
+	_keySplit         = (flags & 0x20) != 0;
+	_enableWaveSelect = (flags & 0x40) != 0;
+	_percussionMode   = (flags & 0x80) != 0;
+
+	_percussionBits = state.readByte();
+
+	setPitchRange(state.readByte());
+
+	state.read(_voiceNote, kMaxVoiceCount);
+	state.read(_voiceOn  , kMaxVoiceCount);
+
+	for (int i = 0; i < kMaxVoiceCount; i++) {
+		_freqPtr       [i] = _freqs[MIN<int>(state.readByte(), kPitchStepCount - 1)];
+		_halfToneOffset[i] = (int8) state.readByte();
+	}
+
+	state.read(_operatorVolume, kOperatorCount);
+	state.read(_operatorParams, kOperatorCount * kParamCount);
+
+	_length     = state.readUint32LE();
+	_eventCount = state.readUint32LE();
+
+	state.read(_registers, sizeof(_registers));
+
+	loadPlayerState(state);
+
+	if (state.err() || state.eos())
+		throw Common::Exception("Invalid player state");
+
+	const Command outer = beginCommand(kCommandSetup);
+
+	rewriteOPL();
+
+	endCommand(outer);
+
+	flushOPL();
+}
+
+void AdLib::rewriteOPL() {
+	// Copy the registers, because writing them again updates them
+	byte registers[sizeof(_registers)];
+	std::memcpy(registers, _registers, sizeof(registers));
+
+	writeOPL(0x01, registers[0x01]);
+	writeOPL(0x08, registers[0x08]);
+
+	for (int i = 0; i < kOperatorCount; i++) {
+		const byte offset = kOperatorOffset[i];
+
+		writeOPL(0x20 + offset, registers[0x20 + offset]);
+		writeOPL(0x40 + offset, registers[0x40 + offset]);
+		writeOPL(0x60 + offset, registers[0x60 + offset]);
+		writeOPL(0x80 + offset, registers[0x80 + offset]);
+		writeOPL(0xE0 + offset, registers[0xE0 + offset]);
+	}
+
+	for (int i = 0; i < kMelodyVoiceCount; i++) {
+		writeOPL(0xC0 + i, registers[0xC0 + i]);
+		writeOPL(0xA0 + i, registers[0xA0 + i]);
+	}
+
+	// Key on last, once everything a note needs is in place
+	writeOPL(0xBD, registers[0xBD]);
+
+	for (int i = 0; i < kMelodyVoiceCount; i++)
+		writeOPL(0xB0 + i, registers[0xB0 + i]);
+}
+
+void AdLib::checkLimits(uint64 startTime) const {
+	if ((_limits.maxSamples > 0) && (_length > _limits.maxSamples))
+		throw Common::Exception("Song exceeds the limit of %u samples", _limits.maxSamples);
+
+	if ((_limits.maxEvents > 0) && (_eventCount > _limits.maxEvents))
+		throw Common::Exception("Song exceeds the limit of %u events", _limits.maxEvents);
+
+	if ((_limits.maxOutputSize > 0) && (_sink->getOutputSize() > _limits.maxOutputSize))
+		throw Common::Exception("Song exceeds the limit of %u output bytes", _limits.maxOutputSize);
+
+	// Reading the clock isn't free, so only look at it every now and then
+	if ((_limits.maxTime > 0) && ((_eventCount & 0xFF) == 0))
+		if ((getMicroseconds() - startTime) > (_limits.maxTime * (uint64) 1000))
+			throw Common::Exception("Song exceeds the limit of %u ms of playing time", _limits.maxTime);
 }
 
-void AdLib::writeVGMData(Common::WriteStream &vgm) const {
-	for (std::list<VGMLine>::const_iterator l = _vgmLines.begin(); l != _vgmLines.end(); ++l)
-		vgm.write(l->data, l->size);
+void AdLib::flushOPL() {
+	// Writes within the silence held back are held back with it, to keep their timing
+	if (!_heldWaits.empty())
+		_heldWrites.insert(_heldWrites.end(), _writeBuffer, _writeBuffer + _writeCount);
+	else if (_sink && (_writeCount > 0))
+		_sink->writeBatch(_writeBuffer, _writeCount);
+
+	_writeCount = 0;
 }
 
 void AdLib::writeOPL(byte reg, byte val) {
-	_vgmLines.push_back(VGMLine(0x5A, reg, val));
-	_vgmDataSize += 3;
+	_oplWriteCount++;
+
+	if (_trimSilence && (reg >= 0xB0) && (reg <= 0xBD))
+		trackKeys(reg, _registers[reg], val);
+
+	_registers[reg] = val;
+
+	OPLWrite &write = _writeBuffer[_writeCount++];
+
+	write.reg     = reg;
+	write.val     = val;
+	write.command = _command;
+
+	if (_writeCount == kWriteBufferSize)
+		flushOPL();
+}
+
+void AdLib::trackKeys(byte reg, byte oldVal, byte val) {
+	if (reg <= 0xB8) {
+		const bool wasOn = (oldVal & 0x20) != 0;
+		const bool isOn  = (val    & 0x20) != 0;
+
+		if      (isOn && !wasOn)
+			keyOn();
+		else if (wasOn && !isOn)
+			keyOff(getVoiceOperators(reg - 0xB0, false));
+
+		return;
+	}
+
+	if (reg != 0xBD)
+		return;
+
+	// The percussion bits only key anything on while the percussion mode is enabled
+	const byte wasOn = (oldVal & 0x20) ? (oldVal & 0x1F) : 0;
+	const byte isOn  = (val    & 0x20) ? (val    & 0x1F) : 0;
+
+	if (isOn & ~wasOn)
+		keyOn();
+
+	uint32 operators = 0;
+	for (int i = 0; i < kPercussionVoiceCount; i++)
+		if (wasOn & ~isOn & kPercussionMasks[i])
+			operators |= getVoiceOperators(kVoiceBaseDrum + i, true);
+
+	if (operators)
+		keyOff(operators);
+}
+
+void AdLib::keyOn() {
+	if (_silence > 0) {
+		// The silence held back is handed out in the next steps, with the writes within it
+		if (_sounded)
+			_replaying = true;
+		else
+			_trimmedStart += _silence;
+
+		_silence = 0;
+	}
+
+	_sounded = true;
+}
+
+void AdLib::keyOff(uint32 operators) {
+	uint32 release = 0;
+	for (int i = 0; i < kOperatorCount; i++)
+		if (operators & (1 << i))
+			release = MAX(release, getReleaseTime(i));
+
+	const uint32 until = (release > (0xFFFFFFFF - _length)) ? 0xFFFFFFFF : (_length + release);
+
+	_audibleUntil = MAX(_audibleUntil, until);
+}
+
+bool AdLib::isKeyOn() const {
+	for (int i = 0; i < kMelodyVoiceCount; i++)
+		if (_registers[0xB0 + i] & 0x20)
+			return true;
+
+	return (_registers[0xBD] & 0x20) && (_registers[0xBD] & 0x1F);
+}
+
+uint32 AdLib::getReleaseTime(uint8 oper) const {
+	const uint8 release = _registers[0x80 + kOperatorOffset[oper]] & 0x0F;
+
+	// Without a release rate, the note never dies away
+	if (release == 0)
+		return 0xFFFFFFFF;
+
+	/* The number of OPL samples the envelope takes to fall from full volume
+	 * into silence, rounded up. Each step of the rate halves it, down to the
+	 * fastest rates, which are over within a few hundred samples. A key scale
+	 * rate only ever makes the release faster. */
+	const uint32 oplSamples = (release >= 12) ? 512 : (512 << (12 - release));
+
+	return (uint32) ((((uint64) oplSamples) * kRate + OPL::kRate - 1) / OPL::kRate);
+}
+
+void AdLib::waitAudible(uint32 delay) {
+	uint32 audible = delay;
+
+	if (!isKeyOn()) {
+		if (!_sounded || (_audibleUntil <= _length))
+			audible = 0;
+		else
+			audible = MIN(delay, _audibleUntil - _length);
+	}
+
+	if (audible > 0)
+		keyOn();
+
+	// While anything is held back, the waits are held back as well, to keep the writes in between in place
+	if ((audible > 0) && !_heldWaits.empty())
+		holdWait(audible);
+	else if (audible > 0)
+		_sink->wait(audible);
+
+	if ((delay > audible) && _sounded)
+		holdWait(delay - audible);
+
+	_silence += delay - audible;
+}
+
+void AdLib::holdWait(uint32 delay) {
+	HeldWait wait;
+
+	wait.writeCount = _heldWrites.size();
+	wait.delay      = delay;
+
+	_heldWaits.push_back(wait);
+}
+
+void AdLib::replayHeld() {
+	const uint written = (_heldNext > 0) ? _heldWaits[_heldNext - 1].writeCount : 0;
+
+	const HeldWait &wait = _heldWaits[_heldNext++];
+	if (wait.writeCount > written)
+		_sink->writeBatch(&_heldWrites[written], wait.writeCount - written);
+
+	_sink->wait(wait.delay);
+
+	if (_heldNext < _heldWaits.size())
+		return;
+
+	// Everything held back is out again
+	releaseHeld();
+}
+
+void AdLib::releaseHeld() {
+	const uint written = (_heldNext > 0) ? _heldWaits[_heldNext - 1].writeCount : 0;
+
+	if (_heldWrites.size() > written)
+		_sink->writeBatch(&_heldWrites[written], _heldWrites.size() - written);
+
+	_heldWrites.clear();
+	_heldWaits.clear();
+
+	_heldNext  = 0;
+	_replaying = false;
 }
 
 void AdLib::end(bool killRepeat) {
-	_ended = true;
+	_ended  = true;
+	_repeat = !killRepeat;
 }
 
 void AdLib::initOPL() {
@@ -242,6 +808,8 @@ bool AdLib::isPercussionMode() const {
 }
 
 void AdLib::setPercussionMode(bool percussion) {
+	const Command outer = beginCommand(kCommandGlobal);
+
 	if (percussion) {
 		voiceOff(kVoiceBaseDrum);
 		voiceOff(kVoiceSnareDrum);
@@ -255,17 +823,25 @@ void AdLib::setPercussionMode(bool percussion) {
 	_percussionMode = percussion;
 	_percussionBits = 0;
 
+	_percussionUsed = _percussionUsed || percussion;
+
 	initOperatorParams();
 	writeTremoloVibratoDepthPercMode();
+
+	endCommand(outer);
 }
 
 void AdLib::enableWaveSelect(bool enable) {
+	const Command outer = beginCommand(kCommandGlobal);
+
 	_enableWaveSelect = enable;
 
 	for (int i = 0; i < kOperatorCount; i++)
 		writeOPL(0xE0 + kOperatorOffset[i], 0);
 
 	writeOPL(0x011, _enableWaveSelect ? 0x20 : 0);
+
+	endCommand(outer);
 }
 
 void AdLib::setPitchRange(uint8 range) {
@@ -274,21 +850,33 @@ void AdLib::setPitchRange(uint8 range) {
 }
 
 void AdLib::setTremoloDepth(bool tremoloDepth) {
+	const Command outer = beginCommand(kCommandGlobal);
+
 	_tremoloDepth = tremoloDepth;
 
 	writeTremoloVibratoDepthPercMode();
+
+	endCommand(outer);
 }
 
 void AdLib::setVibratoDepth(bool vibratoDepth) {
+	const Command outer = beginCommand(kCommandGlobal);
+
 	_vibratoDepth = vibratoDepth;
 
 	writeTremoloVibratoDepthPercMode();
+
+	endCommand(outer);
 }
 
 void AdLib::setKeySplit(bool keySplit) {
+	const Command outer = beginCommand(kCommandGlobal);
+
 	_keySplit = keySplit;
 
 	writeKeySplit();
+
+	endCommand(outer);
 }
 
 void AdLib::setVoiceTimbre(uint8 voice, const uint16 *params) {
@@ -298,6 +886,8 @@ void AdLib::setVoiceTimbre(uint8 voice, const uint16 *params) {
 
 	const int voicePerc = voice - kVoiceBaseDrum;
 
+	const Command outer = beginCommand(kCommandTimbre);
+
 	if (!isPercussionMode() || (voice < kVoiceBaseDrum)) {
 		if (voice < kMelodyVoiceCount) {
 			setOperatorParams(kVoiceMelodyOperator[0][voice], params0, waves[0]);
@@ -309,6 +899,8 @@ void AdLib::setVoiceTimbre(uint8 voice, const uint16 *params) {
 	} else {
 		setOperatorParams(kVoicePercussionOperator[0][voicePerc], params0, waves[0]);
 	}
+
+	endCommand(outer);
 }
 
 void AdLib::setVoiceVolume(uint8 voice, uint8 volume) {
@@ -321,21 +913,34 @@ void AdLib::setVoiceVolume(uint8 voice, uint8 volume) {
 	else
 		oper = kVoicePercussionOperator[voice == kVoiceBaseDrum ? 1 : 0][voicePerc];
 
+	const Command outer = beginCommand(kCommandVolume);
+
 	_operatorVolume[oper] = MIN<uint8>(volume, kMaxVolume);
 	writeKeyScaleLevelVolume(oper);
+
+	endCommand(outer);
 }
 
 void AdLib::bendVoicePitch(uint8 voice, uint16 pitchBend) {
 	if (isPercussionMode() && (voice > kVoiceBaseDrum))
 		return;
 
+	const Command outer = beginCommand(kCommandPitchBend);
+
 	changePitch(voice, MIN<uint16>(pitchBend, kMaxPitch));
 	setFreq(voice, _voiceNote[voice], _voiceOn[voice]);
+
+	endCommand(outer);
 }
 
 void AdLib::noteOn(uint8 voice, uint8 note) {
 	note = MAX<int>(0, note - (kStandardMidC - kOPLMidC));
 
+	const Command outer = beginCommand(kCommandNoteOn);
+
+	if (voice < kMaxVoiceCount)
+		_voiceNotes[voice]++;
+
 	if (isPercussionMode() && (voice >= kVoiceBaseDrum)) {
 
 		if        (voice == kVoiceBaseDrum) {
@@ -350,14 +955,20 @@ void AdLib::noteOn(uint8 voice, uint8 note) {
 
 	} else
 		setFreq(voice, note, true);
+
+	endCommand(outer);
 }
 
 void AdLib::noteOff(uint8 voice) {
+	const Command outer = beginCommand(kCommandNoteOff);
+
 	if (isPercussionMode() && (voice >= kVoiceBaseDrum)) {
 		_percussionBits &= ~kPercussionMasks[voice - kVoiceBaseDrum];
 		writeTremoloVibratoDepthPercMode();
 	} else
 		setFreq(voice, _voiceNote[voice], false);
+
+	endCommand(outer);
 }
 
 void AdLib::writeKeyScaleLevelVolume(uint8 oper) {
@@ -22,17 +22,56 @@
 #define ADLIB_ADLIB_HPP
 
 #include <string>
-#include <list>
+#include <vector>
 
 #include "common/types.hpp"
 
+#include "adlib/oplsink.hpp"
+
 namespace Common {
+	class ReadStream;
 	class WriteStream;
+	class SeekableReadStream;
 }
 
 namespace AdLib {
 
-/** Base class for a VGM recording player of an AdLib music format. */
+class KeyframeIndex;
+
+/** Information about a song, found by playing it. */
+struct SongInfo {
+	static const int kVoiceCount = 11; ///< Number of voices, including the percussion voices.
+
+	uint32 rate;    ///< Number of samples per second.
+	uint32 samples; ///< Length of the song in samples.
+	uint32 events;  ///< Number of times the music was polled.
+
+	uint32 instruments; ///< Number of instruments the song comes with.
+	bool   percussion;  ///< Was the percussion mode used?
+
+	uint32 voiceNotes[kVoiceCount]; ///< Number of notes played on each voice.
+
+	SongInfo();
+
+	/** Return the number of voices that played any notes. */
+	uint32 getUsedVoiceCount() const;
+};
+
+/** Ceilings for playing a single song. A song exceeding any of them is aborted.
+ *
+ *  A value of 0 means no limit.
+ */
+struct PlayLimits {
+	uint32 maxSamples;    ///< Length of the song in samples.
+	uint32 maxEvents;     ///< Number of times the music is polled.
+	uint32 maxOutputSize; ///< Number of bytes the sink produces.
+	uint32 maxTime;       ///< Wall time in milliseconds.
+
+	/** The default limits, far beyond anything a real song needs. */
+	PlayLimits();
+};
+
+/** Base class for a player of an AdLib music format, playing into OPL sinks. */
 class AdLib {
 public:
 	AdLib();
@@ -41,6 +80,115 @@ public:
 	/** Convert AdLib music into VGM and write into outFile. */
 	void convert(const std::string &outFile);
 
+	/** Convert AdLib music into VGM and write into outFile.
+	 *
+	 *  The VGM data is recorded into vgmData before it is written, so that
+	 *  its memory can be reused over several conversions.
+	 */
+	void convert(const std::string &outFile, std::vector<byte> &vgmData);
+
+	/** Convert AdLib music into VGM and write it into a stream. */
+	void convert(Common::WriteStream &vgm, std::vector<byte> &vgmData);
+
+	/** Play the whole song, only counting the OPL writes instead of recording VGM. */
+	void profile(OPLProfile &profile);
+
+	/** Play the whole song without any output, only collecting information about it. */
+	void probe(SongInfo &info);
+
+	/** Play the whole song, handing all OPL writes to a sink. */
+	void play(OPLSink &sink);
+
+	/** Set the ceilings for playing the song. */
+	void setLimits(const PlayLimits &limits);
+
+	/** Trim the silence at the start and at the end of the song while playing it.
+	 *
+	 *  The waits before the first note is keyed on aren't handed to the sink,
+	 *  and neither are those after the last note was keyed off and its release
+	 *  died away. Waits in silence within the song are held back until the next
+	 *  note is keyed on, so that the song can still be played step by step,
+	 *  without knowing what comes next. The position of the song, and thus its
+	 *  limits and keyframes, still count the trimmed silence.
+	 */
+	void setTrimSilence(bool trim);
+
+	/** Return the number of samples trimmed from the start of the song that played, in its timing. */
+	uint32 getTrimmedStart() const;
+	/** Return the number of samples trimmed from the end of the song that played, in its timing. */
+	uint32 getTrimmedEnd() const;
+
+	/** Start playing the song step by step, handing all OPL writes to a sink.
+	 *
+	 *  This lets the caller interleave playing the song with other work. Each
+	 *  step is done by playStep(), and playing ends with stopPlaying().
+	 */
+	void startPlaying(OPLSink &sink);
+
+	/** Poll the music once, hand its OPL writes to the sink and let the time
+	 *  until the next poll pass.
+	 *
+	 *  @return false once the song ended.
+	 */
+	bool playStep();
+
+	/** Stop playing the song step by step. */
+	void stopPlaying();
+
+	/** Throw if the song that just played is too short to be music. */
+	void checkLength() const;
+
+	/** Return the number of samples per second of the song's timing. */
+	uint32 getSamplesPerSecond() const;
+
+	/** Return the OPL operators a voice plays on, a bit for each operator.
+	 *
+	 *  @param voice      The voice, 0 to 8 in melody mode, 0 to 10 in percussion mode.
+	 *  @param percussion Is the voice one of percussion mode?
+	 */
+	static uint32 getVoiceOperators(uint8 voice, bool percussion);
+
+	/** Return the position within the song playing, in samples of its timing.
+	 *
+	 *  This is where the next poll of the music happens.
+	 */
+	uint32 getPosition() const;
+
+	/** Return the number of bytes of the music data the player was created from. */
+	uint32 getInputSize() const;
+	/** Return a hash of the music data the player was created from. */
+	uint32 getInputHash() const;
+
+	/** While playing, record a keyframe of the complete state into an index.
+	 *
+	 *  A keyframe is recorded before the first poll at or after each interval
+	 *  of the index. If index is 0, no keyframes are recorded.
+	 */
+	void setKeyframes(KeyframeIndex *index);
+
+	/** Skip ahead to a position within the song playing, without waiting for the music in between.
+	 *
+	 *  The state is restored out of the last keyframe of the index at or before
+	 *  position, if that's ahead, and the music is polled from there up to and
+	 *  including position. The sink receives the OPL writes restoring the
+	 *  state and those of each poll, as well as the waits between the polls.
+	 *
+	 *  Throws if the index was recorded from other music data.
+	 *
+	 *  @param index The keyframes of the song, or 0 to poll all the way from the current position.
+	 *  @return false if the song ended before position.
+	 */
+	bool seek(uint32 position, const KeyframeIndex *index = 0);
+
+	/** Write the complete state of the song playing into a stream. */
+	void saveState(Common::WriteStream &state) const;
+
+	/** Restore the state of the song playing out of a stream, as written by saveState().
+	 *
+	 *  All OPL registers are written into the sink again.
+	 */
+	void loadState(Common::ReadStream &state);
+
 protected:
 	enum kVoice {
 		kVoiceMelody0   =  0,
@@ -100,8 +248,13 @@ protected:
 	static const int kOPLMidC      = 48; ///< A mid C for the OPL.
 
 
-	/** Return the number of samples per second. */
-	uint32 getSamplesPerSecond() const;
+	/** Number of bytes of the music data the player was created from. */
+	uint32 _inputSize;
+	/** FNV-1a hash of the music data the player was created from. */
+	uint32 _inputHash;
+
+	/** Count the whole data of a stream into the size and the hash of the music data. */
+	void addInput(Common::SeekableReadStream &stream);
 
 	/** Write a value into an OPL register. */
 	void writeOPL(byte reg, byte val);
@@ -122,6 +275,14 @@ protected:
 	/** Rewind the song. */
 	virtual void rewind() = 0;
 
+	/** Return the number of instruments the song comes with. */
+	virtual uint32 getInstrumentCount() const = 0;
+
+	/** Write the state of the format's player, like the position within the song data, into a stream. */
+	virtual void savePlayerState(Common::WriteStream &state) const = 0;
+	/** Restore the state of the format's player out of a stream, as written by savePlayerState(). */
+	virtual void loadPlayerState(Common::ReadStream &state) = 0;
+
 	/** Return whether we're in percussion mode. */
 	bool isPercussionMode() const;
 
@@ -208,19 +369,9 @@ private:
 	static const uint16 kHihatParams    [kParamCount];
 
 
-	struct VGMLine {
-		uint size;
-		byte data[3];
-
-		VGMLine();
-		VGMLine(byte cmd);
-		VGMLine(byte cmd, byte a1);
-		VGMLine(byte cmd, byte a1, byte a2);
-	};
-
-
 	bool _first;
 	bool _ended;
+	bool _repeat; ///< Did the song ask to be repeated when it ended?
 
 	bool _tremoloDepth;
 	bool _vibratoDepth;
@@ -231,6 +382,9 @@ private:
 	bool _percussionMode;
 	byte _percussionBits;
 
+	bool   _percussionUsed;             ///< Was the percussion mode used while playing?
+	uint32 _voiceNotes[kMaxVoiceCount]; ///< Number of notes played on each voice while playing.
+
 	uint8  _pitchRange;
 	uint16 _pitchRangeStep;
 
@@ -246,9 +400,47 @@ private:
 
 	int _halfToneOffset[kMaxVoiceCount];
 
-	std::list<VGMLine> _vgmLines;
-	uint32 _vgmDataSize;
-	uint32 _vgmLength;
+	uint32 _length; ///< Number of samples played.
+
+	bool   _trimSilence;  ///< Trim the silence at the start and at the end of the song?
+	bool   _sounded;      ///< Was any note keyed on yet?
+	uint32 _silence;      ///< Number of samples of silence held back from the sink.
+	uint32 _audibleUntil; ///< Position where the releases of all notes keyed off died away.
+	uint32 _trimmedStart; ///< Number of samples trimmed from the start.
+	uint32 _trimmedEnd;   ///< Number of samples trimmed from the end.
+
+	/** A wait within the silence held back, after a number of the writes held back. */
+	struct HeldWait {
+		uint   writeCount; ///< Number of held writes that come before the wait.
+		uint32 delay;      ///< Number of samples to wait.
+	};
+
+	std::vector<OPLWrite> _heldWrites; ///< OPL writes within the silence held back.
+	std::vector<HeldWait> _heldWaits;  ///< The waits between the writes held back.
+	uint                  _heldNext;   ///< The held wait to hand to the sink next.
+	bool                  _replaying;  ///< Is the held back silence handed to the sink, a wait each step?
+
+	byte _registers[256]; ///< The last value written into each OPL register.
+
+	KeyframeIndex *_keyframes; ///< The index recording keyframes while playing, if any.
+
+	uint64 _startTime; ///< When the song started playing, if there's a time limit.
+
+	PlayLimits _limits;
+
+	uint32 _eventCount;    ///< Number of times the music was polled while playing.
+	uint32 _oplWriteCount; ///< Number of OPL register writes while playing.
+
+	Command _command;                    ///< The kind of the command currently executed.
+	uint32  _commandCounts[kCommandMAX]; ///< Number of commands of each kind while playing.
+
+	/** Number of OPL writes collected before they're handed to the sink. */
+	static const uint kWriteBufferSize = 256;
+
+	OPLSink *_sink; ///< The sink receiving the OPL writes of the song playing.
+
+	OPLWrite _writeBuffer[kWriteBufferSize]; ///< OPL writes not yet handed to the sink.
+	uint     _writeCount;                    ///< Number of writes in the buffer.
 
 
 	void initOPL();
@@ -281,10 +473,43 @@ private:
 
 	void setFreq(uint8 voice, uint16 note, bool on);
 
-	void createVGMData();
-
-	void writeVGMHeader(Common::WriteStream &vgm) const;
-	void writeVGMData(Common::WriteStream &vgm) const;
+	/** Start a command of this kind, unless we're already within a command.
+	 *
+	 *  @return The kind of the command that needs to be restored with endCommand().
+	 */
+	Command beginCommand(Command command);
+	void endCommand(Command command);
+
+	void recordVGM(VGMSink &sink);
+
+	/** Hand all collected OPL writes to the sink. */
+	void flushOPL();
+
+	/** Write the last value of all OPL registers into the OPL again. */
+	void rewriteOPL();
+
+	/** Follow the notes keyed on and off by an OPL register write, when trimming silence. */
+	void trackKeys(byte reg, byte oldVal, byte val);
+	/** A note is keyed on: hand the silence held back to the sink, unless it's at the start. */
+	void keyOn();
+	/** The notes on these operators, a bit for each, were keyed off and now release. */
+	void keyOff(uint32 operators);
+	/** Is any note keyed on? */
+	bool isKeyOn() const;
+	/** Return the number of samples the release of an operator takes to die away, at most. */
+	uint32 getReleaseTime(uint8 oper) const;
+
+	/** Hand the audible part of a wait to the sink, and hold back the silence. */
+	void waitAudible(uint32 delay);
+	/** Hold back a wait, after the writes held back so far. */
+	void holdWait(uint32 delay);
+	/** Hand the next wait held back to the sink, together with the writes before it. */
+	void replayHeld();
+	/** Hand the rest of the writes held back to the sink, dropping their waits. */
+	void releaseHeld();
+
+	/** Throw if the song playing exceeds any of the limits. */
+	void checkLimits(uint64 startTime) const;
 };
 
 } // End of namespace AdLib
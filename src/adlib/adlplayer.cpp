@@ -171,6 +171,10 @@ uint32 ADLPlayer::pollMusic(bool first) {
 	return getSampleDelay(delay);
 }
 
+uint32 ADLPlayer::getInstrumentCount() const {
+	return _timbres.size();
+}
+
 uint32 ADLPlayer::getSampleDelay(uint16 delay) const {
 	if (delay == 0)
 		return 0;
@@ -178,6 +182,55 @@ uint32 ADLPlayer::getSampleDelay(uint16 delay) const {
 	return ((uint32)delay * getSamplesPerSecond()) / 1000;
 }
 
+void ADLPlayer::savePlayerState(Common::WriteStream &state) const {
+	state.writeUint32LE(_playPos ? (_playPos - _songData) : 0xFFFFFFFF);
+
+	state.writeByte(_modifyInstrument);
+	for (int i = 0; i < kMaxVoiceCount; i++)
+		state.writeUint16LE(_currentInstruments[i]);
+
+	// Only the instruments the song modified so far
+	uint16 modified = 0;
+	for (std::vector<Timbre>::const_iterator t = _timbres.begin(); t != _timbres.end(); ++t)
+		if (memcmp(t->params, t->startParams, sizeof(t->params)))
+			modified++;
+
+	state.writeUint16LE(modified);
+	for (size_t i = 0; i < _timbres.size(); i++) {
+		if (!memcmp(_timbres[i].params, _timbres[i].startParams, sizeof(_timbres[i].params)))
+			continue;
+
+		state.writeUint16LE(i);
+		for (int j = 0; j < (kOperatorsPerVoice * kParamCount); j++)
+			state.writeUint16LE(_timbres[i].params[j]);
+	}
+}
+
+void ADLPlayer::loadPlayerState(Common::ReadStream &state) {
+	const uint32 playPos = state.readUint32LE();
+	if ((playPos != 0xFFFFFFFF) && (playPos > _songDataSize))
+		throw Common::Exception("Invalid player state");
+
+	_playPos = (playPos == 0xFFFFFFFF) ? 0 : (_songData + playPos);
+
+	_modifyInstrument = state.readByte();
+	for (int i = 0; i < kMaxVoiceCount; i++)
+		_currentInstruments[i] = state.readUint16LE();
+
+	for (std::vector<Timbre>::iterator t = _timbres.begin(); t != _timbres.end(); ++t)
+		memcpy(t->params, t->startParams, sizeof(t->params));
+
+	const uint16 modified = state.readUint16LE();
+	for (uint16 i = 0; i < modified; i++) {
+		const uint16 timbre = state.readUint16LE();
+		if (timbre >= _timbres.size())
+			throw Common::Exception("Invalid player state");
+
+		for (int j = 0; j < (kOperatorsPerVoice * kParamCount); j++)
+			_timbres[timbre].params[j] = state.readUint16LE();
+	}
+}
+
 void ADLPlayer::rewind() {
 	// Reset song data
 	_playPos = _songData;
@@ -205,6 +258,8 @@ void ADLPlayer::rewind() {
 void ADLPlayer::load(Common::SeekableReadStream &adl) {
 	int timbreCount;
 
+	addInput(adl);
+
 	readHeader(adl, timbreCount);
 	readTimbres(adl, timbreCount);
 	readSongData(adl);
@@ -0,0 +1,199 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/keyframes.cpp
+ *  Keyframes of a song's state, for seeking within it.
+ */
+
+#include <cassert>
+
+#include <algorithm>
+
+#include "common/util.hpp"
+#include "common/error.hpp"
+#include "common/stream.hpp"
+
+#include "adlib/adlib.hpp"
+#include "adlib/keyframes.hpp"
+
+namespace AdLib {
+
+/** Magic tag of a keyframe index file. */
+static const uint32 kIndexTag = MKTAG('A', 'D', 'L', 'K');
+/** Version of the index file, and of the player states within. */
+static const uint32 kIndexVersion = 2;
+
+/** A stream appending to a buffer of bytes. */
+class StateWriter : public Common::WriteStream {
+public:
+	StateWriter(std::vector<byte> &data) : _data(&data) {
+	}
+
+	uint32 write(const void *dataPtr, uint32 dataSize) {
+		const byte *data = (const byte *) dataPtr;
+
+		_data->insert(_data->end(), data, data + dataSize);
+		return dataSize;
+	}
+
+private:
+	std::vector<byte> *_data;
+};
+
+
+KeyframeIndex::KeyframeIndex(uint32 interval) : _interval(MAX<uint32>(interval, 1)), _next(0),
+	_inputSize(0), _inputHash(0) {
+}
+
+KeyframeIndex::~KeyframeIndex() {
+}
+
+void KeyframeIndex::clear() {
+	_next = 0;
+
+	_positions.clear();
+	_offsets.clear();
+	_states.clear();
+}
+
+void KeyframeIndex::setInput(uint32 size, uint32 hash) {
+	_inputSize = size;
+	_inputHash = hash;
+}
+
+bool KeyframeIndex::isOf(const AdLib &player) const {
+	return (_inputSize == player.getInputSize()) && (_inputHash == player.getInputHash());
+}
+
+uint32 KeyframeIndex::getInterval() const {
+	return _interval;
+}
+
+uint32 KeyframeIndex::getCount() const {
+	return _positions.size();
+}
+
+uint32 KeyframeIndex::getPosition(uint32 keyframe) const {
+	assert(keyframe < _positions.size());
+
+	return _positions[keyframe];
+}
+
+bool KeyframeIndex::find(uint32 position, uint32 &keyframe) const {
+	// The keyframes are sorted by their position
+	std::vector<uint32>::const_iterator p = std::upper_bound(_positions.begin(), _positions.end(), position);
+	if (p == _positions.begin())
+		return false;
+
+	keyframe = (p - _positions.begin()) - 1;
+	return true;
+}
+
+bool KeyframeIndex::isDue(uint32 position) const {
+	return position >= _next;
+}
+
+void KeyframeIndex::record(const AdLib &player) {
+	const uint32 position = player.getPosition();
+
+	_positions.push_back(position);
+	_offsets.push_back(_states.size());
+
+	StateWriter state(_states);
+	player.saveState(state);
+
+	_next = (position / _interval + 1) * _interval;
+}
+
+void KeyframeIndex::restore(uint32 keyframe, AdLib &player) const {
+	assert(keyframe < _positions.size());
+
+	const uint32 start = _offsets[keyframe];
+	const uint32 end   = ((keyframe + 1) < _offsets.size()) ? _offsets[keyframe + 1] : _states.size();
+
+	Common::MemoryReadStream state(&_states[start], end - start);
+
+	player.loadState(state);
+}
+
+void KeyframeIndex::write(Common::WriteStream &index) const {
+	index.writeUint32BE(kIndexTag);
+	index.writeUint32LE(kIndexVersion);
+	index.writeUint32LE(_interval);
+	index.writeUint32LE(_inputSize);
+	index.writeUint32LE(_inputHash);
+	index.writeUint32LE(_positions.size());
+
+	for (size_t i = 0; i < _positions.size(); i++) {
+		index.writeUint32LE(_positions[i]);
+		index.writeUint32LE(_offsets[i]);
+	}
+
+	index.writeUint32LE(_states.size());
+	if (!_states.empty())
+		index.write(&_states[0], _states.size());
+}
+
+void KeyframeIndex::read(Common::SeekableReadStream &index) {
+	clear();
+
+	if (index.readUint32BE() != kIndexTag)
+		throw Common::Exception("Not a keyframe index");
+
+	const uint32 version = index.readUint32LE();
+	if (version != kIndexVersion)
+		throw Common::Exception("Unsupported keyframe index version %u", version);
+
+	_interval  = index.readUint32LE();
+	_inputSize = index.readUint32LE();
+	_inputHash = index.readUint32LE();
+
+	const uint32 count = index.readUint32LE();
+	if ((_interval == 0) || (count > (uint32) (index.size() / 8)))
+		throw Common::Exception("Invalid keyframe index");
+
+	_positions.resize(count);
+	_offsets.resize(count);
+
+	for (uint32 i = 0; i < count; i++) {
+		_positions[i] = index.readUint32LE();
+		_offsets  [i] = index.readUint32LE();
+	}
+
+	const uint32 size = index.readUint32LE();
+	if (index.err() || index.eos() || (size > (uint32) (index.size() - index.pos())))
+		throw Common::Exception("Invalid keyframe index");
+
+	_states.resize(size);
+	if ((size > 0) && (index.read(&_states[0], size) != size))
+		throw Common::kReadError;
+
+	// Each keyframe's state starts within the states, right after the one before
+	if ((count > 0) && (_offsets[0] != 0))
+		throw Common::Exception("Invalid keyframe index");
+
+	for (uint32 i = 0; i < count; i++)
+		if ((_offsets[i] >= size) || ((i > 0) && ((_offsets[i] <= _offsets[i - 1]) || (_positions[i] < _positions[i - 1]))))
+			throw Common::Exception("Invalid keyframe index");
+
+	_next = _positions.empty() ? 0 : ((_positions.back() / _interval + 1) * _interval);
+}
+
+} // End of namespace AdLib
@@ -0,0 +1,113 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/keyframes.hpp
+ *  Keyframes of a song's state, for seeking within it.
+ */
+
+#ifndef ADLIB_KEYFRAMES_HPP
+#define ADLIB_KEYFRAMES_HPP
+
+#include <vector>
+
+#include "common/types.hpp"
+
+namespace Common {
+	class WriteStream;
+	class SeekableReadStream;
+}
+
+namespace AdLib {
+
+class AdLib;
+
+/** An index of keyframes of a song, for seeking within it.
+ *
+ *  A keyframe is a snapshot of the complete state of a player, as saved by
+ *  AdLib::saveState(), at one position within the song. Seeking restores the
+ *  last keyframe before the position sought, and then only needs to poll the
+ *  music from there, instead of from the start of the song.
+ *
+ *  The index is recorded while the song plays, see AdLib::setKeyframes(),
+ *  and can be written into a file of its own, next to the song. It notes
+ *  the size and the hash of the music data it was recorded from, so that
+ *  it's not used to seek within another song.
+ */
+class KeyframeIndex {
+public:
+	/** Record a keyframe every interval samples of the song's timing. */
+	KeyframeIndex(uint32 interval = 44100);
+	~KeyframeIndex();
+
+	/** Remove all keyframes. */
+	void clear();
+
+	/** Set the size and the hash of the music data the keyframes are recorded from. */
+	void setInput(uint32 size, uint32 hash);
+
+	/** Were the keyframes recorded from the music data of this player? */
+	bool isOf(const AdLib &player) const;
+
+	/** Return the distance between the keyframes, in samples of the song's timing. */
+	uint32 getInterval() const;
+
+	/** Return the number of keyframes. */
+	uint32 getCount() const;
+
+	/** Return the position of a keyframe, in samples of the song's timing. */
+	uint32 getPosition(uint32 keyframe) const;
+
+	/** Find the last keyframe at or before a position.
+	 *
+	 *  @return false if there's no keyframe at or before position.
+	 */
+	bool find(uint32 position, uint32 &keyframe) const;
+
+	/** Is a keyframe due at this position? */
+	bool isDue(uint32 position) const;
+
+	/** Record a keyframe of the state of a player, at its current position. */
+	void record(const AdLib &player);
+
+	/** Restore the state of a keyframe into a player that's playing the song. */
+	void restore(uint32 keyframe, AdLib &player) const;
+
+	/** Write the index into a stream. */
+	void write(Common::WriteStream &index) const;
+
+	/** Read an index written by write() out of a stream. */
+	void read(Common::SeekableReadStream &index);
+
+private:
+	uint32 _interval;
+	uint32 _next; ///< The position the next keyframe is due at.
+
+	uint32 _inputSize; ///< The size of the music data the keyframes are recorded from.
+	uint32 _inputHash; ///< The hash of the music data the keyframes are recorded from.
+
+	std::vector<uint32> _positions; ///< The position of each keyframe.
+	std::vector<uint32> _offsets;   ///< Where the state of each keyframe starts within _states.
+
+	std::vector<byte> _states; ///< The states of all keyframes, one after the other.
+};
+
+} // End of namespace AdLib
+
+#endif // ADLIB_KEYFRAMES_HPP
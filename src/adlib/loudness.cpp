@@ -0,0 +1,264 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/loudness.cpp
+ *  Measuring the levels of rendered PCM audio, and amplifying it.
+ */
+
+#include <cmath>
+
+#include "common/util.hpp"
+
+#include "adlib/loudness.hpp"
+
+namespace AdLib {
+
+const double LoudnessSink::kSilence      = -120.0;
+const double LoudnessSink::kAbsoluteGate =  -70.0;
+
+/** Highest loudness of the histogram, in LUFS. Louder blocks count as this loud. */
+static const double kHistogramTop = 5.0;
+/** Number of histogram bins per LU. */
+static const int kHistogramScale = 10;
+
+/** The relative gate, in LU below the loudness of all blocks above the absolute gate. */
+static const double kRelativeGate = 10.0;
+
+/** Offset of the loudness of a mean square, after BS.1770. */
+static const double kLoudnessOffset = -0.691;
+
+static double toLoudness(double energy) {
+	return kLoudnessOffset + 10.0 * std::log10(energy);
+}
+
+
+double LoudnessSink::Biquad::process(double x) {
+	// Transposed direct form II
+	const double y = b0 * x + z1;
+
+	z1 = b1 * x - a1 * y + z2;
+	z2 = b2 * x - a2 * y;
+
+	return y;
+}
+
+
+LoudnessSink::LoudnessSink(PCMSink &sink, bool enabled) : _sink(&sink), _enabled(enabled),
+	_peak(0), _squares(0), _sampleCount(0), _stepLength(1), _stepSamples(0), _stepEnergy(0.0), _stepCount(0) {
+
+	for (uint32 i = 0; i < kStepsPerBlock; i++)
+		_steps[i] = 0.0;
+}
+
+LoudnessSink::~LoudnessSink() {
+}
+
+void LoudnessSink::begin(uint32 rate) {
+	_sink->begin(rate);
+
+	if (!_enabled)
+		return;
+
+	/* The K-weighting filters, after BS.1770, with the coefficients
+	 * derived for any sample rate out of their analog prototypes. */
+
+	double k  = std::tan(M_PI * 1681.974450955533 / rate);
+	double q  = 0.7071752369554196;
+	double vh = std::pow(10.0, 3.999843853973347 / 20.0);
+	double vb = std::pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+
+	_shelf.b0 = (vh + vb * k / q + k * k) / a0;
+	_shelf.b1 = 2.0 * (k * k - vh) / a0;
+	_shelf.b2 = (vh - vb * k / q + k * k) / a0;
+	_shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+	_shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+	k  = std::tan(M_PI * 38.13547087602444 / rate);
+	q  = 0.5003270373238773;
+	a0 = 1.0 + k / q + k * k;
+
+	_highPass.b0 =  1.0;
+	_highPass.b1 = -2.0;
+	_highPass.b2 =  1.0;
+	_highPass.a1 = 2.0 * (k * k - 1.0) / a0;
+	_highPass.a2 = (1.0 - k / q + k * k) / a0;
+
+	_shelf.z1    = _shelf.z2    = 0.0;
+	_highPass.z1 = _highPass.z2 = 0.0;
+
+	_peak        = 0;
+	_squares     = 0;
+	_sampleCount = 0;
+
+	_stepLength  = MAX<uint32>(rate / 10, 1);
+	_stepSamples = 0;
+	_stepEnergy  = 0.0;
+	_stepCount   = 0;
+
+	const size_t bins = (size_t) ((kHistogramTop - kAbsoluteGate) * kHistogramScale);
+
+	_blockCounts.assign(bins, 0);
+	_blockEnergies.assign(bins, 0.0);
+}
+
+void LoudnessSink::write(const int16 *samples, uint32 count) {
+	if (_enabled) {
+		for (uint32 i = 0; i < count; i++) {
+			const int32 sample = samples[i];
+
+			_peak     = MAX<uint32>(_peak, ABS(sample));
+			_squares += (uint64) (sample * sample);
+
+			const double weighted = _highPass.process(_shelf.process(sample / 32768.0));
+
+			_stepEnergy += weighted * weighted;
+			if (++_stepSamples >= _stepLength)
+				finishStep();
+		}
+
+		_sampleCount += count;
+	}
+
+	_sink->write(samples, count);
+}
+
+void LoudnessSink::end() {
+	// A partial step at the end doesn't make a full block, and is dropped, as BS.1770 does
+
+	_sink->end();
+}
+
+void LoudnessSink::finishStep() {
+	_steps[_stepCount % kStepsPerBlock] = _stepEnergy;
+	_stepCount++;
+
+	_stepSamples = 0;
+	_stepEnergy  = 0.0;
+
+	if (_stepCount < kStepsPerBlock)
+		return;
+
+	double energy = 0.0;
+	for (uint32 i = 0; i < kStepsPerBlock; i++)
+		energy += _steps[i];
+
+	energy /= _stepLength * kStepsPerBlock;
+
+	if ((energy <= 0.0) || (toLoudness(energy) < kAbsoluteGate))
+		return;
+
+	const int bin = (int) std::floor((toLoudness(energy) - kAbsoluteGate) * kHistogramScale);
+	const size_t index = MIN<size_t>(bin, _blockCounts.size() - 1);
+
+	_blockCounts  [index]++;
+	_blockEnergies[index] += energy;
+}
+
+bool LoudnessSink::isEnabled() const {
+	return _enabled;
+}
+
+double LoudnessSink::getPeak() const {
+	if (_peak == 0)
+		return kSilence;
+
+	return MAX(20.0 * std::log10(_peak / 32768.0), kSilence);
+}
+
+double LoudnessSink::getRMS() const {
+	if (_squares == 0)
+		return kSilence;
+
+	return MAX(10.0 * std::log10(((double) _squares) / _sampleCount / (32768.0 * 32768.0)), kSilence);
+}
+
+double LoudnessSink::getLoudness() const {
+	// The blocks above the absolute gate make up the relative gate
+	uint64 count  = 0;
+	double energy = 0.0;
+
+	for (size_t i = 0; i < _blockCounts.size(); i++) {
+		count  += _blockCounts[i];
+		energy += _blockEnergies[i];
+	}
+
+	if (count == 0)
+		return kAbsoluteGate;
+
+	const double gate = toLoudness(energy / count) - kRelativeGate;
+	const int    bin  = (int) std::floor((gate - kAbsoluteGate) * kHistogramScale);
+
+	// Average the blocks above the relative gate
+	count  = 0;
+	energy = 0.0;
+
+	for (size_t i = MAX(bin, 0); i < _blockCounts.size(); i++) {
+		count  += _blockCounts[i];
+		energy += _blockEnergies[i];
+	}
+
+	if (count == 0)
+		return kAbsoluteGate;
+
+	return MAX(toLoudness(energy / count), kAbsoluteGate);
+}
+
+
+GainSink::GainSink(PCMSink &sink, double gain) : _sink(&sink), _factor(getFactor(gain)) {
+}
+
+GainSink::~GainSink() {
+}
+
+void GainSink::begin(uint32 rate) {
+	_sink->begin(rate);
+}
+
+void GainSink::write(const int16 *samples, uint32 count) {
+	if ((_factor == 0x10000) || (count == 0)) {
+		_sink->write(samples, count);
+		return;
+	}
+
+	_buffer.assign(samples, samples + count);
+
+	amplify(&_buffer[0], count, _factor);
+
+	_sink->write(&_buffer[0], count);
+}
+
+void GainSink::end() {
+	_sink->end();
+}
+
+int32 GainSink::getFactor(double gain) {
+	return (int32) std::floor(std::pow(10.0, gain / 20.0) * 0x10000 + 0.5);
+}
+
+void GainSink::amplify(int16 *samples, uint32 count, int32 factor) {
+	for (uint32 i = 0; i < count; i++) {
+		const int64 sample = (((int64) samples[i]) * factor + 0x8000) >> 16;
+
+		samples[i] = (int16) CLIP<int64>(sample, -32768, 32767);
+	}
+}
+
+} // End of namespace AdLib
@@ -0,0 +1,140 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/loudness.hpp
+ *  Measuring the levels of rendered PCM audio, and amplifying it.
+ */
+
+#ifndef ADLIB_LOUDNESS_HPP
+#define ADLIB_LOUDNESS_HPP
+
+#include <vector>
+
+#include "common/types.hpp"
+
+#include "adlib/render.hpp"
+
+namespace AdLib {
+
+/** A PCM sink measuring the levels of the audio passing through it, on to another sink.
+ *
+ *  Measured are the sample peak, the RMS level and the integrated loudness
+ *  after EBU R128 (ITU-R BS.1770): the audio is K-weighted, its mean square
+ *  taken over blocks of 400ms, overlapping by 75%, and averaged over all
+ *  blocks that pass an absolute gate at -70 LUFS and a relative gate 10 LU
+ *  below the loudness of those.
+ *
+ *  All is measured in one pass, while the audio streams through. Instead of
+ *  keeping every block, the blocks are sorted into a histogram of 0.1 LU
+ *  steps, which only makes the relative gate that coarse.
+ */
+class LoudnessSink : public PCMSink {
+public:
+	/** Level reported for the peak and RMS of silence, in dBFS. */
+	static const double kSilence;
+	/** The absolute gate, in LUFS. Audio that's quieter all the way through reports this loudness. */
+	static const double kAbsoluteGate;
+
+	/** Measure the audio, unless disabled, and pass it on to sink. */
+	LoudnessSink(PCMSink &sink, bool enabled = true);
+	~LoudnessSink();
+
+	void begin(uint32 rate);
+	void write(const int16 *samples, uint32 count);
+	void end();
+
+	/** Was the audio measured? */
+	bool isEnabled() const;
+
+	/** Return the sample peak, in dBFS. */
+	double getPeak() const;
+	/** Return the RMS level, in dBFS. */
+	double getRMS() const;
+	/** Return the integrated loudness, in LUFS. */
+	double getLoudness() const;
+
+private:
+	/** A biquad filter of the K-weighting. */
+	struct Biquad {
+		double b0, b1, b2, a1, a2;
+		double z1, z2;
+
+		double process(double x);
+	};
+
+	/** Number of 100ms steps in a block. */
+	static const uint32 kStepsPerBlock = 4;
+
+	PCMSink *_sink;
+
+	bool _enabled;
+
+	Biquad _shelf;    ///< The first stage of the K-weighting: a high shelf.
+	Biquad _highPass; ///< The second stage of the K-weighting: a high pass.
+
+	uint32 _peak;         ///< The highest absolute sample value.
+	uint64 _squares;      ///< Sum of all squared sample values.
+	uint64 _sampleCount;  ///< Number of samples measured.
+
+	uint32 _stepLength;  ///< Number of samples in a 100ms step.
+	uint32 _stepSamples; ///< Number of samples in the current step so far.
+	double _stepEnergy;  ///< Sum of the squared weighted samples in the current step.
+
+	double _steps[kStepsPerBlock]; ///< Energy of the last steps.
+	uint32 _stepCount;             ///< Number of steps finished.
+
+	std::vector<uint64> _blockCounts;   ///< Number of blocks within each 0.1 LU of the histogram.
+	std::vector<double> _blockEnergies; ///< Sum of the mean squares of the blocks within each 0.1 LU.
+
+	/** Finish a 100ms step, and with it a block. */
+	void finishStep();
+};
+
+/** A PCM sink amplifying the audio by a fixed gain, on to another sink.
+ *
+ *  The gain is applied in 16.16 fixed point, and the samples are clipped.
+ */
+class GainSink : public PCMSink {
+public:
+	/** Amplify by gain dB. */
+	GainSink(PCMSink &sink, double gain);
+	~GainSink();
+
+	void begin(uint32 rate);
+	void write(const int16 *samples, uint32 count);
+	void end();
+
+	/** Return the 16.16 fixed point factor amplifying by gain dB. */
+	static int32 getFactor(double gain);
+
+	/** Amplify samples by a 16.16 fixed point factor. */
+	static void amplify(int16 *samples, uint32 count, int32 factor);
+
+private:
+	PCMSink *_sink;
+
+	int32 _factor;
+
+	std::vector<int16> _buffer;
+};
+
+} // End of namespace AdLib
+
+#endif // ADLIB_LOUDNESS_HPP
@@ -192,6 +192,28 @@ uint32 MUSPlayer::pollMusic(bool first) {
 	return getSampleDelay(delay);
 }
 
+uint32 MUSPlayer::getInstrumentCount() const {
+	return _timbres.size();
+}
+
+void MUSPlayer::savePlayerState(Common::WriteStream &state) const {
+	state.writeUint32LE(_playPos ? (_playPos - _songData) : 0xFFFFFFFF);
+
+	state.writeUint16LE(_tempo);
+	state.writeByte(_lastCommand);
+}
+
+void MUSPlayer::loadPlayerState(Common::ReadStream &state) {
+	const uint32 playPos = state.readUint32LE();
+	if ((playPos != 0xFFFFFFFF) && (playPos > _songDataSize))
+		throw Common::Exception("Invalid player state");
+
+	_playPos = (playPos == 0xFFFFFFFF) ? 0 : (_songData + playPos);
+
+	_tempo       = state.readUint16LE();
+	_lastCommand = state.readByte();
+}
+
 void MUSPlayer::rewind() {
 	_playPos = _songData;
 	_tempo   = _baseTempo;
@@ -205,6 +227,8 @@ void MUSPlayer::rewind() {
 void MUSPlayer::loadSND(Common::SeekableReadStream &snd) {
 	int timbreCount, timbrePos;
 
+	addInput(snd);
+
 	readSNDHeader(snd, timbreCount, timbrePos);
 	readSNDTimbres(snd, timbreCount, timbrePos);
 
@@ -271,6 +295,8 @@ void MUSPlayer::readSNDTimbres(Common::SeekableReadStream &snd, int timbreCount,
 }
 
 void MUSPlayer::loadMUS(Common::SeekableReadStream &mus) {
+	addInput(mus);
+
 	readMUSHeader(mus);
 	readMUSSong(mus);
 
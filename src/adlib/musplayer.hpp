@@ -27,6 +27,8 @@
 #include "adlib/adlib.hpp"
 
 namespace Common {
+	class ReadStream;
+	class WriteStream;
 	class SeekableReadStream;
 }
 
@@ -45,6 +47,9 @@ protected:
 	// AdLib interface
 	uint32 pollMusic(bool first);
 	void rewind();
+	uint32 getInstrumentCount() const;
+	void savePlayerState(Common::WriteStream &state) const;
+	void loadPlayerState(Common::ReadStream &state);
 
 private:
 	struct Timbre {
@@ -0,0 +1,1003 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The OPL emulation is a port of Nuked OPL3, whose copyright and license are:
+ *
+ * Nuked OPL3
+ * Copyright (C) 2013-2020 Nuke.YKT
+ *
+ * Nuked OPL3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * Nuked OPL3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Nuked OPL3. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Nuked OPL3 thanks:
+ *     MAME Development Team (Jarek Burczynski, Tatsuyuki Satoh):
+ *         Feedback and Rhythm part calculation information.
+ *     forums.submarine.org.uk (carbon14, opl3):
+ *         Tremolo and phase generator calculation information.
+ *     OPLx decapsulated (Matthew Gambrell, Olli Niemitalo):
+ *         OPL2 ROMs.
+ *     siliconpr0n.org (John McMaster, digshadow):
+ *         YMF262 and VRC VII decaps and die shots.
+ */
+
+/** @file adlib/opl.cpp
+ *  Emulation of the OPL2 (YM3812) FM synthesis chip.
+ */
+
+#include <cmath>
+
+#include <vector>
+#include <algorithm>
+
+#include "common/util.hpp"
+
+#include "adlib/opl.hpp"
+
+namespace AdLib {
+
+/** Stages of the envelope generator. */
+enum EnvelopeStage {
+	kStageAttack  = 0,
+	kStageDecay   = 1,
+	kStageSustain = 2,
+	kStageRelease = 3
+};
+
+// Key on bits: keyed on by the channel, and keyed on by the rhythm mode
+static const int32 kKeyNormal = 1;
+static const int32 kKeyRhythm = 2;
+
+// Operator register offset to slot, -1 for none
+static const int kRegisterSlot[0x20] = {
+	 0,  1,  2,  3,  4,  5, -1, -1,  6,  7,  8,  9, 10, 11, -1, -1,
+	12, 13, 14, 15, 16, 17, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+// For each slot, the channel it belongs to
+static const int kSlotChannel[OPL::kSlotCount] = {
+	0, 1, 2, 0, 1, 2,
+	3, 4, 5, 3, 4, 5,
+	6, 7, 8, 6, 7, 8
+};
+
+// The slots of the rhythm instruments
+static const int kSlotBaseDrum1  = 12;
+static const int kSlotHihat      = 13;
+static const int kSlotTom        = 14;
+static const int kSlotBaseDrum2  = 15;
+static const int kSlotSnareDrum  = 16;
+static const int kSlotCymbal     = 17;
+
+// Frequency multipliers, doubled
+static const int32 kMultiplier[16] = {
+	1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 20, 24, 24, 30, 30
+};
+
+// Key scale level attenuation, by the upper 4 bits of the frequency number
+static const int32 kKeyScaleLevel[16] = {
+	0, 32, 40, 45, 48, 51, 53, 55, 56, 58, 59, 60, 61, 62, 63, 64
+};
+
+// Shift of the key scale level attenuation: 0, 3, 1.5 and 6 dB per octave
+static const int32 kKeyScaleLevelShift[4] = { 8, 1, 2, 0 };
+
+// Number of samples skipped through at once, with their timer values recorded
+static const uint32 kSkipRunLength = 4096;
+
+// Envelope increments of the fast rates, by the rate's lower bits and the envelope timer
+static const int32 kEnvelopeStep[4][4] = {
+	{ 0, 0, 0, 0 },
+	{ 1, 0, 0, 0 },
+	{ 1, 0, 1, 0 },
+	{ 1, 1, 1, 0 }
+};
+
+/** The chip's log-sin and exponent ROMs. */
+struct OPLTables {
+	int32 logSin[256];
+	int32 exp[256];
+
+	OPLTables() {
+		static const double kPi = 3.14159265358979323846;
+
+		for (int i = 0; i < 256; i++) {
+			logSin[i] = (int32) std::floor(-std::log(std::sin((i + 0.5) * kPi / 512.0)) / std::log(2.0) * 256.0 + 0.5);
+			exp   [i] = (int32) std::floor(std::pow(2.0, (255 - i) / 256.0) * 1024.0 + 0.5);
+		}
+	}
+};
+
+static const OPLTables kTables;
+
+/** Turn an attenuation from the log-sin table into a linear level. */
+static inline int32 calcExp(int32 level) {
+	if (level > 0x1FFF)
+		level = 0x1FFF;
+
+	return (kTables.exp[level & 0xFF] << 1) >> (level >> 8);
+}
+
+/** Return the attenuation of an envelope, including the levels and the tremolo. */
+static inline int32 calcEnvelopeOut(int32 envelope, int32 totalLevel, int32 envelopeKSL, int32 keyScaleLevel,
+                                    int32 tremolo) {
+
+	const int32 out = envelope + (totalLevel << 2) + (envelopeKSL >> kKeyScaleLevelShift[keyScaleLevel]) + tremolo;
+
+	return MIN<int32>(out, 0x1FF);
+}
+
+/** Return the register rate the envelope of a slot changes with in its stage. */
+static inline int32 calcEnvelopeRate(int32 stage, bool reset, int32 sustaining,
+                                     int32 attack, int32 decay, int32 release) {
+
+	if (reset || (stage == kStageAttack))
+		return attack;
+	if (stage == kStageDecay)
+		return decay;
+	if ((stage == kStageRelease) || !sustaining)
+		return release;
+
+	return 0;
+}
+
+/** Step the envelope generator of a slot through one sample.
+ *
+ *  keyScale is the channel's key scale value, as far as the slot's key scale rate lets it through.
+ *
+ *  @return true if keying on the slot restarts its phase.
+ */
+static inline bool calcEnvelope(int32 &envelope, int32 &stage, int32 key, int32 sustaining,
+                                int32 attack, int32 decay, int32 sustain, int32 release, int32 keyScale,
+                                int32 envelopeState, int32 envelopeAdd, int32 envelopeTimer) {
+
+	// Keying on a released slot restarts its attack
+	const bool reset = key && (stage == kStageRelease);
+
+	const int32 regRate = calcEnvelopeRate(stage, reset, sustaining, attack, decay, release);
+
+	const int32 rate     = keyScale + (regRate << 2);
+	const int32 rateLow  = rate & 3;
+	const int32 rateHigh = (rate & 0x40) ? 0x0F : (rate >> 2);
+
+	int32 shift = 0;
+	if (regRate != 0) {
+		if (rateHigh < 12) {
+			if (envelopeState) {
+				const int32 envelopeShift = rateHigh + envelopeAdd;
+
+				if      (envelopeShift == 12)
+					shift = 1;
+				else if (envelopeShift == 13)
+					shift = (rateLow >> 1) & 1;
+				else if (envelopeShift == 14)
+					shift = rateLow & 1;
+			}
+		} else {
+			shift = (rateHigh & 3) + kEnvelopeStep[rateLow][envelopeTimer];
+			if (shift & 4)
+				shift = 3;
+			if (!shift)
+				shift = envelopeState;
+		}
+	}
+
+	const bool off = (envelope & 0x1F8) == 0x1F8;
+
+	int32 level = envelope;
+	if (reset && (rateHigh == 0x0F))
+		level = 0;
+	if ((stage != kStageAttack) && !reset && off)
+		level = 0x1FF;
+
+	int32 increment = 0;
+	if (stage == kStageAttack) {
+		if (envelope == 0)
+			stage = kStageDecay;
+		else if (key && (shift > 0) && (rateHigh != 0x0F))
+			increment = ~envelope >> (4 - shift);
+	} else if ((stage == kStageDecay) && ((envelope >> 4) == sustain)) {
+		stage = kStageSustain;
+	} else if (!off && !reset && (shift > 0)) {
+		increment = 1 << (shift - 1);
+	}
+
+	envelope = (level + increment) & 0x1FF;
+
+	if (reset)
+		stage = kStageAttack;
+	if (!key)
+		stage = kStageRelease;
+
+	return reset;
+}
+
+/** Return the rate of an envelope while skipping, or -1 if it doesn't change anymore. */
+static inline int32 calcSkipRate(int32 envelope, int32 stage, int32 sustaining,
+                                 int32 attack, int32 decay, int32 release, int32 keyScale) {
+
+	// No slot is keyed on while skipping
+	const int32 regRate = calcEnvelopeRate(stage, false, sustaining, attack, decay, release);
+
+	// Without a rate, or fully released, the envelope holds
+	if ((regRate == 0) || ((stage != kStageAttack) && (envelope == 0x1FF)))
+		return -1;
+
+	const int32 rate = keyScale + (regRate << 2);
+
+	return (rate & 0x40) ? 0x0F : (rate >> 2);
+}
+
+/** Return how far the phase of a slot advances with each sample, at a position within the vibrato. */
+static inline int32 calcPhaseStep(int32 freq, int32 block, int32 multiplier, int32 vibratoPos, int32 vibratoShift) {
+	int32 range = (freq >> 7) & 7;
+	if (!(vibratoPos & 3))
+		range = 0;
+	else if (vibratoPos & 1)
+		range >>= 1;
+
+	range >>= vibratoShift;
+
+	freq += (vibratoPos & 4) ? -range : range;
+
+	return (((freq << block) >> 1) * kMultiplier[multiplier]) >> 1;
+}
+
+/** Look up a phase in one of the four waves, attenuated by the envelope. */
+static inline int32 calcWave(int32 wave, int32 phase, int32 envelope) {
+	phase &= 0x3FF;
+
+	const int32 quarter = (phase & 0x100) ? kTables.logSin[(phase & 0xFF) ^ 0xFF] : kTables.logSin[phase & 0xFF];
+
+	int32 level    = quarter;
+	bool  negative = false;
+
+	switch (wave) {
+		case 0: // Sine
+			negative = (phase & 0x200) != 0;
+			break;
+
+		case 1: // Half sine
+			if (phase & 0x200)
+				level = 0x1000;
+			break;
+
+		case 2: // Absolute sine
+			break;
+
+		case 3: // Pulsed sine
+			if (phase & 0x100)
+				level = 0x1000;
+			else
+				level = kTables.logSin[phase & 0xFF];
+			break;
+	}
+
+	const int32 out = calcExp(level + (envelope << 3));
+
+	return negative ? ~out : out;
+}
+
+
+OPL::OPL(uint lanes) : _lanes(MAX<uint>(lanes, 1)) {
+	_slots.resize   (kSlotStateMAX    * kSlotCount    * _lanes);
+	_channels.resize(kChannelStateMAX * kChannelCount * _lanes);
+	_chips.resize   (kChipStateMAX    * _lanes);
+	_mix.resize     (_lanes);
+	_outputs.resize (2 * kSlotCount * _lanes, -1);
+
+	_skipChanged.resize(kSlotCount * _lanes);
+
+	for (uint l = 0; l < _lanes; l++)
+		reset(l);
+}
+
+OPL::~OPL() {
+}
+
+uint OPL::getLaneCount() const {
+	return _lanes;
+}
+
+inline int32 *OPL::slot(SlotState state, int s) {
+	return &_slots[(state * kSlotCount + s) * _lanes];
+}
+
+inline int32 *OPL::channel(ChannelState state, int c) {
+	return &_channels[(state * kChannelCount + c) * _lanes];
+}
+
+inline int32 *OPL::chip(ChipState state) {
+	return &_chips[state * _lanes];
+}
+
+inline int32 &OPL::slot(SlotState state, int s, uint lane) {
+	return _slots[(state * kSlotCount + s) * _lanes + lane];
+}
+
+inline int32 &OPL::channel(ChannelState state, int c, uint lane) {
+	return _channels[(state * kChannelCount + c) * _lanes + lane];
+}
+
+inline int32 &OPL::chip(ChipState state, uint lane) {
+	return _chips[state * _lanes + lane];
+}
+
+void OPL::reset(uint lane) {
+	for (int state = 0; state < kSlotStateMAX; state++)
+		for (int s = 0; s < kSlotCount; s++)
+			slot((SlotState) state, s, lane) = 0;
+
+	for (int state = 0; state < kChannelStateMAX; state++)
+		for (int c = 0; c < kChannelCount; c++)
+			channel((ChannelState) state, c, lane) = 0;
+
+	for (int state = 0; state < kChipStateMAX; state++)
+		chip((ChipState) state, lane) = 0;
+
+	// All envelopes are fully released
+	for (int s = 0; s < kSlotCount; s++) {
+		slot(kSlotEnvelope     , s, lane) = 0x1FF;
+		slot(kSlotEnvelopeOut  , s, lane) = 0x1FF;
+		slot(kSlotEnvelopeStage, s, lane) = kStageRelease;
+	}
+
+	chip(kChipNoise       , lane) = 1;
+	chip(kChipTremoloShift, lane) = 4;
+	chip(kChipVibratoShift, lane) = 1;
+}
+
+void OPL::writeReg(uint lane, byte reg, byte val) {
+	if (lane >= _lanes)
+		return;
+
+	switch (reg & 0xF0) {
+		case 0x00:
+			if      (reg == 0x01)
+				chip(kChipWaveSelect, lane) = (val >> 5) & 1;
+			else if (reg == 0x08)
+				chip(kChipNoteSelect, lane) = (val >> 6) & 1;
+			break;
+
+		case 0x20: case 0x30: case 0x40: case 0x50:
+		case 0x60: case 0x70: case 0x80: case 0x90:
+		case 0xE0: case 0xF0:
+			if (kRegisterSlot[reg & 0x1F] >= 0)
+				writeSlotReg(lane, kRegisterSlot[reg & 0x1F], reg & 0xE0, val);
+			break;
+
+		case 0xA0: case 0xB0: case 0xC0:
+			if      (reg == 0xBD)
+				writeRhythm(lane, val);
+			else if ((reg & 0x0F) < kChannelCount)
+				writeChannelReg(lane, reg & 0x0F, reg & 0xF0, val);
+			break;
+
+		default:
+			break;
+	}
+}
+
+void OPL::setOutputs(uint lane, uint32 melodySlots, uint32 rhythmSlots) {
+	for (int s = 0; s < kSlotCount; s++) {
+		_outputs[ s               * _lanes + lane] = ((melodySlots >> s) & 1) ? -1 : 0;
+		_outputs[(s + kSlotCount) * _lanes + lane] = ((rhythmSlots >> s) & 1) ? -1 : 0;
+	}
+}
+
+void OPL::writeSlotReg(uint lane, int s, byte reg, byte val) {
+	switch (reg) {
+		case 0x20:
+			slot(kSlotTremolo      , s, lane) = (val >> 7) & 1;
+			slot(kSlotVibrato      , s, lane) = (val >> 6) & 1;
+			slot(kSlotSustaining   , s, lane) = (val >> 5) & 1;
+			slot(kSlotKeyScaleRate , s, lane) = (val >> 4) & 1;
+			slot(kSlotMultiplier   , s, lane) =  val       & 0x0F;
+			break;
+
+		case 0x40:
+			slot(kSlotKeyScaleLevel, s, lane) = (val >> 6) & 3;
+			slot(kSlotTotalLevel   , s, lane) =  val       & 0x3F;
+			break;
+
+		case 0x60:
+			slot(kSlotAttack       , s, lane) = (val >> 4) & 0x0F;
+			slot(kSlotDecay        , s, lane) =  val       & 0x0F;
+			break;
+
+		case 0x80:
+			// The highest sustain level means the lowest possible volume
+			slot(kSlotSustain      , s, lane) = ((val >> 4) == 0x0F) ? 0x1F : (val >> 4);
+			slot(kSlotRelease      , s, lane) =  val       & 0x0F;
+			break;
+
+		case 0xE0:
+			slot(kSlotWave         , s, lane) =  val       & 3;
+			break;
+
+		default:
+			break;
+	}
+}
+
+void OPL::writeChannelReg(uint lane, int c, byte reg, byte val) {
+	const int modulator = (c / 3) * 6 + (c % 3);
+	const int carrier   = modulator + 3;
+
+	int32 &freq = channel(kChannelFreq, c, lane);
+
+	switch (reg) {
+		case 0xA0:
+			freq = (freq & 0x300) | val;
+			updateKeyScale(lane, c);
+			break;
+
+		case 0xB0:
+			freq = (freq & 0x0FF) | ((val & 3) << 8);
+			channel(kChannelBlock, c, lane) = (val >> 2) & 7;
+			updateKeyScale(lane, c);
+
+			if (val & 0x20) {
+				keyOn (lane, modulator, kKeyNormal);
+				keyOn (lane, carrier  , kKeyNormal);
+			} else {
+				keyOff(lane, modulator, kKeyNormal);
+				keyOff(lane, carrier  , kKeyNormal);
+			}
+			break;
+
+		case 0xC0:
+			channel(kChannelFeedback  , c, lane) = (val >> 1) & 7;
+			channel(kChannelConnection, c, lane) =  val       & 1;
+			break;
+
+		default:
+			break;
+	}
+}
+
+void OPL::writeRhythm(uint lane, byte val) {
+	chip(kChipTremoloShift, lane) = ((((val >> 7) & 1) ^ 1) << 1) + 2;
+	chip(kChipVibratoShift, lane) =   ((val >> 6) & 1) ^ 1;
+	chip(kChipRhythm      , lane) =     val & 0x3F;
+
+	if (!(val & 0x20)) {
+		for (int s = kSlotBaseDrum1; s <= kSlotCymbal; s++)
+			keyOff(lane, s, kKeyRhythm);
+
+		return;
+	}
+
+	static const int  kRhythmSlots[5] = { kSlotHihat, kSlotCymbal, kSlotTom, kSlotSnareDrum, kSlotBaseDrum1 };
+
+	for (int i = 0; i < 5; i++) {
+		const bool on = (val & (1 << i)) != 0;
+
+		if (on)
+			keyOn (lane, kRhythmSlots[i], kKeyRhythm);
+		else
+			keyOff(lane, kRhythmSlots[i], kKeyRhythm);
+	}
+
+	// The base drum is the only rhythm instrument with two slots
+	if (val & 0x10)
+		keyOn (lane, kSlotBaseDrum2, kKeyRhythm);
+	else
+		keyOff(lane, kSlotBaseDrum2, kKeyRhythm);
+}
+
+void OPL::updateKeyScale(uint lane, int c) {
+	const int32 freq  = channel(kChannelFreq , c, lane);
+	const int32 block = channel(kChannelBlock, c, lane);
+
+	channel(kChannelKeyScale, c, lane) = (block << 1) | ((freq >> (9 - chip(kChipNoteSelect, lane))) & 1);
+
+	const int32 ksl = MAX<int32>((kKeyScaleLevel[freq >> 6] << 2) - ((8 - block) << 5), 0);
+
+	const int modulator = (c / 3) * 6 + (c % 3);
+
+	slot(kSlotEnvelopeKSL, modulator    , lane) = ksl;
+	slot(kSlotEnvelopeKSL, modulator + 3, lane) = ksl;
+}
+
+void OPL::keyOn(uint lane, int s, int32 type) {
+	slot(kSlotKey, s, lane) |= type;
+}
+
+void OPL::keyOff(uint lane, int s, int32 type) {
+	slot(kSlotKey, s, lane) &= ~type;
+}
+
+void OPL::generate(int16 *buffer, uint32 stride, uint32 count) {
+	for (uint32 i = 0; i < count; i++) {
+		for (int s = 0; s < kSlotCount; s++)
+			stepSlot(s);
+
+		mix(buffer + i, stride);
+		stepTimers();
+	}
+}
+
+void OPL::skip(uint32 count) {
+	// The last samples step completely, so that the outputs of all slots are up to date again
+	const uint32 last = MIN<uint32>(count, 3);
+
+	if (count > last)
+		skipSlots(count - last);
+
+	for (uint32 i = 0; i < last; i++)
+		step();
+}
+
+uint32 OPL::getStateSize() {
+	return kSlotStateMAX * kSlotCount + kChannelStateMAX * kChannelCount + kChipStateMAX;
+}
+
+void OPL::saveState(uint lane, int32 *state) const {
+	// The values of one lane are spread out, _lanes apart
+	for (size_t i = lane; i < _slots.size(); i += _lanes)
+		*state++ = _slots[i];
+	for (size_t i = lane; i < _channels.size(); i += _lanes)
+		*state++ = _channels[i];
+	for (size_t i = lane; i < _chips.size(); i += _lanes)
+		*state++ = _chips[i];
+}
+
+void OPL::loadState(uint lane, const int32 *state) {
+	for (size_t i = lane; i < _slots.size(); i += _lanes)
+		_slots[i] = *state++;
+	for (size_t i = lane; i < _channels.size(); i += _lanes)
+		_channels[i] = *state++;
+	for (size_t i = lane; i < _chips.size(); i += _lanes)
+		_chips[i] = *state++;
+}
+
+void OPL::step() {
+	for (int s = 0; s < kSlotCount; s++)
+		stepSlot(s);
+
+	stepTimers();
+}
+
+void OPL::skipSlots(uint32 count) {
+	const uint lanes = _lanes;
+
+	// In rhythm mode, the output of the hihat follows the phase of the cymbal in the sample before
+	for (uint l = 0; l < lanes; l++) {
+		if ((chip(kChipRhythm, l) & 0x20) && (channel(kChannelFeedback, kSlotChannel[kSlotHihat], l) != 0)) {
+			for (uint32 i = 0; i < count; i++)
+				step();
+
+			return;
+		}
+	}
+
+	// The first sample takes in keying on any slot, which restarts its envelope and phase
+	step();
+
+	// Any envelope might have changed in the sample before
+	std::fill(_skipChanged.begin(), _skipChanged.end(), 1);
+
+	for (uint32 done = 1; done < count; ) {
+		const uint32 run = MIN<uint32>(count - done, kSkipRunLength);
+
+		skipTimers(_skipTimers, run);
+
+		for (uint l = 0; l < lanes; l++)
+			for (int s = 0; s < kSlotCount; s++)
+				skipSlot(s, l, _skipTimers, run, _skipChanged[s * lanes + l]);
+
+		done += run;
+	}
+}
+
+void OPL::skipTimers(SkipTimers &timers, uint32 count) {
+	const uint lanes = _lanes;
+
+	timers.envelopeState.resize(lanes * count);
+	timers.envelopeAdd  .resize(lanes * count);
+	timers.envelopeTimer.resize(lanes * count);
+	timers.tremolo      .resize(lanes * count);
+	timers.vibratoPos   .resize(lanes * count);
+
+	for (uint32 i = 0; i < count; i++) {
+		for (uint l = 0; l < lanes; l++) {
+			timers.envelopeState[l * count + i] = chip(kChipEnvelopeState   , l);
+			timers.envelopeAdd  [l * count + i] = chip(kChipEnvelopeAdd     , l);
+			timers.envelopeTimer[l * count + i] = chip(kChipEnvelopeTimerLow, l);
+			timers.tremolo      [l * count + i] = chip(kChipTremolo         , l);
+			timers.vibratoPos   [l * count + i] = chip(kChipVibratoPos      , l);
+		}
+
+		stepTimers();
+	}
+}
+
+void OPL::skipSlot(int s, uint lane, const SkipTimers &timers, uint32 count, byte &changed) {
+	const int c = kSlotChannel[s];
+
+	const int32 *envelopeState = &timers.envelopeState[lane * count];
+	const int32 *envelopeAdd   = &timers.envelopeAdd  [lane * count];
+	const int32 *envelopeTimer = &timers.envelopeTimer[lane * count];
+	const int32 *tremolo       = &timers.tremolo      [lane * count];
+	const int32 *vibratoPos    = &timers.vibratoPos   [lane * count];
+
+	int32 envelope = slot(kSlotEnvelope     , s, lane);
+	int32 stage    = slot(kSlotEnvelopeStage, s, lane);
+	int32 phase    = slot(kSlotPhase        , s, lane);
+
+	const int32 key        = slot(kSlotKey       , s, lane);
+	const int32 sustaining = slot(kSlotSustaining, s, lane);
+	const int32 attack     = slot(kSlotAttack    , s, lane);
+	const int32 decay      = slot(kSlotDecay     , s, lane);
+	const int32 sustain    = slot(kSlotSustain   , s, lane);
+	const int32 release    = slot(kSlotRelease   , s, lane);
+	const int32 vibrato    = slot(kSlotVibrato   , s, lane);
+	const int32 multiplier = slot(kSlotMultiplier, s, lane);
+
+	const int32 keyScale = channel(kChannelKeyScale, c, lane) >> ((slot(kSlotKeyScaleRate, s, lane) ^ 1) << 1);
+	const int32 freq     = channel(kChannelFreq    , c, lane);
+	const int32 block    = channel(kChannelBlock   , c, lane);
+	const int32 strength = channel(kChannelFeedback, c, lane);
+
+	const int32 vibratoShift = chip(kChipVibratoShift, lane);
+
+	// Only the output of a slot feeding back into itself carries over into the next sample
+	const bool feedback = ((s % 6) < 3) && (strength != 0);
+
+	int32 rate = calcSkipRate(envelope, stage, sustaining, attack, decay, release, keyScale);
+
+	if (!feedback) {
+		for (uint32 i = 0; i < count; i++) {
+			if (!changed && ((rate < 0) || ((rate < 12) && (!envelopeState[i] ||
+			    ((rate + envelopeAdd[i]) < 12) || ((rate + envelopeAdd[i]) > 14)))))
+				continue;
+
+			const int32 previousEnvelope = envelope;
+			const int32 previousStage    = stage;
+
+			calcEnvelope(envelope, stage, key, sustaining, attack, decay, sustain, release, keyScale,
+			             envelopeState[i], envelopeAdd[i], envelopeTimer[i]);
+
+			changed = (envelope != previousEnvelope) || (stage != previousStage);
+			if (changed)
+				rate = calcSkipRate(envelope, stage, sustaining, attack, decay, release, keyScale);
+		}
+
+		// The phase advances by the same step while the vibrato stays at one position
+		for (uint32 i = 0; i < count; ) {
+			uint32 run = 1;
+			while (vibrato && ((i + run) < count) && (vibratoPos[i + run] == vibratoPos[i]))
+				run++;
+			if (!vibrato)
+				run = count;
+
+			const int32 step = calcPhaseStep(freq, block, multiplier, vibrato ? vibratoPos[i] : 0, vibratoShift);
+
+			phase = (int32) ((phase + ((uint64) step) * run) & 0x7FFFF);
+			i += run;
+		}
+
+	} else {
+		const int32 totalLevel    = slot(kSlotTotalLevel   , s, lane);
+		const int32 envelopeKSL   = slot(kSlotEnvelopeKSL  , s, lane);
+		const int32 keyScaleLevel = slot(kSlotKeyScaleLevel, s, lane);
+		const int32 tremoloOn     = slot(kSlotTremolo      , s, lane);
+
+		const int32 wave = chip(kChipWaveSelect, lane) ? slot(kSlotWave, s, lane) : 0;
+
+		// In rhythm mode, the drums aren't modulated
+		const bool drum = ((s == kSlotHihat) || (s == kSlotTom)) && (chip(kChipRhythm, lane) & 0x20);
+
+		int32 out      = slot(kSlotOut        , s, lane);
+		int32 previous = slot(kSlotPreviousOut, s, lane);
+		int32 modulation = 0, envelopeOut = 0, phaseOut = 0;
+
+		for (uint32 i = 0; i < count; i++) {
+			modulation = (previous + out) >> (9 - strength);
+			previous   = out;
+
+			envelopeOut = calcEnvelopeOut(envelope, totalLevel, envelopeKSL, keyScaleLevel, tremoloOn ? tremolo[i] : 0);
+
+			if (changed || ((rate >= 0) && ((rate >= 12) || (envelopeState[i] &&
+			    ((rate + envelopeAdd[i]) >= 12) && ((rate + envelopeAdd[i]) <= 14))))) {
+
+				const int32 previousEnvelope = envelope;
+				const int32 previousStage    = stage;
+
+				calcEnvelope(envelope, stage, key, sustaining, attack, decay, sustain, release, keyScale,
+				             envelopeState[i], envelopeAdd[i], envelopeTimer[i]);
+
+				changed = (envelope != previousEnvelope) || (stage != previousStage);
+				if (changed)
+					rate = calcSkipRate(envelope, stage, sustaining, attack, decay, release, keyScale);
+			}
+
+			phaseOut = (phase >> 9) & 0x3FF;
+			phase    = (phase + calcPhaseStep(freq, block, multiplier, vibrato ? vibratoPos[i] : 0, vibratoShift)) & 0x7FFFF;
+
+			out = calcWave(wave, phaseOut + (drum ? 0 : modulation), envelopeOut);
+		}
+
+		slot(kSlotOut        , s, lane) = out;
+		slot(kSlotPreviousOut, s, lane) = previous;
+		slot(kSlotFeedback   , s, lane) = modulation;
+		slot(kSlotEnvelopeOut, s, lane) = envelopeOut;
+		slot(kSlotPhaseOut   , s, lane) = phaseOut;
+	}
+
+	slot(kSlotEnvelope     , s, lane) = envelope;
+	slot(kSlotEnvelopeStage, s, lane) = stage;
+	slot(kSlotPhase        , s, lane) = phase;
+	slot(kSlotPhaseReset   , s, lane) = 0;
+}
+
+void OPL::stepSlot(int s) {
+	// Only the first slot of a channel feeds back into itself
+	if ((s % 6) < 3)
+		stepFeedback(s);
+
+	stepEnvelope(s);
+	stepPhase(s);
+
+	if ((s == kSlotHihat) || (s == kSlotSnareDrum) || (s == kSlotCymbal))
+		stepRhythmPhase(s);
+
+	stepOutput(s);
+}
+
+void OPL::stepFeedback(int s) {
+	const uint lanes = _lanes;
+
+	int32 *out      = slot(kSlotOut        , s);
+	int32 *feedback = slot(kSlotFeedback   , s);
+	int32 *previous = slot(kSlotPreviousOut, s);
+
+	const int32 *strength = channel(kChannelFeedback, kSlotChannel[s]);
+
+	for (uint l = 0; l < lanes; l++) {
+		feedback[l] = (strength[l] != 0) ? ((previous[l] + out[l]) >> (9 - strength[l])) : 0;
+		previous[l] = out[l];
+	}
+}
+
+void OPL::stepEnvelope(int s) {
+	const uint lanes = _lanes;
+
+	int32 *envelope    = slot(kSlotEnvelope     , s);
+	int32 *envelopeOut = slot(kSlotEnvelopeOut  , s);
+	int32 *stage       = slot(kSlotEnvelopeStage, s);
+	int32 *phaseReset  = slot(kSlotPhaseReset   , s);
+
+	const int32 *envelopeKSL   = slot(kSlotEnvelopeKSL  , s);
+	const int32 *key           = slot(kSlotKey          , s);
+	const int32 *tremoloOn     = slot(kSlotTremolo      , s);
+	const int32 *sustaining    = slot(kSlotSustaining   , s);
+	const int32 *keyScaleRate  = slot(kSlotKeyScaleRate , s);
+	const int32 *keyScaleLevel = slot(kSlotKeyScaleLevel, s);
+	const int32 *totalLevel    = slot(kSlotTotalLevel   , s);
+	const int32 *attack        = slot(kSlotAttack       , s);
+	const int32 *decay         = slot(kSlotDecay        , s);
+	const int32 *sustain       = slot(kSlotSustain      , s);
+	const int32 *release       = slot(kSlotRelease      , s);
+
+	const int32 *keyScale = channel(kChannelKeyScale, kSlotChannel[s]);
+
+	const int32 *tremolo        = chip(kChipTremolo);
+	const int32 *envelopeState  = chip(kChipEnvelopeState);
+	const int32 *envelopeAdd    = chip(kChipEnvelopeAdd);
+	const int32 *envelopeTimer  = chip(kChipEnvelopeTimerLow);
+
+	for (uint l = 0; l < lanes; l++) {
+		envelopeOut[l] = calcEnvelopeOut(envelope[l], totalLevel[l], envelopeKSL[l], keyScaleLevel[l],
+		                                 tremoloOn[l] ? tremolo[l] : 0);
+
+		phaseReset[l] = calcEnvelope(envelope[l], stage[l], key[l], sustaining[l], attack[l], decay[l], sustain[l],
+		                             release[l], (keyScale[l] >> ((keyScaleRate[l] ^ 1) << 1)),
+		                             envelopeState[l], envelopeAdd[l], envelopeTimer[l]);
+	}
+}
+
+void OPL::stepPhase(int s) {
+	const uint lanes = _lanes;
+
+	int32 *phase    = slot(kSlotPhase   , s);
+	int32 *phaseOut = slot(kSlotPhaseOut, s);
+
+	const int32 *phaseReset = slot(kSlotPhaseReset, s);
+	const int32 *vibrato    = slot(kSlotVibrato   , s);
+	const int32 *multiplier = slot(kSlotMultiplier, s);
+
+	const int32 *freq  = channel(kChannelFreq , kSlotChannel[s]);
+	const int32 *block = channel(kChannelBlock, kSlotChannel[s]);
+
+	const int32 *vibratoPos   = chip(kChipVibratoPos);
+	const int32 *vibratoShift = chip(kChipVibratoShift);
+
+	for (uint l = 0; l < lanes; l++) {
+		phaseOut[l] = (phase[l] >> 9) & 0x3FF;
+
+		const int32 start = phaseReset[l] ? 0 : phase[l];
+
+		phase[l] = (start + calcPhaseStep(freq[l], block[l], multiplier[l],
+		                                  vibrato[l] ? vibratoPos[l] : 0, vibratoShift[l])) & 0x7FFFF;
+	}
+}
+
+void OPL::stepRhythmPhase(int s) {
+	const uint lanes = _lanes;
+
+	int32 *phaseOut = slot(kSlotPhaseOut, s);
+
+	int32 *hihat  = chip(kChipHihatPhase);
+	int32 *cymbal = chip(kChipCymbalPhase);
+
+	const int32 *rhythm = chip(kChipRhythm);
+	const int32 *noise  = chip(kChipNoise);
+
+	for (uint l = 0; l < lanes; l++) {
+		// The hihat and cymbal phases mix into the noise of three instruments
+		if (s == kSlotHihat)
+			hihat[l] = phaseOut[l];
+		else if ((s == kSlotCymbal) && (rhythm[l] & 0x20))
+			cymbal[l] = phaseOut[l];
+
+		if (!(rhythm[l] & 0x20))
+			continue;
+
+		const int32 hh = hihat[l];
+		const int32 tc = cymbal[l];
+
+		const int32 mixed = (((hh >> 2) ^ (hh >> 7)) | ((hh >> 3) ^ (tc >> 5)) | ((tc >> 3) ^ (tc >> 5))) & 1;
+		const int32 bit   = noise[l] & 1;
+
+		if      (s == kSlotHihat)
+			phaseOut[l] = (mixed << 9) | ((mixed ^ bit) ? 0xD0 : 0x34);
+		else if (s == kSlotSnareDrum)
+			phaseOut[l] = (((hh >> 8) & 1) << 9) | ((((hh >> 8) & 1) ^ bit) << 8);
+		else
+			phaseOut[l] = (mixed << 9) | 0x80;
+	}
+}
+
+void OPL::stepOutput(int s) {
+	const uint lanes = _lanes;
+
+	const bool carrier = (s % 6) >= 3;
+	const bool drum    = (s == kSlotHihat) || (s == kSlotTom) || (s == kSlotSnareDrum) || (s == kSlotCymbal);
+
+	int32 *out = slot(kSlotOut, s);
+
+	// The first slot is modulated by its own feedback, the second by the first slot's output
+	const int32 *modulation  = carrier ? slot(kSlotOut, s - 3) : slot(kSlotFeedback, s);
+	const int32 *phaseOut    = slot(kSlotPhaseOut   , s);
+	const int32 *envelopeOut = slot(kSlotEnvelopeOut, s);
+	const int32 *wave        = slot(kSlotWave       , s);
+
+	const int32 *connection = channel(kChannelConnection, kSlotChannel[s]);
+
+	const int32 *rhythm     = chip(kChipRhythm);
+	const int32 *waveSelect = chip(kChipWaveSelect);
+
+	for (uint l = 0; l < lanes; l++) {
+		int32 mod = modulation[l];
+		if ((carrier && connection[l]) || (drum && (rhythm[l] & 0x20)))
+			mod = 0;
+
+		out[l] = calcWave(waveSelect[l] ? wave[l] : 0, phaseOut[l] + mod, envelopeOut[l]);
+	}
+}
+
+void OPL::mix(int16 *buffer, uint32 stride) {
+	const uint lanes = _lanes;
+
+	int32 *sample = &_mix[0];
+
+	const int32 *rhythm = chip(kChipRhythm);
+
+	for (uint l = 0; l < lanes; l++)
+		sample[l] = 0;
+
+	for (int c = 0; c < kChannelCount; c++) {
+		const int modulator = (c / 3) * 6 + (c % 3);
+
+		const int32 *modulatorOut = slot(kSlotOut, modulator);
+		const int32 *carrierOut   = slot(kSlotOut, modulator + 3);
+		const int32 *connection   = channel(kChannelConnection, c);
+
+		const int32 *modulatorMask = &_outputs[ modulator                   * lanes];
+		const int32 *carrierMask   = &_outputs[(modulator + 3)              * lanes];
+		const int32 *modulatorDrum = &_outputs[(modulator     + kSlotCount) * lanes];
+		const int32 *carrierDrum   = &_outputs[(modulator + 3 + kSlotCount) * lanes];
+
+		for (uint l = 0; l < lanes; l++) {
+			if ((c >= 6) && (rhythm[l] & 0x20)) {
+				// The rhythm instruments play at double the volume
+				if (c == 6)
+					sample[l] += 2 * (carrierOut[l] & carrierDrum[l]);
+				else
+					sample[l] += 2 * ((modulatorOut[l] & modulatorDrum[l]) + (carrierOut[l] & carrierDrum[l]));
+
+				continue;
+			}
+
+			const int32 carrier = carrierOut[l] & carrierMask[l];
+
+			sample[l] += connection[l] ? ((modulatorOut[l] & modulatorMask[l]) + carrier) : carrier;
+		}
+	}
+
+	for (uint l = 0; l < lanes; l++)
+		buffer[l * stride] = CLIP<int32>(sample[l], -32768, 32767);
+}
+
+void OPL::stepTimers() {
+	const uint lanes = _lanes;
+
+	int32 *timer          = chip(kChipTimer);
+	int32 *envelopeTimer  = chip(kChipEnvelopeTimer);
+	int32 *envelopeState  = chip(kChipEnvelopeState);
+	int32 *envelopeAdd    = chip(kChipEnvelopeAdd);
+	int32 *envelopeLow    = chip(kChipEnvelopeTimerLow);
+	int32 *tremoloPos     = chip(kChipTremoloPos);
+	int32 *tremolo        = chip(kChipTremolo);
+	int32 *vibratoPos     = chip(kChipVibratoPos);
+	int32 *noise          = chip(kChipNoise);
+
+	const int32 *tremoloShift = chip(kChipTremoloShift);
+
+	for (uint l = 0; l < lanes; l++) {
+		if ((timer[l] & 0x3F) == 0x3F)
+			tremoloPos[l] = (tremoloPos[l] + 1) % 210;
+
+		tremolo[l] = ((tremoloPos[l] < 105) ? tremoloPos[l] : (210 - tremoloPos[l])) >> tremoloShift[l];
+
+		if ((timer[l] & 0x3FF) == 0x3FF)
+			vibratoPos[l] = (vibratoPos[l] + 1) & 7;
+
+		timer[l] = (timer[l] + 1) & 0xFFFF;
+
+		// The envelope generator steps every other sample
+		if (envelopeState[l]) {
+			int32 shift = 0;
+			while ((shift < 13) && !((envelopeTimer[l] >> shift) & 1))
+				shift++;
+
+			envelopeAdd  [l] = (shift > 12) ? 0 : (shift + 1);
+			envelopeLow  [l] = envelopeTimer[l] & 3;
+			envelopeTimer[l] = (envelopeTimer[l] + 1) & 0x0FFFFFFF;
+		}
+
+		envelopeState[l] ^= 1;
+
+		noise[l] = (noise[l] >> 1) | ((((noise[l] >> 14) ^ noise[l]) & 1) << 22);
+	}
+}
+
+} // End of namespace AdLib
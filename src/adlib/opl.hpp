@@ -0,0 +1,254 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The OPL emulation is a port of Nuked OPL3, whose copyright and license are:
+ *
+ * Nuked OPL3
+ * Copyright (C) 2013-2020 Nuke.YKT
+ *
+ * Nuked OPL3 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * Nuked OPL3 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Nuked OPL3. If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Nuked OPL3 thanks:
+ *     MAME Development Team (Jarek Burczynski, Tatsuyuki Satoh):
+ *         Feedback and Rhythm part calculation information.
+ *     forums.submarine.org.uk (carbon14, opl3):
+ *         Tremolo and phase generator calculation information.
+ *     OPLx decapsulated (Matthew Gambrell, Olli Niemitalo):
+ *         OPL2 ROMs.
+ *     siliconpr0n.org (John McMaster, digshadow):
+ *         YMF262 and VRC VII decaps and die shots.
+ */
+
+/** @file adlib/opl.hpp
+ *  Emulation of the OPL2 (YM3812) FM synthesis chip.
+ */
+
+#ifndef ADLIB_OPL_HPP
+#define ADLIB_OPL_HPP
+
+#include <vector>
+
+#include "common/types.hpp"
+
+namespace AdLib {
+
+/** Emulation of a number of independent OPL2 chips, running in lockstep.
+ *
+ *  Each chip is a lane. The state of all lanes is laid out as a structure of
+ *  arrays: the values of one slot, channel or chip register of all lanes lie
+ *  next to each other. Each step of the synthesis then runs in a loop over
+ *  all lanes, which the compiler can turn into SIMD instructions, one lane
+ *  per SIMD element.
+ *
+ *  The emulation follows the chip's log-sin and exponent tables, envelope
+ *  generator, vibrato, tremolo and rhythm mode, and runs at the chip's
+ *  native rate.
+ */
+class OPL {
+public:
+	/** The native rate of the chip: its 3.579545 MHz clock divided by 72. */
+	static const uint32 kRate = 49716;
+
+	static const int kSlotCount    = 18; ///< Number of operator slots.
+	static const int kChannelCount =  9; ///< Number of channels.
+
+	OPL(uint lanes = 1);
+	~OPL();
+
+	/** Return the number of chips emulated side by side. */
+	uint getLaneCount() const;
+
+	/** Reset the chip of a lane into its power-on state. */
+	void reset(uint lane);
+
+	/** Write a value into a register of the chip of a lane. */
+	void writeReg(uint lane, byte reg, byte val);
+
+	/** Only mix the output of some of the slots into the samples of a lane.
+	 *
+	 *  All slots still play as usual, only what's heard changes. By default,
+	 *  all slots are mixed. This is kept through reset().
+	 *
+	 *  @param melodySlots  The slots mixed while their channel plays melodically, a bit for each slot.
+	 *  @param rhythmSlots  The slots of channels 6 to 8 mixed while they play rhythm instruments.
+	 */
+	void setOutputs(uint lane, uint32 melodySlots, uint32 rhythmSlots);
+
+	/** Generate a number of samples on all lanes.
+	 *
+	 *  The samples of each lane are written into buffer, starting at
+	 *  lane * stride.
+	 */
+	void generate(int16 *buffer, uint32 stride, uint32 count);
+
+	/** Let a number of samples pass on all lanes, without generating them.
+	 *
+	 *  The chips end up in exactly the state generate() would have left them
+	 *  in, at a fraction of the cost: the envelope of a slot only steps when
+	 *  it's due to change, and phases advance many samples at once. Only the
+	 *  slots whose output feeds back into them go through every sample.
+	 */
+	void skip(uint32 count);
+
+	/** Return the number of values making up the state of the chip of one lane. */
+	static uint32 getStateSize();
+
+	/** Copy the complete state of the chip of a lane, getStateSize() values, into state. */
+	void saveState(uint lane, int32 *state) const;
+	/** Put the chip of a lane into a state copied by saveState(), of any OPL object. */
+	void loadState(uint lane, const int32 *state);
+
+private:
+	/** The values kept for each slot. */
+	enum SlotState {
+		kSlotOut = 0,          ///< Last output.
+		kSlotFeedback,         ///< Feedback modulating the slot itself.
+		kSlotPreviousOut,      ///< Output before the last one.
+		kSlotEnvelope,         ///< Envelope attenuation.
+		kSlotEnvelopeOut,      ///< Envelope attenuation including levels and tremolo.
+		kSlotEnvelopeStage,    ///< Attack, decay, sustain or release.
+		kSlotEnvelopeKSL,      ///< Attenuation by key scale level.
+		kSlotKey,              ///< Key on bits, by the channel and the rhythm mode.
+		kSlotPhaseReset,       ///< Does the phase restart with the next step?
+		kSlotPhase,            ///< Phase accumulator.
+		kSlotPhaseOut,         ///< Phase looked up in the wave.
+		kSlotTremolo,          ///< Register: tremolo on?
+		kSlotVibrato,          ///< Register: vibrato on?
+		kSlotSustaining,       ///< Register: envelope holds at the sustain level?
+		kSlotKeyScaleRate,     ///< Register: key scale rate.
+		kSlotMultiplier,       ///< Register: frequency multiplier.
+		kSlotKeyScaleLevel,    ///< Register: key scale level.
+		kSlotTotalLevel,       ///< Register: total level.
+		kSlotAttack,           ///< Register: attack rate.
+		kSlotDecay,            ///< Register: decay rate.
+		kSlotSustain,          ///< Register: sustain level.
+		kSlotRelease,          ///< Register: release rate.
+		kSlotWave,             ///< Register: wave select.
+		kSlotStateMAX
+	};
+
+	/** The values kept for each channel. */
+	enum ChannelState {
+		kChannelFreq = 0,   ///< Frequency number.
+		kChannelBlock,      ///< Octave.
+		kChannelKeyScale,   ///< Key scale value, from the frequency and octave.
+		kChannelFeedback,   ///< Feedback strength of the first slot.
+		kChannelConnection, ///< Are the slots added (AM) instead of modulating (FM)?
+		kChannelStateMAX
+	};
+
+	/** The values kept for each chip. */
+	enum ChipState {
+		kChipTimer = 0,         ///< Samples generated.
+		kChipEnvelopeTimer,     ///< Envelope generator steps.
+		kChipEnvelopeState,     ///< Does the envelope generator step with this sample?
+		kChipEnvelopeAdd,       ///< Rate shift of the envelope generator's current step.
+		kChipEnvelopeTimerLow,  ///< Lowest bits of the envelope generator's current step.
+		kChipTremoloPos,        ///< Position within the tremolo wave.
+		kChipTremolo,           ///< Current tremolo attenuation.
+		kChipTremoloShift,      ///< Tremolo depth, as a shift.
+		kChipVibratoPos,        ///< Position within the vibrato wave.
+		kChipVibratoShift,      ///< Vibrato depth, as a shift.
+		kChipNoise,             ///< Noise generator.
+		kChipRhythm,            ///< Rhythm mode and rhythm key bits.
+		kChipNoteSelect,        ///< Keyboard split point.
+		kChipWaveSelect,        ///< Wave select enabled?
+		kChipHihatPhase,        ///< Phase of the hihat slot, for the rhythm noise.
+		kChipCymbalPhase,       ///< Phase of the cymbal slot, for the rhythm noise.
+		kChipStateMAX
+	};
+
+	/** The values of the chip timers in each sample of a run being skipped. */
+	struct SkipTimers {
+		std::vector<int32> envelopeState;
+		std::vector<int32> envelopeAdd;
+		std::vector<int32> envelopeTimer;
+		std::vector<int32> tremolo;
+		std::vector<int32> vibratoPos;
+	};
+
+	uint _lanes;
+
+	std::vector<int32> _slots;    ///< Slot values, by state, slot and lane.
+	std::vector<int32> _channels; ///< Channel values, by state, channel and lane.
+	std::vector<int32> _chips;    ///< Chip values, by state and lane.
+
+	std::vector<int32> _mix; ///< The sample being mixed on each lane.
+
+	/** Masks of the slot outputs mixed, by slot and lane: melodic first, then in rhythm mode. */
+	std::vector<int32> _outputs;
+
+	/** Kept between skips, so that skipping doesn't allocate memory each time. */
+	SkipTimers _skipTimers;
+	/** Did the envelope of each slot change in the sample before, by slot and lane? See skipSlots(). */
+	std::vector<byte> _skipChanged;
+
+	int32 *slot(SlotState state, int s);
+	int32 *channel(ChannelState state, int c);
+	int32 *chip(ChipState state);
+
+	int32 &slot(SlotState state, int s, uint lane);
+	int32 &channel(ChannelState state, int c, uint lane);
+	int32 &chip(ChipState state, uint lane);
+
+	void writeSlotReg(uint lane, int s, byte reg, byte val);
+	void writeChannelReg(uint lane, int c, byte reg, byte val);
+	void writeRhythm(uint lane, byte val);
+
+	void updateKeyScale(uint lane, int c);
+
+	void keyOn (uint lane, int s, int32 type);
+	void keyOff(uint lane, int s, int32 type);
+
+	void stepSlot(int s);
+	void stepFeedback(int s);
+	void stepEnvelope(int s);
+	void stepPhase(int s);
+	void stepRhythmPhase(int s);
+	void stepOutput(int s);
+
+	void mix(int16 *buffer, uint32 stride);
+	void stepTimers();
+
+	/** Step all slots and the timers through one sample, without mixing it. */
+	void step();
+
+	/** Skip through samples, with each slot on its own. See skip(). */
+	void skipSlots(uint32 count);
+	/** Step the timers through a run of samples, and record their values in each. */
+	void skipTimers(SkipTimers &timers, uint32 count);
+	/** Skip a slot through a run of samples, whose timer values have been recorded. */
+	void skipSlot(int s, uint lane, const SkipTimers &timers, uint32 count, byte &changed);
+};
+
+} // End of namespace AdLib
+
+#endif // ADLIB_OPL_HPP
@@ -0,0 +1,199 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/** @file adlib/oplsink.cpp
+ *  Backends receiving the OPL register writes of a playing song.
+ */
+
+#include <cstring>
+
+#include "common/util.hpp"
+#include "common/stream.hpp"
+
+#include "adlib/oplsink.hpp"
+
+namespace AdLib {
+
+OPLProfile::OPLProfile() : rate(0), samples(0), events(0), writes(0), globalWrites(0) {
+	for (int i = 0; i < kRegisterClassMAX; i++)
+		registerWrites[i] = 0;
+
+	for (int i = 0; i < kChannelCount; i++)
+		channelWrites[i] = 0;
+
+	for (int i = 0; i < kCommandMAX; i++) {
+		commands     [i] = 0;
+		commandWrites[i] = 0;
+	}
+}
+
+void OPLProfile::countWrite(byte reg, Command command) {
+	writes++;
+	commandWrites[command]++;
+
+	RegisterClass regClass = kRegisterOther;
+	if (reg == 0xBD)
+		regClass = kRegisterBD;
+	else if ((reg >= 0x20) && (reg < 0xA0))
+		regClass = (RegisterClass) (kRegister20 + ((reg - 0x20) >> 5));
+	else if ((reg & 0xF0) == 0xA0)
+		regClass = kRegisterA0;
+	else if ((reg & 0xF0) == 0xB0)
+		regClass = kRegisterB0;
+	else if ((reg & 0xF0) == 0xC0)
+		regClass = kRegisterC0;
+	else if (reg >= 0xE0)
+		regClass = kRegisterE0;
+
+	registerWrites[regClass]++;
+
+	int channel = -1;
+	if ((regClass == kRegisterA0) || (regClass == kRegisterB0) || (regClass == kRegisterC0)) {
+		channel = reg & 0x0F;
+	} else if ((regClass != kRegisterBD) && (regClass != kRegisterOther)) {
+		// Operator register: 3 channels with 2 operators each in every 8 offsets
+		const byte offset = reg & 0x1F;
+
+		if ((offset & 0x07) < 6)
+			channel = ((offset & 0x07) % 3) + 3 * (offset >> 3);
+	}
+
+	if ((channel >= 0) && (channel < kChannelCount))
+		channelWrites[channel]++;
+	else
+		globalWrites++;
+}
+
+double OPLProfile::getWritesPerSecond() const {
+	if (samples == 0)
+		return 0.0;
+
+	return (writes * (double) rate) / samples;
+}
+
+
+OPLSink::~OPLSink() {
+}
+
+void OPLSink::begin() {
+}
+
+void OPLSink::wait(uint32) {
+}
+
+void OPLSink::end() {
+}
+
+uint32 OPLSink::getOutputSize() const {
+	return 0;
+}
+
+
+CountingSink::CountingSink(OPLProfile &profile) : _profile(&profile) {
+}
+
+void CountingSink::begin() {
+	*_profile = OPLProfile();
+}
+
+void CountingSink::wait(uint32 samples) {
+	_profile->samples += samples;
+	_profile->events++;
+}
+
+
+static const byte kVGMHeader[256] = {
+	0x56,0x67,0x6D,0x20, 0x00,0x00,0x00,0x00, 0x70,0x01,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x00
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x10
+	0x00,0x00,0x00,0x00, 0xE8,0x03,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x20
+	0x00,0x00,0x00,0x00, 0xCC,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x30
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x40
+	0x00,0x9E,0x36,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x50
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x60
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x70
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x80
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0x90
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0xA0
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0xB0
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0xC0
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0xD0
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, // 0xE0
+	0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00  // 0xF0
+};
+
+VGMSink::VGMSink(std::vector<byte> &data) : _data(&data), _length(0) {
+}
+
+void VGMSink::begin() {
+	// Keep the capacity around, we're going to need it again
+	_data->clear();
+
+	_length = 0;
+}
+
+void VGMSink::wait(uint32 samples) {
+	_length += samples;
+
+	while (samples > 0) {
+		uint16 waitTime = MIN<uint32>(samples, 65535);
+
+		_data->push_back(0x61);
+		_data->push_back(waitTime & 0xFF);
+		_data->push_back(waitTime >> 8);
+
+		samples -= waitTime;
+	}
+}
+
+void VGMSink::end() {
+	_data->push_back(0x66);
+}
+
+uint32 VGMSink::getOutputSize() const {
+	return _data->size();
+}
+
+uint32 VGMSink::getLength() const {
+	return _length;
+}
+
+uint32 VGMSink::getSize() const {
+	return _data->size();
+}
+
+uint32 VGMSink::getFileSize() const {
+	return sizeof(kVGMHeader) + _data->size();
+}
+
+void VGMSink::write(Common::WriteStream &vgm) const {
+	byte header[sizeof(kVGMHeader)];
+	std::memcpy(header, kVGMHeader, sizeof(header));
+
+	WRITE_LE_UINT32(header + 0x04, getFileSize() - 4); // Relative offset to end of file
+	WRITE_LE_UINT32(header + 0x18, _length);           // # samples (total count of wait times)
+
+	vgm.write(header, sizeof(header));
+
+	if (!_data->empty())
+		vgm.write(&(*_data)[0], _data->size());
+}
+
+} // End of namespace AdLib
@@ -0,0 +1,197 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/** @file adlib/oplsink.hpp
+ *  Backends receiving the OPL register writes of a playing song.
+ */
+
+#ifndef ADLIB_OPLSINK_HPP
+#define ADLIB_OPLSINK_HPP
+
+#include <vector>
+
+#include "common/types.hpp"
+
+namespace Common {
+	class WriteStream;
+}
+
+namespace AdLib {
+
+/** The kinds of player commands OPL register writes originate from. */
+enum Command {
+	kCommandOther = 0, ///< Outside of any command.
+	kCommandSetup    , ///< Initializing the OPL and rewinding the song.
+	kCommandTimbre   , ///< Setting a voice's timbre.
+	kCommandVolume   , ///< Setting a voice's volume.
+	kCommandPitchBend, ///< Bending a voice's pitch.
+	kCommandNoteOn   , ///< Switching a voice on.
+	kCommandNoteOff  , ///< Switching a voice off.
+	kCommandGlobal   , ///< Changing global parameters, like the percussion mode.
+	kCommandMAX
+};
+
+/** The classes of OPL registers, by their base address. */
+enum RegisterClass {
+	kRegister20 = 0, ///< Tremolo, vibrato, sustaining, key scale rate, frequency multiplier.
+	kRegister40    , ///< Key scale level, volume.
+	kRegister60    , ///< Attack, decay.
+	kRegister80    , ///< Sustain, release.
+	kRegisterA0    , ///< Frequency, low bits.
+	kRegisterB0    , ///< Key on, octave, frequency high bits.
+	kRegisterBD    , ///< Tremolo and vibrato depth, percussion mode and bits.
+	kRegisterC0    , ///< Feedback, FM.
+	kRegisterE0    , ///< Wave select.
+	kRegisterOther , ///< Test, wave select enable, key split.
+	kRegisterClassMAX
+};
+
+/** A profile of the OPL register writes over a whole song. */
+struct OPLProfile {
+	static const int kChannelCount = 9; ///< Number of OPL channels.
+
+	uint32 rate;    ///< Number of samples per second.
+	uint32 samples; ///< Length of the song in samples.
+	uint32 events;  ///< Number of times the music was polled.
+	uint32 writes;  ///< Number of OPL register writes.
+
+	uint32 registerWrites[kRegisterClassMAX]; ///< Writes into each register class.
+	uint32 channelWrites [kChannelCount];     ///< Writes into the registers of each channel.
+	uint32 globalWrites;                      ///< Writes into registers of no single channel.
+
+	uint32 commands     [kCommandMAX]; ///< Number of commands of each kind.
+	uint32 commandWrites[kCommandMAX]; ///< Writes caused by each kind of command.
+
+	OPLProfile();
+
+	/** Count a write into an OPL register, caused by this kind of command. */
+	void countWrite(byte reg, Command command);
+
+	/** Return the number of OPL writes per second of music. */
+	double getWritesPerSecond() const;
+};
+
+/** One write into an OPL register. */
+struct OPLWrite {
+	byte reg;     ///< The register.
+	byte val;     ///< The value written.
+	byte command; ///< The kind of command the write originates from.
+};
+
+/** Interface of a backend receiving the OPL register writes of a playing song.
+ *
+ *  The player collects the writes between two waits and hands them over in
+ *  batches, so there's only one virtual call per batch. Backends should derive
+ *  from OPLSinkImpl, which loops over a batch without any further virtual calls.
+ */
+class OPLSink {
+public:
+	virtual ~OPLSink();
+
+	/** The song starts playing. */
+	virtual void begin();
+	/** Receive a batch of OPL register writes. */
+	virtual void writeBatch(const OPLWrite *writes, uint count) = 0;
+	/** Let a number of samples pass. */
+	virtual void wait(uint32 samples);
+	/** The song ended. */
+	virtual void end();
+
+	/** Return the number of bytes of output produced so far. */
+	virtual uint32 getOutputSize() const;
+};
+
+/** Base class of an OPL sink that receives the writes one by one.
+ *
+ *  The Sink class needs to provide a non-virtual
+ *  void writeOPL(byte reg, byte val, Command command).
+ */
+template<class Sink>
+class OPLSinkImpl : public OPLSink {
+public:
+	void writeBatch(const OPLWrite *writes, uint count) {
+		Sink &sink = static_cast<Sink &>(*this);
+
+		for (const OPLWrite *w = writes; w != (writes + count); ++w)
+			sink.writeOPL(w->reg, w->val, (Command) w->command);
+	}
+};
+
+/** An OPL sink that ignores everything. */
+class NullSink : public OPLSinkImpl<NullSink> {
+public:
+	void writeOPL(byte, byte, Command) {
+	}
+};
+
+/** An OPL sink counting all writes into a profile. */
+class CountingSink : public OPLSinkImpl<CountingSink> {
+public:
+	CountingSink(OPLProfile &profile);
+
+	void begin();
+	void wait(uint32 samples);
+
+	void writeOPL(byte reg, byte, Command command) {
+		_profile->countWrite(reg, command);
+	}
+
+private:
+	OPLProfile *_profile;
+};
+
+/** An OPL sink recording VGM commands. */
+class VGMSink : public OPLSinkImpl<VGMSink> {
+public:
+	/** Record the VGM commands into data, reusing the memory it already holds. */
+	VGMSink(std::vector<byte> &data);
+
+	void begin();
+	void wait(uint32 samples);
+	void end();
+
+	uint32 getOutputSize() const;
+
+	void writeOPL(byte reg, byte val, Command) {
+		_data->push_back(0x5A);
+		_data->push_back(reg);
+		_data->push_back(val);
+	}
+
+	/** Return the length of the recording in samples. */
+	uint32 getLength() const;
+	/** Return the size of the recorded VGM commands in bytes. */
+	uint32 getSize() const;
+	/** Return the size of a full VGM file of the recording in bytes. */
+	uint32 getFileSize() const;
+
+	/** Write a full VGM file, header and the recorded commands, into a stream. */
+	void write(Common::WriteStream &vgm) const;
+
+private:
+	std::vector<byte> *_data;
+
+	uint32 _length;
+};
+
+} // End of namespace AdLib
+
+#endif // ADLIB_OPLSINK_HPP
@@ -0,0 +1,437 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/render.cpp
+ *  Rendering songs into PCM audio through emulated OPL2 chips.
+ */
+
+#include "common/util.hpp"
+#include "common/stream.hpp"
+#include "common/stats.hpp"
+
+#include "adlib/adlib.hpp"
+#include "adlib/opl.hpp"
+#include "adlib/loudness.hpp"
+#include "adlib/render.hpp"
+
+namespace AdLib {
+
+PCMSink::~PCMSink() {
+}
+
+void PCMSink::begin(uint32) {
+}
+
+void PCMSink::end() {
+}
+
+
+/** Size of a WAV file's header, up to the sample data. */
+static const uint32 kWAVHeaderSize = 44;
+
+WAVSink::WAVSink(std::vector<byte> &data) : _data(&data), _rate(0) {
+}
+
+void WAVSink::begin(uint32 rate) {
+	// Keep the capacity around, we're going to need it again
+	_data->clear();
+
+	_rate = rate;
+}
+
+void WAVSink::write(const int16 *samples, uint32 count) {
+	const size_t size = _data->size();
+
+	_data->resize(size + count * 2);
+
+	byte *data = &(*_data)[size];
+	for (uint32 i = 0; i < count; i++, data += 2)
+		WRITE_LE_UINT16(data, (uint16) samples[i]);
+}
+
+uint32 WAVSink::getLength() const {
+	return _data->size() / 2;
+}
+
+uint32 WAVSink::getFileSize() const {
+	return kWAVHeaderSize + _data->size();
+}
+
+void WAVSink::amplify(double gain) {
+	const int32 factor = GainSink::getFactor(gain);
+	if (factor == 0x10000)
+		return;
+
+	byte *data = _data->empty() ? 0 : &(*_data)[0];
+	for (uint32 i = 0; i < getLength(); i++, data += 2) {
+		int16 sample = (int16) READ_LE_UINT16(data);
+
+		GainSink::amplify(&sample, 1, factor);
+
+		WRITE_LE_UINT16(data, (uint16) sample);
+	}
+}
+
+void WAVSink::write(Common::WriteStream &wav) const {
+	wav.writeUint32BE(MKTAG('R', 'I', 'F', 'F'));
+	wav.writeUint32LE(getFileSize() - 8);
+	wav.writeUint32BE(MKTAG('W', 'A', 'V', 'E'));
+
+	wav.writeUint32BE(MKTAG('f', 'm', 't', ' '));
+	wav.writeUint32LE(16);        // Size of the format chunk
+	wav.writeUint16LE(1);         // PCM
+	wav.writeUint16LE(1);         // Mono
+	wav.writeUint32LE(_rate);     // Samples per second
+	wav.writeUint32LE(_rate * 2); // Bytes per second
+	wav.writeUint16LE(2);         // Bytes per sample
+	wav.writeUint16LE(16);        // Bits per sample
+
+	wav.writeUint32BE(MKTAG('d', 'a', 't', 'a'));
+	wav.writeUint32LE(_data->size());
+
+	if (!_data->empty())
+		wav.write(&(*_data)[0], _data->size());
+}
+
+
+RawSink::RawSink(Common::WriteStream &stream) : _stream(&stream), _size(0) {
+}
+
+void RawSink::write(const int16 *samples, uint32 count) {
+	_block.resize(count * 2);
+
+	byte *data = &_block[0];
+	for (uint32 i = 0; i < count; i++, data += 2)
+		WRITE_LE_UINT16(data, (uint16) samples[i]);
+
+	if ((_stream->write(&_block[0], _block.size()) != _block.size()) || !_stream->flush())
+		throw Common::kWriteError;
+
+	_size += _block.size();
+}
+
+uint64 RawSink::getSize() const {
+	return _size;
+}
+
+
+RenderSink::RenderSink(OPL *chip, uint lane, std::vector<RenderWrite> *writes) : _chip(chip), _lane(lane),
+	_recording(writes), _rate(0), _position(0), _time(0), _waiting(0), _events(0), _writes(0) {
+
+}
+
+uint64 RenderSink::getOPLTime(uint64 position, uint32 rate) {
+	return (position * OPL::kRate) / rate;
+}
+
+void RenderSink::begin() {
+	_position = 0;
+	_time     = 0;
+	_waiting  = 0;
+	_events   = 0;
+	_writes   = 0;
+}
+
+void RenderSink::wait(uint32 samples) {
+	_waiting += samples;
+	_events++;
+}
+
+void RenderSink::setRecording(std::vector<RenderWrite> *writes) {
+	_recording = writes;
+}
+
+void RenderSink::setRate(uint32 rate) {
+	_rate = rate;
+}
+
+bool RenderSink::step(AdLib &player) {
+	const bool playing = player.playStep();
+
+	// The writes of the next poll happen at the sample it's due at
+	_position += _waiting;
+	_time      = getOPLTime(_position, _rate);
+	_waiting   = 0;
+
+	return playing;
+}
+
+void RenderSink::setPosition(uint64 position) {
+	_position = position;
+	_time     = getOPLTime(_position, _rate);
+	_waiting  = 0;
+}
+
+uint64 RenderSink::getTime() const {
+	return _time;
+}
+
+uint64 RenderSink::getEvents() const {
+	return _events;
+}
+
+uint64 RenderSink::getWrites() const {
+	return _writes;
+}
+
+
+/** A lane, rendering one song. */
+struct BatchRenderer::Lane {
+	uint index;
+
+	RenderSink oplSink; ///< Writes into the lane's chip, and keeps the time of the song.
+
+	AdLib   *player;  ///< The player of the song on the lane, or 0 if the lane is free.
+	PCMSink *pcmSink; ///< The sink receiving the song's audio.
+
+	bool playing; ///< Is the player still being polled?
+
+	uint64 rendered; ///< Number of samples synthesized so far.
+
+	Lane(OPL &opl, uint i) : index(i), oplSink(&opl, i), player(0), pcmSink(0), playing(false), rendered(0) {
+	}
+};
+
+
+/** A feeder handing out a single song, and remembering how it went. */
+class SingleFeeder : public BatchRenderer::Feeder {
+public:
+	SingleFeeder(AdLib &player, PCMSink &sink) : _player(&player), _sink(&sink), _failed(false) {
+	}
+
+	AdLib *next(PCMSink *&sink) {
+		AdLib *player = _player;
+
+		sink    = _sink;
+		_player = 0;
+
+		return player;
+	}
+
+	void done(AdLib *, PCMSink *, const Common::Exception *error) {
+		if (!error)
+			return;
+
+		_failed = true;
+		_error  = *error;
+	}
+
+	/** Throw the error of the song, if it failed. */
+	void check() const {
+		if (_failed)
+			throw _error;
+	}
+
+private:
+	AdLib   *_player;
+	PCMSink *_sink;
+
+	bool _failed;
+	Common::Exception _error;
+};
+
+
+BatchRenderer::Feeder::~Feeder() {
+}
+
+
+BatchRenderer::BatchRenderer(uint lanes, uint32 blockSize) : _opl(0), _blockSize(MAX<uint32>(blockSize, 1)),
+	_start(0), _keyframes(0), _samples(0), _events(0), _oplWrites(0) {
+
+	_opl = new OPL(lanes);
+
+	_lanes.resize(_opl->getLaneCount());
+	for (uint i = 0; i < _lanes.size(); i++)
+		_lanes[i] = new Lane(*_opl, i);
+
+	_buffer.resize(_blockSize * _lanes.size());
+}
+
+BatchRenderer::~BatchRenderer() {
+	for (uint i = 0; i < _lanes.size(); i++)
+		delete _lanes[i];
+
+	delete _opl;
+}
+
+uint BatchRenderer::getLaneCount() const {
+	return _lanes.size();
+}
+
+void BatchRenderer::render(AdLib &player, PCMSink &sink, uint32 start, const KeyframeIndex *keyframes) {
+	SingleFeeder feeder(player, sink);
+
+	_start     = start;
+	_keyframes = keyframes;
+
+	try {
+		render(feeder);
+	} catch (Common::Exception &e) {
+		_start     = 0;
+		_keyframes = 0;
+		throw;
+	}
+
+	_start     = 0;
+	_keyframes = 0;
+
+	feeder.check();
+}
+
+void BatchRenderer::render(Feeder &feeder) {
+	Common::StatsTimer timer(Common::kStatsStageRender);
+
+	_samples   = 0;
+	_events    = 0;
+	_oplWrites = 0;
+
+	for (uint i = 0; i < _lanes.size(); i++)
+		startSong(feeder, *_lanes[i]);
+
+	while (true) {
+		// Poll each song up to its next event, and synthesize up to the nearest one
+		uint32 count  = _blockSize;
+		uint   active = 0;
+
+		for (uint i = 0; i < _lanes.size(); i++) {
+			Lane &lane = *_lanes[i];
+
+			// A lane whose song ended takes on the next song
+			while (lane.player && !pollSong(feeder, lane))
+				startSong(feeder, lane);
+
+			if (!lane.player)
+				continue;
+
+			count = MIN<uint64>(count, lane.oplSink.getTime() - lane.rendered);
+			active++;
+		}
+
+		if (active == 0)
+			break;
+
+		_opl->generate(&_buffer[0], _blockSize, count);
+
+		for (uint i = 0; i < _lanes.size(); i++) {
+			Lane &lane = *_lanes[i];
+			if (!lane.player)
+				continue;
+
+			try {
+				lane.pcmSink->write(&_buffer[i * _blockSize], count);
+			} catch (Common::Exception &e) {
+				lane.player->stopPlaying();
+
+				finishSong(feeder, lane, &e);
+				continue;
+			}
+
+			lane.rendered += count;
+		}
+
+		_samples += count * active;
+	}
+
+	timer.setBytes(0, _samples * 2);
+	timer.setEvents(_events, _oplWrites);
+}
+
+void BatchRenderer::startSong(Feeder &feeder, Lane &lane) {
+	lane.player  = 0;
+	lane.pcmSink = 0;
+
+	PCMSink *sink = 0;
+	while (AdLib *player = feeder.next(sink)) {
+		_opl->reset(lane.index);
+
+		const uint32 rate = player->getSamplesPerSecond();
+
+		lane.playing  = true;
+		lane.rendered = 0;
+
+		lane.oplSink.setRate(rate);
+
+		try {
+			sink->begin(OPL::kRate);
+			player->startPlaying(lane.oplSink);
+
+			if (_start > 0) {
+				// The music passed over on the way to the start isn't rendered
+				lane.playing = player->seek(_start, _keyframes);
+
+				lane.oplSink.setPosition(player->getPosition());
+				lane.rendered = RenderSink::getOPLTime(_start, rate);
+			}
+
+		} catch (Common::Exception &e) {
+			player->stopPlaying();
+
+			feeder.done(player, sink, &e);
+			continue;
+		}
+
+		lane.player  = player;
+		lane.pcmSink = sink;
+		break;
+	}
+}
+
+void BatchRenderer::finishSong(Feeder &feeder, Lane &lane, const Common::Exception *error) {
+	_events    += lane.oplSink.getEvents();
+	_oplWrites += lane.oplSink.getWrites();
+
+	AdLib   *player = lane.player;
+	PCMSink *sink   = lane.pcmSink;
+
+	lane.player  = 0;
+	lane.pcmSink = 0;
+
+	feeder.done(player, sink, error);
+}
+
+bool BatchRenderer::pollSong(Feeder &feeder, Lane &lane) {
+	try {
+		while (lane.rendered >= lane.oplSink.getTime()) {
+			if (!lane.playing) {
+				lane.player->stopPlaying();
+				lane.player->checkLength();
+
+				lane.pcmSink->end();
+				break;
+			}
+
+			lane.playing = lane.oplSink.step(*lane.player);
+		}
+
+	} catch (Common::Exception &e) {
+		lane.player->stopPlaying();
+
+		finishSong(feeder, lane, &e);
+		return false;
+	}
+
+	if (lane.rendered < lane.oplSink.getTime())
+		return true;
+
+	finishSong(feeder, lane, 0);
+	return false;
+}
+
+} // End of namespace AdLib
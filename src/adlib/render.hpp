@@ -0,0 +1,281 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/render.hpp
+ *  Rendering songs into PCM audio through emulated OPL2 chips.
+ */
+
+#ifndef ADLIB_RENDER_HPP
+#define ADLIB_RENDER_HPP
+
+#include <vector>
+
+#include "common/types.hpp"
+#include "common/error.hpp"
+
+#include "adlib/oplsink.hpp"
+#include "adlib/opl.hpp"
+
+namespace Common {
+	class WriteStream;
+}
+
+namespace AdLib {
+
+class AdLib;
+class KeyframeIndex;
+
+/** Interface of a backend receiving the PCM audio of a rendered song.
+ *
+ *  The audio is mono, with signed 16-bit samples.
+ */
+class PCMSink {
+public:
+	virtual ~PCMSink();
+
+	/** The song starts playing, with this many samples per second. */
+	virtual void begin(uint32 rate);
+	/** Receive a block of samples. */
+	virtual void write(const int16 *samples, uint32 count) = 0;
+	/** The song ended. */
+	virtual void end();
+};
+
+/** A PCM sink recording a WAV file. */
+class WAVSink : public PCMSink {
+public:
+	/** Record the samples into data, reusing the memory it already holds. */
+	WAVSink(std::vector<byte> &data);
+
+	void begin(uint32 rate);
+	void write(const int16 *samples, uint32 count);
+
+	/** Return the length of the recording in samples. */
+	uint32 getLength() const;
+	/** Return the size of a full WAV file of the recording in bytes. */
+	uint32 getFileSize() const;
+
+	/** Amplify the recorded samples by gain dB. */
+	void amplify(double gain);
+
+	/** Write a full WAV file, header and the recorded samples, into a stream. */
+	void write(Common::WriteStream &wav) const;
+
+private:
+	std::vector<byte> *_data;
+
+	uint32 _rate;
+};
+
+/** A PCM sink streaming raw samples into a stream as they come.
+ *
+ *  The samples are written little-endian, without any header, and the
+ *  stream is flushed after each block. Only one block is held in memory,
+ *  so songs of any length can be streamed into a pipe or FIFO, and played
+ *  while they're still being rendered.
+ */
+class RawSink : public PCMSink {
+public:
+	RawSink(Common::WriteStream &stream);
+
+	void write(const int16 *samples, uint32 count);
+
+	/** Return the number of bytes written so far. */
+	uint64 getSize() const;
+
+private:
+	Common::WriteStream *_stream;
+
+	std::vector<byte> _block;
+
+	uint64 _size;
+};
+
+/** A recorded OPL register write, and the sample of the OPL it happens at. */
+struct RenderWrite {
+	uint64 time;
+	byte   reg;
+	byte   val;
+};
+
+/** An OPL sink keeping the time of a song being rendered, in samples of the OPL.
+ *
+ *  The renderer polls the song through step(), and the sink turns the
+ *  samples the song waits, in the song's own timing, into the sample of the
+ *  OPL the next poll is due at. The register writes of a poll happen at the
+ *  sample it was due at. They go into a lane of a chip, are recorded along
+ *  with that sample, or both.
+ */
+class RenderSink : public OPLSinkImpl<RenderSink> {
+public:
+	/** Write into this lane of the chip, if any, and record the writes into writes, if any. */
+	RenderSink(OPL *chip = 0, uint lane = 0, std::vector<RenderWrite> *writes = 0);
+
+	/** Return a position within a song of this many samples per second in samples of the OPL. */
+	static uint64 getOPLTime(uint64 position, uint32 rate);
+
+	void begin();
+	void wait(uint32 samples);
+
+	void writeOPL(byte reg, byte val, Command) {
+		if (_chip)
+			_chip->writeReg(_lane, reg, val);
+
+		if (_recording) {
+			RenderWrite write;
+
+			write.time = _time;
+			write.reg  = reg;
+			write.val  = val;
+
+			_recording->push_back(write);
+		}
+
+		_writes++;
+	}
+
+	/** Record the following writes into writes, or not at all if 0. */
+	void setRecording(std::vector<RenderWrite> *writes);
+
+	/** Set the samples per second of the song's timing. Needs to be set before the song starts. */
+	void setRate(uint32 rate);
+
+	/** Poll the song once, and move the time on by the samples it waited.
+	 *
+	 *  @return false if the song ended.
+	 */
+	bool step(AdLib &player);
+
+	/** Move the time to this position within the song, in the song's samples, like after seeking. */
+	void setPosition(uint64 position);
+
+	/** Return the sample of the OPL the next poll is due at. */
+	uint64 getTime() const;
+
+	/** Return the number of times the song waited. */
+	uint64 getEvents() const;
+	/** Return the number of OPL register writes. */
+	uint64 getWrites() const;
+
+private:
+	OPL *_chip;
+	uint _lane;
+
+	std::vector<RenderWrite> *_recording;
+
+	uint32 _rate;     ///< The samples per second of the song's timing.
+	uint64 _position; ///< Position within the song, in the song's samples.
+	uint64 _time;     ///< Position within the song, in samples of the OPL.
+
+	uint32 _waiting; ///< Samples waited since the last poll, in the song's samples.
+
+	uint64 _events;
+	uint64 _writes;
+};
+
+/** Renders songs into PCM audio through emulated OPL2 chips, several songs side by side.
+ *
+ *  Each song plays on a lane of its own. A lane follows the timeline of its
+ *  song's player: whenever the song reaches its next event, the player is
+ *  polled, and its OPL writes go into the lane's chip. Up to the nearest
+ *  event of any lane, all lanes are then synthesized together, see OPL.
+ *  A lane whose song ended takes on the next song right away.
+ */
+class BatchRenderer {
+public:
+	/** Hands out the songs to render, and takes them back once they're done. */
+	class Feeder {
+	public:
+		virtual ~Feeder();
+
+		/** Return the next song to render, and set the sink receiving its audio.
+		 *
+		 *  @return The player of the song, or 0 if there are no more songs.
+		 */
+		virtual AdLib *next(PCMSink *&sink) = 0;
+
+		/** Take back a song that was rendered completely, or that failed with an error.
+		 *
+		 *  @param error What went wrong, or 0 if the song was rendered completely.
+		 */
+		virtual void done(AdLib *player, PCMSink *sink, const Common::Exception *error) = 0;
+	};
+
+	/** Number of samples synthesized at once, at most, unless asked otherwise. */
+	static const uint32 kBlockSize = 512;
+
+	/** Create a renderer playing up to this many songs side by side.
+	 *
+	 *  The audio is synthesized and handed to the sinks in blocks of up to
+	 *  blockSize samples. Smaller blocks get the first audio out sooner.
+	 */
+	BatchRenderer(uint lanes = 1, uint32 blockSize = kBlockSize);
+	~BatchRenderer();
+
+	/** Return the number of songs played side by side. */
+	uint getLaneCount() const;
+
+	/** Render all songs the feeder hands out.
+	 *
+	 *  A song whose sink fails to write a block is stopped, and handed back
+	 *  to the feeder with the error.
+	 */
+	void render(Feeder &feeder);
+
+	/** Render a single song.
+	 *
+	 *  @param start     Start rendering at this position within the song, in samples of its timing.
+	 *  @param keyframes The keyframes of the song to seek to the start with, see AdLib::seek().
+	 */
+	void render(AdLib &player, PCMSink &sink, uint32 start = 0, const KeyframeIndex *keyframes = 0);
+
+private:
+	struct Lane;
+
+	OPL *_opl;
+
+	uint32 _blockSize;
+
+	std::vector<Lane *> _lanes;
+
+	std::vector<int16> _buffer; ///< The samples of the current block, _blockSize for each lane.
+
+	uint32 _start;                   ///< The position songs start rendering at.
+	const KeyframeIndex *_keyframes; ///< The keyframes to seek to the start with.
+
+	uint64 _samples;   ///< Number of samples synthesized, over all songs.
+	uint64 _events;    ///< Number of times the music was polled, over all songs.
+	uint64 _oplWrites; ///< Number of OPL register writes, over all songs.
+
+	/** Put the next song of the feeder onto a lane. */
+	void startSong(Feeder &feeder, Lane &lane);
+	/** Hand the song on a lane back to the feeder. */
+	void finishSong(Feeder &feeder, Lane &lane, const Common::Exception *error);
+
+	/** Poll the song on a lane until it has samples to synthesize.
+	 *
+	 *  @return false if the song on the lane ended.
+	 */
+	bool pollSong(Feeder &feeder, Lane &lane);
+};
+
+} // End of namespace AdLib
+
+#endif // ADLIB_RENDER_HPP
@@ -0,0 +1,224 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/resample.cpp
+ *  Resampling rendered PCM audio into another sample rate.
+ */
+
+#include <cmath>
+
+#include "common/util.hpp"
+
+#include "adlib/resample.hpp"
+
+namespace AdLib {
+
+/** Number of fractional bits of the filter taps. */
+static const int kTapBits = 14;
+
+/** Shape parameter of the Kaiser window of the filter. */
+static const double kKaiserBeta = 8.0;
+
+/** Fraction of the lower rate's Nyquist frequency that passes the filter. */
+static const double kPassBand = 0.9;
+
+static uint32 gcd(uint32 a, uint32 b) {
+	while (b != 0) {
+		const uint32 t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/** Zeroth order modified Bessel function of the first kind, for the Kaiser window. */
+static double besselI0(double x) {
+	double sum = 1.0, term = 1.0;
+
+	for (int k = 1; k < 64; k++) {
+		const double f = x / (2.0 * k);
+
+		term *= f * f;
+		sum  += term;
+
+		if (term < (sum * 1e-15))
+			break;
+	}
+
+	return sum;
+}
+
+static inline int16 clip16(int32 sample) {
+	return (int16) CLIP<int32>(sample, -32768, 32767);
+}
+
+
+ResampleSink::ResampleSink(PCMSink &sink, uint32 rate) : _sink(&sink), _rate(rate), _bypass(true),
+	_up(1), _down(1), _phaseCount(1), _inputStart(0), _inputCount(0), _position(0) {
+
+}
+
+ResampleSink::~ResampleSink() {
+}
+
+void ResampleSink::begin(uint32 rate) {
+	_bypass = (_rate == 0) || (_rate == rate);
+	if (_bypass) {
+		_sink->begin(rate);
+		return;
+	}
+
+	createFilter(rate);
+
+	// The filter is centered on each output sample, so it reaches back before the first input sample
+	_input.assign(kTapCount / 2 - 1, 0);
+	_output.clear();
+
+	_inputStart = -((int64) (kTapCount / 2 - 1));
+	_inputCount = 0;
+	_position   = 0;
+
+	_sink->begin(_rate);
+}
+
+void ResampleSink::write(const int16 *samples, uint32 count) {
+	if (_bypass) {
+		_sink->write(samples, count);
+		return;
+	}
+
+	_input.insert(_input.end(), samples, samples + count);
+	_inputCount += count;
+
+	resample(false);
+}
+
+void ResampleSink::end() {
+	if (!_bypass) {
+		// Let the filter run out past the last input sample
+		_input.resize(_input.size() + kTapCount / 2, 0);
+
+		resample(true);
+	}
+
+	_sink->end();
+}
+
+void ResampleSink::createFilter(uint32 rate) {
+	const uint32 divisor = gcd(rate, _rate);
+	if ((_up == (_rate / divisor)) && (_down == (rate / divisor)) && !_taps.empty())
+		return;
+
+	_up   = _rate / divisor;
+	_down = rate  / divisor;
+
+	// With an awkward ratio, output samples close to each other share the taps of one phase
+	_phaseCount = MIN(_up, kMaxPhaseCount);
+
+	_taps.resize(_phaseCount * kTapCount);
+
+	// Cutoff frequency, in cycles per input sample
+	const double cutoff = kPassBand * 0.5 * MIN(rate, _rate) / rate;
+	const double window = besselI0(kKaiserBeta);
+
+	std::vector<double> taps(kTapCount);
+	for (uint32 p = 0; p < _phaseCount; p++) {
+		const double fraction = ((double) p) / _phaseCount;
+
+		// Windowed sinc, centered between the taps kTapCount / 2 - 1 and kTapCount / 2
+		double sum = 0.0;
+		for (uint32 k = 0; k < kTapCount; k++) {
+			const double x = ((double) k) - (kTapCount / 2 - 1) - fraction;
+			const double u = x / (kTapCount / 2);
+			const double s = 2.0 * M_PI * cutoff * x;
+
+			double tap = (s == 0.0) ? 1.0 : (std::sin(s) / s);
+
+			tap *= besselI0(kKaiserBeta * std::sqrt(MAX(1.0 - u * u, 0.0))) / window;
+
+			taps[k] = tap;
+			sum    += tap;
+		}
+
+		// Quantize, keeping the sum of the taps at exactly 1.0, so that the gain doesn't change
+		int16 *phaseTaps = &_taps[p * kTapCount];
+
+		int32  quantized = 0;
+		uint32 largest   = 0;
+		for (uint32 k = 0; k < kTapCount; k++) {
+			phaseTaps[k] = (int16) std::floor(taps[k] / sum * (1 << kTapBits) + 0.5);
+
+			quantized += phaseTaps[k];
+			if (phaseTaps[k] > phaseTaps[largest])
+				largest = k;
+		}
+
+		phaseTaps[largest] += (1 << kTapBits) - quantized;
+	}
+}
+
+void ResampleSink::resample(bool last) {
+	const int64 inputEnd = _inputStart + (int64) _input.size();
+
+	while (true) {
+		// Position of the output sample within the input: sample index, and fraction in units of 1 / _up
+		const uint64 position = _position * _down;
+		const int64  index    = position / _up;
+		const uint64 fraction = position % _up;
+
+		// Once the input ended, only produce the output samples up to the last input sample
+		if (last && (position >= (_inputCount * _up)))
+			break;
+
+		if ((index + (int64) (kTapCount / 2)) >= inputEnd)
+			break;
+
+		const uint32 phase = (_phaseCount == _up) ? fraction : ((fraction * _phaseCount) / _up);
+
+		const int16 *input = &_input[index - (kTapCount / 2 - 1) - _inputStart];
+		const int16 *taps  = &_taps[phase * kTapCount];
+
+		// A fixed trip count and nothing carried over but the sum, so the compiler vectorizes this
+		int32 sum = 0;
+		for (uint32 k = 0; k < kTapCount; k++)
+			sum += ((int32) taps[k]) * input[k];
+
+		_output.push_back(clip16((sum + (1 << (kTapBits - 1))) >> kTapBits));
+		_position++;
+	}
+
+	if (!_output.empty()) {
+		_sink->write(&_output[0], _output.size());
+		_output.clear();
+	}
+
+	// Drop the input samples no further output sample reaches back to
+	const int64 first = ((int64) ((_position * _down) / _up)) - (kTapCount / 2 - 1);
+	if (first > _inputStart) {
+		const int64 drop = MIN<int64>(first - _inputStart, _input.size());
+
+		_input.erase(_input.begin(), _input.begin() + drop);
+		_inputStart += drop;
+	}
+}
+
+} // End of namespace AdLib
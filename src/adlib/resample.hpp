@@ -0,0 +1,100 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/resample.hpp
+ *  Resampling rendered PCM audio into another sample rate.
+ */
+
+#ifndef ADLIB_RESAMPLE_HPP
+#define ADLIB_RESAMPLE_HPP
+
+#include <vector>
+
+#include "common/types.hpp"
+
+#include "adlib/render.hpp"
+
+namespace AdLib {
+
+/** A PCM sink resampling the audio into another rate, before handing it on to another sink.
+ *
+ *  The resampling uses a polyphase FIR filter: a windowed sinc, low-passed
+ *  below the Nyquist frequency of the lower of both rates, with one set of
+ *  taps for each fractional position between two input samples. The ratio
+ *  of the rates is reduced to the smallest fraction, so that the position of
+ *  each output sample, and therefore the phase of the filter used, is found
+ *  exactly in integer arithmetic. The filter taps are 16-bit fixed point,
+ *  making the output bit-exact across runs.
+ *
+ *  Only a few samples are held back, so the resampling works when
+ *  streaming as well.
+ */
+class ResampleSink : public PCMSink {
+public:
+	/** Resample into this many samples per second.
+	 *
+	 *  If rate is 0, the audio is handed on unchanged.
+	 */
+	ResampleSink(PCMSink &sink, uint32 rate);
+	~ResampleSink();
+
+	void begin(uint32 rate);
+	void write(const int16 *samples, uint32 count);
+	void end();
+
+private:
+	/** Number of filter taps for each output sample. */
+	static const uint32 kTapCount = 32;
+	/** Maximum number of phases of the filter. */
+	static const uint32 kMaxPhaseCount = 4096;
+
+	PCMSink *_sink;
+
+	uint32 _rate;   ///< The rate to resample into.
+	bool   _bypass; ///< Are the rates the same, so the audio is handed on unchanged?
+
+	uint32 _up;   ///< Number of output samples for each _down input samples.
+	uint32 _down; ///< Number of input samples for each _up output samples.
+
+	uint32 _phaseCount; ///< Number of phases of the filter.
+
+	std::vector<int16> _taps; ///< kTapCount taps for each phase.
+
+	std::vector<int16> _input;  ///< Input samples still needed, starting at _inputStart.
+	std::vector<int16> _output; ///< Output samples not yet handed on.
+
+	int64  _inputStart; ///< Position of the first sample in _input.
+	uint64 _inputCount; ///< Number of input samples received.
+
+	uint64 _position; ///< Number of output samples produced.
+
+	/** Create the filter for resampling from this rate. */
+	void createFilter(uint32 rate);
+
+	/** Produce all output samples the input received allows.
+	 *
+	 *  @param last The input ended, produce the final output samples.
+	 */
+	void resample(bool last);
+};
+
+} // End of namespace AdLib
+
+#endif // ADLIB_RESAMPLE_HPP
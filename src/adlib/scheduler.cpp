@@ -0,0 +1,127 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/scheduler.cpp
+ *  Playing many songs on a single thread, taking turns.
+ */
+
+#include "common/util.hpp"
+
+#include "adlib/adlib.hpp"
+#include "adlib/oplsink.hpp"
+#include "adlib/scheduler.hpp"
+
+namespace AdLib {
+
+SongScheduler::Task::~Task() {
+}
+
+
+SongScheduler::SongScheduler(uint32 sliceEvents) : _sliceEvents(MAX<uint32>(sliceEvents, 1)) {
+}
+
+SongScheduler::~SongScheduler() {
+	stop();
+}
+
+uint SongScheduler::getSongCount() const {
+	return _songs.size();
+}
+
+void SongScheduler::add(AdLib &player, OPLSink &sink, Task &task) {
+	try {
+		player.startPlaying(sink);
+	} catch (Common::Exception &e) {
+		player.stopPlaying();
+
+		task.finish(&e);
+		return;
+	}
+
+	Song song;
+
+	song.player = &player;
+	song.sink   = &sink;
+	song.task   = &task;
+
+	_songs.push_back(song);
+}
+
+bool SongScheduler::runRound() {
+	// Keep the songs still playing in order, and move the others out
+	size_t playing = 0;
+	for (size_t i = 0; i < _songs.size(); i++)
+		if (runTurn(_songs[i]))
+			_songs[playing++] = _songs[i];
+
+	_songs.resize(playing);
+
+	// Finishing a song might add new ones, so that only happens once the round is over
+	std::vector<Done> done;
+	done.swap(_done);
+
+	for (std::vector<Done>::iterator d = done.begin(); d != done.end(); ++d)
+		d->task->finish(d->failed ? &d->error : 0);
+
+	return !_songs.empty();
+}
+
+void SongScheduler::run() {
+	while (runRound())
+		;
+}
+
+void SongScheduler::stop() {
+	for (std::vector<Song>::iterator s = _songs.begin(); s != _songs.end(); ++s)
+		s->player->stopPlaying();
+
+	_songs.clear();
+	_done.clear();
+}
+
+bool SongScheduler::runTurn(Song &song) {
+	Done done;
+
+	done.task   = song.task;
+	done.failed = false;
+
+	try {
+		bool playing = true;
+		for (uint32 i = 0; playing && (i < _sliceEvents); i++)
+			playing = song.player->playStep();
+
+		if (playing)
+			return true;
+
+		song.player->stopPlaying();
+		song.player->checkLength();
+
+	} catch (Common::Exception &e) {
+		song.player->stopPlaying();
+
+		done.failed = true;
+		done.error  = e;
+	}
+
+	_done.push_back(done);
+	return false;
+}
+
+} // End of namespace AdLib
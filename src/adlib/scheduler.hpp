@@ -0,0 +1,125 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/scheduler.hpp
+ *  Playing many songs on a single thread, taking turns.
+ */
+
+#ifndef ADLIB_SCHEDULER_HPP
+#define ADLIB_SCHEDULER_HPP
+
+#include <vector>
+
+#include "common/types.hpp"
+#include "common/error.hpp"
+
+namespace AdLib {
+
+class AdLib;
+class OPLSink;
+
+/** Plays many songs on a single thread, taking turns.
+ *
+ *  Each song plays into its own OPL sink. Whenever its turn comes up, the
+ *  song is polled for a slice of events, and then waits for its next turn,
+ *  round-robin. Like a coroutine, a song yields after each slice and resumes
+ *  where it left off. But all a song resumes from is the state of its player:
+ *  there's no stack to keep and no thread to switch to, and a waiting song
+ *  costs nothing but the memory of its player and its sink. Thousands of
+ *  songs can be played side by side like this, and short songs finish long
+ *  before long ones, instead of waiting behind them.
+ *
+ *  A song's time limit, see PlayLimits, counts the turns of the other songs
+ *  as well.
+ */
+class SongScheduler {
+public:
+	/** Is told once a song is done. */
+	class Task {
+	public:
+		virtual ~Task();
+
+		/** The song played completely, or failed with an error.
+		 *
+		 *  The scheduler has already forgotten about the song, so the task
+		 *  may delete the song, its sink, and itself.
+		 *
+		 *  @param error What went wrong, or 0 if the song played completely.
+		 */
+		virtual void finish(const Common::Exception *error) = 0;
+	};
+
+	/** Number of events a song is polled for in each turn, unless asked otherwise. */
+	static const uint32 kSliceEvents = 64;
+
+	SongScheduler(uint32 sliceEvents = kSliceEvents);
+	~SongScheduler();
+
+	/** Return the number of songs playing. */
+	uint getSongCount() const;
+
+	/** Start playing a song into a sink. The task is told once it's done. */
+	void add(AdLib &player, OPLSink &sink, Task &task);
+
+	/** Give each song playing one turn.
+	 *
+	 *  The songs that are done in this round are finished at its end.
+	 *
+	 *  @return false if there are no songs playing anymore.
+	 */
+	bool runRound();
+
+	/** Play all songs until they're done. */
+	void run();
+
+	/** Stop all songs playing, without finishing them. */
+	void stop();
+
+private:
+	/** A song playing. */
+	struct Song {
+		AdLib   *player;
+		OPLSink *sink;
+		Task    *task;
+	};
+
+	/** A song that's done. */
+	struct Done {
+		Task *task;
+
+		bool failed;
+		Common::Exception error;
+	};
+
+	uint32 _sliceEvents;
+
+	std::vector<Song> _songs;
+	std::vector<Done> _done;
+
+	/** Poll a song for one slice of events.
+	 *
+	 *  @return false if the song is done.
+	 */
+	bool runTurn(Song &song);
+};
+
+} // End of namespace AdLib
+
+#endif // ADLIB_SCHEDULER_HPP
@@ -0,0 +1,316 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/segments.cpp
+ *  Rendering a single song in segments, on several threads.
+ */
+
+#include <deque>
+
+#include "common/util.hpp"
+#include "common/thread.hpp"
+#include "common/boundedqueue.hpp"
+#include "common/stats.hpp"
+
+#include "adlib/adlib.hpp"
+#include "adlib/opl.hpp"
+#include "adlib/render.hpp"
+#include "adlib/segments.hpp"
+
+namespace AdLib {
+
+/** Number of segments per thread that may be underway, before the song waits for them. */
+static const uint kSegmentsPerThread = 4;
+
+/** A segment of the song, from the state of the chip at its start. */
+struct SegmentRenderer::Segment {
+	uint64 start;  ///< The first sample of the segment, within the song.
+	uint32 length; ///< Number of samples in the segment.
+
+	std::vector<int32>       state;  ///< The state of the chip at the start, see OPL::saveState().
+	std::vector<RenderWrite> writes; ///< The register writes within the segment, in order.
+
+	std::vector<int16> samples; ///< The synthesized audio.
+
+	bool done; ///< Has the segment been synthesized?
+
+	Segment(const OPL &chip, uint64 s) : start(s), length(0), state(OPL::getStateSize()), done(false) {
+		chip.saveState(0, &state[0]);
+	}
+
+	/** Synthesize the segment, on this chip. */
+	void synthesize(OPL &opl) {
+		opl.loadState(0, &state[0]);
+
+		samples.resize(length);
+
+		uint32 position = 0;
+		size_t next     = 0;
+		while (position < length) {
+			// Writes apply before the sample they happen at is synthesized
+			for (; (next < writes.size()) && ((writes[next].time - start) <= position); next++)
+				opl.writeReg(0, writes[next].reg, writes[next].val);
+
+			const uint32 until = (next < writes.size()) ? (uint32) MIN<uint64>(writes[next].time - start, length) : length;
+
+			opl.generate(&samples[position], length, until - position);
+			position = until;
+		}
+
+		// Only the audio is needed from now on
+		std::vector<int32>().swap(state);
+		std::vector<RenderWrite>().swap(writes);
+	}
+};
+
+
+/** The threads synthesizing segments, and the segments underway, in order. */
+class SegmentRenderer::Pool {
+public:
+	Pool(uint threads);
+	~Pool();
+
+	/** Is the number of segments underway at the limit? */
+	bool isFull() const;
+	/** Are there no segments underway? */
+	bool isEmpty() const;
+
+	/** Queue a segment to be synthesized. The pool takes it over. */
+	void add(Segment *segment);
+
+	/** Wait for the oldest segment underway to be synthesized, and write its audio into a sink. */
+	void writeOldest(PCMSink &sink);
+
+	/** Take segments out of the queue and synthesize them, until the queue is closed. */
+	void work();
+
+private:
+	std::vector<Worker *> _workers;
+
+	Common::BoundedQueue<Segment *> _queue;
+
+	/** The segments underway, in the order of the song. Only touched by the rendering thread. */
+	std::deque<Segment *> _segments;
+
+	uint _limit;
+
+	/** Guards the done flags of the segments. */
+	Common::Mutex _mutex;
+
+	/** Signaled whenever a segment has been synthesized. */
+	Common::Condition _synthesized;
+};
+
+/** A thread synthesizing segments. */
+class SegmentRenderer::Worker : public Common::Thread {
+public:
+	Worker(Pool &pool) : _pool(&pool) {
+	}
+
+	~Worker() {
+		join();
+	}
+
+protected:
+	void run() {
+		_pool->work();
+	}
+
+private:
+	Pool *_pool;
+};
+
+SegmentRenderer::Pool::Pool(uint threads) : _queue(threads * kSegmentsPerThread),
+	_limit(threads * kSegmentsPerThread), _synthesized(_mutex) {
+
+	_workers.resize(threads);
+	for (uint i = 0; i < threads; i++) {
+		_workers[i] = new Worker(*this);
+		_workers[i]->start();
+	}
+}
+
+SegmentRenderer::Pool::~Pool() {
+	_queue.close();
+
+	for (uint i = 0; i < _workers.size(); i++)
+		delete _workers[i];
+
+	for (std::deque<Segment *>::iterator s = _segments.begin(); s != _segments.end(); ++s)
+		delete *s;
+}
+
+bool SegmentRenderer::Pool::isFull() const {
+	return _segments.size() >= _limit;
+}
+
+bool SegmentRenderer::Pool::isEmpty() const {
+	return _segments.empty();
+}
+
+void SegmentRenderer::Pool::add(Segment *segment) {
+	_segments.push_back(segment);
+
+	// There's never more in the queue than underway, so this doesn't wait
+	_queue.push(segment);
+}
+
+void SegmentRenderer::Pool::writeOldest(PCMSink &sink) {
+	Segment *segment = _segments.front();
+
+	{
+		Common::ScopedLock lock(_mutex);
+
+		while (!segment->done)
+			_synthesized.wait();
+	}
+
+	_segments.pop_front();
+
+	try {
+		if (!segment->samples.empty())
+			sink.write(&segment->samples[0], segment->samples.size());
+	} catch (Common::Exception &e) {
+		delete segment;
+		throw;
+	}
+
+	delete segment;
+}
+
+void SegmentRenderer::Pool::work() {
+	OPL opl(1);
+
+	Segment *segment;
+	while (_queue.pop(segment)) {
+		segment->synthesize(opl);
+
+		Common::ScopedLock lock(_mutex);
+
+		segment->done = true;
+		_synthesized.broadcast();
+	}
+}
+
+
+SegmentRenderer::SegmentRenderer(uint threads, uint32 segmentLength) :
+	_threadCount(MAX<uint>(threads, 1)), _segmentLength(MAX<uint32>(segmentLength, 1)) {
+
+}
+
+SegmentRenderer::~SegmentRenderer() {
+}
+
+uint SegmentRenderer::getThreadCount() const {
+	return _threadCount;
+}
+
+void SegmentRenderer::render(AdLib &player, PCMSink &sink) {
+	Common::StatsTimer timer(Common::kStatsStageRender);
+
+	uint64 samples = 0, events = 0, oplWrites = 0;
+
+	{
+		Pool pool(_threadCount);
+
+		samples = split(player, sink, pool, events, oplWrites);
+	}
+
+	timer.setBytes(0, samples * 2);
+	timer.setEvents(events, oplWrites);
+}
+
+uint64 SegmentRenderer::split(AdLib &player, PCMSink &sink, Pool &pool, uint64 &events, uint64 &oplWrites) {
+	OPL chip(1);
+	RenderSink oplSink(&chip);
+
+	oplSink.setRate(player.getSamplesPerSecond());
+
+	bool   playing  = true;
+	uint64 rendered = 0; // In samples of the OPL
+
+	sink.begin(OPL::kRate);
+
+	// The segment recording the writes, at the state of the chip at its start
+	Segment *segment = new Segment(chip, 0);
+	oplSink.setRecording(&segment->writes);
+
+	try {
+		player.startPlaying(oplSink);
+
+		while (true) {
+			// Poll the song up to its next event, the same way BatchRenderer does
+			while (playing && (rendered >= oplSink.getTime()))
+				playing = oplSink.step(player);
+
+			if (rendered >= oplSink.getTime())
+				break;
+
+			// Pass over the samples up to the next event, or the end of the segment
+			const uint64 segmentEnd = ((rendered / _segmentLength) + 1) * _segmentLength;
+			const uint64 until      = MIN(oplSink.getTime(), segmentEnd);
+
+			chip.skip((uint32) (until - rendered));
+			rendered = until;
+
+			if (rendered < segmentEnd)
+				continue;
+
+			segment->length = (uint32) (rendered - segment->start);
+
+			oplSink.setRecording(0);
+			pool.add(segment);
+
+			segment = new Segment(chip, rendered);
+			oplSink.setRecording(&segment->writes);
+
+			while (pool.isFull())
+				pool.writeOldest(sink);
+		}
+
+		// Writes after the last poll are past the end of the song, and never make it into the audio
+		player.stopPlaying();
+		player.checkLength();
+
+	} catch (Common::Exception &e) {
+		player.stopPlaying();
+
+		delete segment;
+		throw;
+	}
+
+	segment->length = (uint32) (rendered - segment->start);
+	if (segment->length > 0)
+		pool.add(segment);
+	else
+		delete segment;
+
+	while (!pool.isEmpty())
+		pool.writeOldest(sink);
+
+	sink.end();
+
+	events    = oplSink.getEvents();
+	oplWrites = oplSink.getWrites();
+
+	return rendered;
+}
+
+} // End of namespace AdLib
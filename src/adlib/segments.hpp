@@ -0,0 +1,84 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/segments.hpp
+ *  Rendering a single song in segments, on several threads.
+ */
+
+#ifndef ADLIB_SEGMENTS_HPP
+#define ADLIB_SEGMENTS_HPP
+
+#include <vector>
+
+#include "common/types.hpp"
+
+namespace AdLib {
+
+class AdLib;
+class PCMSink;
+
+/** Renders a single song into PCM audio, several segments of it at once.
+ *
+ *  First, the song is played through a chip that isn't synthesized, only
+ *  let pass over the samples, see OPL::skip(). At the start of each
+ *  segment, the state of that chip is copied, and the register writes
+ *  within the segment are recorded. A pool of threads then synthesizes
+ *  the segments from their starting states, each independently of the
+ *  others, and the audio is handed to the sink in order.
+ *
+ *  Since the chip carries its envelopes, phases and feedback into each
+ *  segment exactly, the audio is the same as that of a BatchRenderer, to
+ *  the sample. Passing over the song costs a fraction of synthesizing it,
+ *  but it's still done in one thread, which limits how much faster more
+ *  threads can get.
+ */
+class SegmentRenderer {
+public:
+	/** Number of samples in a segment, unless asked otherwise. About 5 seconds. */
+	static const uint32 kSegmentLength = 262144;
+
+	/** Create a renderer synthesizing on this many threads, in segments of this many samples. */
+	SegmentRenderer(uint threads, uint32 segmentLength = kSegmentLength);
+	~SegmentRenderer();
+
+	/** Return the number of threads synthesizing segments. */
+	uint getThreadCount() const;
+
+	/** Render a song. */
+	void render(AdLib &player, PCMSink &sink);
+
+private:
+	struct Segment;
+	class Worker;
+	class Pool;
+
+	uint   _threadCount;
+	uint32 _segmentLength;
+
+	/** Pass over the song, and queue its segments into the pool. Finished segments go into the sink.
+	 *
+	 *  @return The number of samples of the song.
+	 */
+	uint64 split(AdLib &player, PCMSink &sink, Pool &pool, uint64 &events, uint64 &oplWrites);
+};
+
+} // End of namespace AdLib
+
+#endif // ADLIB_SEGMENTS_HPP
@@ -0,0 +1,277 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/stems.cpp
+ *  Rendering each voice of a song into audio of its own.
+ */
+
+#include <vector>
+
+#include "common/util.hpp"
+#include "common/error.hpp"
+#include "common/thread.hpp"
+#include "common/stats.hpp"
+
+#include "adlib/adlib.hpp"
+#include "adlib/opl.hpp"
+#include "adlib/render.hpp"
+#include "adlib/stems.hpp"
+
+namespace AdLib {
+
+/** Number of samples synthesized at once, at most. */
+static const uint32 kBlockSize = 512;
+
+/** The voice of the first percussion stem, the base drum. */
+static const uint8 kFirstPercussionVoice = 6;
+
+static const char * const kStemNames[StemRenderer::kStemCount] = {
+	"melody0", "melody1", "melody2", "melody3", "melody4", "melody5", "melody6", "melody7", "melody8",
+	"bassdrum", "snare", "tom", "cymbal", "hihat"
+};
+
+/** The register writes of a whole song. */
+struct StemRenderer::Song {
+	std::vector<RenderWrite> writes; ///< All register writes, in order.
+
+	uint64 length; ///< Number of samples of the song.
+
+	uint64 events; ///< Number of times the music was polled.
+
+	Song() : length(0), events(0) {
+	}
+};
+
+
+/** A thread synthesizing some of the stems, side by side. */
+class StemRenderer::Worker : public Common::Thread {
+public:
+	Worker(const Song &song, PCMSink * const *sinks, uint first, uint count) : _song(&song),
+		_sinks(sinks), _first(first), _count(count), _stopped(count, false), _failed(false) {
+	}
+
+	~Worker() {
+		join();
+	}
+
+	/** Throw the error the first stem that stopped failed with, if any. */
+	void check() const {
+		if (_failed)
+			throw _error;
+	}
+
+protected:
+	void run() {
+		try {
+			synthesize();
+		} catch (Common::Exception &e) {
+			fail(e);
+		}
+	}
+
+private:
+	const Song *_song;
+
+	PCMSink * const *_sinks;
+
+	uint _first;
+	uint _count;
+
+	std::vector<bool> _stopped; ///< Has the stem stopped, because its sink failed?
+
+	bool _failed;
+	Common::Exception _error;
+
+	void fail(const Common::Exception &e) {
+		if (!_failed)
+			_error = e;
+
+		_failed = true;
+	}
+
+	/** Hand the stems still running to their sinks, stopping those that fail. */
+	void write(const int16 *buffer, uint32 count) {
+		for (uint i = 0; i < _count; i++) {
+			if (_stopped[i])
+				continue;
+
+			try {
+				_sinks[_first + i]->write(&buffer[i * kBlockSize], count);
+			} catch (Common::Exception &e) {
+				fail(e);
+				_stopped[i] = true;
+			}
+		}
+	}
+
+	/** Are any of the stems still running? */
+	bool isRunning() const {
+		for (uint i = 0; i < _count; i++)
+			if (!_stopped[i])
+				return true;
+
+		return false;
+	}
+
+	void synthesize() {
+		OPL opl(_count);
+
+		// Each stem only hears the operators of its voice
+		for (uint i = 0; i < _count; i++) {
+			const uint stem = _first + i;
+
+			if (stem < kMelodyStemCount)
+				opl.setOutputs(i, AdLib::getVoiceOperators(stem, false), 0);
+			else
+				opl.setOutputs(i, 0, AdLib::getVoiceOperators(kFirstPercussionVoice + stem - kMelodyStemCount, true));
+		}
+
+		for (uint i = 0; i < _count; i++) {
+			try {
+				_sinks[_first + i]->begin(OPL::kRate);
+			} catch (Common::Exception &e) {
+				fail(e);
+				_stopped[i] = true;
+			}
+		}
+
+		std::vector<int16> buffer(kBlockSize * _count);
+
+		const std::vector<RenderWrite> &writes = _song->writes;
+
+		uint64 rendered = 0;
+		size_t next     = 0;
+		while ((rendered < _song->length) && isRunning()) {
+			// Writes apply before the sample they happen at is synthesized
+			for (; (next < writes.size()) && (writes[next].time <= rendered); next++)
+				for (uint i = 0; i < _count; i++)
+					opl.writeReg(i, writes[next].reg, writes[next].val);
+
+			uint64 until = (next < writes.size()) ? MIN(writes[next].time, _song->length) : _song->length;
+
+			const uint32 count = (uint32) MIN<uint64>(until - rendered, kBlockSize);
+
+			opl.generate(&buffer[0], kBlockSize, count);
+			write(&buffer[0], count);
+
+			rendered += count;
+		}
+
+		for (uint i = 0; i < _count; i++) {
+			if (_stopped[i])
+				continue;
+
+			try {
+				_sinks[_first + i]->end();
+			} catch (Common::Exception &e) {
+				fail(e);
+			}
+		}
+	}
+};
+
+
+StemRenderer::StemRenderer(uint threads) : _threadCount(CLIP<uint>(threads, 1, kStemCount)) {
+}
+
+StemRenderer::~StemRenderer() {
+}
+
+const char *StemRenderer::getStemName(uint stem) {
+	if (stem >= kStemCount)
+		return "";
+
+	return kStemNames[stem];
+}
+
+uint StemRenderer::getThreadCount() const {
+	return _threadCount;
+}
+
+void StemRenderer::render(AdLib &player, PCMSink * const *sinks) {
+	Common::StatsTimer timer(Common::kStatsStageRender);
+
+	Song song;
+	record(player, song);
+
+	std::vector<Worker *> workers(_threadCount);
+
+	// Spread the stems evenly over the threads
+	for (uint i = 0, first = 0; i < _threadCount; i++) {
+		const uint count = (kStemCount - first) / (_threadCount - i);
+
+		workers[i] = new Worker(song, sinks, first, count);
+		workers[i]->start();
+
+		first += count;
+	}
+
+	// Wait for all stems, and throw the first error afterwards
+	bool failed = false;
+	Common::Exception error;
+
+	for (uint i = 0; i < _threadCount; i++) {
+		workers[i]->join();
+
+		try {
+			workers[i]->check();
+		} catch (Common::Exception &e) {
+			if (!failed)
+				error = e;
+
+			failed = true;
+		}
+
+		delete workers[i];
+	}
+
+	if (failed)
+		throw error;
+
+	timer.setBytes(0, song.length * kStemCount * 2);
+	timer.setEvents(song.events, song.writes.size());
+}
+
+void StemRenderer::record(AdLib &player, Song &song) {
+	RenderSink oplSink(0, 0, &song.writes);
+
+	oplSink.setRate(player.getSamplesPerSecond());
+
+	try {
+		player.startPlaying(oplSink);
+
+		// The same timing as BatchRenderer
+		while (oplSink.step(player))
+			;
+
+		// Writes after the last poll are past the end of the song
+		player.stopPlaying();
+		player.checkLength();
+
+	} catch (Common::Exception &e) {
+		player.stopPlaying();
+		throw;
+	}
+
+	song.length = oplSink.getTime();
+	song.events = oplSink.getEvents();
+}
+
+} // End of namespace AdLib
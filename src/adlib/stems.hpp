@@ -0,0 +1,85 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file adlib/stems.hpp
+ *  Rendering each voice of a song into audio of its own.
+ */
+
+#ifndef ADLIB_STEMS_HPP
+#define ADLIB_STEMS_HPP
+
+#include "common/types.hpp"
+
+namespace AdLib {
+
+class AdLib;
+class PCMSink;
+
+/** Renders each voice of a song into PCM audio of its own, a stem, on several threads.
+ *
+ *  The song plays only once, and its register writes are recorded. Each
+ *  stem is then a lane of an emulated OPL2 that receives all of the
+ *  writes, but only mixes the operators of its voice, see OPL::setOutputs().
+ *  This way, what the rhythm instruments share plays exactly as it does in
+ *  the full song: the channel of the hihat and snare drum, the channel of
+ *  the tom and cymbal, and the phases the hihat, snare drum and cymbal are
+ *  made of. The stems add up to the full song.
+ *
+ *  The stems are spread over the threads, each of which synthesizes its
+ *  stems side by side, see OPL.
+ */
+class StemRenderer {
+public:
+	static const uint kMelodyStemCount     = 9; ///< Number of stems of melody voices.
+	static const uint kPercussionStemCount = 5; ///< Number of stems of percussion voices.
+
+	/** Number of stems: the melody voices first, then the percussion voices. */
+	static const uint kStemCount = kMelodyStemCount + kPercussionStemCount;
+
+	/** Return the name of a stem, like "melody0" or "snare". */
+	static const char *getStemName(uint stem);
+
+	/** Create a renderer synthesizing the stems on up to this many threads. */
+	StemRenderer(uint threads);
+	~StemRenderer();
+
+	/** Return the number of threads synthesizing stems. */
+	uint getThreadCount() const;
+
+	/** Render a song, into kStemCount sinks, one for each stem.
+	 *
+	 *  A stem whose sink fails stops, while the others render through, and
+	 *  the error of the first stem that failed is thrown afterwards.
+	 */
+	void render(AdLib &player, PCMSink * const *sinks);
+
+private:
+	struct Song;
+	class Worker;
+
+	uint _threadCount;
+
+	/** Play the song, and record its register writes. */
+	void record(AdLib &player, Song &song);
+};
+
+} // End of namespace AdLib
+
+#endif // ADLIB_STEMS_HPP
@@ -0,0 +1,169 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <vector>
+
+#include "common/util.hpp"
+#include "common/error.hpp"
+#include "common/strutil.hpp"
+
+#include "convert.hpp"
+#include "batch.hpp"
+
+/** Number of songs collected per lane, before they're converted side by side. */
+static const uint kSongsPerLane = 16;
+
+/** Is this a job converting a single song? */
+static bool isSongJob(const std::vector<std::string> &fields) {
+	return (fields[0] == "adl") || (fields[0] == "mdy");
+}
+
+/** Create the job of a single song from the manifest. */
+static SongJob parseSongJob(const std::vector<std::string> &fields) {
+	SongJob job;
+
+	if (fields[0] == "adl") {
+		if ((fields.size() < 2) || (fields.size() > 3))
+			throw Common::Exception("Invalid number of fields for an ADL job");
+
+		job.files[0] = fields[1];
+		job.output   = (fields.size() > 2) ? fields[2] : "";
+
+	} else {
+		if ((fields.size() < 3) || (fields.size() > 4))
+			throw Common::Exception("Invalid number of fields for a MDY job");
+
+		job.files[0] = fields[1];
+		job.files[1] = fields[2];
+		job.output   = (fields.size() > 3) ? fields[3] : "";
+	}
+
+	return job;
+}
+
+/** Run a single job from the manifest that doesn't convert a single song. */
+static void runJob(const std::vector<std::string> &fields, const ConvertOptions &options) {
+	const std::string &type = fields[0];
+
+	if (type == "dir") {
+		if ((fields.size() < 2) || (fields.size() > 3))
+			throw Common::Exception("Invalid number of fields for a directory job");
+
+		crawlDirectory(fields[1], (fields.size() > 2) ? fields[2] : "", options);
+
+	} else
+		throw Common::Exception("Unknown job type \"%s\"", type.c_str());
+}
+
+/** Convert the collected songs, and report the ones that failed.
+ *
+ *  @return The number of songs that failed.
+ */
+static uint convertSongJobs(std::vector<SongJob> &songs, std::vector<uint> &lineNumbers,
+                            const ConvertOptions &options) {
+
+	convertSongs(songs, options);
+
+	uint failed = 0;
+	for (size_t i = 0; i < songs.size(); i++) {
+		if (!songs[i].failed)
+			continue;
+
+		songs[i].error.add("Batch job in line %u failed", lineNumbers[i]);
+
+		Common::printException(songs[i].error, "WARNING: ");
+		failed++;
+	}
+
+	songs.clear();
+	lineNumbers.clear();
+
+	return failed;
+}
+
+void convertBatch(const std::string &manifest, const ConvertOptions &options) {
+	std::FILE *file = stdin;
+	if (manifest != "-")
+		if (!(file = std::fopen(manifest.c_str(), "r")))
+			throw Common::Exception("Can't open manifest \"%s\": %s", manifest.c_str(), strerror(errno));
+
+	// Songs rendered side by side are collected first, all others are converted right away
+	const uint maxSongs = ((options.format == kOutputWAV) && options.writesFiles()) ?
+	                      (options.renderLanes * kSongsPerLane) : 1;
+
+	uint lineNumber = 0, jobs = 0, failed = 0;
+
+	std::vector<SongJob> songs;
+	std::vector<uint> songLineNumbers;
+
+	std::string line;
+	std::vector<std::string> fields;
+	while (Common::readLine(file, line)) {
+		lineNumber++;
+
+		Common::splitFields(line, fields);
+		if (fields.empty() || (fields[0][0] == '#'))
+			continue;
+
+		jobs++;
+
+		try {
+			if (isSongJob(fields)) {
+				songs.push_back(parseSongJob(fields));
+				songLineNumbers.push_back(lineNumber);
+
+				if (songs.size() >= maxSongs)
+					failed += convertSongJobs(songs, songLineNumbers, options);
+
+				continue;
+			}
+
+			// Keep the order of the jobs
+			failed += convertSongJobs(songs, songLineNumbers, options);
+
+			runJob(fields, options);
+
+		} catch (Common::Exception &e) {
+			e.add("Batch job in line %u failed", lineNumber);
+
+			Common::printException(e, "WARNING: ");
+			failed++;
+		}
+	}
+
+	failed += convertSongJobs(songs, songLineNumbers, options);
+
+	const bool readError = std::ferror(file) != 0;
+
+	if (file != stdin)
+		std::fclose(file);
+
+	if (readError)
+		throw Common::Exception("Failed reading manifest \"%s\"", manifest.c_str());
+
+	status("Batch done: %u jobs, %u succeeded, %u failed", jobs, jobs - failed, failed);
+
+	if (failed > 0)
+		throw Common::Exception("%u of %u batch jobs failed", failed, jobs);
+}
@@ -0,0 +1,48 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <string>
+
+struct ConvertOptions;
+
+/** Run all conversion jobs listed in a manifest file.
+ *
+ *  The manifest is a text file with one job per line, the fields of a job
+ *  separated by tabs. Empty lines and lines starting with # are ignored.
+ *  The output path of each job is optional.
+ *
+ *  - adl <file.adl> [<file.vgm>]
+ *  - mdy <file.mdy> <file.tbr> [<file.vgm>]
+ *  - dir </path/to/coktel/game/> [</path/to/output/>]
+ *
+ *  If manifest is "-", the manifest is read from stdin.
+ *
+ *  A failing job does not stop the batch. After all jobs ran, a summary is
+ *  printed and an exception is thrown if any of the jobs failed.
+ *
+ *  The options are used for all jobs. When the songs are rendered into WAV
+ *  files, consecutive ADL and MDY jobs are rendered side by side.
+ */
+void convertBatch(const std::string &manifest, const ConvertOptions &options);
+
+#endif // BATCH_HPP
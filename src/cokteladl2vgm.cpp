@@ -27,6 +27,7 @@
 #include <unistd.h>
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <vector>
@@ -35,8 +36,13 @@
 #include "common/util.hpp"
 #include "common/version.hpp"
 #include "common/error.hpp"
+#include "common/stats.hpp"
+#include "common/trace.hpp"
+#include "common/thread.hpp"
 
 #include "convert.hpp"
+#include "batch.hpp"
+#include "server.hpp"
 
 struct Job;
 
@@ -46,6 +52,12 @@ void printVersion();
 Job parseCommandLine(int argc, char **argv);
 
 bool isDirectory(std::string path);
+bool parseNumber(const char *str, uint32 &number);
+bool parseLevel(const char *str, double &level, double min, double max);
+bool parseThreadCounts(const char *str, uint *threads);
+bool parseShard(const char *str, uint &shard, uint &shardCount);
+
+void writeStats(const std::string &statsFile);
 
 
 /** Type for all operations this tool can do. */
@@ -55,7 +67,10 @@ enum Operation {
 	kOperationVersion    , ///< Show version information.
 	kOperationADL        , ///< Convert an ADL file.
 	kOperationMDY        , ///< Convert a MDY+TBR file.
-	kOperationDirectory    ///< Crawl through a game directory.
+	kOperationDirectory  , ///< Crawl through a game directory.
+	kOperationBatch      , ///< Run all jobs listed in a manifest.
+	kOperationServer     , ///< Run a conversion server.
+	kOperationMerge        ///< Merge the manifests and stats of crawl shards.
 };
 
 /** Full description of the job this tool will be doing. */
@@ -63,7 +78,16 @@ struct Job {
 	Operation operation; ///< The operation to perform.
 	std::vector<std::string> files; ///< The files to manipulate.
 
-	Job() : operation(kOperationInvalid) {
+	std::string output; ///< The file to convert a single song into, or "-" for stdout.
+
+	uint32 cacheSize; ///< Size of the server's file cache in MiB.
+
+	ConvertOptions convertOptions; ///< Options for converting music.
+
+	std::string statsFile; ///< File to write timing and counters into, or "-" for stdout.
+	std::string traceFile; ///< File to write trace events into.
+
+	Job() : operation(kOperationInvalid), cacheSize(64) {
 	}
 };
 
@@ -72,7 +96,15 @@ int main(int argc, char **argv) {
 	// Find out what we're supposed to do
 	Job job = parseCommandLine(argc, argv);
 
+	if (!job.statsFile.empty())
+		Common::enableStats();
+
+	int result = 0;
+
 	try {
+		if (!job.traceFile.empty())
+			Common::openTrace(job.traceFile);
+
 		// Handle the job
 		switch (job.operation) {
 			case kOperationHelp:
@@ -84,33 +116,57 @@ int main(int argc, char **argv) {
 				break;
 
 			case kOperationADL:
-				convertADL(job.files[0]);
+				convertADL(job.files[0], job.output, job.convertOptions);
 				break;
 
 			case kOperationMDY:
-				convertMDY(job.files[0], job.files[1]);
+				convertMDY(job.files[0], job.files[1], job.output, job.convertOptions);
 				break;
 
 			case kOperationDirectory:
-				crawlDirectory(job.files[0]);
+				crawlDirectory(job.files[0], "", job.convertOptions);
+				break;
+
+			case kOperationBatch:
+				convertBatch(job.files[0], job.convertOptions);
+				break;
+
+			case kOperationServer:
+				runServer(job.files[0], job.cacheSize * 1024 * 1024, job.convertOptions.limits);
+				break;
+
+			case kOperationMerge:
+				mergeShards(job.files[0], std::vector<std::string>(job.files.begin() + 1, job.files.end()));
 				break;
 
 			case kOperationInvalid:
 			default:
 				printUsage(argv[0]);
-				return -1;
+				result = -1;
+				break;
 		}
 	} catch (Common::Exception &e) {
 		Common::printException(e);
-		return -2;
+		result = -2;
 	} catch (std::exception &e) {
 		Common::Exception se(e);
 
 		Common::printException(se);
-		return -2;
+		result = -2;
+	}
+
+	// Even a failed job has stats worth looking at
+	try {
+		Common::closeTrace();
+
+		if (!job.statsFile.empty())
+			writeStats(job.statsFile);
+	} catch (Common::Exception &e) {
+		Common::printException(e);
+		result = -2;
 	}
 
-	return 0;
+	return result;
 }
 
 /** Print usage/help text. */
@@ -118,9 +174,114 @@ void printUsage(const char *name) {
 	std::printf("%s - Tool to convert Coktel Vision's AdLib music to VGM\n", ADL2VGM_NAME);
 	std::printf("Usage: %s [options] <file.adl>\n", name);
 	std::printf("       %s [options] <file.mdy> <file.tbr>\n", name);
-	std::printf("       %s [options] </path/to/coktel/game/>\n\n", name);
+	std::printf("       %s [options] </path/to/coktel/game/>\n", name);
+	std::printf("       %s [options] --batch <manifest>\n", name);
+	std::printf("       %s [options] --server <socket>\n", name);
+	std::printf("       %s [options] --merge </path/to/output/> [<stats.json> ...]\n\n", name);
 	std::printf("  -h      --help              Display this text and exit.\n");
 	std::printf("  -v      --version           Display version information and exit.\n");
+	std::printf("  -b      --batch <manifest>  Run all jobs listed in the manifest file.\n");
+	std::printf("                              If the manifest is -, read it from stdin.\n");
+	std::printf("  -i      --incremental       When crawling through a game directory, only\n");
+	std::printf("                              convert files that changed since the last run.\n");
+	std::printf("  -p      --profile           Don't write any VGM files. Instead, print how many\n");
+	std::printf("                              OPL register writes each song does, per register,\n");
+	std::printf("                              channel and command, as JSON lines to stdout.\n");
+	std::printf("          --probe             Don't write any VGM files. Instead, print each\n");
+	std::printf("                              song's length, voice usage, percussion mode\n");
+	std::printf("                              and instrument count as JSON lines. Neither\n");
+	std::printf("                              format marks a loop: whether a song repeats\n");
+	std::printf("                              is up to the game playing it.\n");
+	std::printf("  -w      --wav               Render the music through an emulated OPL2 into WAV\n");
+	std::printf("                              files, instead of converting it into VGM files.\n");
+	std::printf("          --stems             Render each of the 9 melody and 5 percussion voices\n");
+	std::printf("                              of a single song into a WAV file of its own,\n");
+	std::printf("                              named after the voice. Not possible with\n");
+	std::printf("                              --normalize or --seek.\n");
+	std::printf("          --lanes <n>         When rendering WAV files in batch mode, render this\n");
+	std::printf("                              many songs side by side. Default: 8.\n");
+	std::printf("          --render-threads <n>\n");
+	std::printf("                              Render a single song into a WAV file in segments,\n");
+	std::printf("                              on this many threads. \"auto\" uses one thread per\n");
+	std::printf("                              processor. Default: 1. With --stems, render the\n");
+	std::printf("                              stems on this many threads. Not possible with\n");
+	std::printf("                              --stream or --raw.\n");
+	std::printf("          --stream <file>     Render a single song through an emulated OPL2,\n");
+	std::printf("                              and stream it into the file while it's playing,\n");
+	std::printf("                              as raw signed 16-bit little-endian mono PCM.\n");
+	std::printf("                              If the file is -, use stdout.\n");
+	std::printf("          --shm <name>        Write the output of a single song into a new ring\n");
+	std::printf("                              buffer in POSIX shared memory of this name,\n");
+	std::printf("                              instead of into a file, for another process to\n");
+	std::printf("                              read. VGM and WAV data only goes in once the\n");
+	std::printf("                              whole file is done, raw PCM as it's rendered.\n");
+	std::printf("                              Its layout is documented in the README.\n");
+	std::printf("          --raw               Together with --shm, render raw PCM as --stream\n");
+	std::printf("                              does, instead of VGM data. Only valid with\n");
+	std::printf("                              --shm.\n");
+	std::printf("          --rate <hz>         Render WAV files and streams at this many samples\n");
+	std::printf("                              per second. Default: 49716, the OPL2's own rate;\n");
+	std::printf("                              any other rate is resampled from it.\n");
+	std::printf("          --gain <dB>         Amplify WAV files and streams by this many dB.\n");
+	std::printf("                              Default: 0.\n");
+	std::printf("          --normalize <LUFS>\n");
+	std::printf("                              Amplify each WAV file to this EBU R128 integrated\n");
+	std::printf("                              loudness, as measured while rendering, without\n");
+	std::printf("                              clipping its peak. Not possible with --stream.\n");
+	std::printf("          --trim              Trim the silence off the start and the end of each\n");
+	std::printf("                              song: before the first note, and after the last\n");
+	std::printf("                              note's release died away. Not possible with --seek.\n");
+	std::printf("                              With --stats, the silence trimmed is noted there.\n");
+	std::printf("          --keyframes <s>     Record a keyframe of the player's state every this\n");
+	std::printf("                              many seconds, into an index next to each output\n");
+	std::printf("                              file, with .keys appended. Not possible with\n");
+	std::printf("                              --server.\n");
+	std::printf("          --seek <s>          Render a single song into a WAV file or stream\n");
+	std::printf("                              from this many seconds into it on.\n");
+	std::printf("          --seek-index <file>\n");
+	std::printf("                              Seek with the keyframes of this index, recorded\n");
+	std::printf("                              by --keyframes, instead of playing through the\n");
+	std::printf("                              song up to the position. Only valid with --seek.\n");
+	std::printf("  -s      --server <socket>   Run a conversion server on a Unix domain socket.\n");
+	std::printf("          --merge <target>    Merge the manifests of all crawl shards found in\n");
+	std::printf("                              the target directory, and the stats files given,\n");
+	std::printf("                              into the manifest and the --stats file.\n");
+	std::printf("          --shard <i/N>       Split the inputs of the game directory into N\n");
+	std::printf("                              shards of about the same cost, and only crawl\n");
+	std::printf("                              through the i-th, counting from 1. Each shard\n");
+	std::printf("                              keeps its own manifest.\n");
+	std::printf("          --max-length <s>    Abort songs longer than this many seconds.\n");
+	std::printf("                              Default: 7200. 0 means no limit.\n");
+	std::printf("          --max-events <n>    Abort songs with more than this many events.\n");
+	std::printf("                              Default: 0, no limit.\n");
+	std::printf("          --max-size <MiB>    Abort songs producing more than this many MiB of\n");
+	std::printf("                              VGM data. Default: 256. 0 means no limit.\n");
+	std::printf("          --max-time <s>      Abort songs taking more than this many seconds to\n");
+	std::printf("                              convert. Default: 0, no limit.\n");
+	std::printf("          --pipeline <r,u,p,c,w>\n");
+	std::printf("                              Crawl through a game directory in stages running\n");
+	std::printf("                              in parallel: reading, unpacking, parsing TOTs,\n");
+	std::printf("                              converting and writing, with the given number of\n");
+	std::printf("                              threads each. \"auto\" converts in one thread per\n");
+	std::printf("                              processor and runs the other stages in one each.\n");
+	std::printf("          --queue-size <n>    Let up to this many files wait in front of each\n");
+	std::printf("                              stage of the pipeline. Default: 4.\n");
+	std::printf("          --memory-limit <MiB>\n");
+	std::printf("                              Only let more files into the pipeline while the\n");
+	std::printf("                              memory all files in it need, as estimated from\n");
+	std::printf("                              their sizes, stays below this many MiB.\n");
+	std::printf("                              Default: 0, no limit.\n");
+	std::printf("          --cache-size <MiB>  Keep up to this many MiB of game files in memory\n");
+	std::printf("                              between server requests. Default: 64.\n");
+	std::printf("          --stats <file>      Write the time spent in each conversion stage, and\n");
+	std::printf("                              the bytes, events and OPL writes it processed, as\n");
+	std::printf("                              JSON into this file, along with the peak, RMS level\n");
+	std::printf("                              and loudness of each rendered song, and the time a\n");
+	std::printf("                              crawl was predicted to take against the time it\n");
+	std::printf("                              took. If the file is -, use stdout.\n");
+	std::printf("          --trace <file>      Write trace events of each archive opened, file\n");
+	std::printf("                              unpacked and song converted into this file, to be\n");
+	std::printf("                              viewed in chrome://tracing or Perfetto.\n");
 	std::printf("\n");
 	std::printf("Examples:\n");
 	std::printf("- %s intro.adl\n", name);
@@ -134,8 +295,65 @@ void printUsage(const char *name) {
 	std::printf("  used by the game into the VGM format\n");
 	std::printf("- %s C:\\games\\coktel\\gobliiins\\\n", name);
 	std::printf("  Like above, but on Windows\n");
+	std::printf("- %s --incremental /games/coktel/gobliiins/\n", name);
+	std::printf("  Like above, but skip all files that were already converted by an earlier\n");
+	std::printf("  run and didn't change since. A record of what was converted is kept in\n");
+	std::printf("  the file cokteladl2vgm.manifest\n");
+	std::printf("- %s --profile /games/coktel/gobliiins/\n", name);
+	std::printf("  Find out which songs of the game produce the most OPL register writes\n");
+	std::printf("- %s --probe /games/coktel/gobliiins/ > catalogue.json\n", name);
+	std::printf("  Quickly catalogue the length and properties of all songs of the game\n");
+	std::printf("- %s --pipeline 1,1,1,4,1 /games/coktel/gobliiins/\n", name);
+	std::printf("  Convert all music files of the game in four threads, while other threads\n");
+	std::printf("  read and unpack the next files and write the finished VGM files\n");
+	std::printf("- %s --pipeline auto --memory-limit 512 /games/coktel/gobliiins/\n", name);
+	std::printf("  Convert in as many threads as there are processors, but hold back files\n");
+	std::printf("  while the ones being converted would need more than 512 MiB of memory\n");
+	std::printf("- %s --batch jobs.txt\n", name);
+	std::printf("  Run all jobs in jobs.txt within one process. Each line of the manifest\n");
+	std::printf("  is one job, with the fields separated by tabs:\n");
+	std::printf("    adl <file.adl> [<file.vgm>]\n");
+	std::printf("    mdy <file.mdy> <file.tbr> [<file.vgm>]\n");
+	std::printf("    dir </path/to/coktel/game/> [</path/to/output/>]\n");
+	std::printf("- %s --wav --lanes 16 --batch previews.txt\n", name);
+	std::printf("  Render previews of all songs listed in previews.txt into WAV files,\n");
+	std::printf("  16 songs at a time\n");
+	std::printf("- %s --rate 48000 --stream - intro.adl | aplay -f S16_LE -r 48000\n", name);
+	std::printf("  Listen to intro.adl right away, while it's being rendered\n");
+	std::printf("- %s --wav --rate 48000 --normalize -16 --stats levels.json --batch previews.txt\n", name);
+	std::printf("  Render previews at 48 kHz, all at the same loudness, and note each song's\n");
+	std::printf("  peak, RMS level and loudness before normalizing in levels.json\n");
+	std::printf("- %s --trim --stats trim.json /games/coktel/gobliiins/\n", name);
+	std::printf("  Convert all music files of the game without the silence around the music,\n");
+	std::printf("  and note how much of it was trimmed off each in trim.json\n");
+	std::printf("- %s --keyframes 5 intro.adl\n", name);
+	std::printf("  Convert intro.adl, and record a keyframe every 5 seconds into intro.adl.vgm.keys\n");
+	std::printf("- %s --seek 95 --seek-index intro.adl.vgm.keys --stream - intro.adl | aplay -f S16_LE -r 49716\n", name);
+	std::printf("  Listen to intro.adl from 1:35 on, without playing through the song before\n");
+	std::printf("- %s --wav --render-threads auto intro.adl\n", name);
+	std::printf("  Render intro.adl into a WAV file, with all processors working on it\n");
+	std::printf("- %s --stems --render-threads 4 intro.adl\n", name);
+	std::printf("  Render each voice of intro.adl into intro.adl.melody0.wav to\n");
+	std::printf("  intro.adl.melody8.wav, and intro.adl.bassdrum.wav, .snare, .tom, .cymbal\n");
+	std::printf("  and .hihat.wav, on four threads\n");
+	std::printf("- %s --raw --rate 48000 --shm adl2vgm intro.adl\n", name);
+	std::printf("  Render intro.adl into the shared memory ring buffer /adl2vgm, for an\n");
+	std::printf("  encoder running in another process to read as it's rendered\n");
+	std::printf("- %s --server /tmp/adl2vgm.sock\n", name);
+	std::printf("  Wait for conversion requests on the socket /tmp/adl2vgm.sock. Opened game\n");
+	std::printf("  directories and their files stay in memory between requests\n");
+	std::printf("- %s --stats stats.json /games/coktel/gobliiins/\n", name);
+	std::printf("  Convert all music files of the game and write totals and a per-file\n");
+	std::printf("  breakdown of where the time went into stats.json\n");
+	std::printf("- %s -i --shard 2/3 --stats stats.2.json /games/coktel/gobliiins/\n", name);
+	std::printf("  Convert a third of the music files of the game. Two other machines can\n");
+	std::printf("  each convert one of the other thirds at the same time\n");
+	std::printf("- %s --merge . --stats stats.json stats.1.json stats.2.json stats.3.json\n", name);
+	std::printf("  Once the VGM files, manifests and stats of all shards have been gathered\n");
+	std::printf("  in one directory, merge the shards' manifests and stats\n");
 	std::printf("\n");
-	std::printf("All new files will be created in the current working directory.\n");
+	std::printf("Unless the manifest says otherwise, all new files will be created in the\n");
+	std::printf("current working directory.\n");
 }
 
 /** Print the tool's version. */
@@ -158,6 +376,29 @@ void printVersion() {
 	std::printf("along with %s. If not, see <http://www.gnu.org/licenses/>.\n", ADL2VGM_NAME);
 }
 
+/** Parse an operation that's followed by the only path, like the manifest in batch mode. */
+bool parseOperationPath(int argc, char **argv, int &i, Job &job, Operation operation) {
+	if (((i + 1) >= argc) || !job.files.empty() || (job.operation != kOperationInvalid)) {
+		job.operation = kOperationInvalid;
+		return false;
+	}
+
+	job.operation = operation;
+	job.files.push_back(argv[++i]);
+
+	return true;
+}
+
+/** Parse the value of a limit option, given in units of scale. */
+bool parseLimit(int argc, char **argv, int &i, uint32 &limit, uint32 scale) {
+	uint32 value;
+	if (((i + 1) >= argc) || !parseNumber(argv[++i], value) || (value > (0xFFFFFFFF / scale)))
+		return false;
+
+	limit = value * scale;
+	return true;
+}
+
 Job parseCommandLine(int argc, char **argv) {
 	Job job;
 
@@ -170,26 +411,296 @@ Job parseCommandLine(int argc, char **argv) {
 		} else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--version")) {
 			job.operation = kOperationVersion;
 			break;
+		} else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--batch")) {
+			if (!parseOperationPath(argc, argv, i, job, kOperationBatch))
+				return job;
+
+			continue;
+		} else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--server")) {
+			if (!parseOperationPath(argc, argv, i, job, kOperationServer))
+				return job;
+
+			continue;
+		} else if (!strcmp(argv[i], "--merge")) {
+			if (!parseOperationPath(argc, argv, i, job, kOperationMerge))
+				return job;
+
+			continue;
+		} else if (!strcmp(argv[i], "--shard")) {
+			if (((i + 1) >= argc) ||
+			    !parseShard(argv[++i], job.convertOptions.shard, job.convertOptions.shardCount)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			continue;
+		} else if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--incremental")) {
+			job.convertOptions.incremental = true;
+			continue;
+		} else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--profile")) {
+			job.convertOptions.profile = true;
+			continue;
+		} else if (!strcmp(argv[i], "--probe")) {
+			job.convertOptions.probe = true;
+			continue;
+		} else if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--wav")) {
+			job.convertOptions.format = kOutputWAV;
+			continue;
+		} else if (!strcmp(argv[i], "--stems")) {
+			job.convertOptions.format = kOutputWAV;
+			job.convertOptions.stems  = true;
+			continue;
+		} else if (!strcmp(argv[i], "--lanes")) {
+			uint32 lanes;
+			if (((i + 1) >= argc) || !parseNumber(argv[++i], lanes) || (lanes == 0) || (lanes > 64)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			job.convertOptions.renderLanes = lanes;
+			continue;
+		} else if (!strcmp(argv[i], "--render-threads")) {
+			uint32 threads;
+			if (((i + 1) < argc) && !strcmp(argv[i + 1], "auto")) {
+				threads = Common::getCPUCount();
+				i++;
+			} else if (((i + 1) >= argc) || !parseNumber(argv[++i], threads) || (threads == 0) || (threads > 64)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			job.convertOptions.renderThreads = threads;
+			continue;
+		} else if (!strcmp(argv[i], "--rate")) {
+			uint32 rate;
+			if (((i + 1) >= argc) || !parseNumber(argv[++i], rate) || (rate < 8000) || (rate > 192000)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			job.convertOptions.sampleRate = rate;
+			continue;
+		} else if (!strcmp(argv[i], "--gain")) {
+			if (((i + 1) >= argc) || !parseLevel(argv[++i], job.convertOptions.gain, -40.0, 40.0)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			continue;
+		} else if (!strcmp(argv[i], "--normalize")) {
+			if (((i + 1) >= argc) || !parseLevel(argv[++i], job.convertOptions.loudness, -70.0, 0.0)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			job.convertOptions.normalize = true;
+			continue;
+		} else if (!strcmp(argv[i], "--stream")) {
+			if ((i + 1) >= argc) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			job.convertOptions.format = kOutputPCM;
+			job.output = argv[++i];
+			continue;
+		} else if (!strcmp(argv[i], "--shm")) {
+			if ((i + 1) >= argc) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			job.convertOptions.sharedRing = argv[++i];
+			continue;
+		} else if (!strcmp(argv[i], "--raw")) {
+			job.convertOptions.format = kOutputPCM;
+			continue;
+		} else if (!strcmp(argv[i], "--trim")) {
+			job.convertOptions.trimSilence = true;
+			continue;
+		} else if (!strcmp(argv[i], "--keyframes")) {
+			double seconds;
+			if (((i + 1) >= argc) || !parseLevel(argv[++i], seconds, 0.01, 3600.0)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			job.convertOptions.keyframeInterval = (uint32) (seconds * 44100 + 0.5);
+			continue;
+		} else if (!strcmp(argv[i], "--seek")) {
+			double seconds;
+			if (((i + 1) >= argc) || !parseLevel(argv[++i], seconds, 0.0, 86400.0)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			job.convertOptions.seekPosition = (uint32) (seconds * 44100 + 0.5);
+			continue;
+		} else if (!strcmp(argv[i], "--seek-index")) {
+			if ((i + 1) >= argc) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			job.convertOptions.seekIndex = argv[++i];
+			continue;
+		} else if (!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--trace")) {
+			if ((i + 1) >= argc) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			if (!strcmp(argv[i], "--stats"))
+				job.statsFile = argv[++i];
+			else
+				job.traceFile = argv[++i];
+
+			continue;
+		} else if (!strcmp(argv[i], "--max-length")) {
+			if (!parseLimit(argc, argv, i, job.convertOptions.limits.maxSamples, 44100)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			continue;
+		} else if (!strcmp(argv[i], "--max-events")) {
+			if (!parseLimit(argc, argv, i, job.convertOptions.limits.maxEvents, 1)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			continue;
+		} else if (!strcmp(argv[i], "--max-size")) {
+			if (!parseLimit(argc, argv, i, job.convertOptions.limits.maxOutputSize, 1024 * 1024)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			continue;
+		} else if (!strcmp(argv[i], "--max-time")) {
+			if (!parseLimit(argc, argv, i, job.convertOptions.limits.maxTime, 1000)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			continue;
+		} else if (!strcmp(argv[i], "--pipeline")) {
+			if (((i + 1) >= argc) || !parseThreadCounts(argv[++i], job.convertOptions.crawlThreads)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			continue;
+		} else if (!strcmp(argv[i], "--queue-size")) {
+			uint32 queueSize;
+			if (((i + 1) >= argc) || !parseNumber(argv[++i], queueSize) || (queueSize == 0) || (queueSize > 1024)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			job.convertOptions.crawlQueueSize = queueSize;
+			continue;
+		} else if (!strcmp(argv[i], "--memory-limit")) {
+			uint32 memoryLimit;
+			if (((i + 1) >= argc) || !parseNumber(argv[++i], memoryLimit)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			job.convertOptions.crawlMemoryLimit = ((uint64) memoryLimit) * 1024 * 1024;
+			continue;
+		} else if (!strcmp(argv[i], "--cache-size")) {
+			if (((i + 1) >= argc) || !parseNumber(argv[++i], job.cacheSize) || (job.cacheSize > 4095)) {
+				job.operation = kOperationInvalid;
+				return job;
+			}
+
+			continue;
 		}
 
 		// Everything else is assumed to be a path
 		job.files.push_back(argv[i]);
 
-		// If we have a directory, assume directory mode
-		if (isDirectory(job.files.back()))
+		// If we have a directory, assume directory mode, unless another mode was asked for
+		if ((job.operation == kOperationInvalid) && isDirectory(job.files.back()))
 			job.operation = kOperationDirectory;
 	}
 
+	// These options conflict in every operation converting anything
+	if ((job.operation != kOperationHelp) && (job.operation != kOperationVersion)) {
+		// The loudness of a stream isn't known until it's over, too late to normalize it
+		if ((job.convertOptions.format == kOutputPCM) && job.convertOptions.normalize) {
+			job.operation = kOperationInvalid;
+			return job;
+		}
+
+		// A segment only comes out once it's done, far too late for a stream that's listened to as it's rendered
+		if ((job.convertOptions.format == kOutputPCM) && (job.convertOptions.renderThreads > 1)) {
+			job.operation = kOperationInvalid;
+			return job;
+		}
+
+		// A keyframe index is only used for seeking
+		if (!job.convertOptions.seekIndex.empty() && (job.convertOptions.seekPosition == 0)) {
+			job.operation = kOperationInvalid;
+			return job;
+		}
+
+		// The server only answers with VGM data, without anything next to it
+		if ((job.operation == kOperationServer) && (job.convertOptions.keyframeInterval > 0)) {
+			job.operation = kOperationInvalid;
+			return job;
+		}
+
+		// Raw PCM is only streamed, into a file or shared memory
+		if ((job.convertOptions.format == kOutputPCM) && job.output.empty() && job.convertOptions.sharedRing.empty()) {
+			job.operation = kOperationInvalid;
+			return job;
+		}
+
+		// Shared memory takes the place of the output file, and there's no file to put keyframes or stems next to
+		if (!job.convertOptions.sharedRing.empty() &&
+		    (!job.output.empty() || job.convertOptions.stems || (job.convertOptions.keyframeInterval > 0))) {
+			job.operation = kOperationInvalid;
+			return job;
+		}
+	}
+
 	// Already found an operation => return it
 	if (job.operation != kOperationInvalid) {
 
-		// We only support checking one directory
-		if ((job.operation == kOperationDirectory) && (job.files.size() != 1))
+		// We only support checking one directory, and only one manifest or socket
+		if (((job.operation == kOperationDirectory) || (job.operation == kOperationBatch) ||
+		     (job.operation == kOperationServer)) && (job.files.size() != 1))
+			job.operation = kOperationInvalid;
+
+		// Only single songs can be streamed, rendered from a position on, in segments, or into stems
+		if ((!job.output.empty() || !job.convertOptions.sharedRing.empty() ||
+		     (job.convertOptions.seekPosition > 0) || (job.convertOptions.renderThreads > 1) ||
+		     job.convertOptions.stems) &&
+		    (job.operation != kOperationHelp) && (job.operation != kOperationVersion))
 			job.operation = kOperationInvalid;
 
 		return job;
 	}
 
+	// Stems cover the whole song, at the levels they have in it
+	if (job.convertOptions.stems &&
+	    ((job.convertOptions.format != kOutputWAV) || job.convertOptions.normalize ||
+	     (job.convertOptions.seekPosition > 0))) {
+		job.operation = kOperationInvalid;
+		return job;
+	}
+
+	// Only rendered audio starts at a position, and then not all of the song's keyframes are recorded.
+	// Past the position, it's also too late to know what silence would have been trimmed before
+	if ((job.convertOptions.seekPosition > 0) &&
+	    (((job.convertOptions.format != kOutputWAV) && (job.convertOptions.format != kOutputPCM)) ||
+	     (job.convertOptions.keyframeInterval > 0) || job.convertOptions.trimSilence)) {
+		job.operation = kOperationInvalid;
+		return job;
+	}
+
 	// One file is assumed to be an ADL, two files MDY+TBR. Everything else is invalid
 	if      (job.files.size() == 1)
 		job.operation = kOperationADL;
@@ -215,3 +726,95 @@ bool isDirectory(std::string path) {
 
 	return s.st_mode & S_IFDIR;
 }
+
+bool parseNumber(const char *str, uint32 &number) {
+	char *end = 0;
+
+	unsigned long n = std::strtoul(str, &end, 10);
+	if (!*str || !end || *end)
+		return false;
+
+	number = n;
+	return true;
+}
+
+/** Parse a level in dB or LUFS, which may be negative or fractional. */
+bool parseLevel(const char *str, double &level, double min, double max) {
+	char *end = 0;
+
+	double l = std::strtod(str, &end);
+	if (!*str || !end || *end || (l < min) || (l > max))
+		return false;
+
+	level = l;
+	return true;
+}
+
+/** Parse the thread counts of all crawl stages, separated by commas.
+ *
+ *  "auto" runs the conversion in one thread per processor, and all other
+ *  stages in one thread each.
+ */
+bool parseThreadCounts(const char *str, uint *threads) {
+	if (!strcmp(str, "auto")) {
+		for (int i = 0; i < kCrawlStageMAX; i++)
+			threads[i] = 1;
+
+		threads[kCrawlStageConvert] = Common::getCPUCount();
+		return true;
+	}
+
+	std::string counts = str;
+	for (int i = 0; i < kCrawlStageMAX; i++) {
+		const size_t comma = counts.find(',');
+		if ((comma == std::string::npos) != (i == (kCrawlStageMAX - 1)))
+			return false;
+
+		uint32 count;
+		if (!parseNumber(std::string(counts, 0, comma).c_str(), count) || (count == 0) || (count > 64))
+			return false;
+
+		threads[i] = count;
+
+		if (comma != std::string::npos)
+			counts.erase(0, comma + 1);
+	}
+
+	return true;
+}
+
+/** Parse a shard of a crawl, given as i/N. */
+bool parseShard(const char *str, uint &shard, uint &shardCount) {
+	const char *slash = std::strchr(str, '/');
+	if (!slash)
+		return false;
+
+	uint32 i, n;
+	if (!parseNumber(std::string(str, slash - str).c_str(), i) || !parseNumber(slash + 1, n))
+		return false;
+
+	if ((n == 0) || (i == 0) || (i > n))
+		return false;
+
+	shard      = i;
+	shardCount = n;
+	return true;
+}
+
+void writeStats(const std::string &statsFile) {
+	if (statsFile == "-") {
+		Common::writeStatsJSON(stdout);
+		std::fflush(stdout);
+		return;
+	}
+
+	std::FILE *file = std::fopen(statsFile.c_str(), "w");
+	if (!file)
+		throw Common::Exception("Failed to open \"%s\" for writing", statsFile.c_str());
+
+	Common::writeStatsJSON(file);
+
+	bool failed = std::ferror(file) != 0;
+	if ((std::fclose(file) != 0) || failed)
+		throw Common::Exception("Failed to write stats into \"%s\"", statsFile.c_str());
+}
@@ -0,0 +1,118 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file common/boundedqueue.hpp
+ *  A queue between threads, holding a limited number of items.
+ */
+
+#ifndef COMMON_BOUNDEDQUEUE_HPP
+#define COMMON_BOUNDEDQUEUE_HPP
+
+#include <deque>
+
+#include "common/noncopyable.hpp"
+#include "common/thread.hpp"
+
+namespace Common {
+
+/** A first-in, first-out queue between producing and consuming threads.
+ *
+ *  Producers are held up while the queue is full, so that a fast stage can't
+ *  pile up more work than its slower consumers can handle. Once closed, the
+ *  consumers drain the remaining items and then stop.
+ */
+template<typename T>
+class BoundedQueue : public NonCopyable {
+public:
+	BoundedQueue(size_t capacity) : _capacity((capacity > 0) ? capacity : 1), _closed(false),
+		_notFull(_mutex), _notEmpty(_mutex) {
+	}
+
+	/** Add an item, waiting while the queue is full.
+	 *
+	 *  @return false if the queue has been closed, and the item wasn't added.
+	 */
+	bool push(const T &item) {
+		ScopedLock lock(_mutex);
+
+		while (!_closed && (_items.size() >= _capacity))
+			_notFull.wait();
+
+		if (_closed)
+			return false;
+
+		_items.push_back(item);
+		_notEmpty.signal();
+
+		return true;
+	}
+
+	/** Take the oldest item, waiting while the queue is empty.
+	 *
+	 *  @return false if the queue has been closed and is empty.
+	 */
+	bool pop(T &item) {
+		ScopedLock lock(_mutex);
+
+		while (!_closed && _items.empty())
+			_notEmpty.wait();
+
+		if (_items.empty())
+			return false;
+
+		item = _items.front();
+		_items.pop_front();
+
+		_notFull.signal();
+
+		return true;
+	}
+
+	/** Stop accepting items, and wake up everyone waiting. */
+	void close() {
+		ScopedLock lock(_mutex);
+
+		_closed = true;
+
+		_notFull.broadcast();
+		_notEmpty.broadcast();
+	}
+
+	size_t size() const {
+		ScopedLock lock(_mutex);
+
+		return _items.size();
+	}
+
+private:
+	std::deque<T> _items;
+
+	size_t _capacity;
+	bool   _closed;
+
+	mutable Mutex _mutex;
+
+	Condition _notFull;
+	Condition _notEmpty;
+};
+
+} // End of namespace Common
+
+#endif // COMMON_BOUNDEDQUEUE_HPP
@@ -22,9 +22,20 @@
  *  File classes implementing the stream interfaces.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+
 #include "common/file.hpp"
 #include "common/error.hpp"
 
+#ifndef O_BINARY
+	#define O_BINARY 0
+#endif
+
 namespace Common {
 
 File::File() : _handle(0), _size(-1) {
@@ -119,6 +130,164 @@ uint32 File::read(void *dataPtr, uint32 dataSize) {
 }
 
 
+PositionalFile::PositionalFile() : _fd(-1), _size(-1) {
+}
+
+PositionalFile::PositionalFile(const std::string &fileName) : _fd(-1), _size(-1) {
+	if (!open(fileName))
+		throw Exception("Can't open file \"%s\"", fileName.c_str());
+}
+
+PositionalFile::~PositionalFile() {
+	close();
+}
+
+bool PositionalFile::open(const std::string &fileName) {
+	if ((_fd = ::open(fileName.c_str(), O_RDONLY | O_BINARY)) < 0)
+		return false;
+
+	struct stat s;
+	if (fstat(_fd, &s) != 0) {
+		close();
+		return false;
+	}
+
+	_size = s.st_size;
+
+	return true;
+}
+
+void PositionalFile::close() {
+	if (_fd >= 0)
+		::close(_fd);
+
+	_fd   = -1;
+	_size = -1;
+}
+
+bool PositionalFile::isOpen() const {
+	return _fd >= 0;
+}
+
+int32 PositionalFile::size() const {
+	return _size;
+}
+
+uint32 PositionalFile::read(uint32 offset, void *dataPtr, uint32 dataSize) const {
+	if (_fd < 0)
+		return 0;
+
+#if !defined(UNIX)
+	ScopedLock lock(_mutex);
+
+	if (lseek(_fd, offset, SEEK_SET) != (off_t) offset)
+		return 0;
+#endif
+
+	byte *data = (byte *) dataPtr;
+
+	uint32 total = 0;
+	while (total < dataSize) {
+#if defined(UNIX)
+		ssize_t n = pread(_fd, data + total, dataSize - total, offset + total);
+#else
+		ssize_t n = ::read(_fd, data + total, dataSize - total);
+#endif
+
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if (n <= 0)
+			break;
+
+		total += n;
+	}
+
+	return total;
+}
+
+MemoryReadStream *PositionalFile::readStream(uint32 offset, uint32 dataSize) const {
+	byte *buf = new byte[dataSize];
+
+	uint32 size = read(offset, buf, dataSize);
+	if ((size == 0) && (dataSize > 0)) {
+		delete[] buf;
+		throw kReadError;
+	}
+
+	return new MemoryReadStream(buf, size, true);
+}
+
+void PositionalFile::prefetch(uint32 offset, uint32 dataSize) const {
+	if ((_fd < 0) || (dataSize == 0))
+		return;
+
+#if defined(HAVE_POSIX_FADVISE)
+	posix_fadvise(_fd, offset, dataSize, POSIX_FADV_WILLNEED);
+#elif defined(HAVE_READAHEAD)
+	readahead(_fd, offset, dataSize);
+#endif
+}
+
+
+PositionalFileStream::PositionalFileStream(const PositionalFile &file) : _file(&file),
+	_pos(0), _eos(false), _err(false) {
+}
+
+PositionalFileStream::~PositionalFileStream() {
+}
+
+bool PositionalFileStream::err() const {
+	return _err;
+}
+
+void PositionalFileStream::clearErr() {
+	_eos = false;
+	_err = false;
+}
+
+bool PositionalFileStream::eos() const {
+	return _eos;
+}
+
+int32 PositionalFileStream::pos() const {
+	return _pos;
+}
+
+int32 PositionalFileStream::size() const {
+	return _file->size();
+}
+
+bool PositionalFileStream::seek(int32 offs, int whence) {
+	if      (whence == SEEK_CUR)
+		offs += _pos;
+	else if (whence == SEEK_END)
+		offs += size();
+
+	if ((offs < 0) || (offs > size()))
+		return false;
+
+	_pos = offs;
+	_eos = false;
+
+	return true;
+}
+
+uint32 PositionalFileStream::read(void *dataPtr, uint32 dataSize) {
+	if (!_file->isOpen()) {
+		_err = true;
+		return 0;
+	}
+
+	uint32 n = _file->read(_pos, dataPtr, dataSize);
+
+	_pos += n;
+	if (n < dataSize)
+		_eos = true;
+
+	return n;
+}
+
+
 DumpFile::DumpFile() : _handle(0), _size(-1) {
 }
 
@@ -177,4 +346,28 @@ uint32 DumpFile::write(const void *dataPtr, uint32 dataSize) {
 	return std::fwrite(dataPtr, 1, dataSize, _handle);
 }
 
+
+StdOutStream::StdOutStream() {
+}
+
+StdOutStream::~StdOutStream() {
+	flush();
+}
+
+bool StdOutStream::err() const {
+	return std::ferror(stdout) != 0;
+}
+
+void StdOutStream::clearErr() {
+	std::clearerr(stdout);
+}
+
+bool StdOutStream::flush() {
+	return std::fflush(stdout) == 0;
+}
+
+uint32 StdOutStream::write(const void *dataPtr, uint32 dataSize) {
+	return std::fwrite(dataPtr, 1, dataSize, stdout);
+}
+
 } // End of namespace Common
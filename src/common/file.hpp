@@ -32,6 +32,7 @@
 #include "common/types.hpp"
 #include "common/stream.hpp"
 #include "common/noncopyable.hpp"
+#include "common/thread.hpp"
 
 namespace Common {
 
@@ -85,6 +86,90 @@ protected:
 	int32 _size;        ///< The file's size.
 };
 
+/** A file that can be read at any position by several threads at once.
+ *
+ *  Unlike File, there is no shared read position. Every read names its own
+ *  offset, so that threads reading different parts of the same file don't
+ *  need to take turns seeking.
+ */
+class PositionalFile : public NonCopyable {
+public:
+	PositionalFile();
+	PositionalFile(const std::string &fileName);
+	~PositionalFile();
+
+	/**
+	 * Try to open the file with the given fileName.
+	 * @note Must not be called if this file already is open (i.e. if isOpen returns true).
+	 *
+	 * @param  fileName the name of the file to open
+	 * @return true if file was opened successfully, false otherwise
+	 */
+	bool open(const std::string &fileName);
+
+	/**
+	 * Close the file, if open.
+	 */
+	void close();
+
+	/**
+	 * Checks if the object opened a file successfully.
+	 *
+	 * @return true if any file is opened, false otherwise.
+	 */
+	bool isOpen() const;
+
+	int32 size() const;
+
+	/** Read data found at offset. Returns the number of bytes actually read. */
+	uint32 read(uint32 offset, void *dataPtr, uint32 dataSize) const;
+
+	/** Read data found at offset into a new memory stream. */
+	MemoryReadStream *readStream(uint32 offset, uint32 dataSize) const;
+
+	/** Tell the system that data found at offset will be read soon.
+	 *
+	 *  The system may then start reading it in the background. This is only
+	 *  a hint, and does nothing where the system doesn't support it.
+	 */
+	void prefetch(uint32 offset, uint32 dataSize) const;
+
+private:
+	int   _fd;   ///< The file descriptor.
+	int32 _size; ///< The file's size.
+
+#if !defined(UNIX)
+	/** Without pread(), reads need to take turns seeking. */
+	mutable Mutex _mutex;
+#endif
+};
+
+/** A stream reading a PositionalFile, with a read position of its own.
+ *
+ *  Any number of these streams can read the same file at once.
+ */
+class PositionalFileStream : public SeekableReadStream {
+public:
+	PositionalFileStream(const PositionalFile &file);
+	~PositionalFileStream();
+
+	bool err() const; // implement abstract Stream method
+	void clearErr();  // implement abstract Stream method
+	bool eos() const; // implement abstract SeekableReadStream method
+
+	int32 pos() const;  // implement abstract SeekableReadStream method
+	int32 size() const; // implement abstract SeekableReadStream method
+	bool seek(int32 offs, int whence = SEEK_SET); // implement abstract SeekableReadStream method
+	uint32 read(void *dataPtr, uint32 dataSize);  // implement abstract SeekableReadStream method
+
+private:
+	const PositionalFile *_file;
+
+	int32 _pos;
+	bool  _eos;
+	bool  _err;
+};
+
 /** For quickly dumping data into a file.
  *
  *  @note Use only for testing purposes!
@@ -127,6 +212,20 @@ protected:
 	int32 _size;        ///< The file's size.
 };
 
+/** A stream writing into stdout. */
+class StdOutStream : public WriteStream, public NonCopyable {
+public:
+	StdOutStream();
+	~StdOutStream();
+
+	bool err() const; // implement abstract Stream method
+	void clearErr();  // implement abstract Stream method
+
+	bool flush(); // implement abstract WriteStream method
+
+	uint32 write(const void *dataPtr, uint32 dataSize); // implement abstract WriteStream method
+};
+
 } // End of namespace Common
 
 #endif // COMMON_FILE_HPP
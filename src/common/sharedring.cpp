@@ -0,0 +1,346 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file common/sharedring.cpp
+ *  A ring buffer in shared memory, streaming data into another process.
+ */
+
+#include <cstring>
+#include <cerrno>
+
+#include "common/util.hpp"
+#include "common/error.hpp"
+#include "common/sharedring.hpp"
+
+#ifdef UNIX
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(HAVE_LINUX_FUTEX_H)
+	#include <linux/futex.h>
+	#include <sys/syscall.h>
+#endif
+
+namespace Common {
+
+/** The header at the start of the shared memory, see SharedRing for its layout. */
+struct SharedRing::Header {
+	char   magic[4];
+	uint32 version;
+	uint32 headerSize;
+	uint32 capacity;
+	char   format[4];
+	uint32 rate;
+	uint32 flags;
+	byte   reserved0[36];
+
+	// Written by the producer, on a cache line of its own
+	uint64 writePos;
+	uint32 dataSequence;
+	uint32 dataWaiters;
+	byte   reserved1[48];
+
+	// Written by the consumer, on a cache line of its own
+	uint64 readPos;
+	uint32 spaceSequence;
+	uint32 spaceWaiters;
+	byte   reserved2[112];
+};
+
+static const uint32 kHeaderSize = 256;
+static const uint32 kVersion    = 1;
+
+static const uint32 kFlagDone   = 1; ///< The producer stopped writing.
+static const uint32 kFlagClosed = 2; ///< The consumer stopped reading.
+static const uint32 kFlagFailed = 4; ///< The producer failed, the data is incomplete.
+
+/** Largest capacity of the data area. */
+static const uint32 kMaxCapacity = 1024 * 1024 * 1024;
+
+/** Longest single wait for the consumer, in ms, before looking at the ring buffer again. */
+static const uint32 kWaitSlice = 100;
+
+static uint64 loadAcquire(const uint64 *value) {
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static void storeRelease(uint64 *value, uint64 x) {
+	__atomic_store_n(value, x, __ATOMIC_RELEASE);
+}
+
+static uint32 load(const uint32 *value) {
+	return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+}
+
+static void add(uint32 *value, uint32 x) {
+	__atomic_add_fetch(value, x, __ATOMIC_SEQ_CST);
+}
+
+static void sub(uint32 *value, uint32 x) {
+	__atomic_sub_fetch(value, x, __ATOMIC_SEQ_CST);
+}
+
+/** Wait for a futex word to change from value, a spurious wakeup, or at most kWaitSlice ms. */
+static void waitWord(uint32 *word, uint32 value) {
+#if defined(HAVE_LINUX_FUTEX_H)
+	struct timespec timeout = { 0, kWaitSlice * 1000 * 1000 };
+
+	syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, 0, 0);
+#else
+	if (load(word) == value)
+		usleep(1000);
+#endif
+}
+
+/** Bump a sequence futex word, and wake up all waiters, if there are any. */
+static void bumpWord(uint32 *word, const uint32 *waiters) {
+	add(word, 1);
+
+#if defined(HAVE_LINUX_FUTEX_H)
+	if (load(waiters) > 0)
+		syscall(SYS_futex, word, FUTEX_WAKE, 0x7FFFFFFF, 0, 0, 0);
+#else
+	(void) waiters;
+#endif
+}
+
+SharedRing::SharedRing(const std::string &name, const char *format, uint32 rate, uint32 capacity) :
+	_name(name), _memory(0), _size(0), _header(0), _data(0), _capacity(4096), _error(false), _stopped(false) {
+
+	if (_name.empty() || (_name[0] != '/'))
+		_name = "/" + _name;
+
+	while ((_capacity < capacity) && (_capacity < kMaxCapacity))
+		_capacity <<= 1;
+
+	_size = kHeaderSize + _capacity;
+
+	int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		throw Exception("Can't create shared memory \"%s\": %s", _name.c_str(), strerror(errno));
+
+	if (ftruncate(fd, _size) != 0) {
+		Exception e("Can't size shared memory \"%s\": %s", _name.c_str(), strerror(errno));
+
+		close(fd);
+		shm_unlink(_name.c_str());
+		throw e;
+	}
+
+	void *memory = mmap(0, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (memory == MAP_FAILED) {
+		Exception e("Can't map shared memory \"%s\": %s", _name.c_str(), strerror(errno));
+
+		shm_unlink(_name.c_str());
+		throw e;
+	}
+
+	_memory = (byte *) memory;
+	_header = (Header *) _memory;
+	_data   = _memory + kHeaderSize;
+
+	// The fresh object is all zeros, so only the fixed fields need to be set
+	std::memcpy(_header->magic, "ADLR", 4);
+	std::memcpy(_header->format, format, 4);
+
+	_header->version    = kVersion;
+	_header->headerSize = kHeaderSize;
+	_header->capacity   = _capacity;
+	_header->rate       = rate;
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+SharedRing::~SharedRing() {
+	if (!_header)
+		return;
+
+	// A ring buffer that wasn't finalized was given up on
+	stop(true);
+	destroy();
+}
+
+const std::string &SharedRing::getName() const {
+	return _name;
+}
+
+bool SharedRing::err() const {
+	return _error;
+}
+
+void SharedRing::clearErr() {
+	_error = false;
+}
+
+uint32 SharedRing::write(const void *dataPtr, uint32 dataSize) {
+	if (!_header || _stopped || _error)
+		return 0;
+
+	const byte *data = (const byte *) dataPtr;
+
+	uint32 left = dataSize;
+	while (left > 0) {
+		if (load(&_header->flags) & kFlagClosed) {
+			_error = true;
+			break;
+		}
+
+		// Only we ever move the write position
+		const uint64 writePos = _header->writePos;
+		const uint64 readPos  = loadAcquire(&_header->readPos);
+
+		const uint32 space = _capacity - (uint32) (writePos - readPos);
+		if (space == 0) {
+			if (!waitForReader(readPos)) {
+				_error = true;
+				break;
+			}
+
+			continue;
+		}
+
+		const uint32 size   = MIN(space, left);
+		const uint32 offset = (uint32) (writePos & (_capacity - 1));
+		const uint32 first  = MIN(size, _capacity - offset);
+
+		std::memcpy(_data + offset, data, first);
+		std::memcpy(_data, data + first, size - first);
+
+		storeRelease(&_header->writePos, writePos + size);
+		bumpWord(&_header->dataSequence, &_header->dataWaiters);
+
+		data += size;
+		left -= size;
+	}
+
+	return dataSize - left;
+}
+
+void SharedRing::finalize() {
+	if (!_header)
+		return;
+
+	stop(false);
+
+	const uint64 writePos = _header->writePos;
+	while (true) {
+		const uint64 readPos = loadAcquire(&_header->readPos);
+		if (readPos == writePos)
+			break;
+
+		if (!waitForReader(readPos)) {
+			_error = true;
+			break;
+		}
+	}
+
+	destroy();
+}
+
+void SharedRing::stop(bool failed) {
+	if (_stopped)
+		return;
+
+	__atomic_or_fetch(&_header->flags, kFlagDone | (failed ? kFlagFailed : 0), __ATOMIC_SEQ_CST);
+	bumpWord(&_header->dataSequence, &_header->dataWaiters);
+
+	_stopped = true;
+}
+
+bool SharedRing::waitForReader(uint64 readPos) {
+	const uint64 start = getMicroseconds();
+
+	while (true) {
+		// Announce the wait before looking again, so that the consumer can't move on unnoticed
+		add(&_header->spaceWaiters, 1);
+
+		const uint32 sequence = load(&_header->spaceSequence);
+
+		if (!(load(&_header->flags) & kFlagClosed) && (loadAcquire(&_header->readPos) == readPos))
+			waitWord(&_header->spaceSequence, sequence);
+
+		sub(&_header->spaceWaiters, 1);
+
+		if (load(&_header->flags) & kFlagClosed)
+			return false;
+		if (loadAcquire(&_header->readPos) != readPos)
+			return true;
+
+		// A consumer that doesn't read anything for this long is assumed to be gone
+		if ((getMicroseconds() - start) >= (kConsumerTimeout * (uint64) 1000))
+			return false;
+	}
+}
+
+void SharedRing::destroy() {
+	munmap(_memory, _size);
+	shm_unlink(_name.c_str());
+
+	_memory = 0;
+	_header = 0;
+	_data   = 0;
+}
+
+} // End of namespace Common
+
+#else // UNIX
+
+namespace Common {
+
+struct SharedRing::Header {
+};
+
+SharedRing::SharedRing(const std::string &name, const char *, uint32, uint32) : _name(name),
+	_memory(0), _size(0), _header(0), _data(0), _capacity(0), _error(false), _stopped(false) {
+
+	throw Exception("Shared memory ring buffers are not supported on this platform");
+}
+
+SharedRing::~SharedRing() {
+}
+
+const std::string &SharedRing::getName() const {
+	return _name;
+}
+
+bool SharedRing::err() const {
+	return true;
+}
+
+void SharedRing::clearErr() {
+}
+
+uint32 SharedRing::write(const void *, uint32) {
+	return 0;
+}
+
+void SharedRing::finalize() {
+}
+
+} // End of namespace Common
+
+#endif // UNIX
@@ -0,0 +1,142 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file common/sharedring.hpp
+ *  A ring buffer in shared memory, streaming data into another process.
+ */
+
+#ifndef COMMON_SHAREDRING_HPP
+#define COMMON_SHAREDRING_HPP
+
+#include <string>
+
+#include "common/types.hpp"
+#include "common/noncopyable.hpp"
+#include "common/stream.hpp"
+
+namespace Common {
+
+/** A stream writing into a single-producer, single-consumer ring buffer in POSIX shared memory.
+ *
+ *  The ring buffer is created as a new shared memory object, which another
+ *  process opens with shm_open() and maps to read the data in place, as it's
+ *  written. All fields are in the machine's native byte order:
+ *
+ *  | Offset | Size | Field                                                    |
+ *  |-------:|-----:|----------------------------------------------------------|
+ *  |      0 |    4 | Magic, the characters "ADLR"                             |
+ *  |      4 |    4 | Version of the layout, 1                                 |
+ *  |      8 |    4 | Size of the header, the offset of the data (256)         |
+ *  |     12 |    4 | Capacity of the data area in bytes, a power of two       |
+ *  |     16 |    4 | Format of the data: "VGM ", "WAV " or "PCM "             |
+ *  |     20 |    4 | Samples per second of "PCM " data, else 0                |
+ *  |     24 |    4 | Flags, see below                                         |
+ *  |     64 |    8 | Write position: total number of bytes written            |
+ *  |     72 |    4 | Data sequence: futex word, bumped after each write       |
+ *  |     76 |    4 | Number of consumers waiting for data                     |
+ *  |    128 |    8 | Read position: total number of bytes read                |
+ *  |    136 |    4 | Space sequence: futex word, bumped after each read       |
+ *  |    140 |    4 | Number of producers waiting for space                    |
+ *
+ *  The data between the read and the write position is at offset
+ *  256 + (position % capacity), wrapping around at the end of the data area.
+ *  The producer only ever advances the write position, with release
+ *  semantics, and the consumer only the read position.
+ *
+ *  Flag 1 is set by the producer once it stopped writing, together with
+ *  flag 4 if it failed and the data is incomplete. Flag 2 is set by a
+ *  consumer that stops reading early, which fails all further writes.
+ *
+ *  A side waiting for the other increments its number of waiters, reads the
+ *  other side's sequence, checks the positions again, and only then waits
+ *  for the sequence to change with FUTEX_WAIT. After moving its position,
+ *  each side bumps its own sequence and, if the other side is waiting, wakes
+ *  it with FUTEX_WAKE. On systems without futexes, the sequences are polled.
+ *
+ *  Writes block while the ring buffer is full, so that the producer never
+ *  runs further ahead of the consumer than the capacity. The producer wakes
+ *  up every 100ms while waiting, in case a wakeup got lost. A consumer that
+ *  doesn't move the read position for kConsumerTimeout ms is taken to be
+ *  gone, like one that stopped reading early.
+ */
+class SharedRing : public WriteStream, public NonCopyable {
+public:
+	/** Default capacity of the data area: 1MB. */
+	static const uint32 kDefaultCapacity = 1024 * 1024;
+	/** Time in ms the producer waits for the consumer to read anything, before giving up. */
+	static const uint32 kConsumerTimeout = 30000;
+
+	/** Create a new ring buffer as the shared memory object of this name.
+	 *
+	 *  @param name     The name of the shared memory object. A leading '/' is added if missing.
+	 *  @param format   The format of the data, as 4 characters, padded with spaces.
+	 *  @param rate     The samples per second of PCM data.
+	 *  @param capacity The capacity of the data area, rounded up to a power of two.
+	 */
+	SharedRing(const std::string &name, const char *format, uint32 rate = 0,
+	           uint32 capacity = kDefaultCapacity);
+	~SharedRing();
+
+	/** Return the name of the shared memory object. */
+	const std::string &getName() const;
+
+	bool err() const; // implement abstract Stream method
+	void clearErr();  // implement abstract Stream method
+
+	uint32 write(const void *dataPtr, uint32 dataSize); // implement abstract WriteStream method
+
+	/** Mark the data as complete, and wait until the consumer has read all of it.
+	 *
+	 *  The shared memory object is then removed. A consumer that opened it
+	 *  before keeps its mapping.
+	 */
+	void finalize();
+
+private:
+	struct Header;
+
+	std::string _name;
+
+	byte   *_memory;
+	uint32  _size;
+
+	Header *_header;
+	byte   *_data;
+	uint32  _capacity;
+
+	bool _error;
+	bool _stopped;
+
+	/** Unmap and remove the shared memory object. */
+	void destroy();
+
+	/** Stop writing, and wake up the consumer to notice it. */
+	void stop(bool failed);
+
+	/** Wait until the consumer has read past readPos, or stopped reading.
+	 *
+	 *  @return false if the consumer stopped reading, or didn't read anything for kConsumerTimeout ms.
+	 */
+	bool waitForReader(uint64 readPos);
+};
+
+} // End of namespace Common
+
+#endif // COMMON_SHAREDRING_HPP
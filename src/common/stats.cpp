@@ -0,0 +1,570 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file common/stats.cpp
+ *  Timing and counters of the conversion stages.
+ */
+
+#include <cctype>
+#include <cstdlib>
+
+#include <vector>
+#include <map>
+
+#include "common/util.hpp"
+#include "common/error.hpp"
+#include "common/strutil.hpp"
+#include "common/stats.hpp"
+#include "common/trace.hpp"
+#include "common/thread.hpp"
+
+namespace Common {
+
+/** The names of the stages, as used in the JSON output. */
+static const char *kStageNames[kStatsStageMAX] = {
+	"open_archive",
+	"unpack",
+	"load_tot",
+	"create_vgm",
+	"render",
+	"convert",
+	"write_vgm"
+};
+
+/** The stats of all stages of one resource. */
+struct ResourceStats {
+	std::string name;
+
+	StageStats stages[kStatsStageMAX];
+
+	bool hasAudio;    ///< Was audio rendered for the resource?
+	AudioStats audio; ///< The levels of the audio.
+
+	bool hasTrim;   ///< Was silence trimmed off the resource's song?
+	TrimStats trim; ///< The silence trimmed off.
+
+	ResourceStats();
+};
+
+static bool _statsEnabled = false;
+
+/** Guards the stats, which get recorded by all threads. */
+static Mutex _statsMutex;
+
+static StageStats _totals[kStatsStageMAX];
+
+static CrawlCostStats _crawlCost;
+
+/** All resources, in the order they were first seen. */
+static std::vector<ResourceStats> _resources;
+static std::map<std::string, size_t> _resourceIndices;
+
+static const size_t kNoResource = (size_t) -1;
+
+/** The index of the innermost active resource of each thread. */
+static THREAD_LOCAL size_t _currentResource = kNoResource;
+
+
+ResourceStats::ResourceStats() : hasAudio(false), hasTrim(false) {
+}
+
+
+AudioStats::AudioStats() : peak(0.0), rms(0.0), loudness(0.0), gain(0.0) {
+}
+
+
+TrimStats::TrimStats() : start(0.0), end(0.0) {
+}
+
+
+CrawlCostStats::CrawlCostStats() : predicted(0), actual(0) {
+}
+
+
+StageStats::StageStats() : count(0), time(0), bytesIn(0), bytesOut(0), events(0), oplWrites(0) {
+}
+
+void StageStats::add(const StageStats &stats) {
+	count     += stats.count;
+	time      += stats.time;
+	bytesIn   += stats.bytesIn;
+	bytesOut  += stats.bytesOut;
+	events    += stats.events;
+	oplWrites += stats.oplWrites;
+}
+
+
+void enableStats() {
+	_statsEnabled = true;
+}
+
+bool isStatsEnabled() {
+	return _statsEnabled;
+}
+
+void recordStats(StatsStage stage, const StageStats &stats) {
+	if (!_statsEnabled || (stage >= kStatsStageMAX))
+		return;
+
+	ScopedLock lock(_statsMutex);
+
+	_totals[stage].add(stats);
+
+	if (_currentResource != kNoResource)
+		_resources[_currentResource].stages[stage].add(stats);
+}
+
+void recordAudioStats(const AudioStats &stats) {
+	if (!_statsEnabled || (_currentResource == kNoResource))
+		return;
+
+	ScopedLock lock(_statsMutex);
+
+	_resources[_currentResource].hasAudio = true;
+	_resources[_currentResource].audio    = stats;
+}
+
+void recordTrimStats(const TrimStats &stats) {
+	if (!_statsEnabled || (_currentResource == kNoResource))
+		return;
+
+	ScopedLock lock(_statsMutex);
+
+	_resources[_currentResource].hasTrim = true;
+	_resources[_currentResource].trim    = stats;
+}
+
+void recordCrawlCostStats(const CrawlCostStats &stats) {
+	if (!_statsEnabled)
+		return;
+
+	ScopedLock lock(_statsMutex);
+
+	_crawlCost.predicted += stats.predicted;
+	_crawlCost.actual    += stats.actual;
+}
+
+/** Write the stats of all stages that ran as a JSON object. */
+static void writeJSONStages(std::FILE *file, const StageStats *stages, const char *indent, const char *closeIndent) {
+	std::fputs("{", file);
+
+	bool first = true;
+	for (int i = 0; i < kStatsStageMAX; i++) {
+		if (stages[i].count == 0)
+			continue;
+
+		std::fprintf(file, "%s\n%s\"%s\": {\"count\": %llu, \"time_us\": %llu, \"bytes_in\": %llu, "
+		             "\"bytes_out\": %llu, \"events\": %llu, \"opl_writes\": %llu}",
+		             first ? "" : ",", indent, kStageNames[i],
+		             (unsigned long long) stages[i].count,   (unsigned long long) stages[i].time,
+		             (unsigned long long) stages[i].bytesIn, (unsigned long long) stages[i].bytesOut,
+		             (unsigned long long) stages[i].events,  (unsigned long long) stages[i].oplWrites);
+
+		first = false;
+	}
+
+	std::fprintf(file, "\n%s}", closeIndent);
+}
+
+void writeStatsJSON(std::FILE *file) {
+	ScopedLock lock(_statsMutex);
+
+	std::fputs("{\n\t\"totals\": ", file);
+	writeJSONStages(file, _totals, "\t\t", "\t");
+
+	if ((_crawlCost.predicted > 0) || (_crawlCost.actual > 0))
+		std::fprintf(file, ",\n\t\"crawl_cost\": {\"predicted_us\": %llu, \"actual_us\": %llu}",
+		             (unsigned long long) _crawlCost.predicted, (unsigned long long) _crawlCost.actual);
+
+	std::fputs(",\n\t\"resources\": [", file);
+
+	for (std::vector<ResourceStats>::const_iterator r = _resources.begin(); r != _resources.end(); ++r) {
+		std::fprintf(file, "%s\n\t\t{\"name\": ", (r == _resources.begin()) ? "" : ",");
+		std::fputs(quoteJSON(r->name).c_str(), file);
+
+		std::fputs(", \"stages\": ", file);
+		writeJSONStages(file, r->stages, "\t\t\t", "\t\t");
+
+		if (r->hasAudio)
+			std::fprintf(file, ", \"audio\": {\"peak_dbfs\": %.2f, \"rms_dbfs\": %.2f, "
+			             "\"loudness_lufs\": %.2f, \"gain_db\": %.2f}",
+			             r->audio.peak, r->audio.rms, r->audio.loudness, r->audio.gain);
+
+		if (r->hasTrim)
+			std::fprintf(file, ", \"trim\": {\"start_s\": %.3f, \"end_s\": %.3f}", r->trim.start, r->trim.end);
+
+		std::fputs("}", file);
+	}
+
+	std::fputs("\n\t]\n}\n", file);
+}
+
+
+/** Skip whitespace and return the next character of the JSON, without taking it. */
+static int peekJSON(std::FILE *file) {
+	int c;
+	while (((c = std::getc(file)) != EOF) && std::isspace(c))
+		;
+
+	std::ungetc(c, file);
+	return c;
+}
+
+static void readJSONChar(std::FILE *file, char expected) {
+	if (peekJSON(file) != expected)
+		throw Exception("Invalid stats JSON: Expected '%c'", expected);
+
+	std::getc(file);
+}
+
+static std::string readJSONString(std::FILE *file) {
+	readJSONChar(file, '"');
+
+	std::string str;
+
+	int c;
+	while ((c = std::getc(file)) != '"') {
+		if (c == EOF)
+			throw Exception("Invalid stats JSON: Unterminated string");
+
+		if (c == '\\') {
+			c = std::getc(file);
+
+			if      (c == 'n')
+				c = '\n';
+			else if (c == 't')
+				c = '\t';
+			else if (c == 'r')
+				c = '\r';
+			else if (c == 'u') {
+				char hex[5] = { 0, 0, 0, 0, 0 };
+				for (int i = 0; i < 4; i++)
+					hex[i] = std::getc(file);
+
+				c = (int) std::strtoul(hex, 0, 16);
+			} else if (c == EOF)
+				throw Exception("Invalid stats JSON: Unterminated string");
+		}
+
+		str += (char) c;
+	}
+
+	return str;
+}
+
+static uint64 readJSONNumber(std::FILE *file) {
+	if (!std::isdigit(peekJSON(file)))
+		throw Exception("Invalid stats JSON: Expected a number");
+
+	uint64 number = 0;
+
+	int c;
+	while (((c = std::getc(file)) != EOF) && std::isdigit(c))
+		number = number * 10 + (c - '0');
+
+	std::ungetc(c, file);
+	return number;
+}
+
+static double readJSONReal(std::FILE *file) {
+	std::string number;
+
+	int c = peekJSON(file);
+	while ((c != EOF) && (std::isdigit(c) || (c == '-') || (c == '+') || (c == '.') || (c == 'e') || (c == 'E'))) {
+		number += (char) std::getc(file);
+
+		c = std::getc(file);
+		std::ungetc(c, file);
+	}
+
+	char *end = 0;
+	const double value = std::strtod(number.c_str(), &end);
+
+	if (number.empty() || (*end != '\0'))
+		throw Exception("Invalid stats JSON: Expected a number");
+
+	return value;
+}
+
+/** Start reading an object or array, returning false if it's empty. */
+static bool beginJSONList(std::FILE *file, char open, char close) {
+	readJSONChar(file, open);
+
+	if (peekJSON(file) != close)
+		return true;
+
+	std::getc(file);
+	return false;
+}
+
+/** Go on to the next member of an object or array, returning false at its end. */
+static bool nextJSONListItem(std::FILE *file, char close) {
+	const int c = peekJSON(file);
+	if ((c != ',') && (c != close))
+		throw Exception("Invalid stats JSON: Expected ',' or '%c'", close);
+
+	std::getc(file);
+	return c == ',';
+}
+
+/** Read the stats of all stages in a JSON object, as written by writeJSONStages(). */
+static void readJSONStages(std::FILE *file, StageStats *stages) {
+	if (!beginJSONList(file, '{', '}'))
+		return;
+
+	do {
+		const std::string name = readJSONString(file);
+		readJSONChar(file, ':');
+
+		StageStats stats;
+
+		if (beginJSONList(file, '{', '}')) {
+			do {
+				const std::string counter = readJSONString(file);
+				readJSONChar(file, ':');
+
+				const uint64 value = readJSONNumber(file);
+
+				if      (counter == "count")
+					stats.count     = value;
+				else if (counter == "time_us")
+					stats.time      = value;
+				else if (counter == "bytes_in")
+					stats.bytesIn   = value;
+				else if (counter == "bytes_out")
+					stats.bytesOut  = value;
+				else if (counter == "events")
+					stats.events    = value;
+				else if (counter == "opl_writes")
+					stats.oplWrites = value;
+
+			} while (nextJSONListItem(file, '}'));
+		}
+
+		for (int i = 0; i < kStatsStageMAX; i++)
+			if (name == kStageNames[i])
+				stages[i].add(stats);
+
+	} while (nextJSONListItem(file, '}'));
+}
+
+/** Read the levels of audio in a JSON object, as written by writeStatsJSON(). */
+static void readJSONAudio(std::FILE *file, AudioStats &audio) {
+	if (!beginJSONList(file, '{', '}'))
+		return;
+
+	do {
+		const std::string level = readJSONString(file);
+		readJSONChar(file, ':');
+
+		const double value = readJSONReal(file);
+
+		if      (level == "peak_dbfs")
+			audio.peak     = value;
+		else if (level == "rms_dbfs")
+			audio.rms      = value;
+		else if (level == "loudness_lufs")
+			audio.loudness = value;
+		else if (level == "gain_db")
+			audio.gain     = value;
+
+	} while (nextJSONListItem(file, '}'));
+}
+
+/** Read the silence trimmed off a song in a JSON object, as written by writeStatsJSON(). */
+static void readJSONTrim(std::FILE *file, TrimStats &trim) {
+	if (!beginJSONList(file, '{', '}'))
+		return;
+
+	do {
+		const std::string end = readJSONString(file);
+		readJSONChar(file, ':');
+
+		const double value = readJSONReal(file);
+
+		if      (end == "start_s")
+			trim.start = value;
+		else if (end == "end_s")
+			trim.end   = value;
+
+	} while (nextJSONListItem(file, '}'));
+}
+
+/** Read the predicted and actual time of a crawl in a JSON object, as written by writeStatsJSON(). */
+static void readJSONCrawlCost(std::FILE *file, CrawlCostStats &cost) {
+	if (!beginJSONList(file, '{', '}'))
+		return;
+
+	do {
+		const std::string time = readJSONString(file);
+		readJSONChar(file, ':');
+
+		const uint64 value = readJSONNumber(file);
+
+		if      (time == "predicted_us")
+			cost.predicted += value;
+		else if (time == "actual_us")
+			cost.actual    += value;
+
+	} while (nextJSONListItem(file, '}'));
+}
+
+/** Return the index of the resource of that name, adding it if it's new. */
+static size_t findResource(const std::string &name) {
+	std::map<std::string, size_t>::iterator index = _resourceIndices.find(name);
+	if (index == _resourceIndices.end()) {
+		index = _resourceIndices.insert(std::make_pair(name, _resources.size())).first;
+
+		_resources.push_back(ResourceStats());
+		_resources.back().name = name;
+	}
+
+	return index->second;
+}
+
+void readStatsJSON(std::FILE *file) {
+	ScopedLock lock(_statsMutex);
+
+	if (!beginJSONList(file, '{', '}'))
+		return;
+
+	do {
+		const std::string key = readJSONString(file);
+		readJSONChar(file, ':');
+
+		if (key == "totals") {
+			readJSONStages(file, _totals);
+
+		} else if (key == "crawl_cost") {
+			readJSONCrawlCost(file, _crawlCost);
+
+		} else if (key == "resources") {
+			if (!beginJSONList(file, '[', ']'))
+				continue;
+
+			do {
+				std::string name;
+				StageStats stages[kStatsStageMAX];
+
+				bool hasAudio = false;
+				AudioStats audio;
+
+				bool hasTrim = false;
+				TrimStats trim;
+
+				if (beginJSONList(file, '{', '}')) {
+					do {
+						const std::string member = readJSONString(file);
+						readJSONChar(file, ':');
+
+						if      (member == "name")
+							name = readJSONString(file);
+						else if (member == "stages")
+							readJSONStages(file, stages);
+						else if (member == "audio") {
+							readJSONAudio(file, audio);
+							hasAudio = true;
+						} else if (member == "trim") {
+							readJSONTrim(file, trim);
+							hasTrim = true;
+						} else
+							throw Exception("Invalid stats JSON: Unknown resource member \"%s\"", member.c_str());
+
+					} while (nextJSONListItem(file, '}'));
+				}
+
+				ResourceStats &resource = _resources[findResource(name)];
+				for (int i = 0; i < kStatsStageMAX; i++)
+					resource.stages[i].add(stages[i]);
+
+				if (hasAudio) {
+					resource.hasAudio = true;
+					resource.audio    = audio;
+				}
+
+				if (hasTrim) {
+					resource.hasTrim = true;
+					resource.trim    = trim;
+				}
+
+			} while (nextJSONListItem(file, ']'));
+
+		} else
+			throw Exception("Invalid stats JSON: Unknown member \"%s\"", key.c_str());
+
+	} while (nextJSONListItem(file, '}'));
+}
+
+
+StatsResource::StatsResource(const std::string &name) : _enabled(_statsEnabled || isTraceEnabled()),
+	_previous(_currentResource) {
+
+	if (!_enabled)
+		return;
+
+	ScopedLock lock(_statsMutex);
+
+	_currentResource = findResource(name);
+}
+
+StatsResource::~StatsResource() {
+	if (_enabled)
+		_currentResource = _previous;
+}
+
+
+StatsTimer::StatsTimer(StatsStage stage) : _stage(stage), _start(0), _enabled(_statsEnabled || isTraceEnabled()) {
+	if (_enabled)
+		_start = getMicroseconds();
+}
+
+StatsTimer::~StatsTimer() {
+	if (!_enabled)
+		return;
+
+	_stats.count = 1;
+	_stats.time  = getMicroseconds() - _start;
+
+	recordStats(_stage, _stats);
+
+	if (isTraceEnabled()) {
+		std::string resource;
+
+		if (_currentResource != kNoResource) {
+			ScopedLock lock(_statsMutex);
+
+			resource = _resources[_currentResource].name;
+		}
+
+		traceSpan(kStageNames[_stage], resource, _start, _stats.time, _stats.bytesIn, _stats.bytesOut);
+	}
+}
+
+void StatsTimer::setBytes(uint64 bytesIn, uint64 bytesOut) {
+	_stats.bytesIn  = bytesIn;
+	_stats.bytesOut = bytesOut;
+}
+
+void StatsTimer::setEvents(uint64 events, uint64 oplWrites) {
+	_stats.events    = events;
+	_stats.oplWrites = oplWrites;
+}
+
+} // End of namespace Common
@@ -0,0 +1,150 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file common/stats.hpp
+ *  Timing and counters of the conversion stages.
+ */
+
+#ifndef COMMON_STATS_HPP
+#define COMMON_STATS_HPP
+
+#include <cstdio>
+
+#include <string>
+
+#include "common/types.hpp"
+#include "common/noncopyable.hpp"
+
+namespace Common {
+
+/** The measured stages of a conversion. */
+enum StatsStage {
+	kStatsStageOpenArchive = 0, ///< Reading the index of an archive.
+	kStatsStageUnpack         , ///< Unpacking compressed data.
+	kStatsStageLoadTOT        , ///< Loading a TOT file and its resource tables.
+	kStatsStageCreateVGM      , ///< Playing the music into VGM data.
+	kStatsStageRender         , ///< Playing the music through an emulated OPL into PCM audio.
+	kStatsStageConvert        , ///< A whole conversion, including writing the VGM.
+	kStatsStageWriteVGM       , ///< Writing a VGM file, or another output file.
+	kStatsStageMAX
+};
+
+/** The measurements of one stage. */
+struct StageStats {
+	uint64 count;     ///< Number of times the stage ran.
+	uint64 time;      ///< Wall time spent in the stage, in microseconds.
+	uint64 bytesIn;   ///< Number of bytes read.
+	uint64 bytesOut;  ///< Number of bytes produced.
+	uint64 events;    ///< Number of music events played.
+	uint64 oplWrites; ///< Number of OPL register writes.
+
+	StageStats();
+
+	void add(const StageStats &stats);
+};
+
+/** The levels of rendered audio. */
+struct AudioStats {
+	double peak;     ///< Sample peak, in dBFS.
+	double rms;      ///< RMS level, in dBFS.
+	double loudness; ///< EBU R128 integrated loudness, in LUFS.
+	double gain;     ///< Gain applied after measuring, in dB.
+
+	AudioStats();
+};
+
+/** The silence trimmed off the start and the end of a song. */
+struct TrimStats {
+	double start; ///< Silence trimmed off the start, in seconds.
+	double end;   ///< Silence trimmed off the end, in seconds.
+
+	TrimStats();
+};
+
+/** How long a crawl was predicted to take, against how long it actually took. */
+struct CrawlCostStats {
+	uint64 predicted; ///< Predicted time of all crawled items, in microseconds.
+	uint64 actual;    ///< Time all crawled items actually took, in microseconds.
+
+	CrawlCostStats();
+};
+
+/** Start collecting stats. Unless enabled, measuring costs next to nothing. */
+void enableStats();
+/** Are stats being collected? */
+bool isStatsEnabled();
+
+/** Record one run of a stage, for the current resource and the totals. */
+void recordStats(StatsStage stage, const StageStats &stats);
+
+/** Record the levels of the audio rendered for the current resource. */
+void recordAudioStats(const AudioStats &stats);
+
+/** Record the silence trimmed off the song of the current resource. */
+void recordTrimStats(const TrimStats &stats);
+
+/** Record the predicted and actual time of a crawl, adding to the totals. */
+void recordCrawlCostStats(const CrawlCostStats &stats);
+
+/** Write the totals and the per-resource breakdown of all stats as JSON. */
+void writeStatsJSON(std::FILE *file);
+/** Read stats written by writeStatsJSON(), and add them to the current stats.
+ *
+ *  This lets the stats of several runs, like the shards of a crawl, be merged.
+ */
+void readStatsJSON(std::FILE *file);
+
+/** Attribute all stages measured while this object exists to a resource.
+ *
+ *  Resources can be nested; a stage is attributed to the innermost one of
+ *  the thread it ran in. Stages are also written as trace events, when a
+ *  trace is open.
+ */
+class StatsResource : public NonCopyable {
+public:
+	StatsResource(const std::string &name);
+	~StatsResource();
+
+private:
+	bool _enabled;
+
+	size_t _previous; ///< The resource that was active before.
+};
+
+/** Measure the wall time of a stage while this object exists. */
+class StatsTimer : public NonCopyable {
+public:
+	StatsTimer(StatsStage stage);
+	~StatsTimer();
+
+	void setBytes(uint64 bytesIn, uint64 bytesOut);
+	void setEvents(uint64 events, uint64 oplWrites);
+
+private:
+	StatsStage _stage;
+	StageStats _stats;
+
+	uint64 _start;
+	bool _enabled;
+};
+
+} // End of namespace Common
+
+#endif // COMMON_STATS_HPP
@@ -0,0 +1,84 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file common/strutil.cpp
+ *  Utility functions for working with text lines and strings.
+ */
+
+#include "common/strutil.hpp"
+
+namespace Common {
+
+bool readLine(std::FILE *file, std::string &line) {
+	line.clear();
+
+	char buf[1024];
+	while (std::fgets(buf, sizeof(buf), file)) {
+		line += buf;
+
+		if (!line.empty() && (*line.rbegin() == '\n'))
+			break;
+	}
+
+	if (line.empty())
+		return false;
+
+	while (!line.empty() && ((*line.rbegin() == '\n') || (*line.rbegin() == '\r')))
+		line.erase(--line.end());
+
+	return true;
+}
+
+void splitFields(const std::string &line, std::vector<std::string> &fields) {
+	fields.clear();
+
+	size_t start = 0;
+	while (start <= line.size()) {
+		size_t end = line.find('\t', start);
+		if (end == std::string::npos)
+			end = line.size();
+
+		if (end > start)
+			fields.push_back(std::string(line, start, end - start));
+
+		start = end + 1;
+	}
+}
+
+std::string quoteJSON(const std::string &str) {
+	std::string json = "\"";
+
+	for (std::string::const_iterator c = str.begin(); c != str.end(); ++c) {
+		if      (*c == '"')
+			json += "\\\"";
+		else if (*c == '\\')
+			json += "\\\\";
+		else if ((unsigned char) *c < 0x20) {
+			char buf[8];
+			std::snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char) *c);
+			json += buf;
+		} else
+			json += *c;
+	}
+
+	return json + "\"";
+}
+
+} // End of namespace Common
@@ -0,0 +1,49 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file common/strutil.hpp
+ *  Utility functions for working with text lines and strings.
+ */
+
+#ifndef COMMON_STRUTIL_HPP
+#define COMMON_STRUTIL_HPP
+
+#include <cstdio>
+
+#include <string>
+#include <vector>
+
+namespace Common {
+
+/** Read one line from a stdio file, without the line ending.
+ *
+ *  @return false if the end of the file was reached before reading anything.
+ */
+bool readLine(std::FILE *file, std::string &line);
+
+/** Split a line into its fields separated by tabs. Empty fields are skipped. */
+void splitFields(const std::string &line, std::vector<std::string> &fields);
+
+/** Return a string as a quoted JSON string literal. */
+std::string quoteJSON(const std::string &str);
+
+} // End of namespace Common
+
+#endif // COMMON_STRUTIL_HPP
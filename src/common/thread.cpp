@@ -0,0 +1,128 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file common/thread.cpp
+ *  Threads and their synchronization.
+ */
+
+#include <cstring>
+
+#include <unistd.h>
+
+#include "common/error.hpp"
+#include "common/thread.hpp"
+
+namespace Common {
+
+Mutex::Mutex() {
+	pthread_mutex_init(&_mutex, 0);
+}
+
+Mutex::~Mutex() {
+	pthread_mutex_destroy(&_mutex);
+}
+
+void Mutex::lock() {
+	pthread_mutex_lock(&_mutex);
+}
+
+void Mutex::unlock() {
+	pthread_mutex_unlock(&_mutex);
+}
+
+
+ScopedLock::ScopedLock(Mutex &mutex) : _mutex(&mutex) {
+	_mutex->lock();
+}
+
+ScopedLock::~ScopedLock() {
+	_mutex->unlock();
+}
+
+
+Condition::Condition(Mutex &mutex) : _mutex(&mutex) {
+	pthread_cond_init(&_condition, 0);
+}
+
+Condition::~Condition() {
+	pthread_cond_destroy(&_condition);
+}
+
+void Condition::wait() {
+	pthread_cond_wait(&_condition, &_mutex->_mutex);
+}
+
+void Condition::signal() {
+	pthread_cond_signal(&_condition);
+}
+
+void Condition::broadcast() {
+	pthread_cond_broadcast(&_condition);
+}
+
+
+Thread::Thread() : _running(false) {
+}
+
+Thread::~Thread() {
+	join();
+}
+
+void Thread::start() {
+	if (_running)
+		throw Exception("Thread is already running");
+
+	int result = pthread_create(&_thread, 0, &threadMain, this);
+	if (result != 0)
+		throw Exception("Failed to create thread: %s", strerror(result));
+
+	_running = true;
+}
+
+void Thread::join() {
+	if (!_running)
+		return;
+
+	pthread_join(_thread, 0);
+	_running = false;
+}
+
+bool Thread::isRunning() const {
+	return _running;
+}
+
+void *Thread::threadMain(void *thread) {
+	static_cast<Thread *>(thread)->run();
+
+	return 0;
+}
+
+
+uint getCPUCount() {
+#if defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (count > 0)
+		return (uint) count;
+#endif
+
+	return 1;
+}
+
+} // End of namespace Common
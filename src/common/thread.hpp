@@ -0,0 +1,117 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file common/thread.hpp
+ *  Threads and their synchronization.
+ */
+
+#ifndef COMMON_THREAD_HPP
+#define COMMON_THREAD_HPP
+
+#include <pthread.h>
+
+#include "common/types.hpp"
+#include "common/noncopyable.hpp"
+
+#if defined(_MSC_VER)
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
+namespace Common {
+
+class Condition;
+
+/** A mutual exclusion lock. */
+class Mutex : public NonCopyable {
+public:
+	Mutex();
+	~Mutex();
+
+	void lock();
+	void unlock();
+
+private:
+	pthread_mutex_t _mutex;
+
+	friend class Condition;
+};
+
+/** Hold a mutex locked while this object exists. */
+class ScopedLock : public NonCopyable {
+public:
+	ScopedLock(Mutex &mutex);
+	~ScopedLock();
+
+private:
+	Mutex *_mutex;
+};
+
+/** A condition variable, waited on with its mutex locked. */
+class Condition : public NonCopyable {
+public:
+	Condition(Mutex &mutex);
+	~Condition();
+
+	/** Unlock the mutex, wait to be signaled and lock the mutex again. */
+	void wait();
+
+	/** Wake up one waiting thread. */
+	void signal();
+	/** Wake up all waiting threads. */
+	void broadcast();
+
+private:
+	Mutex *_mutex;
+
+	pthread_cond_t _condition;
+};
+
+/** A thread running the run() method of a subclass. */
+class Thread : public NonCopyable {
+public:
+	Thread();
+	virtual ~Thread();
+
+	/** Start running the thread. */
+	void start();
+	/** Wait for the thread to finish. */
+	void join();
+
+	bool isRunning() const;
+
+protected:
+	virtual void run() = 0;
+
+private:
+	pthread_t _thread;
+
+	bool _running;
+
+	static void *threadMain(void *thread);
+};
+
+/** Return the number of processors currently online, at least 1. */
+uint getCPUCount();
+
+} // End of namespace Common
+
+#endif // COMMON_THREAD_HPP
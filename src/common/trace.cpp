@@ -0,0 +1,114 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/** @file common/trace.cpp
+ *  Writing Chrome trace events of the conversion stages.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+
+#if defined(__linux__)
+	#include <sys/syscall.h>
+#endif
+
+#include "common/util.hpp"
+#include "common/error.hpp"
+#include "common/strutil.hpp"
+#include "common/trace.hpp"
+#include "common/thread.hpp"
+
+namespace Common {
+
+static std::FILE *_traceFile  = 0;
+static uint64     _traceStart = 0;
+static bool       _traceFirst = true;
+
+/** Guards the trace file, which gets written to by all threads. */
+static Mutex _traceMutex;
+
+/** Return an ID of the calling thread, as the trace viewer shows it. */
+static unsigned long getThreadID() {
+#if defined(__linux__) && defined(SYS_gettid)
+	return (unsigned long) syscall(SYS_gettid);
+#else
+	return 0;
+#endif
+}
+
+void openTrace(const std::string &traceFile) {
+	closeTrace();
+
+	ScopedLock lock(_traceMutex);
+
+	if (!(_traceFile = std::fopen(traceFile.c_str(), "w")))
+		throw Exception("Can't open trace file \"%s\": %s", traceFile.c_str(), strerror(errno));
+
+	_traceStart = getMicroseconds();
+	_traceFirst = true;
+
+	std::fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", _traceFile);
+}
+
+void closeTrace() {
+	ScopedLock lock(_traceMutex);
+
+	if (!_traceFile)
+		return;
+
+	std::fputs("\n]}\n", _traceFile);
+
+	const bool failed = std::ferror(_traceFile) != 0;
+	const bool closed = std::fclose(_traceFile) == 0;
+
+	_traceFile = 0;
+
+	if (failed || !closed)
+		throw Exception("Failed to write the trace file");
+}
+
+bool isTraceEnabled() {
+	return _traceFile != 0;
+}
+
+void traceSpan(const char *name, const std::string &resource, uint64 start, uint64 duration,
+               uint64 bytesIn, uint64 bytesOut) {
+
+	ScopedLock lock(_traceMutex);
+
+	if (!_traceFile)
+		return;
+
+	// Complete events, with both the start and the duration
+	std::fprintf(_traceFile, "%s\n{\"name\": \"%s\", \"cat\": \"adl2vgm\", \"ph\": \"X\", \"ts\": %llu, \"dur\": %llu, "
+	             "\"pid\": %lu, \"tid\": %lu, \"args\": {\"resource\": %s, \"bytes_in\": %llu, \"bytes_out\": %llu}}",
+	             _traceFirst ? "" : ",", name,
+	             (unsigned long long) ((start >= _traceStart) ? (start - _traceStart) : 0),
+	             (unsigned long long) duration, (unsigned long) getpid(), getThreadID(),
+	             quoteJSON(resource).c_str(), (unsigned long long) bytesIn, (unsigned long long) bytesOut);
+
+	_traceFirst = false;
+}
+
+} // End of namespace Common
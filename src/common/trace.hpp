@@ -0,0 +1,57 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/** @file common/trace.hpp
+ *  Writing Chrome trace events of the conversion stages.
+ */
+
+#ifndef COMMON_TRACE_HPP
+#define COMMON_TRACE_HPP
+
+#include <string>
+
+#include "common/types.hpp"
+
+namespace Common {
+
+/** Start writing trace events into this file, in the Chrome trace event format. */
+void openTrace(const std::string &traceFile);
+/** Finish the trace file. */
+void closeTrace();
+
+/** Are trace events being written? */
+bool isTraceEnabled();
+
+/** Write a span of time spent in something done to a resource.
+ *
+ *  @param name     The name of what was done.
+ *  @param resource The name of the resource it was done to, if any.
+ *  @param start    The start of the span, as returned by getMicroseconds().
+ *  @param duration The length of the span in microseconds.
+ *  @param bytesIn  Number of bytes read during the span.
+ *  @param bytesOut Number of bytes produced during the span.
+ */
+void traceSpan(const char *name, const std::string &resource, uint64 start, uint64 duration,
+               uint64 bytesIn, uint64 bytesOut);
+
+} // End of namespace Common
+
+#endif // COMMON_TRACE_HPP
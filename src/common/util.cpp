@@ -31,6 +31,9 @@
 #include <cstdio>
 #include <cstdlib>
 
+#include <time.h>
+#include <sys/time.h>
+
 void warning(const char *s, ...) {
 	char buf[STRINGBUFLEN];
 	va_list va;
@@ -89,3 +92,16 @@ int adl2vgm_stricmp(const char *s1, const char *s2) {
 	} while (l1 == l2 && l1 != 0);
 	return l1 - l2;
 }
+
+uint64 getMicroseconds() {
+#if defined(CLOCK_MONOTONIC)
+	struct timespec t;
+	if (clock_gettime(CLOCK_MONOTONIC, &t) == 0)
+		return ((uint64) t.tv_sec) * 1000000 + t.tv_nsec / 1000;
+#endif
+
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+
+	return ((uint64) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
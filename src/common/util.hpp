@@ -118,4 +118,7 @@ void NORETURN_PRE error(const char *s, ...) GCC_PRINTF(1, 2) NORETURN_POST;
 
 int adl2vgm_stricmp(const char *s1, const char *s2);
 
+/** Return the time in microseconds of a monotonic clock with an arbitrary start. */
+uint64 getMicroseconds();
+
 #endif // COMMON_UTIL_HPP
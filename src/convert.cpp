@@ -18,15 +18,38 @@
  * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstdio>
+
+#include <vector>
+#include <list>
+#include <set>
+#include <algorithm>
+#include <numeric>
+
 #include "common/util.hpp"
 #include "common/error.hpp"
+#include "common/stream.hpp"
+#include "common/file.hpp"
+#include "common/strutil.hpp"
+#include "common/stats.hpp"
+#include "common/thread.hpp"
+#include "common/boundedqueue.hpp"
+#include "common/sharedring.hpp"
 
 #include "adlib/adlplayer.hpp"
 #include "adlib/musplayer.hpp"
+#include "adlib/opl.hpp"
+#include "adlib/render.hpp"
+#include "adlib/segments.hpp"
+#include "adlib/stems.hpp"
+#include "adlib/resample.hpp"
+#include "adlib/loudness.hpp"
+#include "adlib/keyframes.hpp"
 
 #include "gob/gamedir.hpp"
 #include "gob/totfile.hpp"
 
+#include "crawlmanifest.hpp"
 #include "convert.hpp"
 
 /** Return the filename from a full path. */
@@ -38,6 +61,22 @@ static std::string findFilename(const std::string &path) {
 	return std::string(path, sep + 1);
 }
 
+/** Return the path of the file name within the target directory. */
+static std::string makeTargetPath(const std::string &target, const std::string &name) {
+	if (target.empty())
+		return name;
+
+	if ((*target.rbegin() == '/') || (*target.rbegin() == '\\'))
+		return target + name;
+
+	return target + "/" + name;
+}
+
+/** Return the default output file of a song, in the current working directory. */
+static std::string getOutputFile(const std::string &file, const ConvertOptions &options) {
+	return findFilename(file) + "." + options.getExtension();
+}
+
 static std::string changeExtension(const std::string &file, const std::string &ext) {
 	size_t sep = file.find_last_of('.');
 	if (sep == std::string::npos)
@@ -46,164 +85,1644 @@ static std::string changeExtension(const std::string &file, const std::string &e
 	return std::string(file, 0, sep) + "." + ext;
 }
 
-static void convertADL(Gob::GameDir &gameDir, const std::string &adlFile) {
-	status("Converting ADL \"%s\" to VGM...", adlFile.c_str());
+/** The output data buffer, reused by all conversions of this process. */
+static std::vector<byte> _vgmData;
 
-	Common::SeekableReadStream *adl = 0;
-	try {
-		adl = gameDir.getFile(adlFile);
 
-		AdLib::ADLPlayer adlPlayer(*adl);
+ConvertOptions::ConvertOptions() : incremental(false), profile(false), probe(false), format(kOutputVGM),
+	renderLanes(8), renderThreads(0), stems(false), sampleRate(0), gain(0.0), normalize(false), loudness(-16.0),
+	trimSilence(false), keyframeInterval(0), seekPosition(0), crawlQueueSize(4),
+	crawlMemoryLimit(0), shard(0), shardCount(0) {
 
-		adlPlayer.convert(adlFile + ".vgm");
+	for (int i = 0; i < kCrawlStageMAX; i++)
+		crawlThreads[i] = 0;
+}
 
-	} catch (Common::Exception &e) {
-		delete adl;
+bool ConvertOptions::writesFiles() const {
+	return !profile && !probe;
+}
 
-		throw;
+const char *ConvertOptions::getExtension() const {
+	switch (format) {
+		case kOutputWAV:
+			return "wav";
+		case kOutputPCM:
+			return "pcm";
+		default:
+			return "vgm";
 	}
 }
 
-static void convertADL(Gob::GameDir &gameDir) {
-	const std::list<std::string> &adl = gameDir.getADL();
-	for (std::list<std::string>::const_iterator f = adl.begin(); f != adl.end(); ++f) {
-		try {
-			convertADL(gameDir, *f);
-		} catch (Common::Exception &e) {
-			Common::printException(e, "WARNING: ");
-		}
+const char *ConvertOptions::getFormatName() const {
+	switch (format) {
+		case kOutputWAV:
+			return stems ? "WAV stems" : "WAV";
+		case kOutputPCM:
+			return "raw PCM";
+		default:
+			return "VGM";
 	}
 }
 
-static void convertTOTADL(const Gob::TOTFile &tot) {
-	for (uint i = 0; i < tot.getTOTResourceCount(); i++) {
-		char name[256];
-		snprintf(name, sizeof(name), "%s.tot.%u", tot.getName().c_str(), i);
+bool ConvertOptions::isSharded() const {
+	return shardCount > 1;
+}
 
-		status("Trying to convert ADL \"%s\" to VGM...", name);
+bool ConvertOptions::isPipelined() const {
+	for (int i = 0; i < kCrawlStageMAX; i++)
+		if (crawlThreads[i] > 0)
+			return true;
 
-		Common::SeekableReadStream *adl = 0;
-		try {
+	return false;
+}
 
-			adl = tot.getTOTResource(i);
 
-			AdLib::ADLPlayer adlPlayer(*adl);
+/** Guards stdout, which the analyses of all crawl threads print to. */
+static Common::Mutex _outputMutex;
 
-			adlPlayer.convert(std::string(name) + ".vgm");
+/** Print the profile of a song's OPL register writes as one line of JSON. */
+static void printProfile(const std::string &name, const AdLib::OPLProfile &profile) {
+	static const char *kRegisterClassNames[AdLib::kRegisterClassMAX] = {
+		"20", "40", "60", "80", "A0", "B0", "BD", "C0", "E0", "other"
+	};
+	static const char *kCommandNames[AdLib::kCommandMAX] = {
+		"other", "setup", "timbre", "volume", "pitch_bend", "note_on", "note_off", "global"
+	};
 
-		} catch (Common::Exception &e) {
-			delete adl;
-			adl = 0;
+	Common::ScopedLock lock(_outputMutex);
 
-			Common::printException(e, "WARNING: ");
-		}
+	std::printf("{\"name\": %s, \"seconds\": %.3f, \"events\": %u, \"writes\": %u, \"writes_per_second\": %.1f",
+	            Common::quoteJSON(name).c_str(), profile.rate ? ((double) profile.samples / profile.rate) : 0.0,
+	            profile.events, profile.writes, profile.getWritesPerSecond());
 
-		delete adl;
+	std::printf(", \"registers\": {");
+	for (int i = 0; i < AdLib::kRegisterClassMAX; i++)
+		std::printf("%s\"%s\": %u", (i == 0) ? "" : ", ", kRegisterClassNames[i], profile.registerWrites[i]);
+
+	std::printf("}, \"channels\": [");
+	for (int i = 0; i < AdLib::OPLProfile::kChannelCount; i++)
+		std::printf("%s%u", (i == 0) ? "" : ", ", profile.channelWrites[i]);
+
+	std::printf("], \"global\": %u, \"commands\": {", profile.globalWrites);
+	for (int i = 0; i < AdLib::kCommandMAX; i++)
+		std::printf("%s\"%s\": {\"count\": %u, \"writes\": %u}", (i == 0) ? "" : ", ",
+		            kCommandNames[i], profile.commands[i], profile.commandWrites[i]);
+
+	std::printf("}}\n");
+	std::fflush(stdout);
+}
+
+/** Print the information found by probing a song as one line of JSON. */
+static void printProbe(const std::string &name, const AdLib::SongInfo &info) {
+	const double seconds = info.rate ? ((double) info.samples / info.rate) : 0.0;
+
+	Common::ScopedLock lock(_outputMutex);
+
+	std::printf("{\"name\": %s, \"seconds\": %.3f, \"samples\": %u, \"events\": %u, \"instruments\": %u, "
+	            "\"percussion\": %s, \"voices_used\": %u, \"voice_notes\": [",
+	            Common::quoteJSON(name).c_str(), seconds, info.samples, info.events, info.instruments,
+	            info.percussion ? "true" : "false", info.getUsedVoiceCount());
+
+	for (int i = 0; i < AdLib::SongInfo::kVoiceCount; i++)
+		std::printf("%s%u", (i == 0) ? "" : ", ", info.voiceNotes[i]);
+
+	std::printf("]}\n");
+	std::fflush(stdout);
+}
+
+/** Run the analysis the options ask for instead of a conversion.
+ *
+ *  @return false if the options don't ask for an analysis.
+ */
+static bool analyzeSong(AdLib::AdLib &player, const std::string &name, const ConvertOptions &options) {
+	if (options.profile) {
+		AdLib::OPLProfile profile;
+
+		player.profile(profile);
+		printProfile(name, profile);
+		return true;
 	}
 
-	for (uint i = 0; i < tot.getEXTResourceCount(); i++) {
-		char name[256];
-		snprintf(name, sizeof(name), "%s.ext.%u", tot.getName().c_str(), i);
+	if (options.probe) {
+		AdLib::SongInfo info;
 
-		status("Trying to convert ADL \"%s\" to VGM...", name);
+		player.probe(info);
+		printProbe(name, info);
+		return true;
+	}
 
-		Common::SeekableReadStream *adl = 0;
-		try {
+	return false;
+}
+
+/** The stages rendered audio goes through, before it reaches the sink of its output format.
+ *
+ *  The audio is resampled, measured and amplified, as the options ask.
+ *  The levels are only measured when stats are collected, or when the
+ *  audio is normalized.
+ */
+class AudioChain {
+public:
+	AudioChain(AdLib::PCMSink &sink, const ConvertOptions &options) :
+		_options(&options),
+		_gain(sink, options.normalize ? 0.0 : options.gain),
+		_meter(_gain, Common::isStatsEnabled() || options.normalize),
+		_resampler(_meter, options.sampleRate) {
+	}
 
-			adl = tot.getEXTResource(i);
+	/** Return the sink the rendered audio goes into. */
+	AdLib::PCMSink &getSink() {
+		return _resampler;
+	}
 
-			AdLib::ADLPlayer adlPlayer(*adl);
+	/** Normalize a recording of the audio, if the options ask for it, and record the levels into the stats.
+	 *
+	 *  The recording is amplified to the loudness of the options, but never
+	 *  so far that its peak would clip.
+	 */
+	void finish(AdLib::WAVSink *recording = 0) {
+		if (!_meter.isEnabled())
+			return;
 
-			adlPlayer.convert(std::string(name) + ".vgm");
+		Common::AudioStats stats;
 
-		} catch (Common::Exception &e) {
-			delete adl;
-			adl = 0;
+		stats.peak     = _meter.getPeak();
+		stats.rms      = _meter.getRMS();
+		stats.loudness = _meter.getLoudness();
+		stats.gain     = _options->gain;
+
+		if (_options->normalize && recording) {
+			stats.gain = 0.0;
+			if (stats.loudness > AdLib::LoudnessSink::kAbsoluteGate)
+				stats.gain = MIN(_options->loudness - stats.loudness, -stats.peak);
 
-			Common::printException(e, "WARNING: ");
+			recording->amplify(stats.gain);
 		}
 
-		delete adl;
+		Common::recordAudioStats(stats);
+	}
+
+private:
+	const ConvertOptions *_options;
+
+	AdLib::GainSink     _gain;
+	AdLib::LoudnessSink _meter;
+	AdLib::ResampleSink _resampler;
+};
+
+/** Render a song into a PCM sink, in segments on several threads if asked to. */
+static void renderSong(AdLib::AdLib &player, AdLib::PCMSink &sink, const ConvertOptions &options,
+                       const AdLib::KeyframeIndex *keyframes, uint32 blockSize) {
+
+	// Segments start from the beginning of the song, seeking doesn't mix with them
+	if ((options.renderThreads > 1) && (options.seekPosition == 0)) {
+		AdLib::SegmentRenderer renderer(options.renderThreads);
+		renderer.render(player, sink);
+		return;
 	}
+
+	AdLib::BatchRenderer renderer(1, blockSize);
+	renderer.render(player, sink, options.seekPosition, keyframes);
 }
 
-static void convertMDY(Gob::GameDir &gameDir, const std::string &mdyFile, const std::string &tbrFile) {
-	status("Converting MDY \"%s\" with TBR \"%s\" to VGM...", mdyFile.c_str(), tbrFile.c_str());
+/** Render a song into a WAV file, written into a stream. */
+static void renderWAV(AdLib::AdLib &player, Common::WriteStream &wav, std::vector<byte> &wavData,
+                      const ConvertOptions &options, const AdLib::KeyframeIndex *keyframes) {
 
-	Common::SeekableReadStream *mdy = 0;
-	Common::SeekableReadStream *tbr = 0;
-	try {
-		mdy = gameDir.getFile(mdyFile);
-		tbr = gameDir.getFile(tbrFile);
+	Common::StatsTimer timer(Common::kStatsStageConvert);
+
+	AdLib::WAVSink sink(wavData);
+	AudioChain chain(sink, options);
+
+	renderSong(player, chain.getSink(), options, keyframes, AdLib::BatchRenderer::kBlockSize);
+
+	chain.finish(&sink);
+
+	sink.write(wav);
 
-		AdLib::MUSPlayer musPlayer(*mdy, *tbr);
+	if (!wav.flush() || wav.err())
+		throw Common::kWriteError;
 
-		musPlayer.convert(mdyFile + ".vgm");
+	timer.setBytes(0, sink.getFileSize());
+}
+
+/** Write a WAV file of a song that has been rendered into memory. */
+static void writeWAV(const std::string &wavFile, const AdLib::WAVSink &sink) {
+	Common::StatsTimer timer(Common::kStatsStageWriteVGM);
+
+	Common::DumpFile wav;
+	if (!wav.open(wavFile))
+		throw Common::Exception("Failed to open \"%s\" for writing", wavFile.c_str());
+
+	sink.write(wav);
+
+	wav.flush();
+	wav.close();
+
+	if (wav.err())
+		throw Common::kWriteError;
+
+	timer.setBytes(0, sink.getFileSize());
+}
+
+/** Number of samples rendered at once when streaming raw PCM.
+ *
+ *  At the OPL's rate, that's about 5ms of audio. The first block goes out
+ *  as soon as it's synthesized, and only one block is held in memory.
+ */
+static const uint32 kStreamBlockSize = 256;
+
+/** Render a song into raw PCM, streamed into a stream while the song plays. */
+static void streamPCM(AdLib::AdLib &player, Common::WriteStream &pcm, const ConvertOptions &options,
+                      const AdLib::KeyframeIndex *keyframes) {
+
+	Common::StatsTimer timer(Common::kStatsStageConvert);
+
+	AdLib::RawSink sink(pcm);
+	AudioChain chain(sink, options);
+
+	renderSong(player, chain.getSink(), options, keyframes, kStreamBlockSize);
+
+	chain.finish();
+
+	timer.setBytes(0, sink.getSize());
+}
+
+/** Render a song into raw PCM, streamed into a file, or stdout if the file is "-". */
+static void streamPCM(AdLib::AdLib &player, const std::string &pcmFile, const ConvertOptions &options,
+                      const AdLib::KeyframeIndex *keyframes) {
+
+	if (pcmFile == "-") {
+		Common::StdOutStream pcm;
+
+		streamPCM(player, pcm, options, keyframes);
+		return;
+	}
+
+	Common::DumpFile pcm;
+	if (!pcm.open(pcmFile))
+		throw Common::Exception("Failed to open \"%s\" for writing", pcmFile.c_str());
+
+	streamPCM(player, pcm, options, keyframes);
+
+	pcm.close();
+}
+
+/** Record the silence trimmed off a song that was converted into the stats, if it was trimmed. */
+static void recordTrim(const AdLib::AdLib &player, const ConvertOptions &options) {
+	if (!options.trimSilence)
+		return;
+
+	Common::TrimStats stats;
+
+	stats.start = ((double) player.getTrimmedStart()) / player.getSamplesPerSecond();
+	stats.end   = ((double) player.getTrimmedEnd  ()) / player.getSamplesPerSecond();
+
+	Common::recordTrimStats(stats);
+}
+
+/** Convert a song into a file of the output format, written into a stream.
+ *
+ *  If keyframes is given, a keyframe index of the song is recorded into it.
+ */
+static void convertSong(AdLib::AdLib &player, Common::WriteStream &out, std::vector<byte> &data,
+                        const ConvertOptions &options, AdLib::KeyframeIndex *keyframes) {
+
+	player.setKeyframes(keyframes);
+
+	try {
+		if      (options.format == kOutputWAV)
+			renderWAV(player, out, data, options, 0);
+		else if (options.format == kOutputPCM)
+			streamPCM(player, out, options, 0);
+		else
+			player.convert(out, data);
 
 	} catch (Common::Exception &e) {
-		delete mdy;
-		delete tbr;
+		player.setKeyframes(0);
+		throw;
+	}
+
+	player.setKeyframes(0);
+
+	recordTrim(player, options);
+}
+
+/** Return the file the keyframe index of a song is written into, next to its output file. */
+static std::string getKeyframeFile(const std::string &outFile) {
+	return outFile + ".keys";
+}
+
+/** Write the keyframe index of a song into a file. */
+static void writeKeyframes(const std::string &indexFile, const AdLib::KeyframeIndex &keyframes) {
+	Common::DumpFile index;
+	if (!index.open(indexFile))
+		throw Common::Exception("Failed to open \"%s\" for writing", indexFile.c_str());
+
+	keyframes.write(index);
+
+	index.flush();
+	index.close();
+
+	if (index.err())
+		throw Common::kWriteError;
+}
+
+/** Read the keyframe index of a song out of a file. */
+static void readKeyframes(const std::string &indexFile, AdLib::KeyframeIndex &keyframes) {
+	Common::File index;
+	if (!index.open(indexFile))
+		throw Common::Exception("Failed to open \"%s\"", indexFile.c_str());
 
+	try {
+		keyframes.read(index);
+	} catch (Common::Exception &e) {
+		e.add("Failed to read keyframe index \"%s\"", indexFile.c_str());
 		throw;
 	}
 }
 
-static void convertMDY(Gob::GameDir &gameDir) {
-	const std::list<std::string> &mdy = gameDir.getMDY();
-	for (std::list<std::string>::const_iterator f = mdy.begin(); f != mdy.end(); ++f) {
-		std::string tbr = changeExtension(*f, "tbr");
+/** The audio of one stem, amplified, resampled and recorded into memory. */
+struct StemAudio {
+	std::vector<byte> data;
 
-		try {
-			convertMDY(gameDir, *f, tbr);
-		} catch (Common::Exception &e) {
-			Common::printException(e, "WARNING: ");
+	AdLib::WAVSink      sink;
+	AdLib::GainSink     gain;
+	AdLib::ResampleSink resampler;
+
+	StemAudio(const ConvertOptions &options) : sink(data), gain(sink, options.gain),
+		resampler(gain, options.sampleRate) {
+	}
+};
+
+/** Return the WAV file a stem of a song is written into, named after the song's WAV file. */
+static std::string getStemFile(const std::string &wavFile, uint stem) {
+	std::string base = wavFile;
+	if ((base.size() > 4) && (base.compare(base.size() - 4, 4, ".wav") == 0))
+		base.erase(base.size() - 4);
+
+	return base + "." + AdLib::StemRenderer::getStemName(stem) + ".wav";
+}
+
+/** Render each voice of a song into a WAV file of its own. */
+static void renderStems(AdLib::AdLib &player, const std::string &wavFile, const ConvertOptions &options) {
+	Common::StatsTimer timer(Common::kStatsStageConvert);
+
+	std::vector<StemAudio *> stems(AdLib::StemRenderer::kStemCount);
+	std::vector<AdLib::PCMSink *> sinks(AdLib::StemRenderer::kStemCount);
+
+	for (uint i = 0; i < stems.size(); i++) {
+		stems[i] = new StemAudio(options);
+		sinks[i] = &stems[i]->resampler;
+	}
+
+	uint64 size = 0;
+
+	try {
+		AdLib::StemRenderer renderer(options.renderThreads);
+		renderer.render(player, &sinks[0]);
+
+		for (uint i = 0; i < stems.size(); i++) {
+			writeWAV(getStemFile(wavFile, i), stems[i]->sink);
+
+			size += stems[i]->sink.getFileSize();
 		}
+
+	} catch (Common::Exception &e) {
+		for (uint i = 0; i < stems.size(); i++)
+			delete stems[i];
+
+		throw;
 	}
+
+	for (uint i = 0; i < stems.size(); i++)
+		delete stems[i];
+
+	timer.setBytes(0, size);
 }
 
+/** Convert a song into the output format, written into a ring buffer in shared memory.
+ *
+ *  The ring buffer is only removed again once the reading process has
+ *  read all of it.
+ */
+static void shareSong(AdLib::AdLib &player, const ConvertOptions &options, const AdLib::KeyframeIndex *keyframes) {
+	const char *format = "VGM ";
+	uint32 rate = 0;
 
-/** Convert an ADL file into VGM. */
-void convertADL(const std::string &adlFile) {
-	status("Converting ADL \"%s\" to VGM...", adlFile.c_str());
+	if (options.format == kOutputWAV)
+		format = "WAV ";
 
-	// Open the input file
-	Common::File adl(adlFile);
-	AdLib::ADLPlayer adlPlayer(adl);
+	if (options.format == kOutputPCM) {
+		format = "PCM ";
+		rate   = (options.sampleRate > 0) ? options.sampleRate : (uint32) AdLib::OPL::kRate;
+	}
+
+	Common::SharedRing ring(options.sharedRing, format, rate);
 
-	adlPlayer.convert(findFilename(adlFile) + ".vgm");
+	if      (options.format == kOutputWAV)
+		renderWAV(player, ring, _vgmData, options, keyframes);
+	else if (options.format == kOutputPCM)
+		streamPCM(player, ring, options, keyframes);
+	else
+		player.convert(ring, _vgmData);
+
+	ring.finalize();
+	if (ring.err())
+		throw Common::Exception("Reader of shared memory \"%s\" stopped reading early", ring.getName().c_str());
 }
 
-/** Convert a MDY+TBR file into VGM. */
-void convertMDY(const std::string &mdyFile, const std::string &tbrFile) {
-	status("Converting MDY \"%s\" with TBR \"%s\" to VGM...", mdyFile.c_str(), tbrFile.c_str());
+/** Convert a song into a file of the output format, written into a file. */
+static void convertSong(AdLib::AdLib &player, const std::string &outFile, const ConvertOptions &options,
+                        const AdLib::KeyframeIndex *keyframes) {
 
-	// Open the input files
-	Common::File mdy(mdyFile);
-	Common::File tbr(tbrFile);
-	AdLib::MUSPlayer musPlayer(mdy, tbr);
+	if (!options.sharedRing.empty()) {
+		shareSong(player, options, keyframes);
+		return;
+	}
+
+	if (options.format == kOutputPCM) {
+		streamPCM(player, outFile, options, keyframes);
+		return;
+	}
+
+	if (options.format != kOutputWAV) {
+		player.convert(outFile, _vgmData);
+		return;
+	}
+
+	if (options.stems) {
+		renderStems(player, outFile, options);
+		return;
+	}
 
-	musPlayer.convert(findFilename(mdyFile) + ".vgm");
+	Common::StatsTimer timer(Common::kStatsStageConvert);
+
+	AdLib::WAVSink sink(_vgmData);
+	AudioChain chain(sink, options);
+
+	renderSong(player, chain.getSink(), options, keyframes, AdLib::BatchRenderer::kBlockSize);
+
+	chain.finish(&sink);
+
+	writeWAV(outFile, sink);
+
+	timer.setBytes(0, sink.getFileSize());
 }
 
-void crawlDirectory(const std::string &directory) {
-	status("Crawling through game directory \"%s\"", directory.c_str());
+/** Convert a song into a file of the output format, or only analyze it.
+ *
+ *  Depending on the options, a keyframe index of the song is recorded
+ *  alongside, or the song is rendered from a position on, seeking there
+ *  with a keyframe index read before.
+ */
+static void convertSong(AdLib::AdLib &player, const std::string &name, const std::string &outFile,
+                        const ConvertOptions &options) {
 
-	Gob::GameDir gameDir(directory);
+	player.setLimits(options.limits);
+	player.setTrimSilence(options.trimSilence);
 
-	convertADL(gameDir);
-	convertMDY(gameDir);
+	if (analyzeSong(player, name, options))
+		return;
 
-	const std::list<std::string> &tot = gameDir.getTOT();
-	for (std::list<std::string>::const_iterator f = tot.begin(); f != tot.end(); ++f) {
-		status("Loading TOT \"%s\"", f->c_str());
+	AdLib::KeyframeIndex seekIndex;
+	if ((options.seekPosition > 0) && !options.seekIndex.empty())
+		readKeyframes(options.seekIndex, seekIndex);
 
-		try {
-			Gob::TOTFile totFile(gameDir, *f);
+	const bool recordKeyframes = (options.keyframeInterval > 0) && (outFile != "-");
 
-			convertTOTADL(totFile);
+	AdLib::KeyframeIndex keyframes(MAX<uint32>(options.keyframeInterval, 1));
+	if (recordKeyframes)
+		player.setKeyframes(&keyframes);
 
-		} catch (Common::Exception &e) {
-			Common::printException(e, "WARNING: ");
+	try {
+		convertSong(player, outFile, options, options.seekIndex.empty() ? 0 : &seekIndex);
+	} catch (Common::Exception &e) {
+		player.setKeyframes(0);
+		throw;
+	}
+
+	player.setKeyframes(0);
+
+	recordTrim(player, options);
+
+	if (recordKeyframes)
+		writeKeyframes(getKeyframeFile(outFile), keyframes);
+}
+
+
+/** Write VGM data that has been converted into memory into a file. */
+static void writeVGM(const std::string &vgmFile, Common::MemoryWriteStreamDynamic &vgmData) {
+	Common::StatsTimer timer(Common::kStatsStageWriteVGM);
+
+	Common::DumpFile vgm;
+	if (!vgm.open(vgmFile))
+		throw Common::Exception("Failed to open \"%s\" for writing", vgmFile.c_str());
+
+	vgm.write(vgmData.getData(), vgmData.size());
+
+	vgm.flush();
+	vgm.close();
+
+	if (vgm.err())
+		throw Common::kWriteError;
+
+	timer.setBytes(0, vgmData.size());
+}
+
+/** Convert one resource of a TOT into VGM data in memory, or only analyze it.
+ *
+ *  If keyframes is given, a keyframe index of the song is recorded into it.
+ *
+ *  @return false if the resource isn't ADL music, or nothing was converted.
+ */
+static bool convertTOTADL(const Gob::GameDir &gameDir, const Gob::TOTFile &tot, bool ext, uint index,
+                          const ConvertOptions &options, std::vector<byte> &vgmData,
+                          Common::MemoryWriteStreamDynamic &vgm, AdLib::KeyframeIndex *keyframes,
+                          std::string &name) {
+
+	char resource[256];
+	snprintf(resource, sizeof(resource), "%s.%s.%u", tot.getName().c_str(), ext ? "ext" : "tot", index);
+
+	name = resource;
+
+	status("Trying to convert ADL \"%s\" to %s...", resource, options.getFormatName());
+
+	Common::StatsResource statsResource(gameDir.getPath() + "/" + name);
+
+	// Many resources aren't ADL at all, so failing to convert them is expected
+	Common::SeekableReadStream *adl = 0;
+	try {
+
+		adl = ext ? tot.getEXTResource(index) : tot.getTOTResource(index);
+
+		AdLib::ADLPlayer adlPlayer(*adl);
+		adlPlayer.setLimits(options.limits);
+		adlPlayer.setTrimSilence(options.trimSilence);
+
+		if (analyzeSong(adlPlayer, gameDir.getPath() + "/" + name, options)) {
+			delete adl;
+			return false;
+		}
+
+		convertSong(adlPlayer, vgm, vgmData, options, keyframes);
+
+	} catch (Common::Exception &e) {
+		delete adl;
+
+		Common::printException(e, "WARNING: ");
+		return false;
+	}
+
+	delete adl;
+	return true;
+}
+
+/** Return the identity of all files a TOT's resources can come from. */
+static std::string getTOTIdentity(const Gob::GameDir &gameDir, const std::string &totFile) {
+	const std::string name = std::string(totFile, 0, totFile.find_last_of('.'));
+
+	std::string identity = gameDir.getFileIdentity(totFile);
+	if (identity.empty())
+		return "";
+
+	std::list<std::string> files;
+
+	files.push_back(name + ".ext");
+	for (char n = '0'; n <= '9'; n++) {
+		files.push_back(std::string("commun.im") + n);
+		files.push_back(std::string("commun.ex") + n);
+	}
+
+	// Optional files, only the existing ones make up the identity
+	for (std::list<std::string>::const_iterator f = files.begin(); f != files.end(); ++f) {
+		const std::string fileIdentity = gameDir.getFileIdentity(*f);
+		if (!fileIdentity.empty())
+			identity += ";" + fileIdentity;
+	}
+
+	return identity;
+}
+
+
+/** One input of a crawl, handed from stage to stage. */
+struct CrawlItem {
+	enum Type {
+		kTypeADL,
+		kTypeMDY,
+		kTypeTOT
+	};
+
+	/** A VGM file converted into memory, waiting to be written. */
+	struct Output {
+		std::string file;     ///< The VGM file's name within the target directory.
+		std::string resource; ///< What the VGM was converted from.
+
+		Common::MemoryWriteStreamDynamic *vgm;
+
+		AdLib::KeyframeIndex *keyframes; ///< The keyframe index of the song, if recorded.
+	};
+
+	Type type;
+
+	std::string files[2]; ///< ADL; MDY and TBR; TOT and EXT.
+
+	Common::SeekableReadStream *data[2]; ///< The data of the files, once read.
+	uint8 compression[2];                ///< How the data still needs to be unpacked.
+
+	Gob::TOTFile *tot;
+
+	std::string key;      ///< The input's key within the crawl manifest.
+	std::string identity; ///< The identity of the input's data.
+
+	std::list<Output> outputs;
+
+	uint64 inputMemory; ///< The estimated memory the input data takes up, once unpacked.
+	uint64 memory;      ///< The estimated memory the whole item takes up at most.
+
+	uint64 cost; ///< The predicted time all stages take on the item, in microseconds.
+	uint64 time; ///< The time all stages actually took on the item, in microseconds.
+
+	CrawlItem(Type t, const std::string &file, const std::string &second = "") : type(t), tot(0),
+		inputMemory(0), memory(0), cost(0), time(0) {
+
+		files[0] = file;
+		files[1] = second;
+
+		data[0] = data[1] = 0;
+		compression[0] = compression[1] = 0;
+	}
+
+	~CrawlItem() {
+		delete data[0];
+		delete data[1];
+
+		delete tot;
+
+		for (std::list<Output>::iterator o = outputs.begin(); o != outputs.end(); ++o) {
+			delete o->vgm;
+			delete o->keyframes;
 		}
 	}
+};
+
+typedef std::list<CrawlItem *> CrawlItems;
+
+/** A file's data unpacks to about this many times its packed size. */
+static const uint32 kUnpackRatio = 4;
+/** Music data turns into about this many times its size of VGM data. */
+static const uint32 kVGMRatio = 16;
+
+/** Estimate the memory a file's data takes up while it's read and unpacked. */
+static uint64 estimateFileMemory(const Gob::GameDir &gameDir, const std::string &file) {
+	uint32 size;
+	uint8  compression;
+	if (!gameDir.getFileSize(file, size, compression))
+		return 0;
+
+	// Both the packed and the unpacked data are held while unpacking
+	if (compression != 0)
+		return size + ((uint64) size) * kUnpackRatio;
+
+	return size;
+}
+
+/** Estimate the memory a crawl item takes up at most, from the sizes of its files. */
+static void estimateMemory(const Gob::GameDir &gameDir, CrawlItem &item) {
+	item.inputMemory = estimateFileMemory(gameDir, item.files[0]);
+	if (!item.files[1].empty())
+		item.inputMemory += estimateFileMemory(gameDir, item.files[1]);
+
+	// The VGM data of all songs is held until it's written
+	item.memory = item.inputMemory * (1 + kVGMRatio);
+
+	if (item.type != CrawlItem::kTypeTOT)
+		return;
+
+	// Each TOT opens its own copy of the commun files its resources can come from
+	uint64 imMemory = 0, exMemory = 0;
+	for (char n = '0'; n <= '9'; n++) {
+		imMemory = MAX(imMemory, estimateFileMemory(gameDir, std::string("commun.im") + n));
+		exMemory = MAX(exMemory, estimateFileMemory(gameDir, std::string("commun.ex") + n));
+	}
+
+	item.inputMemory += imMemory + exMemory;
+	item.memory      += imMemory + exMemory;
+}
+
+/** The predicted time it takes to open an input and write its VGM files, in microseconds. */
+static const uint32 kCostBase = 50;
+/** The predicted time it takes to unpack 1 KiB of packed data, in microseconds. */
+static const uint32 kCostUnpack = 20;
+/** The predicted time it takes to convert 1 KiB of music data of each item type, in microseconds.
+ *
+ *  MDY songs carry more events per byte than ADL songs; TOTs are mostly
+ *  made up of resources that aren't music and are quickly given up on.
+ */
+static const uint32 kCostConvert[] = { 40, 60, 10 };
+
+/** Predict how long it takes to crawl through an item, from the sizes and formats of its files. */
+static void estimateCost(const Gob::GameDir &gameDir, CrawlItem &item) {
+	uint64 packedSize = 0, dataSize = 0;
+
+	for (int i = 0; i < 2; i++) {
+		uint32 size;
+		uint8  compression;
+		if (item.files[i].empty() || !gameDir.getFileSize(item.files[i], size, compression))
+			continue;
+
+		if (compression != 0) {
+			packedSize += size;
+			dataSize   += ((uint64) size) * kUnpackRatio;
+		} else
+			dataSize   += size;
+	}
+
+	item.cost = kCostBase + (packedSize * kCostUnpack + dataSize * kCostConvert[item.type]) / 1024;
+}
+
+/** Order the items so that the ones predicted to take the longest come first. */
+static bool compareCost(const CrawlItem *a, const CrawlItem *b) {
+	return a->cost > b->cost;
+}
+
+/** Add an input to the list of crawl items. */
+static void addCrawlItem(const Gob::GameDir &gameDir, CrawlItems &items, CrawlItem::Type type,
+                         const std::string &file, const std::string &second,
+                         const std::string &key, const std::string &identity) {
+
+	items.push_back(new CrawlItem(type, file, second));
+	items.back()->key      = key;
+	items.back()->identity = identity;
+
+	estimateMemory(gameDir, *items.back());
+	estimateCost(gameDir, *items.back());
+}
+
+/** Find all inputs of a game directory.
+ *
+ *  Finding the identity of a TOT is costly, so it's only done if requested.
+ */
+static void findCrawlItems(const Gob::GameDir &gameDir, bool withTOTIdentity, CrawlItems &items) {
+	const std::list<std::string> &adl = gameDir.getADL();
+	for (std::list<std::string>::const_iterator f = adl.begin(); f != adl.end(); ++f)
+		addCrawlItem(gameDir, items, CrawlItem::kTypeADL, *f, "", "adl:" + *f, gameDir.getFileIdentity(*f));
+
+	const std::list<std::string> &mdy = gameDir.getMDY();
+	for (std::list<std::string>::const_iterator f = mdy.begin(); f != mdy.end(); ++f) {
+		std::string tbr = changeExtension(*f, "tbr");
+
+		const std::string mdyIdentity = gameDir.getFileIdentity(*f);
+		const std::string tbrIdentity = gameDir.getFileIdentity(tbr);
+
+		std::string identity;
+		if (!mdyIdentity.empty() && !tbrIdentity.empty())
+			identity = mdyIdentity + ";" + tbrIdentity;
+
+		addCrawlItem(gameDir, items, CrawlItem::kTypeMDY, *f, tbr, "mdy:" + *f, identity);
+	}
+
+	const std::list<std::string> &tot = gameDir.getTOT();
+	for (std::list<std::string>::const_iterator f = tot.begin(); f != tot.end(); ++f) {
+		const std::string identity = withTOTIdentity ? getTOTIdentity(gameDir, *f) : "";
+
+		addCrawlItem(gameDir, items, CrawlItem::kTypeTOT, *f, changeExtension(*f, "ext"), "tot:" + *f, identity);
+	}
+}
+
+/** Order the items by their predicted cost, and then by their key. */
+static bool compareShardOrder(const CrawlItem *a, const CrawlItem *b) {
+	if (a->cost != b->cost)
+		return a->cost > b->cost;
+
+	return a->key < b->key;
+}
+
+/** Only keep the items belonging to one shard of a crawl.
+ *
+ *  The items are dealt out to the shards one by one, each to the shard with
+ *  the least predicted cost so far, starting with the most costly. Since
+ *  this only depends on the game directory's files, every shard comes up
+ *  with the same distribution on its own.
+ */
+static void selectShard(CrawlItems &items, uint shard, uint shardCount) {
+	std::vector<CrawlItem *> order(items.begin(), items.end());
+	std::sort(order.begin(), order.end(), compareShardOrder);
+
+	std::vector<uint64> shardCosts(shardCount, 0);
+	std::set<CrawlItem *> selected;
+
+	for (std::vector<CrawlItem *>::const_iterator i = order.begin(); i != order.end(); ++i) {
+		const uint cheapest = std::min_element(shardCosts.begin(), shardCosts.end()) - shardCosts.begin();
+
+		shardCosts[cheapest] += (*i)->cost;
+		if (cheapest == (shard - 1))
+			selected.insert(*i);
+	}
+
+	for (CrawlItems::iterator i = items.begin(); i != items.end(); ) {
+		if (selected.find(*i) != selected.end()) {
+			++i;
+			continue;
+		}
+
+		delete *i;
+		i = items.erase(i);
+	}
+
+	status("Crawling shard %u of %u: %u inputs, predicted %llu of %llu us", shard, shardCount,
+	       (uint) items.size(), (unsigned long long) shardCosts[shard - 1],
+	       (unsigned long long) std::accumulate(shardCosts.begin(), shardCosts.end(), (uint64) 0));
+}
+
+/** Announce all files the crawl items are going to read, so that they can be read ahead. */
+static void prefetchCrawlItems(const Gob::GameDir &gameDir, const CrawlItems &items) {
+	std::list<std::string> files;
+
+	bool hasTOT = false;
+	for (CrawlItems::const_iterator i = items.begin(); i != items.end(); ++i) {
+		files.push_back((*i)->files[0]);
+		if (!(*i)->files[1].empty())
+			files.push_back((*i)->files[1]);
+
+		hasTOT = hasTOT || ((*i)->type == CrawlItem::kTypeTOT);
+	}
+
+	if (hasTOT) {
+		for (char n = '0'; n <= '9'; n++) {
+			files.push_back(std::string("commun.im") + n);
+			files.push_back(std::string("commun.ex") + n);
+		}
+	}
+
+	gameDir.prefetch(files);
+}
+
+/** Drop the items whose VGM files are still up-to-date. */
+static void skipUpToDate(CrawlItems &items, CrawlManifest &manifest) {
+	static const char *kTypeNames[] = { "ADL", "MDY", "TOT" };
+
+	for (CrawlItems::iterator i = items.begin(); i != items.end(); ) {
+		if (!manifest.isUpToDate((*i)->key, (*i)->identity)) {
+			++i;
+			continue;
+		}
+
+		status("Skipping up-to-date %s \"%s\"", kTypeNames[(*i)->type], (*i)->files[0].c_str());
+
+		delete *i;
+		i = items.erase(i);
+	}
+}
+
+
+/** Runs the inputs of a crawl through the stages of a conversion.
+ *
+ *  Either all stages run one after the other in the calling thread, or each
+ *  stage runs in its own set of threads. In the latter case, the stages are
+ *  connected by bounded queues, so that a stage outpacing the next one is
+ *  held up instead of piling up data in memory.
+ */
+class Crawler {
+public:
+	Crawler(Gob::GameDir &gameDir, const std::string &target, const ConvertOptions &options,
+	        CrawlManifest *manifest);
+	~Crawler();
+
+	/** Convert all items. The crawler takes them over. */
+	void crawl(CrawlItems &items);
+
+private:
+	/** A thread running one stage. */
+	class Worker : public Common::Thread {
+	public:
+		Worker(Crawler &crawler, CrawlStage stage);
+		~Worker();
+
+	protected:
+		void run();
+
+	private:
+		Crawler *_crawler;
+		CrawlStage _stage;
+	};
+
+	Gob::GameDir *_gameDir;
+
+	std::string _target;
+
+	const ConvertOptions *_options;
+
+	CrawlManifest *_manifest;
+
+	/** The queue of items waiting for each stage. */
+	Common::BoundedQueue<CrawlItem *> *_queues[kCrawlStageMAX];
+
+	/** The number of threads still running each stage. */
+	uint _running[kCrawlStageMAX];
+
+	uint64 _memoryUsed; ///< The estimated memory all items in the pipeline take up.
+	uint64 _memoryPeak; ///< The highest estimated memory used so far.
+
+	uint64 _predictedCost; ///< The predicted time of all finished items.
+	uint64 _actualCost;    ///< The time all finished items actually took.
+
+	/** Guards the manifest, the number of running threads, the memory used and the costs. */
+	Common::Mutex _mutex;
+
+	/** Signaled whenever an item leaves the pipeline. */
+	Common::Condition _memoryFreed;
+
+
+	void crawlSequential(CrawlItems &items);
+	void crawlPipelined(CrawlItems &items);
+
+	/** Wait until the item fits into the memory limit, and then count it in. */
+	void reserveMemory(CrawlItem &item);
+	/** Change the estimated memory an item in the pipeline takes up. */
+	void updateMemory(CrawlItem &item, uint64 memory);
+	/** Remove a finished or failed item from the pipeline. */
+	void finish(CrawlItem *item);
+
+	/** Take items out of a stage's queue and run the stage on them, until the queue is closed. */
+	void work(CrawlStage stage);
+
+	/** Run a stage on an item.
+	 *
+	 *  @return false if the item failed, and can't go on to the next stage.
+	 */
+	bool runStage(CrawlStage stage, CrawlItem &item, std::vector<byte> &vgmData);
+
+	void read(CrawlItem &item);
+	void unpack(CrawlItem &item);
+	void parse(CrawlItem &item);
+	void convert(CrawlItem &item, std::vector<byte> &vgmData);
+	void write(CrawlItem &item);
+
+	std::string getResourceName(const std::string &file) const;
+};
+
+Crawler::Worker::Worker(Crawler &crawler, CrawlStage stage) : _crawler(&crawler), _stage(stage) {
+}
+
+Crawler::Worker::~Worker() {
+	join();
+}
+
+void Crawler::Worker::run() {
+	_crawler->work(_stage);
+}
+
+Crawler::Crawler(Gob::GameDir &gameDir, const std::string &target, const ConvertOptions &options,
+                 CrawlManifest *manifest) :
+	_gameDir(&gameDir), _target(target), _options(&options), _manifest(manifest),
+	_memoryUsed(0), _memoryPeak(0), _predictedCost(0), _actualCost(0), _memoryFreed(_mutex) {
+
+	for (int i = 0; i < kCrawlStageMAX; i++) {
+		_queues [i] = 0;
+		_running[i] = 0;
+	}
+}
+
+Crawler::~Crawler() {
+	for (int i = 0; i < kCrawlStageMAX; i++)
+		delete _queues[i];
+}
+
+void Crawler::crawl(CrawlItems &items) {
+	if (_options->isPipelined())
+		crawlPipelined(items);
+	else
+		crawlSequential(items);
+
+	// Tell how good the cost model was, so that it can be tuned
+	status("Predicted %llu us of work, took %llu us", (unsigned long long) _predictedCost,
+	       (unsigned long long) _actualCost);
+
+	Common::CrawlCostStats cost;
+	cost.predicted = _predictedCost;
+	cost.actual    = _actualCost;
+
+	Common::recordCrawlCostStats(cost);
+}
+
+void Crawler::crawlSequential(CrawlItems &items) {
+	std::vector<byte> vgmData;
+
+	while (!items.empty()) {
+		CrawlItem *item = items.front();
+		items.pop_front();
+
+		for (int i = 0; i < kCrawlStageMAX; i++)
+			if (!runStage((CrawlStage) i, *item, vgmData))
+				break;
+
+		_predictedCost += item->cost;
+		_actualCost    += item->time;
+
+		delete item;
+	}
+}
+
+void Crawler::crawlPipelined(CrawlItems &items) {
+	for (int i = 0; i < kCrawlStageMAX; i++) {
+		_queues [i] = new Common::BoundedQueue<CrawlItem *>(_options->crawlQueueSize);
+		_running[i] = MAX<uint>(_options->crawlThreads[i], 1);
+	}
+
+	// Start the longest items first, so that no long item is left running alone at the end
+	items.sort(compareCost);
+
+	std::list<Worker *> workers;
+
+	try {
+		for (int i = 0; i < kCrawlStageMAX; i++) {
+			for (uint j = 0; j < _running[i]; j++) {
+				workers.push_back(new Worker(*this, (CrawlStage) i));
+				workers.back()->start();
+			}
+		}
+
+	} catch (Common::Exception &e) {
+		// Let the threads that did start drain the queues
+		for (int i = 0; i < kCrawlStageMAX; i++)
+			_queues[i]->close();
+
+		for (std::list<Worker *>::iterator w = workers.begin(); w != workers.end(); ++w)
+			delete *w;
+
+		throw;
+	}
+
+	// Feed the first stage, waiting whenever it has enough to do or memory is short
+	while (!items.empty()) {
+		CrawlItem *item = items.front();
+		items.pop_front();
+
+		reserveMemory(*item);
+
+		if (!_queues[0]->push(item))
+			finish(item);
+	}
+
+	_queues[0]->close();
+
+	for (std::list<Worker *>::iterator w = workers.begin(); w != workers.end(); ++w)
+		delete *w;
+
+	if (_options->crawlMemoryLimit > 0)
+		status("Estimated peak memory use: %llu of %llu KiB", (unsigned long long) (_memoryPeak / 1024),
+		       (unsigned long long) (_options->crawlMemoryLimit / 1024));
+}
+
+void Crawler::reserveMemory(CrawlItem &item) {
+	const uint64 limit = _options->crawlMemoryLimit;
+
+	Common::ScopedLock lock(_mutex);
+
+	// An item too big for the limit on its own still gets to run, just alone
+	while ((limit > 0) && (_memoryUsed > 0) && ((_memoryUsed + item.memory) > limit))
+		_memoryFreed.wait();
+
+	_memoryUsed += item.memory;
+	_memoryPeak  = MAX(_memoryPeak, _memoryUsed);
+}
+
+void Crawler::updateMemory(CrawlItem &item, uint64 memory) {
+	Common::ScopedLock lock(_mutex);
+
+	_memoryUsed = _memoryUsed - item.memory + memory;
+	_memoryPeak = MAX(_memoryPeak, _memoryUsed);
+
+	item.memory = memory;
+
+	_memoryFreed.broadcast();
+}
+
+void Crawler::finish(CrawlItem *item) {
+	{
+		Common::ScopedLock lock(_mutex);
+
+		_memoryUsed -= item->memory;
+		_memoryFreed.broadcast();
+
+		_predictedCost += item->cost;
+		_actualCost    += item->time;
+	}
+
+	delete item;
+}
+
+void Crawler::work(CrawlStage stage) {
+	std::vector<byte> vgmData;
+
+	CrawlItem *item;
+	while (_queues[stage]->pop(item)) {
+		if (!runStage(stage, *item, vgmData) || ((stage + 1) >= kCrawlStageMAX) ||
+		    !_queues[stage + 1]->push(item))
+			finish(item);
+	}
+
+	// The last thread of a stage to finish tells the next stage that nothing more is coming
+	Common::ScopedLock lock(_mutex);
+
+	if ((--_running[stage] == 0) && ((stage + 1) < kCrawlStageMAX))
+		_queues[stage + 1]->close();
+}
+
+bool Crawler::runStage(CrawlStage stage, CrawlItem &item, std::vector<byte> &vgmData) {
+	const uint64 start = getMicroseconds();
+
+	try {
+		switch (stage) {
+			case kCrawlStageRead:
+				read(item);
+				break;
+
+			case kCrawlStageUnpack:
+				unpack(item);
+				break;
+
+			case kCrawlStageParse:
+				parse(item);
+				break;
+
+			case kCrawlStageConvert:
+				convert(item, vgmData);
+				break;
+
+			case kCrawlStageWrite:
+				write(item);
+				break;
+
+			default:
+				break;
+		}
+
+	} catch (Common::Exception &e) {
+		Common::printException(e, "WARNING: ");
+
+		item.time += getMicroseconds() - start;
+		return false;
+	} catch (std::exception &e) {
+		Common::Exception se(e);
+
+		Common::printException(se, "WARNING: ");
+
+		item.time += getMicroseconds() - start;
+		return false;
+	}
+
+	item.time += getMicroseconds() - start;
+	return true;
+}
+
+void Crawler::read(CrawlItem &item) {
+	Common::StatsResource statsResource(getResourceName(item.files[0]));
+
+	item.data[0] = _gameDir->getPackedFile(item.files[0], item.compression[0]);
+
+	if (item.type == CrawlItem::kTypeMDY)
+		item.data[1] = _gameDir->getPackedFile(item.files[1], item.compression[1]);
+
+	// TOTs don't need to have an EXT, but failing to read one that exists is an error
+	uint32 extSize;
+	if ((item.type == CrawlItem::kTypeTOT) && _gameDir->getFileSize(item.files[1], extSize, item.compression[1]))
+		item.data[1] = _gameDir->getPackedFile(item.files[1], item.compression[1]);
+}
+
+void Crawler::unpack(CrawlItem &item) {
+	Common::StatsResource statsResource(getResourceName(item.files[0]));
+
+	for (int i = 0; i < 2; i++) {
+		if (!item.data[i] || (item.compression[i] == 0))
+			continue;
+
+		Common::SeekableReadStream *unpacked = Gob::GameDir::unpack(*item.data[i], item.compression[i]);
+
+		delete item.data[i];
+
+		item.data[i]        = unpacked;
+		item.compression[i] = 0;
+	}
+}
+
+void Crawler::parse(CrawlItem &item) {
+	if (item.type != CrawlItem::kTypeTOT)
+		return;
+
+	status("Loading TOT \"%s\"", item.files[0].c_str());
+
+	Common::StatsResource statsResource(getResourceName(item.files[0]));
+
+	// The TOT takes over the data, even if it fails to load
+	Common::SeekableReadStream *tot = item.data[0];
+	Common::SeekableReadStream *ext = item.data[1];
+
+	item.data[0] = item.data[1] = 0;
+
+	item.tot = new Gob::TOTFile(*_gameDir, item.files[0], tot, ext);
+
+	// Now that the resources are known, the estimate of the VGM data can be narrowed down
+	if (_options->isPipelined())
+		updateMemory(item, item.inputMemory + ((uint64) item.tot->getResourcesSize()) * kVGMRatio);
+}
+
+void Crawler::convert(CrawlItem &item, std::vector<byte> &vgmData) {
+	if (item.type == CrawlItem::kTypeTOT) {
+		const Gob::TOTFile &tot = *item.tot;
+
+		const uint totCount = tot.getTOTResourceCount();
+		const uint extCount = tot.getEXTResourceCount();
+
+		for (uint i = 0; i < (totCount + extCount); i++) {
+			const bool ext   = i >= totCount;
+			const uint index = ext ? (i - totCount) : i;
+
+			Common::MemoryWriteStreamDynamic *vgm = new Common::MemoryWriteStreamDynamic(true);
+			AdLib::KeyframeIndex *keyframes = (_options->keyframeInterval > 0) ?
+				new AdLib::KeyframeIndex(_options->keyframeInterval) : 0;
+
+			std::string name;
+			if (!convertTOTADL(*_gameDir, tot, ext, index, *_options, vgmData, *vgm, keyframes, name)) {
+				delete vgm;
+				delete keyframes;
+				continue;
+			}
+
+			CrawlItem::Output output;
+
+			output.file      = name + "." + _options->getExtension();
+			output.resource  = getResourceName(name);
+			output.vgm       = vgm;
+			output.keyframes = keyframes;
+
+			item.outputs.push_back(output);
+		}
+
+		delete item.tot;
+		item.tot = 0;
+
+		return;
+	}
+
+	if (item.type == CrawlItem::kTypeADL)
+		status("Converting ADL \"%s\" to %s...", item.files[0].c_str(), _options->getFormatName());
+	else
+		status("Converting MDY \"%s\" with TBR \"%s\" to %s...", item.files[0].c_str(), item.files[1].c_str(),
+		       _options->getFormatName());
+
+	const std::string name = getResourceName(item.files[0]);
+
+	Common::StatsResource statsResource(name);
+
+	CrawlItem::Output output;
+
+	output.file      = item.files[0] + "." + _options->getExtension();
+	output.resource  = name;
+	output.vgm       = new Common::MemoryWriteStreamDynamic(true);
+	output.keyframes = (_options->keyframeInterval > 0) ? new AdLib::KeyframeIndex(_options->keyframeInterval) : 0;
+
+	item.outputs.push_back(output);
+
+	AdLib::AdLib *player = 0;
+	try {
+		if (item.type == CrawlItem::kTypeADL)
+			player = new AdLib::ADLPlayer(*item.data[0]);
+		else
+			player = new AdLib::MUSPlayer(*item.data[0], *item.data[1]);
+
+		player->setLimits(_options->limits);
+		player->setTrimSilence(_options->trimSilence);
+
+		if (!analyzeSong(*player, name, *_options))
+			convertSong(*player, *output.vgm, vgmData, *_options, output.keyframes);
+
+	} catch (Common::Exception &e) {
+		delete player;
+		throw;
+	}
+
+	delete player;
+
+	delete item.data[0];
+	delete item.data[1];
+
+	item.data[0] = item.data[1] = 0;
+}
+
+void Crawler::write(CrawlItem &item) {
+	std::list<std::string> files;
+
+	if (_options->writesFiles()) {
+		for (std::list<CrawlItem::Output>::iterator o = item.outputs.begin(); o != item.outputs.end(); ++o) {
+			Common::StatsResource statsResource(o->resource);
+
+			writeVGM(makeTargetPath(_target, o->file), *o->vgm);
+			files.push_back(o->file);
+
+			delete o->vgm;
+			o->vgm = 0;
+
+			if (o->keyframes) {
+				writeKeyframes(makeTargetPath(_target, getKeyframeFile(o->file)), *o->keyframes);
+				files.push_back(getKeyframeFile(o->file));
+
+				delete o->keyframes;
+				o->keyframes = 0;
+			}
+		}
+	}
+
+	if (!_manifest)
+		return;
+
+	Common::ScopedLock lock(_mutex);
+
+	_manifest->update(item.key, item.identity, files);
+}
+
+std::string Crawler::getResourceName(const std::string &file) const {
+	return _gameDir->getPath() + "/" + file;
+}
+
+void convertADL(const std::string &adlFile, const std::string &vgmFile, const ConvertOptions &options) {
+	status("Converting ADL \"%s\" to %s...", adlFile.c_str(), options.getFormatName());
+
+	Common::StatsResource statsResource(adlFile);
+
+	// Open the input file
+	Common::File adl(adlFile);
+	AdLib::ADLPlayer adlPlayer(adl);
+
+	convertSong(adlPlayer, adlFile, vgmFile.empty() ? getOutputFile(adlFile, options) : vgmFile, options);
+}
+
+void convertMDY(const std::string &mdyFile, const std::string &tbrFile, const std::string &vgmFile,
+                const ConvertOptions &options) {
+
+	status("Converting MDY \"%s\" with TBR \"%s\" to %s...", mdyFile.c_str(), tbrFile.c_str(),
+	       options.getFormatName());
+
+	Common::StatsResource statsResource(mdyFile);
+
+	// Open the input files
+	Common::File mdy(mdyFile);
+	Common::File tbr(tbrFile);
+	AdLib::MUSPlayer musPlayer(mdy, tbr);
+
+	convertSong(musPlayer, mdyFile, vgmFile.empty() ? getOutputFile(mdyFile, options) : vgmFile, options);
+}
+
+SongJob::SongJob() : failed(false) {
+}
+
+/** Open a song's files and create its player. */
+static AdLib::AdLib *openSong(const SongJob &job) {
+	if (job.files[1].empty()) {
+		Common::File adl(job.files[0]);
+
+		return new AdLib::ADLPlayer(adl);
+	}
+
+	Common::File mdy(job.files[0]);
+	Common::File tbr(job.files[1]);
+
+	return new AdLib::MUSPlayer(mdy, tbr);
+}
+
+/** Hands the songs of a list to a batch renderer, and writes each rendered song into a WAV file. */
+class SongFeeder : public AdLib::BatchRenderer::Feeder {
+public:
+	SongFeeder(std::vector<SongJob> &songs, const ConvertOptions &options);
+	~SongFeeder();
+
+	AdLib::AdLib *next(AdLib::PCMSink *&sink);
+	void done(AdLib::AdLib *player, AdLib::PCMSink *sink, const Common::Exception *error);
+
+private:
+	/** A song being rendered. */
+	struct Song {
+		SongJob *job;
+
+		AdLib::AdLib *player;
+
+		std::vector<byte> wavData;
+		AdLib::WAVSink    sink;
+		AudioChain        chain;
+
+		AdLib::KeyframeIndex keyframes;
+
+		Song(SongJob &j, AdLib::AdLib *p, const ConvertOptions &options) : job(&j), player(p), sink(wavData),
+			chain(sink, options), keyframes(MAX<uint32>(options.keyframeInterval, 1)) {
+		}
+	};
+
+	std::vector<SongJob> *_songs;
+	const ConvertOptions *_options;
+
+	size_t _next; ///< The next song to hand out.
+
+	std::list<Song *> _rendering;
+};
+
+SongFeeder::SongFeeder(std::vector<SongJob> &songs, const ConvertOptions &options) :
+	_songs(&songs), _options(&options), _next(0) {
+}
+
+SongFeeder::~SongFeeder() {
+	for (std::list<Song *>::iterator s = _rendering.begin(); s != _rendering.end(); ++s) {
+		delete (*s)->player;
+		delete *s;
+	}
+}
+
+AdLib::AdLib *SongFeeder::next(AdLib::PCMSink *&sink) {
+	while (_next < _songs->size()) {
+		SongJob &job = (*_songs)[_next++];
+
+		if (job.files[1].empty())
+			status("Rendering ADL \"%s\" to WAV...", job.files[0].c_str());
+		else
+			status("Rendering MDY \"%s\" with TBR \"%s\" to WAV...", job.files[0].c_str(), job.files[1].c_str());
+
+		AdLib::AdLib *player = 0;
+		try {
+			player = openSong(job);
+		} catch (Common::Exception &e) {
+			job.failed = true;
+			job.error  = e;
+			continue;
+		}
+
+		player->setLimits(_options->limits);
+		player->setTrimSilence(_options->trimSilence);
+
+		Song *song = new Song(job, player, *_options);
+		_rendering.push_back(song);
+
+		if (_options->keyframeInterval > 0)
+			player->setKeyframes(&song->keyframes);
+
+		sink = &song->chain.getSink();
+		return player;
+	}
+
+	return 0;
+}
+
+void SongFeeder::done(AdLib::AdLib *player, AdLib::PCMSink *, const Common::Exception *error) {
+	std::list<Song *>::iterator s = _rendering.begin();
+	while ((s != _rendering.end()) && ((*s)->player != player))
+		++s;
+
+	if (s == _rendering.end())
+		return;
+
+	Song    *song = *s;
+	SongJob &job  = *song->job;
+
+	_rendering.erase(s);
+
+	if (error) {
+		job.failed = true;
+		job.error  = *error;
+	} else {
+		try {
+			Common::StatsResource statsResource(job.files[0]);
+
+			song->chain.finish(&song->sink);
+			recordTrim(*player, *_options);
+
+			const std::string wavFile = job.output.empty() ? getOutputFile(job.files[0], *_options) : job.output;
+
+			writeWAV(wavFile, song->sink);
+
+			if (_options->keyframeInterval > 0)
+				writeKeyframes(getKeyframeFile(wavFile), song->keyframes);
+		} catch (Common::Exception &e) {
+			job.failed = true;
+			job.error  = e;
+		}
+	}
+
+	delete song->player;
+	delete song;
+}
+
+void convertSongs(std::vector<SongJob> &songs, const ConvertOptions &options) {
+	if (songs.empty())
+		return;
+
+	// Seeking only starts single songs at a position
+	if ((options.format != kOutputWAV) || !options.writesFiles() || (options.renderLanes <= 1) ||
+	    (options.seekPosition > 0)) {
+		for (std::vector<SongJob>::iterator s = songs.begin(); s != songs.end(); ++s) {
+			try {
+				if (s->files[1].empty())
+					convertADL(s->files[0], s->output, options);
+				else
+					convertMDY(s->files[0], s->files[1], s->output, options);
+
+			} catch (Common::Exception &e) {
+				s->failed = true;
+				s->error  = e;
+			}
+		}
+
+		return;
+	}
+
+	SongFeeder feeder(songs, options);
+
+	AdLib::BatchRenderer renderer(MIN<size_t>(options.renderLanes, songs.size()));
+	renderer.render(feeder);
+}
+
+void crawlDirectory(const std::string &directory, const std::string &target, const ConvertOptions &options) {
+	status("Crawling through game directory \"%s\"", directory.c_str());
+
+	Gob::GameDir gameDir(directory);
+
+	CrawlManifest *manifest = 0;
+	CrawlItems items;
+	try {
+		// An analysis doesn't produce anything the manifest could keep track of
+		if (options.incremental && options.writesFiles()) {
+			// Each shard keeps its own manifest, to be merged later
+			const std::string name =
+				options.isSharded() ? CrawlManifest::getShardName(options.shard, options.shardCount) : "";
+
+			manifest = new CrawlManifest(target, directory, name);
+		}
+
+		findCrawlItems(gameDir, manifest != 0, items);
+
+		if (options.isSharded())
+			selectShard(items, options.shard, options.shardCount);
+
+		if (manifest)
+			skipUpToDate(items, *manifest);
+
+		prefetchCrawlItems(gameDir, items);
+
+		Crawler crawler(gameDir, target, options, manifest);
+		crawler.crawl(items);
+
+		if (manifest)
+			manifest->save();
+
+	} catch (Common::Exception &e) {
+		for (CrawlItems::iterator i = items.begin(); i != items.end(); ++i)
+			delete *i;
+
+		delete manifest;
+		throw;
+	}
+
+	delete manifest;
+}
+
+void mergeShards(const std::string &target, const std::vector<std::string> &statsFiles) {
+	if (!statsFiles.empty() && !Common::isStatsEnabled())
+		throw Common::Exception("Merging stats needs a stats file to write the merged stats into");
+
+	for (std::vector<std::string>::const_iterator s = statsFiles.begin(); s != statsFiles.end(); ++s) {
+		status("Merging stats \"%s\"", s->c_str());
+
+		std::FILE *file = std::fopen(s->c_str(), "r");
+		if (!file)
+			throw Common::Exception("Can't open stats \"%s\"", s->c_str());
+
+		try {
+			Common::readStatsJSON(file);
+		} catch (Common::Exception &e) {
+			std::fclose(file);
+
+			e.add("Failed to merge stats \"%s\"", s->c_str());
+			throw;
+		}
+
+		std::fclose(file);
+	}
+
+	std::list<std::string> shards;
+	CrawlManifest::findShards(target, shards);
+
+	if (shards.empty()) {
+		if (statsFiles.empty())
+			throw Common::Exception("No shard manifests found in \"%s\"", target.c_str());
+
+		return;
+	}
+
+	// The empty scope keeps all inputs of all game directories already in the manifest
+	CrawlManifest manifest(target, "");
+
+	for (std::list<std::string>::const_iterator s = shards.begin(); s != shards.end(); ++s) {
+		status("Merging crawl manifest \"%s\"", s->c_str());
+
+		manifest.merge(*s);
+	}
+
+	manifest.save();
 }
@@ -22,10 +22,208 @@
 #define CONVERT_HPP
 
 #include <string>
+#include <vector>
 
-void convertADL(const std::string &adlFile);
-void convertMDY(const std::string &mdyFile, const std::string &tbrFile);
+#include "common/error.hpp"
 
-void crawlDirectory(const std::string &directory);
+#include "adlib/adlib.hpp"
+
+/** The stages of a crawl through a game directory. */
+enum CrawlStage {
+	kCrawlStageRead = 0, ///< Reading the input files out of the archives.
+	kCrawlStageUnpack  , ///< Unpacking compressed input files.
+	kCrawlStageParse   , ///< Parsing the resource tables of TOT files.
+	kCrawlStageConvert , ///< Converting the music into VGM data in memory.
+	kCrawlStageWrite   , ///< Writing the VGM files.
+	kCrawlStageMAX
+};
+
+/** The kinds of files music is converted into. */
+enum OutputFormat {
+	kOutputVGM = 0, ///< VGM files, recording the OPL register writes.
+	kOutputWAV    , ///< WAV files, rendered through an emulated OPL2.
+	kOutputPCM      ///< Raw PCM, rendered through an emulated OPL2 and streamed out while playing.
+};
+
+/** Options for converting music. */
+struct ConvertOptions {
+	/** Only convert inputs that changed since the last crawl into the same target.
+	 *
+	 *  What was converted is recorded in a manifest within the target directory.
+	 */
+	bool incremental;
+
+	/** Don't write any VGM files, instead only profile the OPL register writes.
+	 *
+	 *  The profile of each song is printed to stdout as one line of JSON.
+	 */
+	bool profile;
+
+	/** Don't write any VGM files, instead only find each song's length and properties.
+	 *
+	 *  The information of each song is printed to stdout as one line of JSON.
+	 */
+	bool probe;
+
+	/** The kind of files the music is converted into. */
+	OutputFormat format;
+
+	/** Write the output of a single song into a ring buffer in shared memory of this name, instead of into a file.
+	 *
+	 *  Another process reads the output from there while it's converted.
+	 *  If empty, the output is written into a file. See Common::SharedRing.
+	 */
+	std::string sharedRing;
+
+	/** The number of songs rendered side by side when converting several songs into WAV files.
+	 *
+	 *  See AdLib::BatchRenderer.
+	 */
+	uint renderLanes;
+
+	/** The number of threads rendering a single song into WAV, in segments.
+	 *
+	 *  0 or 1 renders the song in the calling thread. Doesn't apply when
+	 *  seeking. See AdLib::SegmentRenderer.
+	 */
+	uint renderThreads;
+
+	/** Render each voice of a single song into a WAV file of its own, instead of the whole song.
+	 *
+	 *  The stems are rendered on renderThreads threads. See AdLib::StemRenderer.
+	 */
+	bool stems;
+
+	/** The samples per second of rendered audio. 0 means the emulated OPL2's own rate.
+	 *
+	 *  See AdLib::ResampleSink.
+	 */
+	uint32 sampleRate;
+
+	/** The gain applied to rendered audio, in dB. */
+	double gain;
+
+	/** Amplify each rendered WAV file to the loudness below, instead of by the gain above.
+	 *
+	 *  The loudness of each song is measured while it renders, see AdLib::LoudnessSink.
+	 */
+	bool normalize;
+	/** The integrated loudness rendered WAV files are normalized to, in LUFS. */
+	double loudness;
+
+	/** Trim the silence off the start and the end of each song, as far as no note sounds.
+	 *
+	 *  The silence trimmed is recorded into the stats. See AdLib::AdLib::setTrimSilence().
+	 */
+	bool trimSilence;
+
+	/** Record a keyframe index of each converted song, with a keyframe every this many samples.
+	 *
+	 *  The samples are those of the song's timing. The index is written next
+	 *  to the output file, with ".keys" appended. 0 means no keyframes are
+	 *  recorded. See AdLib::KeyframeIndex.
+	 */
+	uint32 keyframeInterval;
+
+	/** Start rendering audio at this position within the song, in samples of the song's timing. */
+	uint32 seekPosition;
+	/** The keyframe index of the song to seek with. If empty, the song plays through to the position. */
+	std::string seekIndex;
+
+	/** Ceilings for each single conversion. A song exceeding them isn't converted. */
+	AdLib::PlayLimits limits;
+
+	/** The number of threads running each stage of a crawl.
+	 *
+	 *  If all are 0, the whole crawl runs in the calling thread instead.
+	 */
+	uint crawlThreads[kCrawlStageMAX];
+
+	/** The number of inputs that can wait in front of each stage of a crawl. */
+	uint crawlQueueSize;
+
+	/** The memory, in bytes, the inputs of a pipelined crawl may take up at once.
+	 *
+	 *  The memory each input needs is estimated from the sizes of its files.
+	 *  Inputs only enter the pipeline while the estimate of all inputs in it
+	 *  stays below this limit. 0 means no limit.
+	 */
+	uint64 crawlMemoryLimit;
+
+	/** Only crawl through one shard of each game directory's inputs, counting from 1.
+	 *
+	 *  The inputs are distributed over shardCount shards, balanced by their
+	 *  predicted cost. Every shard comes up with the same distribution, so
+	 *  several machines can each crawl through one shard of the same game
+	 *  directory without talking to each other. If shardCount is 0 or 1,
+	 *  all inputs are crawled through.
+	 */
+	uint shard;
+	uint shardCount;
+
+	ConvertOptions();
+
+	/** Are files written, or do the options ask for an analysis instead? */
+	bool writesFiles() const;
+
+	/** Return the file extension of the output format. */
+	const char *getExtension() const;
+	/** Return the name of the output format. */
+	const char *getFormatName() const;
+
+	/** Does a crawl only go through one shard of the inputs? */
+	bool isSharded() const;
+
+	/** Does a crawl run its stages in threads of their own? */
+	bool isPipelined() const;
+};
+
+/** Convert an ADL file into VGM, or the output format the options ask for.
+ *
+ *  If vgmFile is empty, the output file is created in the current working directory.
+ */
+void convertADL(const std::string &adlFile, const std::string &vgmFile = "",
+                const ConvertOptions &options = ConvertOptions());
+/** Convert a MDY+TBR file into VGM, or the output format the options ask for.
+ *
+ *  If vgmFile is empty, the output file is created in the current working directory.
+ */
+void convertMDY(const std::string &mdyFile, const std::string &tbrFile, const std::string &vgmFile = "",
+                const ConvertOptions &options = ConvertOptions());
+
+/** A single song to convert: an ADL file, or a MDY+TBR file. */
+struct SongJob {
+	std::string files[2]; ///< ADL; MDY and TBR.
+
+	/** The output file. If empty, it's created in the current working directory. */
+	std::string output;
+
+	bool failed;             ///< Did the conversion fail?
+	Common::Exception error; ///< Why did the conversion fail?
+
+	SongJob();
+};
+
+/** Convert several songs, noting in each job whether it failed.
+ *
+ *  When the songs are converted into WAV files, up to options.renderLanes of
+ *  them are rendered side by side.
+ */
+void convertSongs(std::vector<SongJob> &songs, const ConvertOptions &options = ConvertOptions());
+
+/** Convert all music found in a game directory into VGM files within target.
+ *
+ *  If target is empty, the VGM files are created in the current working directory.
+ */
+void crawlDirectory(const std::string &directory, const std::string &target = "",
+                    const ConvertOptions &options = ConvertOptions());
+
+/** Merge the results of crawls that were split into shards.
+ *
+ *  The manifests of all shards found in the target directory are merged
+ *  into its main manifest. The stats files, as written by each shard, are
+ *  added to the current stats.
+ */
+void mergeShards(const std::string &target, const std::vector<std::string> &statsFiles);
 
 #endif // CONVERT_HPP
@@ -0,0 +1,229 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <vector>
+
+#include "common/util.hpp"
+#include "common/error.hpp"
+#include "common/strutil.hpp"
+#include "common/version.hpp"
+
+#include "crawlmanifest.hpp"
+
+/** Name of the manifest file within the target directory. */
+static const char *kManifestName  = "cokteladl2vgm.manifest";
+/** The first field of a manifest's header line. */
+static const char *kManifestMagic = "CoktelADL2VGM crawl manifest";
+/** Start and end of the names of the manifests of crawl shards. */
+static const char *kShardPrefix = "cokteladl2vgm.shard-";
+static const char *kShardSuffix = ".manifest";
+
+
+CrawlManifest::Entry::Entry() : seen(false) {
+}
+
+
+CrawlManifest::CrawlManifest(const std::string &target, const std::string &scope, const std::string &name) :
+	_target(target), _scope(scope) {
+
+	_path = getOutputPath(name.empty() ? kManifestName : name);
+
+	load(_path, false);
+}
+
+CrawlManifest::~CrawlManifest() {
+}
+
+std::string CrawlManifest::getOutputPath(const std::string &output) const {
+	if (_target.empty())
+		return output;
+
+	if ((*_target.rbegin() == '/') || (*_target.rbegin() == '\\'))
+		return _target + output;
+
+	return _target + "/" + output;
+}
+
+void CrawlManifest::merge(const std::string &name) {
+	const std::string path = getOutputPath(name);
+
+	if (!load(path, true))
+		throw Common::Exception("Can't open crawl manifest \"%s\": %s", path.c_str(), strerror(errno));
+}
+
+std::string CrawlManifest::getShardName(uint shard, uint shardCount) {
+	char name[64];
+	snprintf(name, sizeof(name), "%s%u-of-%u%s", kShardPrefix, shard, shardCount, kShardSuffix);
+
+	return name;
+}
+
+void CrawlManifest::findShards(const std::string &target, std::list<std::string> &names) {
+	names.clear();
+
+	DIR *dir = opendir(target.empty() ? "." : target.c_str());
+	if (!dir)
+		throw Common::Exception("Can't open directory \"%s\": %s", target.c_str(), strerror(errno));
+
+	const size_t prefixLength = std::strlen(kShardPrefix);
+	const size_t suffixLength = std::strlen(kShardSuffix);
+
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		const std::string name = entry->d_name;
+
+		if ((name.size() > (prefixLength + suffixLength)) &&
+		    !name.compare(0, prefixLength, kShardPrefix) &&
+		    !name.compare(name.size() - suffixLength, suffixLength, kShardSuffix))
+			names.push_back(name);
+	}
+
+	closedir(dir);
+
+	names.sort();
+}
+
+bool CrawlManifest::load(const std::string &path, bool merge) {
+	std::FILE *file = std::fopen(path.c_str(), "r");
+	if (!file)
+		return false;
+
+	std::string line;
+	std::vector<std::string> fields;
+
+	// Only use manifests written by this very version
+	if (Common::readLine(file, line)) {
+		Common::splitFields(line, fields);
+
+		if ((fields.size() != 2) || (fields[0] != kManifestMagic) || (fields[1] != ADL2VGM_VERSION)) {
+			status("Ignoring crawl manifest \"%s\" of a different version", path.c_str());
+
+			std::fclose(file);
+			return true;
+		}
+	}
+
+	// One input per line: scope, key, identity, VGM files
+	while (Common::readLine(file, line)) {
+		Common::splitFields(line, fields);
+		if (fields.size() < 3)
+			continue;
+
+		Entry &entry = _entries[fields[0] + '\t' + fields[1]];
+
+		entry.scope    = fields[0];
+		entry.key      = fields[1];
+		entry.identity = fields[2];
+		entry.outputs.assign(fields.begin() + 3, fields.end());
+
+		// Inputs of other game directories, and merged inputs, stay as they are
+		entry.seen = merge || (entry.scope != _scope);
+	}
+
+	std::fclose(file);
+
+	return true;
+}
+
+CrawlManifest::Entry *CrawlManifest::find(const std::string &key) {
+	EntryMap::iterator entry = _entries.find(_scope + '\t' + key);
+	if (entry == _entries.end())
+		return 0;
+
+	return &entry->second;
+}
+
+bool CrawlManifest::isUpToDate(const std::string &key, const std::string &identity) {
+	Entry *entry = find(key);
+	if (!entry)
+		return false;
+
+	entry->seen = true;
+
+	if (identity.empty() || (entry->identity != identity))
+		return false;
+
+	const std::list<std::string> &outputs = entry->outputs;
+	for (std::list<std::string>::const_iterator o = outputs.begin(); o != outputs.end(); ++o) {
+		struct stat s;
+		if (stat(getOutputPath(*o).c_str(), &s) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+void CrawlManifest::update(const std::string &key, const std::string &identity,
+                           const std::list<std::string> &outputs) {
+
+	if (identity.empty())
+		return;
+
+	Entry &entry = _entries[_scope + '\t' + key];
+
+	entry.scope    = _scope;
+	entry.key      = key;
+	entry.identity = identity;
+	entry.outputs  = outputs;
+	entry.seen     = true;
+}
+
+void CrawlManifest::save() {
+	// Write into a temporary file first, so that a crash can't leave a broken manifest
+	const std::string tmpPath = _path + ".tmp";
+
+	std::FILE *file = std::fopen(tmpPath.c_str(), "w");
+	if (!file)
+		throw Common::Exception("Can't open \"%s\" for writing: %s", tmpPath.c_str(), strerror(errno));
+
+	std::fprintf(file, "%s\t%s\n", kManifestMagic, ADL2VGM_VERSION);
+
+	for (EntryMap::const_iterator e = _entries.begin(); e != _entries.end(); ++e) {
+		if (!e->second.seen)
+			continue;
+
+		std::fprintf(file, "%s\t%s\t%s", e->second.scope.c_str(), e->second.key.c_str(),
+		             e->second.identity.c_str());
+
+		const std::list<std::string> &outputs = e->second.outputs;
+		for (std::list<std::string>::const_iterator o = outputs.begin(); o != outputs.end(); ++o)
+			std::fprintf(file, "\t%s", o->c_str());
+
+		std::fprintf(file, "\n");
+	}
+
+	const bool failed = (std::fflush(file) != 0) || (std::ferror(file) != 0);
+
+	std::fclose(file);
+
+	if (failed || (std::rename(tmpPath.c_str(), _path.c_str()) != 0)) {
+		std::remove(tmpPath.c_str());
+
+		throw Common::Exception("Failed to write crawl manifest \"%s\"", _path.c_str());
+	}
+}
@@ -0,0 +1,111 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRAWLMANIFEST_HPP
+#define CRAWLMANIFEST_HPP
+
+#include <string>
+#include <list>
+#include <map>
+
+#include "common/types.hpp"
+
+/** The record of an earlier crawl, stored next to its VGM files.
+ *
+ *  For every converted input, the manifest remembers the identity of the
+ *  input files' data and which VGM files were created from them. When the
+ *  identity is still the same and all the VGM files still exist, the input
+ *  doesn't need to be converted again.
+ *
+ *  Several game directories can be crawled into the same target directory;
+ *  the inputs of each of them are kept apart by their scope.
+ *
+ *  The manifest is tied to the version of the converter; a manifest written
+ *  by a different version is ignored.
+ */
+class CrawlManifest {
+public:
+	/** Load the manifest found in the target directory, if any.
+	 *
+	 *  @param target The directory the VGM files are written to.
+	 *  @param scope  The game directory that's being crawled.
+	 *  @param name   The manifest's file name, if not the default one.
+	 */
+	CrawlManifest(const std::string &target, const std::string &scope, const std::string &name = "");
+	~CrawlManifest();
+
+	/** Were the VGM files of this input created from the same data? */
+	bool isUpToDate(const std::string &key, const std::string &identity);
+
+	/** Record the VGM files created from an input. */
+	void update(const std::string &key, const std::string &identity, const std::list<std::string> &outputs);
+
+	/** Write the manifest back into the target directory.
+	 *
+	 *  Inputs of this scope that were neither checked nor updated since
+	 *  loading the manifest are dropped.
+	 */
+	void save();
+
+	/** Take over all inputs recorded in another manifest within the target directory.
+	 *
+	 *  Inputs found in both manifests are taken from the other one.
+	 */
+	void merge(const std::string &name);
+
+	/** Return the file name of the manifest of one shard of a crawl. */
+	static std::string getShardName(uint shard, uint shardCount);
+	/** Find the file names of all shard manifests within a target directory. */
+	static void findShards(const std::string &target, std::list<std::string> &names);
+
+private:
+	struct Entry {
+		std::string scope;
+		std::string key;
+		std::string identity;
+		std::list<std::string> outputs;
+
+		bool seen; ///< Was this input found in the current crawl?
+
+		Entry();
+	};
+
+	typedef std::map<std::string, Entry> EntryMap;
+
+
+	std::string _target;
+	std::string _scope;
+	std::string _path;
+
+	EntryMap _entries;
+
+
+	/** Read the inputs recorded in a manifest file.
+	 *
+	 *  @return false if the file couldn't be opened.
+	 */
+	bool load(const std::string &path, bool merge);
+
+	Entry *find(const std::string &key);
+
+	std::string getOutputPath(const std::string &output) const;
+};
+
+#endif // CRAWLMANIFEST_HPP
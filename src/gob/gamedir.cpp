@@ -19,14 +19,20 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
 
 #include <cctype>
+#include <cstdio>
 #include <cstring>
 #include <cerrno>
 
+#include <vector>
+#include <algorithm>
+
 #include "common/error.hpp"
 #include "common/util.hpp"
+#include "common/stats.hpp"
 
 #include "gob/gamedir.hpp"
 
@@ -40,16 +46,17 @@ GameDir::File::File(const std::string &n, uint32 s, uint32 o, uint8 c, Archive &
 }
 
 
-GameDir::Archive::Archive(const std::string &n) : name(n) {
+GameDir::Archive::Archive(const std::string &n) : name(n), mtime(0) {
 }
 
 
-GameDir::GameDir(const std::string &path) : _path(path) {
+GameDir::GameDir(const std::string &path) : _path(path), _cacheLimit(0), _cacheUsage(0), _cacheTime(0) {
 	openDir();
 	openArchives();
 }
 
 GameDir::~GameDir() {
+	clearCache();
 	closeArchives();
 }
 
@@ -63,6 +70,14 @@ static std::string makeLower(const std::string &str) {
 	return l;
 }
 
+static std::string findFilename(const std::string &path) {
+	size_t sep = path.find_last_of("\\/");
+	if (sep == std::string::npos)
+		return path;
+
+	return std::string(path, sep + 1);
+}
+
 static bool hasExtension(const char *name, const char *ext) {
 	const char *p = strrchr(name, '.');
 	if (!p)
@@ -121,22 +136,33 @@ void GameDir::closeArchives() {
 }
 
 GameDir::Archive *GameDir::openArchive(const std::string &name) {
+	Common::StatsResource statsResource(name);
+	Common::StatsTimer    timer(Common::kStatsStageOpenArchive);
+
 	Archive *archive = new Archive(name);
-	if (!archive->file.open(archive->name))
+	if (!archive->file.open(archive->name)) {
+		delete archive;
 		throw Common::kOpenError;
+	}
+
+	struct stat s;
+	if (stat(archive->name.c_str(), &s) == 0)
+		archive->mtime = s.st_mtime;
 
-	uint16 fileCount = archive->file.readUint16LE();
+	Common::PositionalFileStream index(archive->file);
+
+	uint16 fileCount = index.readUint16LE();
 	for (uint16 i = 0; i < fileCount; i++) {
 		File file;
 
 		char fileName[14];
 
-		archive->file.read(fileName, 13);
+		index.read(fileName, 13);
 		fileName[13] = '\0';
 
-		file.size        = archive->file.readUint32LE();
-		file.offset      = archive->file.readUint32LE();
-		file.compression = archive->file.readByte() != 0;
+		file.size        = index.readUint32LE();
+		file.offset      = index.readUint32LE();
+		file.compression = index.readByte() != 0;
 
 		file.name = makeLower(fileName);
 
@@ -161,9 +187,15 @@ GameDir::Archive *GameDir::openArchive(const std::string &name) {
 			_tot.push_back(file.name);
 	}
 
+	timer.setBytes(index.pos(), 0);
+
 	return archive;
 }
 
+const std::string &GameDir::getPath() const {
+	return _path;
+}
+
 const std::list<std::string> &GameDir::getADL() const {
 	return _adl;
 }
@@ -177,6 +209,193 @@ const std::list<std::string> &GameDir::getTOT() const {
 }
 
 Common::SeekableReadStream *GameDir::getFile(const std::string &name) {
+	{
+		Common::ScopedLock lock(_mutex);
+
+		Common::SeekableReadStream *stream = (_cacheLimit > 0) ? getCachedFile(name) : 0;
+		if (stream)
+			return stream;
+	}
+
+	// Reading and unpacking happens without the lock, so that several threads can do it at once
+	Common::SeekableReadStream *stream = openFile(name);
+
+	Common::ScopedLock lock(_mutex);
+
+	if (_cacheLimit == 0)
+		return stream;
+
+	return addCachedFile(name, stream);
+}
+
+Common::SeekableReadStream *GameDir::getPackedFile(const std::string &name, uint8 &compression) {
+	compression = 0;
+
+	const std::string *directFile = findDirectFile(name);
+	if (directFile) {
+		Common::File file(_path + "/" + *directFile);
+
+		return file.readStream(file.size());
+	}
+
+	File *file = findArchiveFile(name);
+	if (!file)
+		throw Common::kOpenError;
+
+	compression = file->compression;
+
+	return readArchiveFile(*file);
+}
+
+/** A range of a file that's going to be read. */
+struct PrefetchRange {
+	const Common::PositionalFile *file;
+
+	uint32 offset;
+	uint32 size;
+
+	bool operator<(const PrefetchRange &right) const {
+		if (file != right.file)
+			return file < right.file;
+
+		return offset < right.offset;
+	}
+};
+
+void GameDir::prefetch(const std::list<std::string> &names) const {
+	std::vector<PrefetchRange> ranges;
+	std::list<Common::PositionalFile *> directFiles;
+
+	for (std::list<std::string>::const_iterator n = names.begin(); n != names.end(); ++n) {
+		PrefetchRange range;
+
+		const std::string *directFile = findDirectFile(*n);
+		if (directFile) {
+			Common::PositionalFile *file = new Common::PositionalFile;
+			if (!file->open(_path + "/" + *directFile)) {
+				delete file;
+				continue;
+			}
+
+			directFiles.push_back(file);
+
+			range.file   = file;
+			range.offset = 0;
+			range.size   = file->size();
+
+		} else {
+			const File *file = findArchiveFile(*n);
+			if (!file || !file->archive)
+				continue;
+
+			range.file   = &file->archive->file;
+			range.offset = file->offset;
+			range.size   = file->size;
+		}
+
+		ranges.push_back(range);
+	}
+
+	std::sort(ranges.begin(), ranges.end());
+
+	// Merge adjacent and overlapping reads into one hint each
+	for (std::vector<PrefetchRange>::const_iterator r = ranges.begin(); r != ranges.end(); ) {
+		PrefetchRange merged = *r;
+
+		for (++r; (r != ranges.end()) && (r->file == merged.file) && (r->offset <= (merged.offset + merged.size)); ++r)
+			merged.size = MAX(merged.size, r->offset + r->size - merged.offset);
+
+		merged.file->prefetch(merged.offset, merged.size);
+	}
+
+	// The system keeps on reading after the file is closed
+	for (std::list<Common::PositionalFile *>::iterator f = directFiles.begin(); f != directFiles.end(); ++f)
+		delete *f;
+}
+
+void GameDir::setCacheLimit(uint32 limit) {
+	Common::ScopedLock lock(_mutex);
+
+	_cacheLimit = limit;
+
+	trimCache(_cacheLimit);
+}
+
+uint32 GameDir::getCacheUsage() const {
+	Common::ScopedLock lock(_mutex);
+
+	return _cacheUsage;
+}
+
+Common::SeekableReadStream *GameDir::getCachedFile(const std::string &name) {
+	FileCache::iterator cached = _cache.find(makeLower(name));
+	if (cached == _cache.end())
+		return 0;
+
+	cached->second.lastUse = ++_cacheTime;
+
+	// Hand out a copy, so that the stream stays valid when the file is dropped from the cache
+	byte *data = new byte[cached->second.size];
+	std::memcpy(data, cached->second.data, cached->second.size);
+
+	return new Common::MemoryReadStream(data, cached->second.size, true);
+}
+
+Common::SeekableReadStream *GameDir::addCachedFile(const std::string &name, Common::SeekableReadStream *stream) {
+	const uint32 size = stream->size();
+	if ((size == 0) || (size > _cacheLimit))
+		return stream;
+
+	// Another thread might have been faster
+	if (_cache.find(makeLower(name)) != _cache.end())
+		return stream;
+
+	byte *data = new byte[size];
+
+	if (!stream->seek(0) || (stream->read(data, size) != size)) {
+		delete[] data;
+		delete stream;
+
+		throw Common::kReadError;
+	}
+
+	delete stream;
+
+	trimCache(_cacheLimit - size);
+
+	CachedFile &cached = _cache[makeLower(name)];
+
+	cached.data    = data;
+	cached.size    = size;
+	cached.lastUse = ++_cacheTime;
+
+	_cacheUsage += size;
+
+	byte *copy = new byte[size];
+	std::memcpy(copy, data, size);
+
+	return new Common::MemoryReadStream(copy, size, true);
+}
+
+void GameDir::trimCache(uint32 limit) {
+	while (_cacheUsage > limit) {
+		FileCache::iterator oldest = _cache.begin();
+		for (FileCache::iterator c = _cache.begin(); c != _cache.end(); ++c)
+			if (c->second.lastUse < oldest->second.lastUse)
+				oldest = c;
+
+		_cacheUsage -= oldest->second.size;
+
+		delete[] oldest->second.data;
+		_cache.erase(oldest);
+	}
+}
+
+void GameDir::clearCache() {
+	trimCache(0);
+}
+
+Common::SeekableReadStream *GameDir::openFile(const std::string &name) {
 	Common::SeekableReadStream *stream = openDirectFile(name);
 	if (stream)
 		return stream;
@@ -188,29 +407,74 @@ Common::SeekableReadStream *GameDir::getFile(const std::string &name) {
 	return openArchiveFile(*file);
 }
 
-Common::SeekableReadStream *GameDir::openDirectFile(const std::string &name) {
-	for (std::list<std::string>::const_iterator f = _files.begin(); f != _files.end(); ++f) {
-		if (adl2vgm_stricmp(f->c_str(), name.c_str()))
-			continue;
+std::string GameDir::getFileIdentity(const std::string &name) const {
+	char identity[64];
 
-		Common::File *file = 0;
-		try {
-			file = new Common::File(_path + "/" + *f);
-		} catch (Common::Exception &e) {
-			delete file;
-			throw;
-		}
+	const std::string *directFile = findDirectFile(name);
+	if (directFile) {
+		struct stat s;
+		if (stat((_path + "/" + *directFile).c_str(), &s) != 0)
+			return "";
+
+		snprintf(identity, sizeof(identity), "@0+%lld/%lld:%lld",
+		         (long long) s.st_size, (long long) s.st_size, (long long) s.st_mtime);
+
+		return *directFile + identity;
+	}
+
+	const File *file = findArchiveFile(name);
+	if (!file)
+		return "";
 
-		return file;
+	snprintf(identity, sizeof(identity), "@%u+%u/%d:%lld", file->offset, file->size,
+	         file->archive->file.size(), (long long) file->archive->mtime);
+
+	return findFilename(file->archive->name) + "/" + file->name + identity;
+}
+
+bool GameDir::getFileSize(const std::string &name, uint32 &size, uint8 &compression) const {
+	compression = 0;
+
+	const std::string *directFile = findDirectFile(name);
+	if (directFile) {
+		struct stat s;
+		if (stat((_path + "/" + *directFile).c_str(), &s) != 0)
+			return false;
+
+		size = s.st_size;
+		return true;
 	}
 
+	const File *file = findArchiveFile(name);
+	if (!file)
+		return false;
+
+	size        = file->size;
+	compression = file->compression;
+
+	return true;
+}
+
+const std::string *GameDir::findDirectFile(const std::string &name) const {
+	for (std::list<std::string>::const_iterator f = _files.begin(); f != _files.end(); ++f)
+		if (!adl2vgm_stricmp(f->c_str(), name.c_str()))
+			return &*f;
+
 	return 0;
 }
 
-GameDir::File *GameDir::findArchiveFile(std::string name) {
+Common::SeekableReadStream *GameDir::openDirectFile(const std::string &name) {
+	const std::string *directFile = findDirectFile(name);
+	if (!directFile)
+		return 0;
+
+	return new Common::File(_path + "/" + *directFile);
+}
+
+GameDir::File *GameDir::findArchiveFile(std::string name) const {
 	name = makeLower(name);
 
-	for (std::list<Archive *>::iterator a = _archives.begin(); a != _archives.end(); ++a) {
+	for (std::list<Archive *>::const_iterator a = _archives.begin(); a != _archives.end(); ++a) {
 		FileMap::iterator file = (*a)->files.find(name);
 		if (file != (*a)->files.end())
 			return &file->second;
@@ -220,16 +484,7 @@ GameDir::File *GameDir::findArchiveFile(std::string name) {
 }
 
 Common::SeekableReadStream *GameDir::openArchiveFile(File &file) {
-	if (!file.archive)
-		throw Common::Exception("File has no archive");
-
-	if (!file.archive->file.isOpen())
-		throw Common::Exception("File's archive is not open");
-
-	if (!file.archive->file.seek(file.offset))
-		throw Common::kSeekError;
-
-	Common::SeekableReadStream *rawData = file.archive->file.readStream(file.size);
+	Common::SeekableReadStream *rawData = readArchiveFile(file);
 
 	if (file.compression == 0)
 		return rawData;
@@ -241,6 +496,16 @@ Common::SeekableReadStream *GameDir::openArchiveFile(File &file) {
 	return unpackedData;
 }
 
+Common::SeekableReadStream *GameDir::readArchiveFile(File &file) {
+	if (!file.archive)
+		throw Common::Exception("File has no archive");
+
+	if (!file.archive->file.isOpen())
+		throw Common::Exception("File's archive is not open");
+
+	return file.archive->file.readStream(file.offset, file.size);
+}
+
 Common::SeekableReadStream *GameDir::unpack(Common::SeekableReadStream &src, uint8 compression) {
 	int32 size;
 
@@ -274,6 +539,8 @@ uint32 GameDir::getSizeChunks(Common::SeekableReadStream &src) {
 }
 
 byte *GameDir::unpack(Common::SeekableReadStream &src, int32 &size, uint8 compression) {
+	Common::StatsTimer timer(Common::kStatsStageUnpack);
+
 	if ((compression != 1) && (compression != 2))
 		throw Common::Exception("Invalid compression (%d)", compression);
 
@@ -292,6 +559,8 @@ byte *GameDir::unpack(Common::SeekableReadStream &src, int32 &size, uint8 compre
 	else if (compression == 2)
 		unpackChunks(src, data, size);
 
+	timer.setBytes(src.size(), size);
+
 	return data;
 }
 
@@ -27,6 +27,7 @@
 
 #include "common/types.hpp"
 #include "common/file.hpp"
+#include "common/thread.hpp"
 
 namespace Common {
 	class SeekableReadStream;
@@ -39,12 +40,60 @@ public:
 	GameDir(const std::string &path);
 	~GameDir();
 
+	const std::string &getPath() const;
+
 	const std::list<std::string> &getADL() const;
 	const std::list<std::string> &getMDY() const;
 	const std::list<std::string> &getTOT() const;
 
+	/** Open a file, unpacking it if necessary.
+	 *
+	 *  Like all methods reading files, this can be called from several threads at once.
+	 */
 	Common::SeekableReadStream *getFile(const std::string &name);
 
+	/** Read a file's data into memory as it is stored, without unpacking it.
+	 *
+	 *  The compression method the data needs to be unpacked with, if any, is
+	 *  written into compression. Together with unpack(), this lets reading
+	 *  and unpacking happen in different threads.
+	 */
+	Common::SeekableReadStream *getPackedFile(const std::string &name, uint8 &compression);
+
+	/** Return a string identifying the current state of a file's data.
+	 *
+	 *  The identity is made up of the file or archive the data is stored in,
+	 *  its offset and size within, and the size and modification time of the
+	 *  whole file or archive. If the file does not exist, an empty string is
+	 *  returned.
+	 */
+	std::string getFileIdentity(const std::string &name) const;
+
+	/** Find the size of a file's data as it is stored, and how it's compressed.
+	 *
+	 *  @return false if the file does not exist.
+	 */
+	bool getFileSize(const std::string &name, uint32 &size, uint8 &compression) const;
+
+	/** Keep up to limit bytes of opened and unpacked files in memory.
+	 *
+	 *  Further getFile() calls for a cached file are then served from memory.
+	 *  If the cache grows over the limit, the least recently used files are dropped.
+	 *  A limit of 0 disables the cache.
+	 */
+	void setCacheLimit(uint32 limit);
+	/** Return the number of bytes currently held by the cache. */
+	uint32 getCacheUsage() const;
+
+	/** Announce that these files are going to be read soon.
+	 *
+	 *  The reads are sorted by archive and offset, adjacent reads are merged,
+	 *  and the system is told to start reading them in the background. Later
+	 *  reads, in whatever order they come, then find the data in memory more
+	 *  often, instead of seeking across the archives.
+	 */
+	void prefetch(const std::list<std::string> &names) const;
+
 	static Common::SeekableReadStream *unpack(Common::SeekableReadStream &src, uint8 compression);
 
 private:
@@ -64,9 +113,19 @@ private:
 
 	typedef std::map<std::string, File> FileMap;
 
+	struct CachedFile {
+		byte  *data;
+		uint32 size;
+		uint32 lastUse;
+	};
+
+	typedef std::map<std::string, CachedFile> FileCache;
+
 	struct Archive {
-		std::string  name;
-		Common::File file;
+		std::string            name;
+		Common::PositionalFile file;
+
+		int64 mtime; ///< Modification time of the archive file.
 
 		FileMap files;
 
@@ -85,6 +144,14 @@ private:
 
 	std::list<Archive *> _archives;
 
+	FileCache _cache;
+	uint32    _cacheLimit;
+	uint32    _cacheUsage;
+	uint32    _cacheTime;
+
+	/** Guards the cache against concurrent access. The archives are read without locking. */
+	mutable Common::Mutex _mutex;
+
 
 	void openDir();
 
@@ -93,10 +160,19 @@ private:
 
 	Archive *openArchive(const std::string &name);
 
+	Common::SeekableReadStream *openFile(const std::string &name);
 	Common::SeekableReadStream *openDirectFile(const std::string &name);
 
-	File *findArchiveFile(std::string name);
+	Common::SeekableReadStream *getCachedFile(const std::string &name);
+	Common::SeekableReadStream *addCachedFile(const std::string &name, Common::SeekableReadStream *stream);
+	void trimCache(uint32 limit);
+	void clearCache();
+
+	const std::string *findDirectFile(const std::string &name) const;
+
+	File *findArchiveFile(std::string name) const;
 	Common::SeekableReadStream *openArchiveFile(File &file);
+	Common::SeekableReadStream *readArchiveFile(File &file);
 
 	static uint32 getSizeChunks(Common::SeekableReadStream &src);
 
@@ -21,6 +21,7 @@
 #include "common/util.hpp"
 #include "common/error.hpp"
 #include "common/stream.hpp"
+#include "common/stats.hpp"
 
 #include "gob/totfile.hpp"
 #include "gob/gamedir.hpp"
@@ -52,18 +53,45 @@ TOTFile::TOTFile(GameDir &gameDir, const std::string &name) :
 
 	_name = std::string(name, 0, name.find_last_of('.'));
 
-	load(gameDir);
+	try {
+		load(gameDir, false);
+	} catch (...) {
+		unload();
+		throw;
+	}
+}
+
+TOTFile::TOTFile(GameDir &gameDir, const std::string &name,
+                 Common::SeekableReadStream *tot, Common::SeekableReadStream *ext) :
+	_totFile(tot), _extFile(ext), _exFile(0), _imFile(0), _totResourceTable(0), _extResourceTable(0) {
+
+	_name = std::string(name, 0, name.find_last_of('.'));
+
+	try {
+		if (!_totFile)
+			throw Common::kOpenError;
+
+		load(gameDir, true);
+	} catch (...) {
+		unload();
+		throw;
+	}
 }
 
 TOTFile::~TOTFile() {
 	unload();
 }
 
-void TOTFile::load(GameDir &gameDir) {
-	_totFile = gameDir.getFile(_name + ".tot");
+void TOTFile::load(GameDir &gameDir, bool preloaded) {
+	Common::StatsTimer timer(Common::kStatsStageLoadTOT);
+
+	if (!preloaded)
+		_totFile = gameDir.getFile(_name + ".tot");
 
 	loadProperties();
-	loadEXTFile(gameDir);
+
+	if (!preloaded)
+		loadEXTFile(gameDir);
 
 	bool hasTOTRes = loadTOTResourceTable();
 	bool hasEXTRes = loadEXTResourceTable();
@@ -83,6 +111,8 @@ void TOTFile::load(GameDir &gameDir) {
 
 	if (hasEXTRes)
 		loadEXFile(gameDir);
+
+	timer.setBytes(_totFile->size() + (_extFile ? _extFile->size() : 0), 0);
 }
 
 void TOTFile::loadProperties() {
@@ -321,16 +351,7 @@ Common::SeekableReadStream *TOTFile::getEXTResource(uint16 id) const {
 
 	EXTResourceItem &extItem = _extResourceTable->items[id];
 
-	uint32 size = extItem.size;
-
-	if (extItem.width & 0x4000)
-		size += 1 << 16;
-	if (extItem.width & 0x2000)
-		size += 2 << 16;
-	if (extItem.width & 0x1000)
-		size += 4 << 16;
-	if (extItem.height == 0)
-		size += extItem.width << 16;
+	uint32 size = getEXTItemSize(extItem);
 
 	Common::SeekableReadStream *data = 0;
 	if (extItem.type == kResourceEXT)
@@ -351,6 +372,33 @@ Common::SeekableReadStream *TOTFile::getEXTResource(uint16 id) const {
 	return unpackData;
 }
 
+uint32 TOTFile::getResourcesSize() const {
+	uint32 size = 0;
+
+	for (uint16 i = 0; i < getTOTResourceCount(); i++)
+		size += _totResourceTable->items[i].size;
+
+	for (uint16 i = 0; i < getEXTResourceCount(); i++)
+		size += getEXTItemSize(_extResourceTable->items[i]);
+
+	return size;
+}
+
+uint32 TOTFile::getEXTItemSize(const EXTResourceItem &extItem) {
+	uint32 size = extItem.size;
+
+	if (extItem.width & 0x4000)
+		size += 1 << 16;
+	if (extItem.width & 0x2000)
+		size += 2 << 16;
+	if (extItem.width & 0x1000)
+		size += 4 << 16;
+	if (extItem.height == 0)
+		size += extItem.width << 16;
+
+	return size;
+}
+
 Common::SeekableReadStream *TOTFile::getTOTData(TOTResourceItem &totItem) const {
 	if (!_totFile)
 		throw Common::Exception("No TOT file");
@@ -36,6 +36,13 @@ class GameDir;
 class TOTFile {
 public:
 	TOTFile(GameDir &gameDir, const std::string &name);
+	/** Load a TOT whose .tot and .ext files have already been read.
+	 *
+	 *  The TOT takes over both streams; ext is 0 if the TOT has no .ext file.
+	 *  The commun files the resources can come from are still opened from gameDir.
+	 */
+	TOTFile(GameDir &gameDir, const std::string &name,
+	        Common::SeekableReadStream *tot, Common::SeekableReadStream *ext);
 	~TOTFile();
 
 	const std::string &getName() const;
@@ -46,6 +53,9 @@ public:
 	Common::SeekableReadStream *getTOTResource(uint16 id) const;
 	Common::SeekableReadStream *getEXTResource(uint16 id) const;
 
+	/** Return the combined size of all resources, as they are stored. */
+	uint32 getResourcesSize() const;
+
 private:
 	// Structure sizes in the files
 	static const int kTOTResItemSize   = 4 + 2 + 2 + 2;
@@ -130,13 +140,15 @@ private:
 	EXTResourceTable *_extResourceTable;
 
 
-	void load(GameDir &gameDir);
+	void load(GameDir &gameDir, bool preloaded);
 	void unload();
 
 	void loadProperties();
 	bool loadTOTResourceTable();
 	bool loadEXTResourceTable();
 
+	static uint32 getEXTItemSize(const EXTResourceItem &extItem);
+
 	void loadEXTFile(GameDir &gameDir);
 	void loadIMFile(GameDir &gameDir);
 	void loadEXFile(GameDir &gameDir);
@@ -0,0 +1,910 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <vector>
+#include <list>
+#include <map>
+
+#include "common/util.hpp"
+#include "common/error.hpp"
+#include "common/strutil.hpp"
+#include "common/stream.hpp"
+#include "common/file.hpp"
+
+#include "adlib/adlplayer.hpp"
+#include "adlib/musplayer.hpp"
+#include "adlib/scheduler.hpp"
+
+#include "gob/gamedir.hpp"
+#include "gob/totfile.hpp"
+
+#include "server.hpp"
+
+#ifdef UNIX
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+
+/** Maximum length of a request line. */
+static const uint32 kMaxLineLength = 65536;
+/** Maximum size of inline file data. */
+static const uint32 kMaxDataSize   = 16 * 1024 * 1024;
+/** Maximum number of bytes read ahead of the request being handled: a line, and the data of a MDY request. */
+static const uint32 kMaxReadAhead  = kMaxLineLength + 2 * kMaxDataSize;
+
+/** Return the message of an exception as a single line. */
+static std::string getMessage(Common::Exception &e) {
+	Common::Exception::Stack stack = e.getStack();
+
+	std::string message;
+	while (!stack.empty()) {
+		if (!message.empty())
+			message += ": ";
+
+		message += stack.top();
+		stack.pop();
+	}
+
+	// Keep the answer a single line
+	for (std::string::iterator c = message.begin(); c != message.end(); ++c)
+		if ((*c == '\n') || (*c == '\r'))
+			*c = ' ';
+
+	return message;
+}
+
+/** A client connection, with buffered non-blocking reading and writing. */
+class Connection {
+public:
+	Connection(int fd) : _fd(fd), _inputPos(0), _outputPos(0), _ended(false), _broken(false) {
+		fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	~Connection() {
+		close(_fd);
+	}
+
+	int getFD() const {
+		return _fd;
+	}
+
+	/** Has the client stopped sending? */
+	bool hasEnded() const {
+		return _ended;
+	}
+
+	/** Read what arrived so far, up to a limit of what waits to be taken. */
+	void receive() {
+		while (!_ended && (getAvailable() < kMaxReadAhead)) {
+			byte buffer[4096];
+
+			ssize_t n = ::read(_fd, buffer, sizeof(buffer));
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+					return;
+
+				throw Common::Exception("Failed to read request: %s", strerror(errno));
+			}
+
+			if (n == 0) {
+				_ended = true;
+				return;
+			}
+
+			_input.insert(_input.end(), buffer, buffer + n);
+		}
+	}
+
+	/** Take a line out of what arrived, without the line ending.
+	 *
+	 *  @return false if no complete line arrived yet.
+	 */
+	bool takeLine(std::string &line) {
+		if (getAvailable() == 0)
+			return false;
+
+		const byte *start = &_input[_inputPos];
+		const byte *end   = (const byte *) std::memchr(start, '\n', getAvailable());
+
+		size_t size = getAvailable();
+		if (end)
+			size = (end - start) + 1;
+		else if (getAvailable() > kMaxLineLength)
+			throw Common::Exception("Request line too long");
+		else if (!_ended)
+			return false;
+
+		// A last line without a line ending still counts
+		line.assign((const char *) start, end ? (end - start) : size);
+		if (!line.empty() && (*line.rbegin() == '\r'))
+			line.erase(--line.end());
+
+		drop(size);
+		return true;
+	}
+
+	/** Return the number of bytes that arrived, but weren't taken yet. */
+	size_t getAvailable() const {
+		return _input.size() - _inputPos;
+	}
+
+	/** Take size bytes out of what arrived. At least that many need to be available. */
+	void take(std::vector<byte> &data, uint32 size) {
+		data.assign(_input.begin() + _inputPos, _input.begin() + _inputPos + size);
+
+		drop(size);
+	}
+
+	/** Queue size bytes to be written, and write as many as possible right away. */
+	void write(const void *data, uint32 size) {
+		// Writing failed before, and was already reported
+		if (_broken)
+			return;
+
+		const byte *ptr = (const byte *) data;
+
+		_output.insert(_output.end(), ptr, ptr + size);
+
+		flush();
+	}
+
+	void writeString(const std::string &str) {
+		write(str.c_str(), str.size());
+	}
+
+	/** Are there queued bytes that couldn't be written yet? */
+	bool hasOutput() const {
+		return _outputPos < _output.size();
+	}
+
+	/** Write as many of the queued bytes as possible, without waiting. */
+	void flush() {
+		while (hasOutput()) {
+			ssize_t n = ::write(_fd, &_output[_outputPos], _output.size() - _outputPos);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+					return;
+
+				// The answers can't go anywhere anymore
+				_output.clear();
+				_outputPos = 0;
+
+				_broken = true;
+
+				throw Common::Exception("Failed to write answer: %s", strerror(errno));
+			}
+
+			_outputPos += n;
+		}
+
+		_output.clear();
+		_outputPos = 0;
+	}
+
+private:
+	int _fd;
+
+	std::vector<byte> _input;
+	size_t _inputPos;
+
+	std::vector<byte> _output;
+	size_t _outputPos;
+
+	bool _ended;
+	bool _broken; ///< Did writing fail?
+
+	void drop(size_t size) {
+		_inputPos += size;
+
+		// Move what's left to the front, once it's cheap compared to what was read
+		if (_inputPos >= (_input.size() / 2)) {
+			_input.erase(_input.begin(), _input.begin() + _inputPos);
+			_inputPos = 0;
+		}
+	}
+};
+
+class Conversion;
+
+/** A client of the server, and the request it's on. */
+struct Client {
+	Connection connection;
+
+	std::vector<std::string> request; ///< The request still waiting for its inline data.
+
+	Conversion *conversion; ///< The conversion of the current request, if it's running.
+
+	bool closing; ///< Close the connection once the answers are out?
+	bool desync;  ///< Did we fail to read the inline data of a request?
+
+	Client(int fd) : connection(fd), conversion(0), closing(false), desync(false) {
+	}
+};
+
+/** The conversion of a request into VGM, played a slice at a time alongside the others. */
+class Conversion : public AdLib::SongScheduler::Task {
+public:
+	/** Convert a song for a client. The conversion takes over the player. */
+	Conversion(Client &client, AdLib::AdLib *player, const std::string &vgmFile) : _client(&client),
+		_player(player), _sink(_vgmData), _vgmFile(vgmFile) {
+
+		_client->conversion = this;
+	}
+
+	~Conversion() {
+		_client->conversion = 0;
+
+		delete _player;
+	}
+
+	AdLib::AdLib &getPlayer() {
+		return *_player;
+	}
+
+	AdLib::OPLSink &getSink() {
+		return _sink;
+	}
+
+	void finish(const Common::Exception *error) {
+		try {
+			if (error)
+				throw *error;
+
+			answer();
+
+		} catch (Common::Exception &e) {
+			try {
+				_client->connection.writeString("ERR\t" + getMessage(e) + "\n");
+			} catch (Common::Exception &w) {
+				// The client went away, there's no one left to answer
+				Common::printException(w, "WARNING: ");
+
+				_client->closing = true;
+			}
+		}
+
+		delete this;
+	}
+
+private:
+	Client *_client;
+
+	AdLib::AdLib *_player;
+
+	std::vector<byte> _vgmData;
+	AdLib::VGMSink    _sink;
+
+	std::string _vgmFile;
+
+	void answer() {
+		if (!_vgmFile.empty()) {
+			Common::DumpFile vgm;
+			if (!vgm.open(_vgmFile))
+				throw Common::Exception("Failed to open \"%s\" for writing", _vgmFile.c_str());
+
+			_sink.write(vgm);
+
+			vgm.flush();
+			vgm.close();
+
+			if (vgm.err())
+				throw Common::kWriteError;
+
+			_client->connection.writeString("OK\t0\n");
+			return;
+		}
+
+		Common::MemoryWriteStreamDynamic vgm(true);
+		_sink.write(vgm);
+
+		char header[32];
+		snprintf(header, sizeof(header), "OK\t%u\n", vgm.size());
+
+		_client->connection.writeString(header);
+		_client->connection.write(vgm.getData(), vgm.size());
+	}
+};
+
+/** The conversion server and its warm state. */
+class Server {
+public:
+	Server(const std::string &socketPath, uint32 cacheLimit, const AdLib::PlayLimits &limits);
+	~Server();
+
+	void run();
+
+private:
+	struct CachedGameDir {
+		Gob::GameDir *gameDir;
+		uint32 lastUse;
+	};
+
+	typedef std::map<std::string, CachedGameDir> GameDirMap;
+
+	typedef std::list<Client *> Clients;
+
+
+	std::string _socketPath;
+	int _socket;
+
+	dev_t _socketDevice; ///< The device of the socket file we created.
+	ino_t _socketInode;  ///< The inode of the socket file we created.
+
+	uint32 _cacheLimit;
+
+	AdLib::PlayLimits _limits;
+
+	GameDirMap _gameDirs;
+	uint32 _gameDirTime;
+
+	Clients _clients;
+
+	/** Plays the conversions of all clients side by side. */
+	AdLib::SongScheduler _scheduler;
+
+	bool _quit;
+
+
+	void open();
+	void close();
+
+	/** Remove a socket file left behind by a server that's gone.
+	 *
+	 *  Throws if the path is something other than a socket, or if a server
+	 *  is still listening on it.
+	 */
+	void removeStaleSocket(const struct sockaddr_un &address);
+
+	void accept();
+
+	/** Handle the requests of a client that arrived, until one of them is being converted. */
+	void serve(Client &client);
+	/** Handle a request.
+	 *
+	 *  @return false if the inline data of the request hasn't arrived completely yet.
+	 */
+	bool handleRequest(Client &client, const std::vector<std::string> &fields);
+
+	/** Close the connections that are done. */
+	void closeClients();
+	/** Are there answers that couldn't be written yet? */
+	bool hasOutput() const;
+
+	Gob::GameDir &getGameDir(const std::string &path);
+	void trimGameDirs(const Gob::GameDir &current);
+
+	void answer(Client &client, AdLib::AdLib *player, const std::string &vgmFile);
+
+	static uint32 parseSize(const std::string &str);
+	/** Parse the size of inline data, which can't be empty. */
+	static uint32 parseDataSize(const std::string &str);
+};
+
+Server::Server(const std::string &socketPath, uint32 cacheLimit, const AdLib::PlayLimits &limits) :
+	_socketPath(socketPath), _socket(-1), _socketDevice(0), _socketInode(0), _cacheLimit(cacheLimit), _limits(limits), _gameDirTime(0),
+	_quit(false) {
+
+	open();
+}
+
+Server::~Server() {
+	_scheduler.stop();
+
+	for (Clients::iterator c = _clients.begin(); c != _clients.end(); ++c) {
+		delete (*c)->conversion;
+		delete *c;
+	}
+
+	close();
+
+	for (GameDirMap::iterator g = _gameDirs.begin(); g != _gameDirs.end(); ++g)
+		delete g->second.gameDir;
+}
+
+void Server::open() {
+	struct sockaddr_un address;
+	std::memset(&address, 0, sizeof(address));
+
+	if (_socketPath.size() >= sizeof(address.sun_path))
+		throw Common::Exception("Socket path \"%s\" too long", _socketPath.c_str());
+
+	address.sun_family = AF_UNIX;
+	std::strcpy(address.sun_path, _socketPath.c_str());
+
+	removeStaleSocket(address);
+
+	if ((_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		throw Common::Exception("Can't create socket: %s", strerror(errno));
+
+	if (bind(_socket, (struct sockaddr *) &address, sizeof(address)) != 0) {
+		Common::Exception e("Can't bind socket \"%s\": %s", _socketPath.c_str(), strerror(errno));
+
+		::close(_socket);
+		_socket = -1;
+
+		throw e;
+	}
+
+	// Remember our socket file, so that we only ever remove that one again
+	struct stat socketStat;
+	if (lstat(_socketPath.c_str(), &socketStat) == 0) {
+		_socketDevice = socketStat.st_dev;
+		_socketInode  = socketStat.st_ino;
+	}
+
+	if (listen(_socket, 128) != 0) {
+		Common::Exception e("Can't listen on socket \"%s\": %s", _socketPath.c_str(), strerror(errno));
+
+		close();
+		throw e;
+	}
+
+	// A client that went away before we accepted it should not hold us up
+	fcntl(_socket, F_SETFL, fcntl(_socket, F_GETFL) | O_NONBLOCK);
+
+	// A client closing its connection early should not kill us
+	signal(SIGPIPE, SIG_IGN);
+}
+
+void Server::close() {
+	if (_socket < 0)
+		return;
+
+	::close(_socket);
+
+	struct stat socketStat;
+	if ((lstat(_socketPath.c_str(), &socketStat) == 0) && S_ISSOCK(socketStat.st_mode) &&
+	    (socketStat.st_dev == _socketDevice) && (socketStat.st_ino == _socketInode))
+		unlink(_socketPath.c_str());
+
+	_socket = -1;
+}
+
+void Server::removeStaleSocket(const struct sockaddr_un &address) {
+	struct stat socketStat;
+	if (lstat(_socketPath.c_str(), &socketStat) != 0) {
+		if (errno == ENOENT)
+			return;
+
+		throw Common::Exception("Can't stat socket \"%s\": %s", _socketPath.c_str(), strerror(errno));
+	}
+
+	if (!S_ISSOCK(socketStat.st_mode))
+		throw Common::Exception("\"%s\" exists and is not a socket", _socketPath.c_str());
+
+	// Only a socket nobody listens on anymore is stale
+	int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe < 0)
+		throw Common::Exception("Can't create socket: %s", strerror(errno));
+
+	const bool listening = connect(probe, (const struct sockaddr *) &address, sizeof(address)) == 0;
+	const int  error     = errno;
+
+	::close(probe);
+
+	if (listening)
+		throw Common::Exception("A server is already listening on \"%s\"", _socketPath.c_str());
+	if (error != ECONNREFUSED)
+		throw Common::Exception("Can't check socket \"%s\": %s", _socketPath.c_str(), strerror(error));
+
+	unlink(_socketPath.c_str());
+}
+
+void Server::run() {
+	status("Listening on \"%s\"", _socketPath.c_str());
+
+	std::vector<struct pollfd> fds;
+
+	// After a quit request, the conversions still running are answered before shutting down
+	while (!_quit || (_scheduler.getSongCount() > 0) || hasOutput()) {
+		const bool listening = !_quit;
+
+		fds.clear();
+
+		if (listening) {
+			struct pollfd fd = { _socket, POLLIN, 0 };
+			fds.push_back(fd);
+		}
+
+		for (Clients::iterator c = _clients.begin(); c != _clients.end(); ++c) {
+			Client &client = **c;
+
+			struct pollfd fd = { client.connection.getFD(), 0, 0 };
+
+			// Don't read ahead of a running conversion, so that a client can't pile up requests
+			if (!_quit && !client.closing && !client.conversion && !client.connection.hasEnded())
+				fd.events |= POLLIN;
+			if (client.connection.hasOutput())
+				fd.events |= POLLOUT;
+
+			fds.push_back(fd);
+		}
+
+		// While songs are playing, only look at the sockets in passing
+		if (poll(&fds[0], fds.size(), (_scheduler.getSongCount() > 0) ? 0 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			throw Common::Exception("Can't poll connections: %s", strerror(errno));
+		}
+
+		std::vector<struct pollfd>::const_iterator fd = fds.begin();
+
+		if (listening && ((fd++)->revents & POLLIN))
+			accept();
+
+		for (Clients::iterator c = _clients.begin(); (c != _clients.end()) && (fd != fds.end()); ++c, ++fd) {
+			Client &client = **c;
+
+			try {
+				if (fd->revents & POLLOUT)
+					client.connection.flush();
+				if (fd->revents & (POLLIN | POLLHUP | POLLERR))
+					client.connection.receive();
+
+				serve(client);
+
+			} catch (Common::Exception &e) {
+				Common::printException(e, "WARNING: ");
+
+				client.closing = true;
+			}
+		}
+
+		_scheduler.runRound();
+
+		// Requests that arrived behind a conversion that just finished are already read
+		for (Clients::iterator c = _clients.begin(); c != _clients.end(); ++c) {
+			Client &client = **c;
+			if (client.conversion || (client.connection.getAvailable() == 0))
+				continue;
+
+			try {
+				serve(client);
+			} catch (Common::Exception &e) {
+				Common::printException(e, "WARNING: ");
+
+				client.closing = true;
+			}
+		}
+
+		closeClients();
+	}
+
+	status("Shutting down");
+}
+
+void Server::accept() {
+	while (true) {
+		int fd = ::accept(_socket, 0, 0);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ECONNABORTED))
+				return;
+
+			throw Common::Exception("Can't accept connection: %s", strerror(errno));
+		}
+
+		_clients.push_back(new Client(fd));
+	}
+}
+
+void Server::serve(Client &client) {
+	std::string line;
+
+	while (!_quit && !client.closing && !client.conversion) {
+		if (client.request.empty()) {
+			if (!client.connection.takeLine(line))
+				break;
+
+			Common::splitFields(line, client.request);
+			if (client.request.empty())
+				continue;
+		}
+
+		try {
+			if (!handleRequest(client, client.request)) {
+				if (!client.connection.hasEnded())
+					break;
+
+				throw Common::Exception("Unexpected end of request data");
+			}
+
+		} catch (Common::Exception &e) {
+			client.connection.writeString("ERR\t" + getMessage(e) + "\n");
+		}
+
+		client.request.clear();
+
+		// We don't know where the next request starts, so drop the connection
+		if (client.desync)
+			client.closing = true;
+	}
+}
+
+void Server::closeClients() {
+	for (Clients::iterator c = _clients.begin(); c != _clients.end(); ) {
+		Client &client = **c;
+
+		// A client that stopped sending is done once all of its requests are answered
+		const bool done = client.closing ||
+			(client.connection.hasEnded() && client.request.empty() && (client.connection.getAvailable() == 0));
+
+		if (!done || client.conversion || client.connection.hasOutput()) {
+			++c;
+			continue;
+		}
+
+		delete *c;
+		c = _clients.erase(c);
+	}
+}
+
+bool Server::hasOutput() const {
+	for (Clients::const_iterator c = _clients.begin(); c != _clients.end(); ++c)
+		if ((*c)->connection.hasOutput())
+			return true;
+
+	return false;
+}
+
+bool Server::handleRequest(Client &client, const std::vector<std::string> &fields) {
+	const std::string &type = fields[0];
+
+	if        (type == "quit") {
+		_quit = true;
+
+		client.connection.writeString("OK\t0\n");
+
+	} else if (type == "adl") {
+		if ((fields.size() < 2) || (fields.size() > 3))
+			throw Common::Exception("Invalid number of fields for an ADL request");
+
+		Common::File adl(fields[1]);
+
+		answer(client, new AdLib::ADLPlayer(adl), (fields.size() > 2) ? fields[2] : "");
+
+	} else if (type == "mdy") {
+		if ((fields.size() < 3) || (fields.size() > 4))
+			throw Common::Exception("Invalid number of fields for a MDY request");
+
+		Common::File mdy(fields[1]);
+		Common::File tbr(fields[2]);
+
+		answer(client, new AdLib::MUSPlayer(mdy, tbr), (fields.size() > 3) ? fields[3] : "");
+
+	} else if (type == "adl-data") {
+		if ((fields.size() < 2) || (fields.size() > 3))
+			throw Common::Exception("Invalid number of fields for an ADL data request");
+
+		client.desync = true;
+
+		const uint32 adlSize = parseDataSize(fields[1]);
+		if (client.connection.getAvailable() < adlSize)
+			return false;
+
+		std::vector<byte> adlData;
+		client.connection.take(adlData, adlSize);
+
+		client.desync = false;
+
+		Common::MemoryReadStream adl(&adlData[0], adlData.size());
+
+		answer(client, new AdLib::ADLPlayer(adl), (fields.size() > 2) ? fields[2] : "");
+
+	} else if (type == "mdy-data") {
+		if ((fields.size() < 3) || (fields.size() > 4))
+			throw Common::Exception("Invalid number of fields for a MDY data request");
+
+		client.desync = true;
+
+		const uint32 mdySize = parseDataSize(fields[1]);
+		const uint32 tbrSize = parseDataSize(fields[2]);
+		if (client.connection.getAvailable() < (mdySize + tbrSize))
+			return false;
+
+		std::vector<byte> mdyData, tbrData;
+		client.connection.take(mdyData, mdySize);
+		client.connection.take(tbrData, tbrSize);
+
+		client.desync = false;
+
+		Common::MemoryReadStream mdy(&mdyData[0], mdyData.size());
+		Common::MemoryReadStream tbr(&tbrData[0], tbrData.size());
+
+		answer(client, new AdLib::MUSPlayer(mdy, tbr), (fields.size() > 3) ? fields[3] : "");
+
+	} else if (type == "game-adl") {
+		if ((fields.size() < 3) || (fields.size() > 4))
+			throw Common::Exception("Invalid number of fields for a game ADL request");
+
+		Gob::GameDir &gameDir = getGameDir(fields[1]);
+
+		Common::SeekableReadStream *adl = gameDir.getFile(fields[2]);
+
+		AdLib::AdLib *player = 0;
+		try {
+			player = new AdLib::ADLPlayer(*adl);
+		} catch (Common::Exception &e) {
+			delete adl;
+			throw;
+		}
+
+		delete adl;
+
+		answer(client, player, (fields.size() > 3) ? fields[3] : "");
+
+	} else if (type == "game-mdy") {
+		if ((fields.size() < 4) || (fields.size() > 5))
+			throw Common::Exception("Invalid number of fields for a game MDY request");
+
+		Gob::GameDir &gameDir = getGameDir(fields[1]);
+
+		Common::SeekableReadStream *mdy = 0;
+		Common::SeekableReadStream *tbr = 0;
+
+		AdLib::AdLib *player = 0;
+		try {
+			mdy = gameDir.getFile(fields[2]);
+			tbr = gameDir.getFile(fields[3]);
+
+			player = new AdLib::MUSPlayer(*mdy, *tbr);
+		} catch (Common::Exception &e) {
+			delete mdy;
+			delete tbr;
+			throw;
+		}
+
+		delete mdy;
+		delete tbr;
+
+		answer(client, player, (fields.size() > 4) ? fields[4] : "");
+
+	} else if (type == "game-tot") {
+		if ((fields.size() < 5) || (fields.size() > 6))
+			throw Common::Exception("Invalid number of fields for a game TOT request");
+
+		if ((fields[3] != "tot") && (fields[3] != "ext"))
+			throw Common::Exception("Invalid TOT resource type \"%s\"", fields[3].c_str());
+
+		Gob::GameDir &gameDir = getGameDir(fields[1]);
+		Gob::TOTFile totFile(gameDir, fields[2]);
+
+		const uint32 index = parseSize(fields[4]);
+
+		Common::SeekableReadStream *adl = (fields[3] == "tot") ?
+			totFile.getTOTResource(index) : totFile.getEXTResource(index);
+
+		AdLib::AdLib *player = 0;
+		try {
+			player = new AdLib::ADLPlayer(*adl);
+		} catch (Common::Exception &e) {
+			delete adl;
+			throw;
+		}
+
+		delete adl;
+
+		answer(client, player, (fields.size() > 5) ? fields[5] : "");
+
+	} else
+		throw Common::Exception("Unknown request type \"%s\"", type.c_str());
+
+	return true;
+}
+
+void Server::answer(Client &client, AdLib::AdLib *player, const std::string &vgmFile) {
+	player->setLimits(_limits);
+
+	// The players load all their data up front, so the song can play long after its files are gone
+	Conversion *conversion = new Conversion(client, player, vgmFile);
+
+	_scheduler.add(conversion->getPlayer(), conversion->getSink(), *conversion);
+}
+
+Gob::GameDir &Server::getGameDir(const std::string &path) {
+	GameDirMap::iterator g = _gameDirs.find(path);
+	if (g == _gameDirs.end()) {
+		CachedGameDir cached;
+
+		cached.gameDir = new Gob::GameDir(path);
+		cached.gameDir->setCacheLimit(_cacheLimit);
+
+		g = _gameDirs.insert(std::make_pair(path, cached)).first;
+	}
+
+	g->second.lastUse = ++_gameDirTime;
+
+	trimGameDirs(*g->second.gameDir);
+
+	return *g->second.gameDir;
+}
+
+void Server::trimGameDirs(const Gob::GameDir &current) {
+	// Close the least recently used game directories until the caches fit into the limit again
+	while (true) {
+		uint32 usage = 0;
+		for (GameDirMap::iterator g = _gameDirs.begin(); g != _gameDirs.end(); ++g)
+			usage += g->second.gameDir->getCacheUsage();
+
+		if (usage <= _cacheLimit)
+			break;
+
+		GameDirMap::iterator oldest = _gameDirs.end();
+		for (GameDirMap::iterator g = _gameDirs.begin(); g != _gameDirs.end(); ++g)
+			if ((g->second.gameDir != &current) &&
+			    ((oldest == _gameDirs.end()) || (g->second.lastUse < oldest->second.lastUse)))
+				oldest = g;
+
+		if (oldest == _gameDirs.end())
+			break;
+
+		delete oldest->second.gameDir;
+		_gameDirs.erase(oldest);
+	}
+}
+
+uint32 Server::parseSize(const std::string &str) {
+	char *end = 0;
+
+	unsigned long size = std::strtoul(str.c_str(), &end, 10);
+	if (!end || *end || str.empty() || (size > kMaxDataSize))
+		throw Common::Exception("Invalid size \"%s\"", str.c_str());
+
+	return size;
+}
+
+uint32 Server::parseDataSize(const std::string &str) {
+	const uint32 size = parseSize(str);
+	if (size == 0)
+		throw Common::Exception("Empty inline data");
+
+	return size;
+}
+
+void runServer(const std::string &socketPath, uint32 cacheLimit, const AdLib::PlayLimits &limits) {
+	Server server(socketPath, cacheLimit, limits);
+
+	server.run();
+}
+
+#else // UNIX
+
+void runServer(const std::string &, uint32, const AdLib::PlayLimits &) {
+	throw Common::Exception("The conversion server is not supported on this platform");
+}
+
+#endif // UNIX
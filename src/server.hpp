@@ -0,0 +1,63 @@
+/* CoktelADL2VGM - Tool to convert Coktel Vision's AdLib music to VGM
+ *
+ * CoktelADL2VGM is the legal property of its developers, whose names
+ * can be found in the AUTHORS file distributed with this source
+ * distribution.
+ *
+ * CoktelADL2VGM is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with CoktelADL2VGM. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <string>
+
+#include "common/types.hpp"
+
+namespace AdLib {
+	struct PlayLimits;
+}
+
+/** Run a conversion server listening on a Unix domain socket.
+ *
+ *  A client sends requests as single lines of tab-separated fields. Inline
+ *  file data directly follows the request line. The VGM output path of each
+ *  request is optional.
+ *
+ *  - adl <file.adl> [<file.vgm>]
+ *  - mdy <file.mdy> <file.tbr> [<file.vgm>]
+ *  - adl-data <size> [<file.vgm>], followed by size bytes of ADL data
+ *  - mdy-data <mdysize> <tbrsize> [<file.vgm>], followed by the MDY and the TBR data
+ *  - game-adl </path/to/game/> <name.adl> [<file.vgm>]
+ *  - game-mdy </path/to/game/> <name.mdy> <name.tbr> [<file.vgm>]
+ *  - game-tot </path/to/game/> <name.tot> <tot|ext> <index> [<file.vgm>]
+ *  - quit
+ *
+ *  Every request is answered with either "OK <size>", followed by size bytes
+ *  of VGM data, or with "ERR <message>". When an output path was given, the
+ *  VGM is written there instead and the size in the answer is 0. Several
+ *  requests can be sent over one connection.
+ *
+ *  Any number of clients can be connected at once. Their songs are converted
+ *  side by side on a single thread, a slice at a time, see
+ *  AdLib::SongScheduler, so that a long song doesn't hold up the short ones
+ *  of other clients. The requests of one connection are answered in order.
+ *
+ *  Opened game directories stay open between requests, and their unpacked
+ *  files are kept in memory, up to cacheLimit bytes in total. Each conversion
+ *  is aborted once it exceeds the limits.
+ */
+void runServer(const std::string &socketPath, uint32 cacheLimit, const AdLib::PlayLimits &limits);
+
+#endif // SERVER_HPP